@@ -0,0 +1,345 @@
+// Capture replayer
+
+#include <windows.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <comlib/comlib.h>
+
+// How long in ms to wait for the last replies once everything has been sent
+static const DWORD REPLY_WAIT_TIME = 2000;
+
+static HANDLE s_shutdownEvent = NULL;
+
+// The number of frames received back from the server
+static volatile LONG s_framesRecv = 0;
+
+// The number of sockets the server has closed
+static volatile LONG s_socketsClosed = 0;
+
+BOOL WINAPI consoleCtrlHandler(DWORD ctrlType)
+{
+    switch (ctrlType)
+    {
+    case CTRL_C_EVENT:
+    case CTRL_CLOSE_EVENT:
+        SetEvent(s_shutdownEvent);
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+void dataRecv(CLSocket skt, const char* buf, int len, void* arg)
+{
+    InterlockedIncrement(&s_framesRecv);
+}
+
+void socketClosed(CLSocket skt, int err, void* arg)
+{
+    InterlockedIncrement(&s_socketsClosed);
+}
+
+// Returns the time in microseconds since the given performance counter value
+double microsSince(const LARGE_INTEGER& start, const LARGE_INTEGER& freq)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<double>(now.QuadPart - start.QuadPart) * 1e6 /
+        static_cast<double>(freq.QuadPart);
+}
+
+// Reads a whole segment file, returning false if it could not be read or is
+// not a capture segment
+bool readSegment(const std::string& path, std::vector<char>& contents)
+{
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER fileLen;
+    bool ok = (GetFileSizeEx(file, &fileLen) != FALSE &&
+        fileLen.QuadPart >= static_cast<LONGLONG>(sizeof(CLCaptureFileHeader))
+        && fileLen.QuadPart <= CL_CAPTURE_MAX_SEGMENT_LEN);
+    if (ok)
+    {
+        contents.resize(static_cast<size_t>(fileLen.QuadPart));
+        DWORD bytesRead = 0;
+        ok = (ReadFile(file, &contents[0], static_cast<DWORD>(contents.size()),
+            &bytesRead, NULL) != FALSE && bytesRead == contents.size());
+    }
+    CloseHandle(file);
+
+    if (ok)
+    {
+        const CLCaptureFileHeader* header =
+            reinterpret_cast<const CLCaptureFileHeader*>(&contents[0]);
+        ok = (memcmp(header->magic, "CLCAPT01", sizeof(header->magic)) == 0 &&
+            header->ticksPerSec != 0 &&
+            header->headerLen >= sizeof(CLCaptureFileHeader) &&
+            header->headerLen <= contents.size());
+    }
+    return ok;
+}
+
+void displayUsage()
+{
+    std::cout << "Replays data captured with CLStartCapture() to a server, such as echoserver.exe,\r\n";
+    std::cout << "with the timing it was captured with or faster.\r\n\r\n";
+
+    std::cout << "CAPREPLAY prefix addr port [/X:speed] [/SEND]\r\n\r\n";
+
+    std::cout << "prefix  The path prefix the capture was started with.\r\n";
+    std::cout << "addr    The host address to connect to.\r\n";
+    std::cout << "port    The port to connect to.\r\n";
+    std::cout << "/X      Replay speed times faster than the data was captured, 1 if not\r\n";
+    std::cout << "        given. A speed of 0 sends everything as fast as possible.\r\n";
+    std::cout << "/SEND   Replay the data the captured sockets sent rather than the data\r\n";
+    std::cout << "        they received, for a capture taken at a client.\r\n";
+    std::cout << "\r\n";
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        displayUsage();
+        return 1;
+    }
+
+    std::string pathPrefix(argv[1]);
+    const char* addr = argv[2];
+    unsigned short port =
+        static_cast<unsigned short>(strtoul(argv[3], NULL, 10));
+    double speed = 1;
+    unsigned int direction = CL_CAPTURE_RECV;
+
+    for (int i = 4; i < argc; ++i)
+    {
+        if (_strnicmp(argv[i], "/X:", 3) == 0)
+        {
+            speed = strtod(&argv[i][3], NULL);
+        }
+        else if (_stricmp(argv[i], "/SEND") == 0)
+        {
+            direction = CL_CAPTURE_SEND;
+        }
+    }
+
+    s_shutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (s_shutdownEvent == NULL)
+    {
+        return 1;
+    }
+
+    if (!SetConsoleCtrlHandler(&consoleCtrlHandler, TRUE))
+    {
+        return 1;
+    }
+
+    // Startup the communication library
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return 1;
+    }
+
+    // Sleep for as little as a ms at a time while waiting for data to be due,
+    // rather than for the 10-16 ms of the default timer resolution
+    timeBeginPeriod(1);
+
+    // A connection to the server for each socket in the capture still open
+    std::map<unsigned __int64, CLSocket> sockets;
+    int connectionCount = 0;
+
+    LARGE_INTEGER freq;
+    LARGE_INTEGER start;
+    QueryPerformanceFrequency(&freq);
+    bool started = false;
+    unsigned __int64 firstTicks = 0;
+    double capturedMicros = 0;
+    double maxLateMicros = 0;
+    LONG framesSent = 0;
+    unsigned __int64 bytesSent = 0;
+    int segmentCount = 0;
+    std::vector<char> contents;
+
+    for (unsigned int segmentIdx = 0; err == CL_ERR_OK &&
+        WaitForSingleObject(s_shutdownEvent, 0) != WAIT_OBJECT_0;
+        ++segmentIdx)
+    {
+        char suffix[32];
+        sprintf_s(suffix, ".%06u.cap", segmentIdx);
+        if (!readSegment(pathPrefix + suffix, contents))
+        {
+            break;
+        }
+        ++segmentCount;
+
+        const CLCaptureFileHeader* header =
+            reinterpret_cast<const CLCaptureFileHeader*>(&contents[0]);
+        double ticksPerMicro = static_cast<double>(header->ticksPerSec) / 1e6;
+
+        size_t pos = header->headerLen;
+        while (err == CL_ERR_OK &&
+            pos + sizeof(CLCaptureRecord) <= contents.size())
+        {
+            const CLCaptureRecord* record =
+                reinterpret_cast<const CLCaptureRecord*>(&contents[pos]);
+            if (record->recordLen < sizeof(CLCaptureRecord) ||
+                pos + record->recordLen > contents.size() ||
+                record->dataLen > record->recordLen - sizeof(CLCaptureRecord))
+            {
+                // The end of the records
+                break;
+            }
+            pos += record->recordLen;
+
+            if (record->direction != direction &&
+                record->direction != CL_CAPTURE_OPEN &&
+                record->direction != CL_CAPTURE_CLOSE)
+            {
+                continue;
+            }
+
+            if (!started)
+            {
+                started = true;
+                firstTicks = record->ticks;
+                QueryPerformanceCounter(&start);
+            }
+
+            // Wait until the data is due, sleeping while it is more than a
+            // couple of ms away and then yielding
+            double dueMicros = 0;
+            if (record->ticks > firstTicks)
+            {
+                capturedMicros = static_cast<double>(
+                    record->ticks - firstTicks) / ticksPerMicro;
+                dueMicros = (speed > 0) ? capturedMicros / speed : 0;
+            }
+            double nowMicros = microsSince(start, freq);
+            while (nowMicros < dueMicros)
+            {
+                if (dueMicros - nowMicros > 2000)
+                {
+                    Sleep(1);
+                }
+                else
+                {
+                    SwitchToThread();
+                }
+                nowMicros = microsSince(start, freq);
+            }
+            if (speed > 0 && nowMicros - dueMicros > maxLateMicros)
+            {
+                maxLateMicros = nowMicros - dueMicros;
+            }
+
+            std::map<unsigned __int64, CLSocket>::iterator it =
+                sockets.find(record->socketId);
+            if (record->direction == CL_CAPTURE_CLOSE)
+            {
+                // Close the connection as the captured socket was closed.
+                // A socket closed by the other end then deleted has a
+                // second close record, which finds nothing to close
+                if (it != sockets.end())
+                {
+                    CLDeleteSocket(it->second);
+                    sockets.erase(it);
+                }
+                continue;
+            }
+
+            // Open a connection when the captured socket was opened, or
+            // for its first data if capturing started after that
+            if (it == sockets.end())
+            {
+                CLSocket skt = 0;
+                err = CLCreateSocket(addr, port, dataRecv, socketClosed, NULL,
+                    &skt);
+                if (err != CL_ERR_OK)
+                {
+                    std::cout << "\r\nCLCreateSocket() failed, err=" << err <<
+                        "\r\n" << std::flush;
+                    break;
+                }
+                it = sockets.insert(
+                    std::make_pair(record->socketId, skt)).first;
+                ++connectionCount;
+            }
+
+            if (record->direction == direction && record->dataLen > 0)
+            {
+                int sendErr = CLSendData(it->second,
+                    reinterpret_cast<const char*>(record + 1),
+                    static_cast<int>(record->dataLen));
+                if (sendErr != CL_ERR_OK)
+                {
+                    std::cout << "\r\nCLSendData() failed, err=" << sendErr <<
+                        "\r\n" << std::flush;
+                }
+                else
+                {
+                    ++framesSent;
+                    bytesSent += record->dataLen;
+                }
+            }
+        }
+    }
+
+    if (segmentCount == 0)
+    {
+        std::cout << "\r\nNo capture found at " << pathPrefix <<
+            ".000000.cap\r\n" << std::flush;
+    }
+    else if (started)
+    {
+        double replayMicros = microsSince(start, freq);
+
+        // Give the server a moment to reply to the last of the data
+        ULONGLONG waitEnd = GetTickCount64() + REPLY_WAIT_TIME;
+        while (s_framesRecv < framesSent && GetTickCount64() < waitEnd)
+        {
+            Sleep(10);
+        }
+
+        std::cout << "\r\nSegments replayed: " << segmentCount << "\r\n";
+        std::cout << "Connections: " << connectionCount << "\r\n";
+        std::cout << "Frames sent: " << framesSent << "\r\n";
+        std::cout << "Bytes sent: " << bytesSent << "\r\n";
+        std::cout << "Frames received: " << s_framesRecv << "\r\n";
+        std::cout << "Connections closed by server: " << s_socketsClosed <<
+            "\r\n";
+        std::cout << "Captured over: " << capturedMicros / 1000 << " ms\r\n";
+        std::cout << "Replayed over: " << replayMicros / 1000 << " ms\r\n";
+        if (speed > 0)
+        {
+            std::cout << "Most behind schedule: " << maxLateMicros / 1000 <<
+                " ms\r\n";
+        }
+        std::cout << std::flush;
+    }
+
+    for (std::map<unsigned __int64, CLSocket>::iterator it = sockets.begin();
+        it != sockets.end(); ++it)
+    {
+        CLDeleteSocket(it->second);
+    }
+
+    // Cleanup the communication library
+    CLCleanup();
+
+    timeEndPeriod(1);
+
+    return (err == CL_ERR_OK) ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+/**
+ * @file
+ * Defines the BufPool class.
+ */
+
+#include "bufpool.h"
+#include <malloc.h>
+#include <new>
+
+// The length of the buffers in each size class. Each is four times the last,
+// so a buffer is never more than four times longer than needed, and the
+// largest holds the longest frame with its length prefix left out
+static const int CLASS_BUF_LENS[] = { 256, 1024, 4096, 16384, 65536 };
+
+// How often in ms the buffers kept for reuse are trimmed back to the most that
+// were in use at once
+static const ULONGLONG TRIM_INTERVAL = 1000;
+
+// Allocates a buffer of the given length from the heap
+static char* allocBuf(size_t len)
+{
+    char* buf = static_cast<char*>(_aligned_malloc(len,
+        MEMORY_ALLOCATION_ALIGNMENT));
+    if (buf == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return buf;
+}
+
+BufPool::BufPool() :
+m_nextTrim(static_cast<LONGLONG>(GetTickCount64() + TRIM_INTERVAL))
+{
+    for (int idx = 0; idx < CLASS_COUNT; ++idx)
+    {
+        InitializeSListHead(&m_classes[idx].freeList);
+        m_classes[idx].freeCount = 0;
+        m_classes[idx].inUseCount = 0;
+        m_classes[idx].highWaterCount = 0;
+    }
+}
+
+BufPool::~BufPool()
+{
+    for (int idx = 0; idx < CLASS_COUNT; ++idx)
+    {
+        PSLIST_ENTRY entry = InterlockedFlushSList(&m_classes[idx].freeList);
+        while (entry != NULL)
+        {
+            PSLIST_ENTRY next = entry->Next;
+            _aligned_free(entry);
+            entry = next;
+        }
+    }
+}
+
+char* BufPool::borrow(int len)
+{
+    int idx = classIdx(len);
+    if (idx == CLASS_COUNT)
+    {
+        return allocBuf(len);
+    }
+
+    SizeClass& sizeClass = m_classes[idx];
+    PSLIST_ENTRY entry = InterlockedPopEntrySList(&sizeClass.freeList);
+    char* buf = 0;
+    if (entry != NULL)
+    {
+        InterlockedDecrement(&sizeClass.freeCount);
+        buf = reinterpret_cast<char*>(entry);
+    }
+    else
+    {
+        buf = allocBuf(CLASS_BUF_LENS[idx]);
+    }
+
+    // Raise the high water mark if this is the most in use at once so far
+    LONG inUseCount = InterlockedIncrement(&sizeClass.inUseCount);
+    LONG highWaterCount = sizeClass.highWaterCount;
+    while (inUseCount > highWaterCount)
+    {
+        LONG prevCount = InterlockedCompareExchange(
+            &sizeClass.highWaterCount, inUseCount, highWaterCount);
+        if (prevCount == highWaterCount)
+        {
+            break;
+        }
+        highWaterCount = prevCount;
+    }
+
+    return buf;
+}
+
+void BufPool::giveBack(char* buf, int len)
+{
+    int idx = classIdx(len);
+    if (idx == CLASS_COUNT)
+    {
+        _aligned_free(buf);
+        return;
+    }
+
+    SizeClass& sizeClass = m_classes[idx];
+    LONG inUseCount = InterlockedDecrement(&sizeClass.inUseCount);
+    if (sizeClass.freeCount + inUseCount < sizeClass.highWaterCount)
+    {
+        InterlockedPushEntrySList(&sizeClass.freeList,
+            reinterpret_cast<PSLIST_ENTRY>(buf));
+        InterlockedIncrement(&sizeClass.freeCount);
+    }
+    else
+    {
+        _aligned_free(buf);
+    }
+
+    trimIfDue();
+}
+
+ULONGLONG BufPool::trimDeadline() const
+{
+    for (int idx = 0; idx < CLASS_COUNT; ++idx)
+    {
+        if (m_classes[idx].freeCount > 0)
+        {
+            return static_cast<ULONGLONG>(InterlockedCompareExchange64(
+                const_cast<volatile LONGLONG*>(&m_nextTrim), 0, 0));
+        }
+    }
+    return NO_TRIM;
+}
+
+int BufPool::classIdx(int len)
+{
+    int idx = 0;
+    while (idx < CLASS_COUNT && CLASS_BUF_LENS[idx] < len)
+    {
+        ++idx;
+    }
+    return idx;
+}
+
+void BufPool::trimIfDue()
+{
+    // Read all 64 bits at once, even on 32-bit Windows, then have only the
+    // thread that moves the next trim time on do the trimming
+    LONGLONG nextTrim = InterlockedCompareExchange64(&m_nextTrim, 0, 0);
+    ULONGLONG now = GetTickCount64();
+    if (now < static_cast<ULONGLONG>(nextTrim) ||
+        InterlockedCompareExchange64(&m_nextTrim,
+            static_cast<LONGLONG>(now + TRIM_INTERVAL), nextTrim) != nextTrim)
+    {
+        return;
+    }
+
+    for (int idx = 0; idx < CLASS_COUNT; ++idx)
+    {
+        // Keep enough buffers to reach the high water mark of the interval
+        // just ended again, then start the next interval from those in use
+        SizeClass& sizeClass = m_classes[idx];
+        LONG inUseCount = sizeClass.inUseCount;
+        LONG keepCount = InterlockedExchange(&sizeClass.highWaterCount,
+            inUseCount) - inUseCount;
+
+        while (sizeClass.freeCount > keepCount)
+        {
+            PSLIST_ENTRY entry = InterlockedPopEntrySList(&sizeClass.freeList);
+            if (entry == NULL)
+            {
+                break;
+            }
+            InterlockedDecrement(&sizeClass.freeCount);
+            _aligned_free(entry);
+        }
+    }
+}
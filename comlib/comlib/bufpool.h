@@ -0,0 +1,113 @@
+/**
+ * @file
+ * Declares the BufPool class.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <boost/utility.hpp>
+
+/**
+ * A pool of buffers in a few size classes, shared by all socket objects for
+ * the frames they are part way through receiving. A socket object borrows a
+ * buffer when a frame's length prefix arrives and gives it back once the
+ * whole frame has been handled, so an idle socket holds no buffer at all.
+ *
+ * Buffers given back are kept for reuse, but only up to the most that were
+ * in use at once in each size class over the last second or so. The pool is
+ * trimmed back to that once a second, as buffers are given back and from the
+ * network threads' timers while it keeps any, so after a burst of large frames
+ * the memory goes back to the heap rather than staying with the pool even if
+ * no frame is received again. The counts used for this are only approximate when threads
+ * race, which at worst keeps a buffer too many or frees one that is needed
+ * again.
+ *
+ * A pool is thread safe.
+ */
+class BufPool : private boost::noncopyable
+{
+public:
+    BufPool();
+
+    /**
+     * Frees the buffers kept for reuse. Buffers still borrowed are freed
+     * when they are given back.
+     */
+    ~BufPool();
+
+    /**
+     * Borrows a buffer, throwing std::bad_alloc if there is not enough memory
+     * as operator new does.
+     *
+     * @param len the length of buffer needed.
+     * @return A buffer at least len bytes long.
+     */
+    char* borrow(int len);
+
+    /**
+     * Gives back a buffer borrowed by borrow().
+     *
+     * @param buf the buffer to give back.
+     * @param len the length the buffer was borrowed with.
+     */
+    void giveBack(char* buf, int len);
+
+    /**
+     * Returns when the pool is next to be trimmed.
+     *
+     * @return The tick count when trimIfDue() should next be called, or
+     * NO_TRIM if the pool keeps no buffers for reuse, so has nothing to trim.
+     */
+    ULONGLONG trimDeadline() const;
+
+    /**
+     * Frees the buffers kept beyond the high water mark of each size class,
+     * then starts the high water marks again from the buffers in use now, if
+     * it is time to.
+     */
+    void trimIfDue();
+
+    /** The value trimDeadline() returns when there is nothing to trim. */
+    static const ULONGLONG NO_TRIM = ~0ULL;
+
+private:
+    /** The buffers kept for one size class. */
+    struct SizeClass
+    {
+        /** The buffers kept for reuse. This must come first to be aligned. */
+        SLIST_HEADER freeList;
+
+        /** The number of buffers in freeList. */
+        volatile LONG freeCount;
+
+        /** The number of buffers borrowed and not yet given back. */
+        volatile LONG inUseCount;
+
+        /**
+         * The most buffers in use at once since the pool was last trimmed.
+         * Buffers are only kept for reuse while those kept and those in use
+         * add up to less than this.
+         */
+        volatile LONG highWaterCount;
+    };
+
+    /** The number of size classes, as listed in CLASS_BUF_LENS. */
+    static const int CLASS_COUNT = 5;
+
+    /**
+     * Returns the index of the smallest size class holding buffers of at
+     * least the given length.
+     *
+     * @param len the length of buffer needed.
+     * @return The index of the size class, or CLASS_COUNT if the length is
+     * longer than any size class, in which case the buffer is not pooled.
+     */
+    static int classIdx(int len);
+
+    /** The size classes, smallest first. */
+    SizeClass m_classes[CLASS_COUNT];
+
+    /** The tick count when the pool is next trimmed. */
+    volatile LONGLONG m_nextTrim;
+};
@@ -0,0 +1,210 @@
+/**
+ * @file
+ * Defines the Capture class.
+ */
+
+#include "capture.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// The characters at the start of each segment file
+static const char CAPTURE_MAGIC[8] =
+{
+    'C', 'L', 'C', 'A', 'P', 'T', '0', '1'
+};
+
+volatile LONG Capture::s_on = 0;
+SRWLOCK Capture::s_lock = SRWLOCK_INIT;
+Capture::Segment* Capture::s_segment = NULL;
+std::string Capture::s_pathPrefix;
+ULONG Capture::s_segmentLen = 0;
+ULONG Capture::s_nextSegmentIdx = 0;
+
+int Capture::start(const char* pathPrefix, ULONG segmentLen)
+{
+    AcquireSRWLockExclusive(&s_lock);
+
+    if (s_segment != NULL)
+    {
+        LONG usedLen = s_segment->used;
+        closeSegment(s_segment, (std::min)(usedLen, s_segment->len));
+        s_segment = NULL;
+    }
+
+    s_pathPrefix = pathPrefix;
+    s_segmentLen = segmentLen;
+    s_nextSegmentIdx = 0;
+
+    int err = openSegment(&s_segment);
+    InterlockedExchange(&s_on, (err == CL_ERR_OK) ? 1 : 0);
+
+    ReleaseSRWLockExclusive(&s_lock);
+    return err;
+}
+
+void Capture::stop()
+{
+    InterlockedExchange(&s_on, 0);
+
+    AcquireSRWLockExclusive(&s_lock);
+
+    if (s_segment != NULL)
+    {
+        LONG usedLen = s_segment->used;
+        closeSegment(s_segment, (std::min)(usedLen, s_segment->len));
+        s_segment = NULL;
+    }
+
+    ReleaseSRWLockExclusive(&s_lock);
+}
+
+void Capture::recordOn(unsigned int direction, unsigned __int64 socketId,
+    const char* buf, int len)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // Keep each record aligned for the 64-bit fields of the next
+    LONG recordLen = static_cast<LONG>((sizeof(CLCaptureRecord) + len + 7) &
+        ~static_cast<size_t>(7));
+
+    for (;;)
+    {
+        AcquireSRWLockShared(&s_lock);
+
+        Segment* segment = s_segment;
+        if (segment == NULL)
+        {
+            // Capturing has stopped
+            ReleaseSRWLockShared(&s_lock);
+            return;
+        }
+
+        // Only claim space while the segment is not full, so that threads
+        // waiting for the next segment cannot run the used length up
+        bool claimed = false;
+        LONG offset = 0;
+        if (segment->used <= segment->len)
+        {
+            claimed = true;
+            offset = InterlockedExchangeAdd(&segment->used, recordLen);
+        }
+
+        if (claimed && offset <= segment->len - recordLen)
+        {
+            CLCaptureRecord* record =
+                reinterpret_cast<CLCaptureRecord*>(segment->view + offset);
+            record->dataLen = static_cast<unsigned int>(len);
+            record->ticks = static_cast<unsigned __int64>(now.QuadPart);
+            record->socketId = socketId;
+            record->direction = direction;
+            record->reserved = 0;
+            if (len > 0)
+            {
+                memcpy(record + 1, buf, len);
+            }
+
+            // Set the length last, so that a reader never takes a record
+            // that is still being copied in for a whole one
+            *static_cast<volatile unsigned int*>(&record->recordLen) =
+                static_cast<unsigned int>(recordLen);
+
+            ReleaseSRWLockShared(&s_lock);
+            return;
+        }
+
+        ReleaseSRWLockShared(&s_lock);
+
+        if (claimed && offset <= segment->len)
+        {
+            // This is the first record that does not fit, so move on to the
+            // next segment once every record that does fit is copied in
+            AcquireSRWLockExclusive(&s_lock);
+            if (s_segment == segment)
+            {
+                closeSegment(segment, offset);
+                s_segment = NULL;
+
+                if (openSegment(&s_segment) != CL_ERR_OK)
+                {
+                    InterlockedExchange(&s_on, 0);
+                }
+            }
+            ReleaseSRWLockExclusive(&s_lock);
+        }
+        else
+        {
+            // Wait for the thread whose record did not fit to move on
+            SwitchToThread();
+        }
+    }
+}
+
+int Capture::openSegment(Segment** pSegment)
+{
+    char suffix[32];
+    sprintf_s(suffix, ".%06lu.cap", s_nextSegmentIdx);
+    std::string path = s_pathPrefix + suffix;
+
+    int err = CL_ERR_OK;
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError();
+    }
+
+    // Mapping the file at its full length extends it to that length
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0,
+        s_segmentLen, NULL);
+    if (mapping == NULL)
+    {
+        err = GetLastError();
+        CloseHandle(file);
+        return err;
+    }
+
+    char* view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0,
+        0, 0));
+    if (view == NULL)
+    {
+        err = GetLastError();
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return err;
+    }
+
+    CLCaptureFileHeader* header = reinterpret_cast<CLCaptureFileHeader*>(view);
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+    header->ticksPerSec = static_cast<unsigned __int64>(freq.QuadPart);
+    header->segmentIdx = s_nextSegmentIdx;
+    header->headerLen = sizeof(CLCaptureFileHeader);
+    header->reserved = 0;
+
+    Segment* segment = new Segment;
+    segment->file = file;
+    segment->mapping = mapping;
+    segment->view = view;
+    segment->len = static_cast<LONG>(s_segmentLen);
+    segment->used = sizeof(CLCaptureFileHeader);
+
+    ++s_nextSegmentIdx;
+    *pSegment = segment;
+    return CL_ERR_OK;
+}
+
+void Capture::closeSegment(Segment* segment, LONG usedLen)
+{
+    UnmapViewOfFile(segment->view);
+    CloseHandle(segment->mapping);
+
+    // Trim off the space no record was written to
+    SetFilePointer(segment->file, usedLen, NULL, FILE_BEGIN);
+    SetEndOfFile(segment->file);
+    CloseHandle(segment->file);
+
+    delete segment;
+}
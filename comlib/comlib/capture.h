@@ -0,0 +1,135 @@
+/**
+ * @file
+ * Declares the Capture class.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include "inc/comlib/comlib.h"
+
+/**
+ * Captures the data that sockets send and receive to a series of memory-mapped
+ * segment files, in the format described by CLCaptureFileHeader and
+ * CLCaptureRecord, so that the traffic can be replayed later.
+ *
+ * Threads capturing data share the current segment. Each claims space for its
+ * record by moving the segment's used length on with a single interlocked add
+ * and then copies the record in, so threads never wait on each other while
+ * capturing. The thread whose record first runs past the end of a segment
+ * closes it and opens the next, waiting for the threads still copying into
+ * the segment to finish; the others wait for the next segment to be opened
+ * then claim space in it instead. A slim reader/writer lock, which writers
+ * take shared and so never contend on, keeps a segment from being closed while
+ * it is being copied into.
+ *
+ * The methods are thread safe.
+ */
+class Capture
+{
+public:
+    /**
+     * Starts capturing, stopping first if capturing has already started.
+     *
+     * @param pathPrefix the path that segment file names start with.
+     * @param segmentLen the length of each segment file.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int start(const char* pathPrefix, ULONG segmentLen);
+
+    /** Stops capturing, if it has started. */
+    static void stop();
+
+    /**
+     * Captures data that was sent or received, or a socket opening or
+     * closing, if capturing has started.
+     *
+     * @param direction one of the CL_CAPTURE_ values.
+     * @param socketId the capture id of the socket.
+     * @param buf the data, or NULL if there is none.
+     * @param len the length of the data.
+     */
+    static void record(unsigned int direction, unsigned __int64 socketId,
+        const char* buf, int len)
+    {
+        if (s_on != 0)
+        {
+            recordOn(direction, socketId, buf, len);
+        }
+    }
+
+private:
+    /** A segment file, mapped into memory whole. */
+    struct Segment
+    {
+        /** The file. */
+        HANDLE file;
+
+        /** The file mapping object. */
+        HANDLE mapping;
+
+        /** The mapped view of the file. */
+        char* view;
+
+        /** The length of the file. */
+        LONG len;
+
+        /**
+         * The length claimed by records so far, which runs past len once a
+         * record does not fit.
+         */
+        volatile LONG used;
+    };
+
+    /**
+     * Captures data, claiming space in the current segment and moving on to
+     * the next segment if there is not enough.
+     *
+     * @param direction one of the CL_CAPTURE_ values.
+     * @param socketId the capture id of the socket.
+     * @param buf the data, or NULL if there is none.
+     * @param len the length of the data.
+     */
+    static void recordOn(unsigned int direction, unsigned __int64 socketId,
+        const char* buf, int len);
+
+    /**
+     * Creates the next segment file and maps it into memory. The lock must be
+     * held exclusively.
+     *
+     * @param pSegment if the method was successful this will be set to point
+     * to the segment.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int openSegment(Segment** pSegment);
+
+    /**
+     * Unmaps a segment file and trims it to the records in it. The lock must
+     * be held exclusively.
+     *
+     * @param segment the segment, which is deleted.
+     * @param usedLen the length of the records in the segment.
+     */
+    static void closeSegment(Segment* segment, LONG usedLen);
+
+    /** Is data being captured? This is not 0 if it is. */
+    static volatile LONG s_on;
+
+    /** Guards s_segment, held shared while a record is copied in. */
+    static SRWLOCK s_lock;
+
+    /** The segment records are being added to, or NULL. */
+    static Segment* s_segment;
+
+    /** The path that segment file names start with. */
+    static std::string s_pathPrefix;
+
+    /** The length of each segment file. */
+    static ULONG s_segmentLen;
+
+    /** The number of the next segment file to open. */
+    static ULONG s_nextSegmentIdx;
+};
@@ -8,95 +8,126 @@
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <vector>
+#include "capture.h"
+#include "conadmission.h"
+#include "connectbatch.h"
+#include "contextobj.h"
 #include "debug.h"
-#include "netthreadpool.h"
+#include "sendlinger.h"
 #include "socketobj.h"
-#include "socketregistry.h"
 #include "srvsocketobj.h"
+#include "trace.h"
+#include "udpsocketobj.h"
 
 // Provides exclusive or shared access to the library
 static boost::shared_mutex s_libMutex;
 // The number of times the library has been started up
 static int s_startupCount = 0;
-// A registry for server socket objects
-static SrvSocketRegistry s_srvSocketRegistry;
-// A registry for socket objects
-static SocketRegistry s_socketRegistry;
-// The library's pool of network threads
-static NetThreadPool s_netThreadPool;
+// The library's contexts, the default context first. Only changed with
+// exclusive access to the library
+static std::vector<ContextObjSPtr> s_contexts;
 // Are we currently uninitializing the library?
 static bool s_uninitializing = false;
 // This will be notified when the library is no longer being uninitialized
 static boost::condition_variable_any s_uninitializingCondVar;
+// How long we are prepared to wait in milliseconds for the network threads of
+// a context to shutdown
+static const DWORD SHUTDOWN_TIMEOUT_INTERVAL = 10000;
 
-int finishCreateSrvSocketObj(SrvSocketObj* rawSrvSktObj, CLSrvSocket* pSrvSkt)
+ContextObj* findContextObj(CLContext ctx)
 {
-    assert(rawSrvSktObj != 0);
-
-    SrvSocketObjSPtr srvSktObj(rawSrvSktObj);
-
-    // Add server socket object to registry
-    CLSrvSocket srvSkt = SrvSocketRegistry::toHandle(rawSrvSktObj);
-    s_srvSocketRegistry.addSocketObj(srvSkt, srvSktObj);
-
-    // Add server socket object to network thread pool
-    int err = s_netThreadPool.addNetObj(srvSktObj);
-    if (err == CL_ERR_OK)
+    if (ctx == 0)
     {
-        *pSrvSkt = srvSkt;
+        return s_contexts.front().get();
     }
-    else
+
+    for (size_t idx = 0; idx < s_contexts.size(); ++idx)
     {
-        s_srvSocketRegistry.removeSocketObj(srvSkt);
-        srvSktObj->close();
+        if (s_contexts[idx].get() == reinterpret_cast<ContextObj*>(ctx))
+        {
+            return s_contexts[idx].get();
+        }
     }
-
-    return err;
+    return 0;
 }
 
-void closeSrvSocketObj(const SrvSocketObjSPtr& srvSktObj)
+SrvSocketObjSPtr findSrvSocketObj(CLSrvSocket srvSkt,
+    ContextObj** pCtxObj = 0)
 {
-    assert(srvSktObj.get() != 0);
-
-    // Remove server socket object from network thread pool
-    s_netThreadPool.removeNetObj(srvSktObj);
-    // Close server socket object
-    srvSktObj->close();
+    // Look in each context in turn, the default context first
+    SrvSocketObjSPtr srvSktObj;
+    for (size_t idx = 0; srvSktObj.get() == 0 && idx < s_contexts.size();
+        ++idx)
+    {
+        srvSktObj = s_contexts[idx]->findSrvSocketObj(srvSkt);
+        if (srvSktObj.get() != 0 && pCtxObj != 0)
+        {
+            *pCtxObj = s_contexts[idx].get();
+        }
+    }
+    return srvSktObj;
 }
 
-int finishCreateSocketObj(SocketObj* rawSktObj, CLSocket* pSkt)
+SocketObjSPtr findSocketObj(CLSocket skt)
 {
-    assert(rawSktObj != 0);
-
-    SocketObjSPtr sktObj(rawSktObj);
+    // Look in each context in turn, the default context first
+    SocketObjSPtr sktObj;
+    for (size_t idx = 0; sktObj.get() == 0 && idx < s_contexts.size(); ++idx)
+    {
+        sktObj = s_contexts[idx]->findSocketObj(skt);
+    }
+    return sktObj;
+}
 
-    // Add socket object to registry
-    CLSocket skt = SocketRegistry::toHandle(rawSktObj);
-    s_socketRegistry.addSocketObj(skt, sktObj);
+UdpSocketObjSPtr findUdpSocketObj(CLUdpSocket udpSkt)
+{
+    // Look in each context in turn, the default context first
+    UdpSocketObjSPtr udpSktObj;
+    for (size_t idx = 0; udpSktObj.get() == 0 && idx < s_contexts.size();
+        ++idx)
+    {
+        udpSktObj = s_contexts[idx]->findUdpSocketObj(udpSkt);
+    }
+    return udpSktObj;
+}
 
-    // Add socket object to network thread pool
-    int err = s_netThreadPool.addNetObj(sktObj);
-    if (err == CL_ERR_OK)
+bool isSlowConsumerPolicyValid(const CLSlowConsumerPolicy* pPolicy,
+    CLPSlowConsumerFn slowConsumerFn)
+{
+    if (pPolicy == 0)
     {
-        *pSkt = skt;
+        return false;
     }
-    else
+
+    switch (pPolicy->action)
     {
-        s_socketRegistry.removeSocketObj(skt);
-        sktObj->close();
+    case CL_SLOW_CONSUMER_NONE:
+        return true;
+    case CL_SLOW_CONSUMER_DROP:
+    case CL_SLOW_CONSUMER_DISCONNECT:
+        break;
+    case CL_SLOW_CONSUMER_CALLBACK:
+        if (slowConsumerFn == 0)
+        {
+            return false;
+        }
+        break;
+    default:
+        return false;
     }
 
-    return err;
+    return pPolicy->maxQueuedBytes != 0 || pPolicy->maxQueueAgeMs != 0;
 }
 
-void closeSocketObj(const SocketObjSPtr& sktObj)
+BOOL WINAPI DllMain(HINSTANCE instance, DWORD reason, LPVOID reserved)
 {
-    assert(sktObj.get() != 0);
-
-    // Remove socket object from network thread pool
-    s_netThreadPool.removeNetObj(sktObj);
-    // Close socket object
-    sktObj->close();
+    if (reason == DLL_THREAD_DETACH)
+    {
+        // Let another thread take over the exiting thread's trace ring
+        Trace::onThreadExit();
+    }
+    return TRUE;
 }
 
 extern "C" __declspec(dllexport) int __cdecl CLStartup(void)
@@ -123,6 +154,13 @@ extern "C" __declspec(dllexport) int __cdecl CLStartup(void)
             err = wsaStartupErr;
             --s_startupCount;
         }
+        else
+        {
+            // Create the default context
+            CLContextConfig defaultConfig = {};
+            s_contexts.push_back(ContextObjSPtr(
+                new ContextObj(defaultConfig)));
+        }
     }
 
     return err;
@@ -142,57 +180,202 @@ extern "C" __declspec(dllexport) void __cdecl CLCleanup(void)
 
     if (s_startupCount == 0)
     {
-        // Close server socket objects
-        SrvSocketObjSPtr srvSktObj =
-            s_srvSocketRegistry.removeFrontSocketObj();
-        while (srvSktObj.get() != 0)
+        // Close the socket objects in every context, which starts the
+        // shutdown of the contexts' network threads
+        std::vector<ContextObjSPtr> contexts;
+        contexts.swap(s_contexts);
+        for (size_t idx = 0; idx < contexts.size(); ++idx)
         {
-            closeSrvSocketObj(srvSktObj);
-            srvSktObj = s_srvSocketRegistry.removeFrontSocketObj();
+            contexts[idx]->deleteAllSocketObjs();
         }
 
-        // Close socket objects
-        SocketObjSPtr sktObj = s_socketRegistry.removeFrontSocketObj();
-        while (sktObj.get() != 0)
+        // Wait for the contexts' net thread pools to shutdown. Note that we
+        // need to unlock the library mutex while we do this otherwise network
+        // threads in the pools may block for quite a while when attempting to
+        // aquire the mutex. However, we don't want these threads to do
+        // anything during this time so we set a special "uninitializing" flag
+        // to ensure this.
+        s_uninitializing = true;
+        lock.unlock();
+        DWORD startTickCount = GetTickCount();
+        for (size_t idx = 0; idx < contexts.size(); ++idx)
         {
-            closeSocketObj(sktObj);
-            sktObj = s_socketRegistry.removeFrontSocketObj();
+            DWORD elapsedInterval = GetTickCount() - startTickCount;
+            DWORD timeOutInterval =
+                (elapsedInterval < SHUTDOWN_TIMEOUT_INTERVAL) ?
+                SHUTDOWN_TIMEOUT_INTERVAL - elapsedInterval : 0;
+            if (!contexts[idx]->waitForShutdown(timeOutInterval))
+            {
+                OUTPUT_FMT_DEBUG_STRING("Network thread pool did not shutdown "
+                    "in " << SHUTDOWN_TIMEOUT_INTERVAL << "ms");
+            }
         }
 
-        // Wait for the net thread pool to shutdown. Note that we need to
-        // unlock the library mutex while we do this otherwise network threads
-        // in the pool may block for quite a while when attempting to aquire
-        // the mutex. However, we don't want these threads to do anything
-        // during this time so we set a special "uninitializing" flag to ensure
-        // this.
-        s_uninitializing = true;
-        lock.unlock();
-        // How long we are prepared to wait in milliseconds for the network
-        // threads in the pool to shutdown
-        static const DWORD SHUTDOWN_TIMEOUT_INTERVAL = 10000;
-        if (!s_netThreadPool.waitForShutdown(SHUTDOWN_TIMEOUT_INTERVAL))
+        // Give the sockets closed with data still queued the time left to
+        // write it, as cleaning up Winsock resets them
+        DWORD elapsedInterval = GetTickCount() - startTickCount;
+        if (!SendLinger::waitForIdle(
+            (elapsedInterval < SHUTDOWN_TIMEOUT_INTERVAL) ?
+            SHUTDOWN_TIMEOUT_INTERVAL - elapsedInterval : 0))
         {
-            OUTPUT_FMT_DEBUG_STRING("Network thread pool did not shutdown in "
-                << SHUTDOWN_TIMEOUT_INTERVAL << "ms");
+            OUTPUT_FMT_DEBUG_STRING("Data queued on closed sockets was not "
+                "written in " << SHUTDOWN_TIMEOUT_INTERVAL << "ms");
         }
         lock.lock();
         s_uninitializing = false;
         s_uninitializingCondVar.notify_all();
 
-        // TODO: Test if this is really needed
-        // Sleep a little bit so that the destructors of socket and thread
-        // objects in the library can complete
-        Sleep(500 /*Milliseconds*/);
+        // The network threads have been joined, so deleting the contexts
+        // deletes the thread and socket objects straight away
+        contexts.clear();
 
         // Cleanup the Winsock library
         WSACleanup();
     }
 }
 
+extern "C" __declspec(dllexport) int __cdecl CLCreateContext(
+    const CLContextConfig* pConfig, CLContext* pCtx)
+{
+    // Gain exclusive access to the library
+    boost::unique_lock<boost::shared_mutex> lock(s_libMutex);
+
+    while (s_uninitializing)
+    {
+        s_uninitializingCondVar.wait(lock);
+    }
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (pConfig == 0 || pConfig->threadCount < 0 || pCtx == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    ContextObjSPtr ctxObj(new ContextObj(*pConfig));
+    s_contexts.push_back(ctxObj);
+    *pCtx = reinterpret_cast<CLContext>(ctxObj.get());
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) void __cdecl CLDeleteContext(CLContext ctx)
+{
+    // Gain exclusive access to the library
+    boost::unique_lock<boost::shared_mutex> lock(s_libMutex);
+
+    while (s_uninitializing)
+    {
+        s_uninitializingCondVar.wait(lock);
+    }
+
+    if (s_startupCount <= 0 || ctx == 0)
+    {
+        return;
+    }
+
+    // Remove the context, never the default context, then close its socket
+    // objects
+    ContextObjSPtr ctxObj;
+    for (size_t idx = 1; ctxObj.get() == 0 && idx < s_contexts.size(); ++idx)
+    {
+        if (s_contexts[idx].get() == reinterpret_cast<ContextObj*>(ctx))
+        {
+            ctxObj = s_contexts[idx];
+            s_contexts.erase(s_contexts.begin() + idx);
+        }
+    }
+    if (ctxObj.get() == 0)
+    {
+        // Context not found
+        return;
+    }
+    ctxObj->deleteAllSocketObjs();
+
+    // Wait for the context's network threads to shutdown without the library
+    // mutex, so that any callbacks they are running can still call into the
+    // library
+    lock.unlock();
+    if (!ctxObj->waitForShutdown(SHUTDOWN_TIMEOUT_INTERVAL))
+    {
+        OUTPUT_FMT_DEBUG_STRING("Context's network thread pool did not "
+            "shutdown in " << SHUTDOWN_TIMEOUT_INTERVAL << "ms");
+    }
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLGetNetThreadStats(
+    CLContext ctx, CLNetThreadStats* pStats, int maxCount, int* pCount)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if ((pStats == 0 && maxCount != 0) || maxCount < 0 || pCount == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    ContextObj* ctxObj = findContextObj(ctx);
+    if (ctxObj == 0)
+    {
+        return CL_ERR_CONTEXT_NOT_FOUND;
+    }
+
+    *pCount = ctxObj->getNetThreadStats(pStats, maxCount);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) void __cdecl CLSetTracing(int on)
+{
+    Trace::setOn(on != 0);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLDumpTrace(const char* path)
+{
+    if (path == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    return Trace::dump(path);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLStartCapture(
+    const char* pathPrefix, unsigned int segmentLen)
+{
+    if (pathPrefix == 0 || segmentLen < CL_CAPTURE_MIN_SEGMENT_LEN ||
+        segmentLen > CL_CAPTURE_MAX_SEGMENT_LEN)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    return Capture::start(pathPrefix, segmentLen);
+}
+
+extern "C" __declspec(dllexport) void __cdecl CLStopCapture(void)
+{
+    Capture::stop();
+}
+
 extern "C" __declspec(dllexport) int __cdecl CLCreateSrvSocket(
     const char* ipAddr, unsigned short port, CLPConPendingFn conPendingFn,
     CLPSrvSocketClosedFn srvSocketClosedFn, int conBacklog, void* srvArg,
     CLSrvSocket* pSrvSkt)
+{
+    return CLCreateSrvSocketCtx(0, ipAddr, port, conPendingFn,
+        srvSocketClosedFn, conBacklog, srvArg, pSrvSkt);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLCreateSrvSocketCtx(
+    CLContext ctx, const char* ipAddr, unsigned short port,
+    CLPConPendingFn conPendingFn, CLPSrvSocketClosedFn srvSocketClosedFn,
+    int conBacklog, void* srvArg, CLSrvSocket* pSrvSkt)
 {
     // Gain shared access to the library
     boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
@@ -208,18 +391,69 @@ extern "C" __declspec(dllexport) int __cdecl CLCreateSrvSocket(
         return CL_ERR_ILLEGAL_ARG;
     }
 
+    ContextObj* ctxObj = findContextObj(ctx);
+    if (ctxObj == 0)
+    {
+        return CL_ERR_CONTEXT_NOT_FOUND;
+    }
+
     // Create server socket object
     SrvSocketObj* srvSktObj = 0;
     int err = SrvSocketObj::create(ipAddr, port, conPendingFn,
         srvSocketClosedFn, conBacklog, srvArg, &srvSktObj);
     if (err == CL_ERR_OK)
     {
-        err = finishCreateSrvSocketObj(srvSktObj, pSrvSkt);
+        err = ctxObj->addSrvSocketObj(srvSktObj, pSrvSkt);
     }
 
     return err;
 }
 
+extern "C" __declspec(dllexport) int __cdecl CLSetMaxCons(int maxCons)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (maxCons < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    ConAdmission::global().setMaxCons(maxCons);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetSrvMaxCons(
+    CLSrvSocket srvSkt, int maxCons)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (maxCons < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SrvSocketObjSPtr srvSktObj = findSrvSocketObj(srvSkt);
+    if (srvSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    srvSktObj->setMaxCons(maxCons);
+    return CL_ERR_OK;
+}
+
 extern "C" __declspec(dllexport) int __cdecl CLAcceptCon(CLSrvSocket srvSkt,
     CLPDataRecvFn dataRecvFn, CLPSocketClosedFn socketClosedFn, void* arg,
     CLSocket* pClientSkt, char* clientIpAddr, int clientIpAddrLen,
@@ -239,7 +473,8 @@ extern "C" __declspec(dllexport) int __cdecl CLAcceptCon(CLSrvSocket srvSkt,
         return CL_ERR_ILLEGAL_ARG;
     }
 
-    SrvSocketObjSPtr srvSktObj = s_srvSocketRegistry.findSocketObj(srvSkt);
+    ContextObj* ctxObj = 0;
+    SrvSocketObjSPtr srvSktObj = findSrvSocketObj(srvSkt, &ctxObj);
     if (srvSktObj.get() == 0)
     {
         return CL_ERR_SOCKET_NOT_FOUND;
@@ -247,17 +482,68 @@ extern "C" __declspec(dllexport) int __cdecl CLAcceptCon(CLSrvSocket srvSkt,
 
     // Accept the connection then create the client socket obj
     SOCKET acceptedSocket = INVALID_SOCKET;
-    int err = srvSktObj->acceptConnection(&acceptedSocket, clientIpAddr,
-        clientIpAddrLen, pClientPort);
+    RingChannel* acceptedChannel = 0;
+    int err = srvSktObj->acceptConnection(&acceptedSocket, &acceptedChannel,
+        clientIpAddr, clientIpAddrLen, pClientPort);
     if (err == CL_ERR_OK)
     {
-        // Create the client socket obj given the accepted socket
+        // Create the client socket obj given the accepted socket or channel
         SocketObj* clientSktObj = 0;
-        err = SocketObj::createAccepted(acceptedSocket, dataRecvFn,
-            socketClosedFn, arg, &clientSktObj);
+        if (acceptedChannel != 0)
+        {
+            err = SocketObj::createAccepted(acceptedChannel, dataRecvFn,
+                socketClosedFn, arg, &clientSktObj);
+        }
+        else
+        {
+            err = SocketObj::createAccepted(acceptedSocket, dataRecvFn,
+                socketClosedFn, arg, &clientSktObj);
+        }
         if (err == CL_ERR_OK)
         {
-            err = finishCreateSocketObj(clientSktObj, pClientSkt);
+            // Set the request callback before the network thread can receive
+            // anything
+            clientSktObj->setRequestRecvFn(srvSktObj->requestRecvFn());
+            clientSktObj->setAdmission(srvSktObj->admission());
+
+            int compressMinLen = srvSktObj->compressMinLen();
+            if (compressMinLen > 0)
+            {
+                err = clientSktObj->setCompression(compressMinLen);
+            }
+
+            clientSktObj->setRateLimit(srvSktObj->rateLimit());
+
+            CLPSlowConsumerFn slowConsumerFn = 0;
+            CLSlowConsumerPolicy slowConsumerPolicy =
+                srvSktObj->slowConsumerPolicy(&slowConsumerFn);
+            if (err == CL_ERR_OK &&
+                slowConsumerPolicy.action != CL_SLOW_CONSUMER_NONE)
+            {
+                err = clientSktObj->setSlowConsumerPolicy(slowConsumerPolicy,
+                    slowConsumerFn);
+            }
+
+            if (err == CL_ERR_OK)
+            {
+                err = ctxObj->addSocketObj(clientSktObj, pClientSkt);
+                if (err == CL_ERR_OK)
+                {
+                    Trace::record(TRACE_ACCEPT, *pClientSkt,
+                        reinterpret_cast<ULONG_PTR>(srvSkt));
+                }
+            }
+            else
+            {
+                clientSktObj->close();
+                delete clientSktObj;
+            }
+        }
+        else
+        {
+            // The connection was counted against the caps when it was
+            // accepted
+            srvSktObj->admission()->release();
         }
     }
 
@@ -275,20 +561,27 @@ extern "C" __declspec(dllexport) void __cdecl CLDeleteSrvSocket(
         return;
     }
 
-    // Remove server socket object from registry
-    SrvSocketObjSPtr srvSktObj = s_srvSocketRegistry.removeSocketObj(srvSkt);
-    if (srvSktObj.get() == 0)
+    // Delete the server socket object from whichever context it is in
+    for (size_t idx = 0; idx < s_contexts.size(); ++idx)
     {
-        // Server socket object not found
-        return;
+        if (s_contexts[idx]->deleteSrvSocketObj(srvSkt))
+        {
+            break;
+        }
     }
-
-    closeSrvSocketObj(srvSktObj);
 }
 
 extern "C" __declspec(dllexport) int __cdecl CLCreateSocket(
     const char* hostAddr, unsigned short hostPort, CLPDataRecvFn dataRecvFn,
     CLPSocketClosedFn socketClosedFn, void* arg, CLSocket* pSkt)
+{
+    return CLCreateSocketCtx(0, hostAddr, hostPort, dataRecvFn,
+        socketClosedFn, arg, pSkt);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLCreateSocketCtx(CLContext ctx,
+    const char* hostAddr, unsigned short hostPort, CLPDataRecvFn dataRecvFn,
+    CLPSocketClosedFn socketClosedFn, void* arg, CLSocket* pSkt)
 {
     // Gain shared access to the library
     boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
@@ -304,13 +597,19 @@ extern "C" __declspec(dllexport) int __cdecl CLCreateSocket(
         return CL_ERR_ILLEGAL_ARG;
     }
 
+    ContextObj* ctxObj = findContextObj(ctx);
+    if (ctxObj == 0)
+    {
+        return CL_ERR_CONTEXT_NOT_FOUND;
+    }
+
     // Create socket object
     SocketObj* sktObj = 0;
     int err = SocketObj::create(hostAddr, hostPort, dataRecvFn,
         socketClosedFn, arg, &sktObj);
     if (err == CL_ERR_OK)
     {
-        err = finishCreateSocketObj(sktObj, pSkt);
+        err = ctxObj->addSocketObj(sktObj, pSkt);
     }
 
     return err;
@@ -320,6 +619,15 @@ extern "C" __declspec(dllexport) int __cdecl CLCreateSocketAsync(
     const char* hostAddr, unsigned short hostPort,
     CLPConCompletedFn conCompletedFn, CLPDataRecvFn dataRecvFn,
     CLPSocketClosedFn socketClosedFn, void* arg, CLSocket* pSkt)
+{
+    return CLCreateSocketAsyncCtx(0, hostAddr, hostPort, conCompletedFn,
+        dataRecvFn, socketClosedFn, arg, pSkt);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLCreateSocketAsyncCtx(
+    CLContext ctx, const char* hostAddr, unsigned short hostPort,
+    CLPConCompletedFn conCompletedFn, CLPDataRecvFn dataRecvFn,
+    CLPSocketClosedFn socketClosedFn, void* arg, CLSocket* pSkt)
 {
     // Gain shared access to the library
     boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
@@ -335,15 +643,119 @@ extern "C" __declspec(dllexport) int __cdecl CLCreateSocketAsync(
         return CL_ERR_ILLEGAL_ARG;
     }
 
+    ContextObj* ctxObj = findContextObj(ctx);
+    if (ctxObj == 0)
+    {
+        return CL_ERR_CONTEXT_NOT_FOUND;
+    }
+
     // Create socket object
     SocketObj* sktObj = 0;
     int err = SocketObj::createAsync(hostAddr, hostPort, conCompletedFn,
         dataRecvFn, socketClosedFn, arg, &sktObj);
     if (err == CL_ERR_OK)
     {
-        err = finishCreateSocketObj(sktObj, pSkt);
+        err = ctxObj->addSocketObj(sktObj, pSkt);
+    }
+
+    return err;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLCreateSocketsAsync(
+    CLConnectTarget* targets, int count, int maxInFlight,
+    CLPConCompletedFn conCompletedFn, CLPDataRecvFn dataRecvFn,
+    CLPSocketClosedFn socketClosedFn)
+{
+    return CLCreateSocketsAsyncCtx(0, targets, count, maxInFlight,
+        conCompletedFn, dataRecvFn, socketClosedFn);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLCreateSocketsAsyncCtx(
+    CLContext ctx, CLConnectTarget* targets, int count, int maxInFlight,
+    CLPConCompletedFn conCompletedFn, CLPDataRecvFn dataRecvFn,
+    CLPSocketClosedFn socketClosedFn)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (targets == 0 || count < 0 || maxInFlight < 0 || conCompletedFn == 0 ||
+        dataRecvFn == 0 || socketClosedFn == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    ContextObj* ctxObj = findContextObj(ctx);
+    if (ctxObj == 0)
+    {
+        return CL_ERR_CONTEXT_NOT_FOUND;
+    }
+
+    // Create socket objects, none of which starts connecting until it has
+    // been added to the network threads
+    std::vector<SocketObjSPtr> sktObjs;
+    std::vector<int> targetIdxs;
+    sktObjs.reserve(count);
+    targetIdxs.reserve(count);
+    for (int idx = 0; idx < count; ++idx)
+    {
+        CLConnectTarget& target = targets[idx];
+        target.skt = 0;
+        target.err = CL_ERR_ILLEGAL_ARG;
+        if (target.hostAddr != 0)
+        {
+            SocketObj* sktObj = 0;
+            target.err = SocketObj::createBatched(target.hostAddr,
+                conCompletedFn, dataRecvFn, socketClosedFn, target.arg,
+                &sktObj);
+            if (target.err == CL_ERR_OK)
+            {
+                sktObjs.push_back(SocketObjSPtr(sktObj));
+                targetIdxs.push_back(idx);
+            }
+        }
+    }
+
+    size_t addedCount = 0;
+    int addErr = ctxObj->addSocketObjs(sktObjs, &addedCount);
+
+    ConnectBatchSPtr batch(new ConnectBatch((maxInFlight > 0) ?
+        maxInFlight : CL_CONNECT_MAX_IN_FLIGHT));
+    bool batchEmpty = true;
+    for (size_t idx = 0; idx < sktObjs.size(); ++idx)
+    {
+        CLConnectTarget& target = targets[targetIdxs[idx]];
+        if (idx >= addedCount)
+        {
+            target.err = addErr;
+        }
+        else
+        {
+            target.skt = SocketRegistry::toHandle(sktObjs[idx].get());
+
+            // Ring channels have already connected
+            if (!isRingAddr(target.hostAddr))
+            {
+                batch->addSocketObj(sktObjs[idx], target.hostAddr,
+                    target.hostPort);
+                batchEmpty = false;
+            }
+        }
+    }
+    if (!batchEmpty)
+    {
+        ctxObj->startConnectBatch(batch);
     }
 
+    int err = CL_ERR_OK;
+    for (int idx = 0; idx < count && err == CL_ERR_OK; ++idx)
+    {
+        err = targets[idx].err;
+    }
     return err;
 }
 
@@ -358,7 +770,9 @@ extern "C" __declspec(dllexport) int __cdecl CLSendData(
         return CL_ERR_NOT_INITIALIZED;
     }
 
-    if (buf == 0 || len < 0)
+    // A zero-length frame marks the library frame that follows it, so data
+    // of length 0 cannot be sent
+    if (buf == 0 || len <= 0)
     {
         return CL_ERR_ILLEGAL_ARG;
     }
@@ -368,19 +782,44 @@ extern "C" __declspec(dllexport) int __cdecl CLSendData(
         return CL_ERR_BUF_TOO_BIG;
     }
 
-    SocketObjSPtr sktObj = s_socketRegistry.findSocketObj(skt);
+    SocketObjSPtr sktObj = findSocketObj(skt);
     if (sktObj.get() == 0)
     {
         return CL_ERR_SOCKET_NOT_FOUND;
     }
 
-    if (len == 0)
+    return sktObj->sendData(buf, len, CL_PRI_NORMAL);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSendDataPri(CLSocket skt,
+    const char* buf, int len, int pri)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    // As for CLSendData(), data of length 0 cannot be sent
+    if (buf == 0 || len <= 0 || pri < CL_PRI_NORMAL || pri >= CL_PRI_COUNT)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    if (len > SocketObj::DATA_MAX_LEN)
+    {
+        return CL_ERR_BUF_TOO_BIG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
     {
-        // Treat sending a buffer of length 0 as a null operation
-        return CL_ERR_OK;
+        return CL_ERR_SOCKET_NOT_FOUND;
     }
 
-    return sktObj->sendData(buf, len);
+    return sktObj->sendData(buf, len, pri);
 }
 
 extern "C" __declspec(dllexport) void __cdecl CLDeleteSocket(CLSocket skt)
@@ -393,13 +832,512 @@ extern "C" __declspec(dllexport) void __cdecl CLDeleteSocket(CLSocket skt)
         return;
     }
 
-    // Remove socket object from registry
-    SocketObjSPtr sktObj = s_socketRegistry.removeSocketObj(skt);
-    if (sktObj.get() == 0)
+    // Delete the socket object from whichever context it is in
+    for (size_t idx = 0; idx < s_contexts.size(); ++idx)
     {
-        // Socket object not found
-        return;
-    }
+        if (s_contexts[idx]->deleteSocketObj(skt))
+        {
+            break;
+        }
+    }
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetRequestRecvFn(
+    CLSocket skt, CLPRequestRecvFn requestRecvFn)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    sktObj->setRequestRecvFn(requestRecvFn);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetSrvRequestRecvFn(
+    CLSrvSocket srvSkt, CLPRequestRecvFn requestRecvFn)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
 
-    closeSocketObj(sktObj);
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    SrvSocketObjSPtr srvSktObj = findSrvSocketObj(srvSkt);
+    if (srvSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    srvSktObj->setRequestRecvFn(requestRecvFn);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLRequest(
+    CLSocket skt, const char* buf, int len, unsigned long timeout,
+    CLPResponseRecvFn responseRecvFn, void* reqArg)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (buf == 0 || len < 0 || responseRecvFn == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    if (len > SocketObj::REQUEST_MAX_LEN)
+    {
+        return CL_ERR_BUF_TOO_BIG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return sktObj->request(buf, len, timeout, responseRecvFn, reqArg);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLRespond(
+    CLSocket skt, CLRequestId reqId, const char* buf, int len)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (buf == 0 || len < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    if (len > SocketObj::REQUEST_MAX_LEN)
+    {
+        return CL_ERR_BUF_TOO_BIG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return sktObj->respond(reqId, buf, len);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetCompression(CLSocket skt,
+    int minLen)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (minLen < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return sktObj->setCompression(minLen);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetSrvCompression(
+    CLSrvSocket srvSkt, int minLen)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (minLen < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SrvSocketObjSPtr srvSktObj = findSrvSocketObj(srvSkt);
+    if (srvSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    srvSktObj->setCompression(minLen);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetCork(CLSocket skt,
+    unsigned long maxDelay, int maxBytes)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (maxDelay != 0 && maxBytes <= 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return sktObj->setCork(maxDelay, maxBytes);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLFlush(CLSocket skt)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return sktObj->flush();
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetRateLimit(CLSocket skt,
+    const CLRateLimit* pLimit)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (pLimit == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    sktObj->setRateLimit(*pLimit);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetSrvRateLimit(
+    CLSrvSocket srvSkt, const CLRateLimit* pLimit)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (pLimit == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SrvSocketObjSPtr srvSktObj = findSrvSocketObj(srvSkt);
+    if (srvSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    srvSktObj->setRateLimit(*pLimit);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetSlowConsumerPolicy(
+    CLSocket skt, const CLSlowConsumerPolicy* pPolicy,
+    CLPSlowConsumerFn slowConsumerFn)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (!isSlowConsumerPolicyValid(pPolicy, slowConsumerFn))
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return sktObj->setSlowConsumerPolicy(*pPolicy, slowConsumerFn);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSetSrvSlowConsumerPolicy(
+    CLSrvSocket srvSkt, const CLSlowConsumerPolicy* pPolicy,
+    CLPSlowConsumerFn slowConsumerFn)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (!isSlowConsumerPolicyValid(pPolicy, slowConsumerFn))
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SrvSocketObjSPtr srvSktObj = findSrvSocketObj(srvSkt);
+    if (srvSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    srvSktObj->setSlowConsumerPolicy(*pPolicy, slowConsumerFn);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLGetSocketStats(CLSocket skt,
+    CLSocketStats* pStats)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (pStats == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    SocketObjSPtr sktObj = findSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    sktObj->getStats(pStats);
+    return CL_ERR_OK;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLCreateUdpSocket(
+    const char* localAddr, unsigned short localPort, const char* remoteAddr,
+    unsigned short remotePort, CLPDatagramRecvFn datagramRecvFn, void* arg,
+    CLUdpSocket* pUdpSkt)
+{
+    return CLCreateUdpSocketCtx(0, localAddr, localPort, remoteAddr,
+        remotePort, datagramRecvFn, arg, pUdpSkt);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLCreateUdpSocketCtx(
+    CLContext ctx, const char* localAddr, unsigned short localPort,
+    const char* remoteAddr, unsigned short remotePort,
+    CLPDatagramRecvFn datagramRecvFn, void* arg, CLUdpSocket* pUdpSkt)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (localAddr == 0 || datagramRecvFn == 0 || pUdpSkt == 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    ContextObj* ctxObj = findContextObj(ctx);
+    if (ctxObj == 0)
+    {
+        return CL_ERR_CONTEXT_NOT_FOUND;
+    }
+
+    // Create UDP socket object
+    UdpSocketObj* udpSktObj = 0;
+    int err = UdpSocketObj::create(localAddr, localPort, remoteAddr,
+        remotePort, datagramRecvFn, arg, &udpSktObj);
+    if (err == CL_ERR_OK)
+    {
+        err = ctxObj->addUdpSocketObj(udpSktObj, pUdpSkt);
+    }
+
+    return err;
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSendDatagram(
+    CLUdpSocket udpSkt, const char* buf, int len)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (buf == 0 || len < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    if (len > UdpSocketObj::DATA_MAX_LEN)
+    {
+        return CL_ERR_BUF_TOO_BIG;
+    }
+
+    UdpSocketObjSPtr udpSktObj = findUdpSocketObj(udpSkt);
+    if (udpSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return udpSktObj->sendDatagram(buf, len);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSendDatagramTo(
+    CLUdpSocket udpSkt, const char* toAddr, unsigned short toPort,
+    const char* buf, int len)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (toAddr == 0 || buf == 0 || len < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    if (len > UdpSocketObj::DATA_MAX_LEN)
+    {
+        return CL_ERR_BUF_TOO_BIG;
+    }
+
+    UdpSocketObjSPtr udpSktObj = findUdpSocketObj(udpSkt);
+    if (udpSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return udpSktObj->sendDatagramTo(toAddr, toPort, buf, len);
+}
+
+extern "C" __declspec(dllexport) int __cdecl CLSendDatagrams(
+    CLUdpSocket udpSkt, const CLDatagram* datagrams, int count,
+    int* pSentCount)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (pSentCount != 0)
+    {
+        *pSentCount = 0;
+    }
+
+    if (s_startupCount <= 0)
+    {
+        return CL_ERR_NOT_INITIALIZED;
+    }
+
+    if (datagrams == 0 || count < 0)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    for (int idx = 0; idx < count; ++idx)
+    {
+        if (datagrams[idx].buf == 0 || datagrams[idx].len < 0)
+        {
+            return CL_ERR_ILLEGAL_ARG;
+        }
+
+        if (datagrams[idx].len > UdpSocketObj::DATA_MAX_LEN)
+        {
+            return CL_ERR_BUF_TOO_BIG;
+        }
+    }
+
+    UdpSocketObjSPtr udpSktObj = findUdpSocketObj(udpSkt);
+    if (udpSktObj.get() == 0)
+    {
+        return CL_ERR_SOCKET_NOT_FOUND;
+    }
+
+    return udpSktObj->sendDatagrams(datagrams, count, pSentCount);
+}
+
+extern "C" __declspec(dllexport) void __cdecl CLDeleteUdpSocket(
+    CLUdpSocket udpSkt)
+{
+    // Gain shared access to the library
+    boost::shared_lock<boost::shared_mutex> lock(s_libMutex);
+
+    if (s_startupCount <= 0)
+    {
+        return;
+    }
+
+    // Delete the UDP socket object from whichever context it is in
+    for (size_t idx = 0; idx < s_contexts.size(); ++idx)
+    {
+        if (s_contexts[idx]->deleteUdpSocketObj(udpSkt))
+        {
+            break;
+        }
+    }
 }
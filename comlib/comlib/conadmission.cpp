@@ -0,0 +1,131 @@
+/**
+ * @file
+ * Defines the ConAdmission class.
+ */
+
+#include "conadmission.h"
+#include <algorithm>
+#include <boost/thread/locks.hpp>
+#include "srvsocketobj.h"
+
+// The admission for the whole library, constructed when the library is loaded
+// so it is never constructed by two threads at once
+static ConAdmission s_globalAdmission(NULL);
+
+ConAdmission::ConAdmission(ConAdmission* parent) : m_parent(parent),
+m_maxCons(0), m_conCount(0)
+{
+}
+
+ConAdmission& ConAdmission::global()
+{
+    return s_globalAdmission;
+}
+
+void ConAdmission::setMaxCons(int maxCons)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    m_maxCons = maxCons;
+    resumeWaiters();
+}
+
+bool ConAdmission::tryAdmit(bool take)
+{
+    if (m_parent != NULL && !m_parent->tryAdmit(take))
+    {
+        return false;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+
+        if (hasRoom())
+        {
+            if (take)
+            {
+                ++m_conCount;
+            }
+            return true;
+        }
+    }
+
+    if (m_parent != NULL && take)
+    {
+        m_parent->release();
+    }
+    return false;
+}
+
+bool ConAdmission::waitForRoom(SrvSocketObj* waiter)
+{
+    if (m_parent != NULL && !m_parent->waitForRoom(waiter))
+    {
+        return false;
+    }
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (hasRoom())
+    {
+        return true;
+    }
+
+    if (std::find(m_waiters.begin(), m_waiters.end(), waiter) ==
+        m_waiters.end())
+    {
+        m_waiters.push_back(waiter);
+    }
+    return false;
+}
+
+void ConAdmission::removeWaiter(SrvSocketObj* waiter)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+
+        m_waiters.erase(std::remove(m_waiters.begin(), m_waiters.end(),
+            waiter), m_waiters.end());
+    }
+
+    if (m_parent != NULL)
+    {
+        m_parent->removeWaiter(waiter);
+    }
+}
+
+void ConAdmission::release()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+
+        --m_conCount;
+        resumeWaiters();
+    }
+
+    if (m_parent != NULL)
+    {
+        m_parent->release();
+    }
+}
+
+bool ConAdmission::hasRoom() const
+{
+    return m_maxCons == 0 || m_conCount < m_maxCons;
+}
+
+void ConAdmission::resumeWaiters()
+{
+    if (!hasRoom() || m_waiters.empty())
+    {
+        return;
+    }
+
+    // A waiter that finds no room elsewhere waits there instead
+    std::vector<SrvSocketObj*> waiters;
+    waiters.swap(m_waiters);
+    for (size_t idx = 0; idx < waiters.size(); ++idx)
+    {
+        waiters[idx]->resumeAccepting();
+    }
+}
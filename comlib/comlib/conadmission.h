@@ -0,0 +1,107 @@
+/**
+ * @file
+ * Declares the ConAdmission class.
+ */
+
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+#include <vector>
+
+class SrvSocketObj;
+
+/**
+ * Counts the connections accepted against a cap. There is one for the whole
+ * library and one for each server socket object, which also counts against
+ * the library's. A server socket object that finds the cap reached stops
+ * accepting and waits here, and is resumed once enough connections close.
+ */
+class ConAdmission : private boost::noncopyable
+{
+public:
+    /**
+     * Constructs a connection admission with no cap.
+     *
+     * @param parent the admission connections also count against, or NULL
+     * for none.
+     */
+    explicit ConAdmission(ConAdmission* parent);
+
+    /**
+     * Returns the admission for the whole library.
+     *
+     * @return The admission for the whole library.
+     */
+    static ConAdmission& global();
+
+    /**
+     * Sets the cap, resuming any waiting server socket objects if there is
+     * now room.
+     *
+     * @param maxCons the maximum number of connections, or 0 for no cap.
+     */
+    void setMaxCons(int maxCons);
+
+    /**
+     * Counts a connection if there is room for one, here and in the parent.
+     *
+     * @param take whether to count the connection, or only check there is
+     * room for one.
+     * @return Whether or not there is room for the connection.
+     */
+    bool tryAdmit(bool take);
+
+    /**
+     * Checks there is room for a connection, here and in the parent, and if
+     * not adds the given server socket object to those resumed once there is.
+     *
+     * @param waiter the server socket object to resume.
+     * @return Whether or not there is room for a connection.
+     */
+    bool waitForRoom(SrvSocketObj* waiter);
+
+    /**
+     * Stops the given server socket object being resumed, here and in the
+     * parent.
+     *
+     * @param waiter the server socket object.
+     */
+    void removeWaiter(SrvSocketObj* waiter);
+
+    /**
+     * Uncounts a connection that has closed, here and in the parent, resuming
+     * the waiting server socket objects if there is now room.
+     */
+    void release();
+
+private:
+    /**
+     * Is there room for another connection? m_mutex must be locked by the
+     * caller.
+     *
+     * @return Whether or not there is room for another connection.
+     */
+    bool hasRoom() const;
+
+    /**
+     * Resumes the waiting server socket objects if there is room. m_mutex
+     * must be locked by the caller, which keeps them from being deleted.
+     */
+    void resumeWaiters();
+
+    /** The admission connections also count against, or NULL for none. */
+    ConAdmission* m_parent;
+
+    /** Synchronizes access to this object. */
+    boost::mutex m_mutex;
+
+    /** The maximum number of connections, or 0 for no cap. */
+    int m_maxCons;
+
+    /** The number of connections counted. */
+    int m_conCount;
+
+    /** The server socket objects waiting for room. */
+    std::vector<SrvSocketObj*> m_waiters;
+};
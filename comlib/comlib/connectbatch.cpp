@@ -0,0 +1,131 @@
+/**
+ * @file
+ * Defines the ConnectBatch class.
+ */
+
+#include "connectbatch.h"
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include "inc/comlib/comlib.h"
+#include "unixaddr.h"
+
+ConnectBatch::ConnectBatch(LONG maxInFlight) :
+m_maxInFlight(maxInFlight), m_inFlight(0), m_cancelled(false)
+{
+}
+
+ConnectBatch::~ConnectBatch()
+{
+    // Every socket object is done with the address information, as each holds
+    // on to this batch while it connects
+    std::map<std::pair<std::string, unsigned short>, Resolution>::iterator it =
+        m_resolutions.begin();
+    for (; it != m_resolutions.end(); ++it)
+    {
+        freeAddrInfo(it->second.addrInfo);
+    }
+}
+
+void ConnectBatch::addSocketObj(const SocketObjSPtr& sktObj,
+                                const char* hostAddr, unsigned short hostPort)
+{
+    Target target;
+    target.sktObj = sktObj;
+    target.hostAddr = hostAddr;
+    target.hostPort = hostPort;
+    m_targets.push_back(target);
+}
+
+boost::shared_ptr<boost::thread> ConnectBatch::start(
+    const ConnectBatchSPtr& self)
+{
+    return boost::shared_ptr<boost::thread>(
+        new boost::thread(threadProc, self));
+}
+
+void ConnectBatch::cancel()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    m_cancelled = true;
+    m_inFlightCondVar.notify_one();
+}
+
+void ConnectBatch::onConnectCompleted()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    --m_inFlight;
+    m_inFlightCondVar.notify_one();
+}
+
+void ConnectBatch::threadProc(ConnectBatchSPtr self)
+{
+    for (size_t idx = 0; idx < self->m_targets.size() &&
+        !self->isCancelled(); ++idx)
+    {
+        Target& target = self->m_targets[idx];
+        if (target.sktObj->closeCalled())
+        {
+            // Deleted before its turn came, so there is nothing to resolve
+            target.sktObj.reset();
+            continue;
+        }
+
+        const Resolution& resolution = self->resolve(target.hostAddr,
+            target.hostPort);
+
+        {
+            // Wait for room for another connection attempt
+            boost::unique_lock<boost::mutex> lock(self->m_mutex);
+            while (self->m_inFlight >= self->m_maxInFlight &&
+                !self->m_cancelled)
+            {
+                self->m_inFlightCondVar.wait(lock);
+            }
+            if (self->m_cancelled)
+            {
+                break;
+            }
+            ++self->m_inFlight;
+        }
+
+        if (!target.sktObj->connectBatched(self, resolution.addrInfo,
+            resolution.err))
+        {
+            // The socket object closed before its turn came
+            self->onConnectCompleted();
+        }
+
+        // Let the socket object go as soon as it has been started, or it
+        // would not be deleted until the whole batch has been
+        target.sktObj.reset();
+    }
+
+    // Let go of the socket objects a cancelled batch never started
+    self->m_targets.clear();
+}
+
+bool ConnectBatch::isCancelled()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    return m_cancelled;
+}
+
+const ConnectBatch::Resolution& ConnectBatch::resolve(
+    const std::string& hostAddr, unsigned short hostPort)
+{
+    std::pair<std::string, unsigned short> key(hostAddr, hostPort);
+    std::map<std::pair<std::string, unsigned short>, Resolution>::iterator it =
+        m_resolutions.find(key);
+    if (it == m_resolutions.end())
+    {
+        Resolution resolution;
+        resolution.addrInfo = NULL;
+        resolution.err = SocketObj::resolveHostAddr(hostAddr.c_str(), hostPort,
+            &resolution.addrInfo);
+        it = m_resolutions.insert(std::make_pair(key, resolution)).first;
+    }
+    return it->second;
+}
@@ -0,0 +1,171 @@
+/**
+ * @file
+ * Declares the ConnectBatch class.
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <ws2tcpip.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "socketobj.h"
+
+class ConnectBatch;
+
+/** A shared pointer to a connect batch. */
+typedef boost::shared_ptr<ConnectBatch> ConnectBatchSPtr;
+
+/**
+ * Starts the connection attempts of a batch of socket objects created by
+ * CLCreateSocketsAsync(). A single thread resolves each distinct host address
+ * and port once, keeping the address information for the whole batch, then
+ * starts each socket object's connection attempt in turn, waiting whenever
+ * the most allowed are already under way. A socket object holds on to the
+ * batch, and with it the address information it is connecting to, until its
+ * connection attempt has completed or it has closed.
+ *
+ * The context the socket objects were added to keeps track of the thread, and
+ * cancels the batch and waits for the thread to exit when it shuts down, so
+ * that no host address is resolved once the library has been cleaned up.
+ */
+class ConnectBatch : private boost::noncopyable
+{
+public:
+    /**
+     * Constructs a connect batch with no socket objects.
+     *
+     * @param maxInFlight the most connection attempts under way at once.
+     */
+    explicit ConnectBatch(LONG maxInFlight);
+
+    ~ConnectBatch();
+
+    /**
+     * Adds a socket object whose connection attempt is to be started. This
+     * must not be called once start() has been.
+     *
+     * @param sktObj the socket object, created by SocketObj::createBatched().
+     * @param hostAddr the host address to connect to.
+     * @param hostPort the host port to connect to.
+     */
+    void addSocketObj(const SocketObjSPtr& sktObj, const char* hostAddr,
+        unsigned short hostPort);
+
+    /**
+     * Starts the thread that resolves the host addresses and starts the
+     * connection attempts, which holds on to the batch until it is done.
+     *
+     * @param self the batch.
+     * @return The thread, which the caller must join.
+     */
+    static boost::shared_ptr<boost::thread> start(const ConnectBatchSPtr& self);
+
+    /**
+     * Stops the thread started by start() from resolving any more host
+     * addresses or starting any more connection attempts. The thread exits
+     * once any resolve under way has completed.
+     */
+    void cancel();
+
+    /**
+     * This is called by a socket object whose connection attempt was started
+     * by this batch once the attempt has completed or the socket object has
+     * closed, making room for the next connection attempt.
+     */
+    void onConnectCompleted();
+
+private:
+    /** A socket object whose connection attempt is to be started. */
+    struct Target
+    {
+        /** The socket object. */
+        SocketObjSPtr sktObj;
+
+        /** The host address to connect to. */
+        std::string hostAddr;
+
+        /** The host port to connect to. */
+        unsigned short hostPort;
+    };
+
+    /** The outcome of resolving a host address and port. */
+    struct Resolution
+    {
+        /**
+         * The linked list of address information structures, or NULL if the
+         * resolve failed.
+         */
+        ADDRINFOA* addrInfo;
+
+        /**
+         * CL_ERR_OK if the resolve was successful, any other value
+         * otherwise.
+         */
+        int err;
+    };
+
+    /**
+     * The method the thread started by start() runs.
+     *
+     * @param self the batch.
+     */
+    static void threadProc(ConnectBatchSPtr self);
+
+    /**
+     * Returns the resolution of the given host address and port, resolving it
+     * if it has not been already.
+     *
+     * @param hostAddr the host address.
+     * @param hostPort the host port.
+     * @return The resolution.
+     */
+    const Resolution& resolve(const std::string& hostAddr,
+        unsigned short hostPort);
+
+    /** The most connection attempts under way at once. */
+    LONG m_maxInFlight;
+
+    /**
+     * Returns whether or not cancel() has been called.
+     *
+     * @return Whether or not the batch has been cancelled.
+     */
+    bool isCancelled();
+
+    /** Synchronizes access to m_inFlight and m_cancelled. */
+    boost::mutex m_mutex;
+
+    /**
+     * Signalled when a connection attempt completes or the batch is
+     * cancelled.
+     */
+    boost::condition_variable m_inFlightCondVar;
+
+    /** The number of connection attempts under way. */
+    LONG m_inFlight;
+
+    /** Has cancel() been called? */
+    bool m_cancelled;
+
+    /**
+     * The socket objects whose connection attempts are to be started, each
+     * released once its attempt has been started.
+     */
+    std::vector<Target> m_targets;
+
+    /**
+     * The resolution of each host address and port, used only by the thread
+     * started by start() until every socket object is done with them.
+     */
+    std::map<std::pair<std::string, unsigned short>, Resolution>
+        m_resolutions;
+};
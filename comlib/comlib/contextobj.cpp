@@ -0,0 +1,270 @@
+/**
+ * @file
+ * Defines the ContextObj class.
+ */
+
+#include "contextobj.h"
+#include <boost/thread/locks.hpp>
+#include <cassert>
+
+ContextObj::ContextObj(const CLContextConfig& config) :
+m_netThreadPool(config)
+{
+}
+
+int ContextObj::addSrvSocketObj(SrvSocketObj* rawSrvSktObj,
+    CLSrvSocket* pSrvSkt)
+{
+    assert(rawSrvSktObj != 0);
+
+    SrvSocketObjSPtr srvSktObj(rawSrvSktObj);
+
+    // Add server socket object to registry
+    CLSrvSocket srvSkt = SrvSocketRegistry::toHandle(rawSrvSktObj);
+    m_srvSocketRegistry.addSocketObj(srvSkt, srvSktObj);
+
+    // Add server socket object to network thread pool
+    int err = m_netThreadPool.addNetObj(srvSktObj);
+    if (err == CL_ERR_OK)
+    {
+        *pSrvSkt = srvSkt;
+    }
+    else
+    {
+        m_srvSocketRegistry.removeSocketObj(srvSkt);
+        srvSktObj->close();
+    }
+
+    return err;
+}
+
+int ContextObj::addSocketObj(SocketObj* rawSktObj, CLSocket* pSkt)
+{
+    assert(rawSktObj != 0);
+
+    SocketObjSPtr sktObj(rawSktObj);
+
+    // Add socket object to registry
+    CLSocket skt = SocketRegistry::toHandle(rawSktObj);
+    m_socketRegistry.addSocketObj(skt, sktObj);
+
+    // Add socket object to network thread pool
+    int err = m_netThreadPool.addNetObj(sktObj);
+    if (err == CL_ERR_OK)
+    {
+        *pSkt = skt;
+    }
+    else
+    {
+        m_socketRegistry.removeSocketObj(skt);
+        sktObj->close();
+    }
+
+    return err;
+}
+
+int ContextObj::addSocketObjs(const std::vector<SocketObjSPtr>& sktObjs,
+                              size_t* pAddedCount)
+{
+    // Add socket objects to registry
+    std::vector<NetObjSPtr> netObjs;
+    netObjs.reserve(sktObjs.size());
+    for (size_t idx = 0; idx < sktObjs.size(); ++idx)
+    {
+        m_socketRegistry.addSocketObj(
+            SocketRegistry::toHandle(sktObjs[idx].get()), sktObjs[idx]);
+        netObjs.push_back(sktObjs[idx]);
+    }
+
+    // Add socket objects to network thread pool
+    int err = m_netThreadPool.addNetObjs(netObjs, pAddedCount);
+    for (size_t idx = *pAddedCount; idx < sktObjs.size(); ++idx)
+    {
+        m_socketRegistry.removeSocketObj(
+            SocketRegistry::toHandle(sktObjs[idx].get()));
+        sktObjs[idx]->close();
+    }
+
+    return err;
+}
+
+int ContextObj::addUdpSocketObj(UdpSocketObj* rawUdpSktObj,
+    CLUdpSocket* pUdpSkt)
+{
+    assert(rawUdpSktObj != 0);
+
+    UdpSocketObjSPtr udpSktObj(rawUdpSktObj);
+
+    // Add UDP socket object to registry
+    CLUdpSocket udpSkt = UdpSocketRegistry::toHandle(rawUdpSktObj);
+    m_udpSocketRegistry.addSocketObj(udpSkt, udpSktObj);
+
+    // Add UDP socket object to network thread pool
+    int err = m_netThreadPool.addNetObj(udpSktObj);
+    if (err == CL_ERR_OK)
+    {
+        *pUdpSkt = udpSkt;
+    }
+    else
+    {
+        m_udpSocketRegistry.removeSocketObj(udpSkt);
+        udpSktObj->close();
+    }
+
+    return err;
+}
+
+void ContextObj::startConnectBatch(const ConnectBatchSPtr& batch)
+{
+    boost::lock_guard<boost::mutex> lock(m_connectBatchMutex);
+
+    // Forget the batches that are done, so the list does not grow with every
+    // batch started in a long running context
+    joinExitedConnectBatchThreads();
+
+    ConnectBatchThread batchThread;
+    batchThread.batch = batch;
+    batchThread.thread = ConnectBatch::start(batch);
+    m_connectBatchThreads.push_back(batchThread);
+}
+
+bool ContextObj::deleteSrvSocketObj(CLSrvSocket srvSkt)
+{
+    // Remove server socket object from registry
+    SrvSocketObjSPtr srvSktObj = m_srvSocketRegistry.removeSocketObj(srvSkt);
+    if (srvSktObj.get() == 0)
+    {
+        // Server socket object not found
+        return false;
+    }
+
+    // Remove server socket object from network thread pool
+    m_netThreadPool.removeNetObj(srvSktObj);
+    // Close server socket object
+    srvSktObj->close();
+    return true;
+}
+
+bool ContextObj::deleteSocketObj(CLSocket skt)
+{
+    // Remove socket object from registry
+    SocketObjSPtr sktObj = m_socketRegistry.removeSocketObj(skt);
+    if (sktObj.get() == 0)
+    {
+        // Socket object not found
+        return false;
+    }
+
+    // Remove socket object from network thread pool
+    m_netThreadPool.removeNetObj(sktObj);
+    // Close socket object
+    sktObj->close();
+    return true;
+}
+
+bool ContextObj::deleteUdpSocketObj(CLUdpSocket udpSkt)
+{
+    // Remove UDP socket object from registry
+    UdpSocketObjSPtr udpSktObj = m_udpSocketRegistry.removeSocketObj(udpSkt);
+    if (udpSktObj.get() == 0)
+    {
+        // UDP socket object not found
+        return false;
+    }
+
+    // Remove UDP socket object from network thread pool
+    m_netThreadPool.removeNetObj(udpSktObj);
+    // Close UDP socket object
+    udpSktObj->close();
+    return true;
+}
+
+void ContextObj::deleteAllSocketObjs()
+{
+    // Stop the connect batches first, so they do not go on to resolve host
+    // addresses for socket objects that are about to be closed
+    {
+        boost::lock_guard<boost::mutex> lock(m_connectBatchMutex);
+
+        for (size_t idx = 0; idx < m_connectBatchThreads.size(); ++idx)
+        {
+            ConnectBatchSPtr batch = m_connectBatchThreads[idx].batch.lock();
+            if (batch.get() != 0)
+            {
+                batch->cancel();
+            }
+        }
+    }
+
+    // Take every socket object out of the registries in one go, then shut
+    // down the network threads, which lets go of all of the objects in one
+    // pass per thread, before closing them
+    std::vector<SrvSocketObjSPtr> srvSktObjs;
+    m_srvSocketRegistry.removeAllSocketObjs(srvSktObjs);
+    std::vector<SocketObjSPtr> sktObjs;
+    m_socketRegistry.removeAllSocketObjs(sktObjs);
+    std::vector<UdpSocketObjSPtr> udpSktObjs;
+    m_udpSocketRegistry.removeAllSocketObjs(udpSktObjs);
+
+    m_netThreadPool.removeAllNetObjs();
+
+    // Close server socket objects
+    for (size_t idx = 0; idx < srvSktObjs.size(); ++idx)
+    {
+        srvSktObjs[idx]->close();
+    }
+
+    // Close socket objects
+    for (size_t idx = 0; idx < sktObjs.size(); ++idx)
+    {
+        sktObjs[idx]->close();
+    }
+
+    // Close UDP socket objects
+    for (size_t idx = 0; idx < udpSktObjs.size(); ++idx)
+    {
+        udpSktObjs[idx]->close();
+    }
+}
+
+bool ContextObj::waitForShutdown(DWORD milliseconds)
+{
+    DWORD startTickCount = GetTickCount();
+    bool allThreadsShutdown = m_netThreadPool.waitForShutdown(milliseconds);
+
+    boost::lock_guard<boost::mutex> lock(m_connectBatchMutex);
+
+    // Wait for the connect batch threads in the time left, which only run
+    // on past a cancel while a host address is being resolved
+    for (size_t idx = 0; idx < m_connectBatchThreads.size(); ++idx)
+    {
+        DWORD elapsedInterval = GetTickCount() - startTickCount;
+        DWORD timeOutInterval = (elapsedInterval < milliseconds) ?
+            milliseconds - elapsedInterval : 0;
+        if (WaitForSingleObject(
+            m_connectBatchThreads[idx].thread->native_handle(),
+            timeOutInterval) != WAIT_OBJECT_0)
+        {
+            allThreadsShutdown = false;
+            break;
+        }
+    }
+    joinExitedConnectBatchThreads();
+
+    return allThreadsShutdown;
+}
+
+void ContextObj::joinExitedConnectBatchThreads()
+{
+    for (size_t idx = m_connectBatchThreads.size(); idx > 0; --idx)
+    {
+        std::vector<ConnectBatchThread>::iterator it =
+            m_connectBatchThreads.begin() + (idx - 1);
+        if (WaitForSingleObject(it->thread->native_handle(), 0) ==
+            WAIT_OBJECT_0)
+        {
+            it->thread->join();
+            m_connectBatchThreads.erase(it);
+        }
+    }
+}
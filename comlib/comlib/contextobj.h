@@ -0,0 +1,237 @@
+/**
+ * @file
+ * Declares the ContextObj class.
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+#include <boost/weak_ptr.hpp>
+#include <vector>
+#include "connectbatch.h"
+#include "inc/comlib/comlib.h"
+#include "netthreadpool.h"
+#include "socketobj.h"
+#include "socketregistry.h"
+#include "srvsocketobj.h"
+#include "udpsocketobj.h"
+
+/**
+ * A library context, which owns the sockets created in it and the pool of
+ * network threads that serves them. Sockets in different contexts never share
+ * a network thread, so a busy context cannot delay the callbacks of another.
+ */
+class ContextObj : private boost::noncopyable
+{
+public:
+    /**
+     * Constructs a context object. No threads are started until the first
+     * socket is added.
+     *
+     * @param config how the context's network threads are set up.
+     */
+    explicit ContextObj(const CLContextConfig& config);
+
+    /**
+     * Adds the given server socket object to this context, closing it if it
+     * could not be added.
+     *
+     * @param rawSrvSktObj the server socket object to add, which this context
+     * takes ownership of.
+     * @param pSrvSkt if the method was successful this will be set to the
+     * handle of the server socket.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int addSrvSocketObj(SrvSocketObj* rawSrvSktObj, CLSrvSocket* pSrvSkt);
+
+    /**
+     * Adds the given socket object to this context, closing it if it could
+     * not be added.
+     *
+     * @param rawSktObj the socket object to add, which this context takes
+     * ownership of.
+     * @param pSkt if the method was successful this will be set to the handle
+     * of the socket.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int addSocketObj(SocketObj* rawSktObj, CLSocket* pSkt);
+
+    /**
+     * Adds the given socket objects to this context, as addSocketObj() does
+     * for each, but adding them to the network threads in bulk. Any that
+     * could not be added are closed.
+     *
+     * @param sktObjs the socket objects to add.
+     * @param pAddedCount this will be set to the number of socket objects
+     * added, which are those at the start of sktObjs.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int addSocketObjs(const std::vector<SocketObjSPtr>& sktObjs,
+        size_t* pAddedCount);
+
+    /**
+     * Adds the given UDP socket object to this context, closing it if it
+     * could not be added.
+     *
+     * @param rawUdpSktObj the UDP socket object to add, which this context
+     * takes ownership of.
+     * @param pUdpSkt if the method was successful this will be set to the
+     * handle of the UDP socket.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int addUdpSocketObj(UdpSocketObj* rawUdpSktObj, CLUdpSocket* pUdpSkt);
+
+    /**
+     * Starts the thread of the given connect batch, whose socket objects have
+     * been added to this context, and keeps track of it so that shutting
+     * down the context cancels the batch and waits for the thread to exit.
+     *
+     * @param batch the connect batch to start.
+     */
+    void startConnectBatch(const ConnectBatchSPtr& batch);
+
+    /**
+     * Finds the server socket object for the given handle in this context.
+     *
+     * @param srvSkt the handle of the server socket.
+     * @return The server socket object, or an empty pointer if it is not in
+     * this context.
+     */
+    SrvSocketObjSPtr findSrvSocketObj(CLSrvSocket srvSkt)
+    {
+        return m_srvSocketRegistry.findSocketObj(srvSkt);
+    }
+
+    /**
+     * Finds the socket object for the given handle in this context.
+     *
+     * @param skt the handle of the socket.
+     * @return The socket object, or an empty pointer if it is not in this
+     * context.
+     */
+    SocketObjSPtr findSocketObj(CLSocket skt)
+    {
+        return m_socketRegistry.findSocketObj(skt);
+    }
+
+    /**
+     * Finds the UDP socket object for the given handle in this context.
+     *
+     * @param udpSkt the handle of the UDP socket.
+     * @return The UDP socket object, or an empty pointer if it is not in this
+     * context.
+     */
+    UdpSocketObjSPtr findUdpSocketObj(CLUdpSocket udpSkt)
+    {
+        return m_udpSocketRegistry.findSocketObj(udpSkt);
+    }
+
+    /**
+     * Removes the server socket for the given handle from this context and
+     * closes it.
+     *
+     * @param srvSkt the handle of the server socket.
+     * @return Whether or not the server socket was in this context.
+     */
+    bool deleteSrvSocketObj(CLSrvSocket srvSkt);
+
+    /**
+     * Removes the socket for the given handle from this context and closes
+     * it.
+     *
+     * @param skt the handle of the socket.
+     * @return Whether or not the socket was in this context.
+     */
+    bool deleteSocketObj(CLSocket skt);
+
+    /**
+     * Removes the UDP socket for the given handle from this context and
+     * closes it.
+     *
+     * @param udpSkt the handle of the UDP socket.
+     * @return Whether or not the UDP socket was in this context.
+     */
+    bool deleteUdpSocketObj(CLUdpSocket udpSkt);
+
+    /**
+     * Removes every socket from this context and closes them, starting the
+     * shutdown of all of the context's network threads at once. Connect
+     * batches still starting connection attempts are cancelled.
+     */
+    void deleteAllSocketObjs();
+
+    /**
+     * Waits until the network threads of this context that are shutting down,
+     * and the threads of its connect batches, have exited or the time-out
+     * interval elapses.
+     *
+     * @param milliseconds the time-out interval in milliseconds.
+     * @return Whether or not all the threads completed shutdown in the
+     * time-out interval.
+     */
+    bool waitForShutdown(DWORD milliseconds);
+
+    /**
+     * Gets statistics for each of this context's network threads.
+     *
+     * @param pStats an array that will be filled in with the statistics of up
+     * to maxCount threads.
+     * @param maxCount the number of elements in the array.
+     * @return The number of network threads, which may be more than
+     * maxCount.
+     */
+    int getNetThreadStats(CLNetThreadStats* pStats, int maxCount)
+    {
+        return m_netThreadPool.getThreadStats(pStats, maxCount);
+    }
+
+private:
+    /** A connect batch started in this context and its thread. */
+    struct ConnectBatchThread
+    {
+        /**
+         * The connect batch, which is not kept alive by the context once its
+         * thread and socket objects are done with it.
+         */
+        boost::weak_ptr<ConnectBatch> batch;
+
+        /** The thread started for the connect batch. */
+        boost::shared_ptr<boost::thread> thread;
+    };
+
+    /**
+     * Joins and forgets the connect batch threads that have exited.
+     * m_connectBatchMutex must be locked by the caller.
+     */
+    void joinExitedConnectBatchThreads();
+
+    /** A registry for server socket objects. */
+    SrvSocketRegistry m_srvSocketRegistry;
+
+    /** A registry for socket objects. */
+    SocketRegistry m_socketRegistry;
+
+    /** A registry for UDP socket objects. */
+    UdpSocketRegistry m_udpSocketRegistry;
+
+    /** The context's pool of network threads. */
+    NetThreadPool m_netThreadPool;
+
+    /** Synchronizes access to m_connectBatchThreads. */
+    boost::mutex m_connectBatchMutex;
+
+    /** The connect batch threads that have not been joined yet. */
+    std::vector<ConnectBatchThread> m_connectBatchThreads;
+};
+
+/** A shared pointer to a context object. */
+typedef boost::shared_ptr<ContextObj> ContextObjSPtr;
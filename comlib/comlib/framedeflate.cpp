@@ -0,0 +1,171 @@
+/**
+ * @file
+ * Defines the FrameDeflater and FrameInflater classes.
+ */
+
+#include "framedeflate.h"
+#include <windows.h>
+#include "inc/comlib/comlib.h"
+
+// The zlib compression level. The fastest level gets most of the saving on
+// typical message traffic for a fraction of the CPU time of the default
+static const int DEFLATE_LEVEL = Z_BEST_SPEED;
+
+// The base two logarithm of the history size, negated to leave out the zlib
+// header and checksum as the frame length prefix already delimits the data
+static const int DEFLATE_WINDOW_BITS = -MAX_WBITS;
+
+// How much memory zlib uses for the compression state, this is its default
+static const int DEFLATE_MEM_LEVEL = 8;
+
+// Maps an error from a zlib function onto a comlib error code
+static int zlibErr(int zErr)
+{
+    return (zErr == Z_MEM_ERROR) ? ERROR_NOT_ENOUGH_MEMORY :
+        CL_ERR_DATA_STREAM_CORRUPTED;
+}
+
+int FrameDeflater::create(FrameDeflater** pDeflater)
+{
+    FrameDeflater* self = new FrameDeflater;
+    int err = self->construct();
+    if (err == CL_ERR_OK)
+    {
+        *pDeflater = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+FrameDeflater::~FrameDeflater()
+{
+    if (m_streamInitialized)
+    {
+        deflateEnd(&m_stream);
+    }
+}
+
+int FrameDeflater::deflateFrame(const char* buf, int len, char* outBuf,
+                                int outLen, int& deflatedLen)
+{
+    deflatedLen = 0;
+
+    m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf));
+    m_stream.avail_in = static_cast<uInt>(len);
+    m_stream.next_out = reinterpret_cast<Bytef*>(outBuf);
+    m_stream.avail_out = static_cast<uInt>(outLen);
+
+    // A sync flush ends the output on a byte boundary with everything so far
+    // included, but keeps the history for the next frame
+    int zErr = deflate(&m_stream, Z_SYNC_FLUSH);
+    if (zErr != Z_OK)
+    {
+        return zlibErr(zErr);
+    }
+
+    if (m_stream.avail_in != 0 || m_stream.avail_out == 0)
+    {
+        // The output buffer was too small, so some of the frame is still held
+        // inside the stream
+        return CL_ERR_BUF_TOO_BIG;
+    }
+
+    deflatedLen = outLen - static_cast<int>(m_stream.avail_out);
+    return CL_ERR_OK;
+}
+
+FrameDeflater::FrameDeflater() : m_streamInitialized(false)
+{
+}
+
+int FrameDeflater::construct()
+{
+    m_stream.zalloc = Z_NULL;
+    m_stream.zfree = Z_NULL;
+    m_stream.opaque = Z_NULL;
+
+    int zErr = deflateInit2(&m_stream, DEFLATE_LEVEL, Z_DEFLATED,
+        DEFLATE_WINDOW_BITS, DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (zErr != Z_OK)
+    {
+        return zlibErr(zErr);
+    }
+
+    m_streamInitialized = true;
+    return CL_ERR_OK;
+}
+
+int FrameInflater::create(int maxLen, FrameInflater** pInflater)
+{
+    FrameInflater* self = new FrameInflater(maxLen);
+    int err = self->construct();
+    if (err == CL_ERR_OK)
+    {
+        *pInflater = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+FrameInflater::~FrameInflater()
+{
+    if (m_streamInitialized)
+    {
+        inflateEnd(&m_stream);
+    }
+}
+
+int FrameInflater::inflateFrame(const char* buf, int len, int& inflatedLen)
+{
+    inflatedLen = 0;
+
+    m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf));
+    m_stream.avail_in = static_cast<uInt>(len);
+    m_stream.next_out = reinterpret_cast<Bytef*>(&m_buf[0]);
+    m_stream.avail_out = static_cast<uInt>(m_buf.size());
+
+    // The buffer is one byte longer than the longest frame, so a frame that
+    // fills it completely is known to be too long
+    int zErr = inflate(&m_stream, Z_SYNC_FLUSH);
+    if (zErr != Z_OK && zErr != Z_BUF_ERROR)
+    {
+        return zlibErr(zErr);
+    }
+
+    if (m_stream.avail_in != 0 || m_stream.avail_out == 0)
+    {
+        return CL_ERR_BUF_TOO_BIG;
+    }
+
+    inflatedLen = static_cast<int>(m_buf.size() - m_stream.avail_out);
+    return CL_ERR_OK;
+}
+
+FrameInflater::FrameInflater(int maxLen) : m_streamInitialized(false),
+m_buf(maxLen + 1)
+{
+}
+
+int FrameInflater::construct()
+{
+    m_stream.zalloc = Z_NULL;
+    m_stream.zfree = Z_NULL;
+    m_stream.opaque = Z_NULL;
+    m_stream.next_in = Z_NULL;
+    m_stream.avail_in = 0;
+
+    int zErr = inflateInit2(&m_stream, DEFLATE_WINDOW_BITS);
+    if (zErr != Z_OK)
+    {
+        return zlibErr(zErr);
+    }
+
+    m_streamInitialized = true;
+    return CL_ERR_OK;
+}
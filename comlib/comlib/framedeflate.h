@@ -0,0 +1,130 @@
+/**
+ * @file
+ * Declares the FrameDeflater and FrameInflater classes.
+ */
+
+#pragma once
+
+#include <boost/utility.hpp>
+#include <vector>
+#include <zlib.h>
+
+/**
+ * Compresses frames one at a time as a single raw deflate stream, so matches
+ * can reach back into earlier frames. Each frame is flushed on its own, so
+ * the other end can inflate it as soon as it arrives.
+ */
+class FrameDeflater : private boost::noncopyable
+{
+public:
+    /**
+     * Creates a frame deflater.
+     *
+     * @param pDeflater if the method was successful this will be set to point
+     * to the frame deflater that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int create(FrameDeflater** pDeflater);
+
+    ~FrameDeflater();
+
+    /**
+     * Compresses the given frame. If the method fails the stream can no
+     * longer be used, as the other end will not see the same history.
+     *
+     * @param buf the frame to compress.
+     * @param len the length of the frame to compress.
+     * @param outBuf the buffer to compress the frame into.
+     * @param outLen the length of the buffer to compress the frame into.
+     * @param deflatedLen this will be set to the length of the compressed
+     * frame.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int deflateFrame(const char* buf, int len, char* outBuf, int outLen,
+        int& deflatedLen);
+
+private:
+    /** The first stage of construction. */
+    FrameDeflater();
+
+    /**
+     * The second stage of construction.
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int construct();
+
+    /** The zlib stream. */
+    z_stream m_stream;
+
+    /** This is set once m_stream has been initialized. */
+    bool m_streamInitialized;
+};
+
+/**
+ * Decompresses frames compressed by a FrameDeflater at the other end of the
+ * connection, in the order they were compressed.
+ */
+class FrameInflater : private boost::noncopyable
+{
+public:
+    /**
+     * Creates a frame inflater.
+     *
+     * @param maxLen the maximum length of a decompressed frame.
+     * @param pInflater if the method was successful this will be set to point
+     * to the frame inflater that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int create(int maxLen, FrameInflater** pInflater);
+
+    ~FrameInflater();
+
+    /**
+     * Decompresses the given frame into the buffer returned by buf().
+     *
+     * @param buf the frame to decompress.
+     * @param len the length of the frame to decompress.
+     * @param inflatedLen this will be set to the length of the decompressed
+     * frame.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int inflateFrame(const char* buf, int len, int& inflatedLen);
+
+    /**
+     * Returns the buffer holding the frame most recently decompressed.
+     *
+     * @return The buffer holding the frame most recently decompressed.
+     */
+    const char* buf() const { return &m_buf[0]; }
+
+private:
+    /**
+     * The first stage of construction.
+     *
+     * @param maxLen the maximum length of a decompressed frame.
+     */
+    explicit FrameInflater(int maxLen);
+
+    /**
+     * The second stage of construction.
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int construct();
+
+    /** The zlib stream. */
+    z_stream m_stream;
+
+    /** This is set once m_stream has been initialized. */
+    bool m_streamInitialized;
+
+    /** The buffer decompressed frames are written into. */
+    std::vector<char> m_buf;
+};
@@ -10,11 +10,28 @@
  * scheme on TCP for you (though this does make the library unsuitable if you
  * require data to be streamed). The library supports IPv4, IPv6 on systems
  * that have it installed, and will also resolve host names to IP addresses for
- * you (via DNS lookup or a "hosts" file).
+ * you (via DNS lookup or a "hosts" file). Peers on the same machine can use
+ * Unix domain sockets instead of TCP/IP by giving an address of the form
+ * "unix:path", which avoids the overhead of the TCP/IP stack (this requires
+ * Windows 10 version 1803 or later). For the lowest latency, processes on the
+ * same machine can instead use an address of the form "shm://name", which
+ * carries the same packets over rings in shared memory without any system
+ * calls on the data path. Both ends must be in the same Windows session. If
+ * the process at one end exits without deleting its socket, the other end's
+ * socket closed callback is called with WSAECONNRESET within about a second.
+ * Sockets in the same process can connect using an address of the form
+ * "inproc://name", which uses the same rings without any kernel objects beyond
+ * the wakeup events. This is useful for measuring the cost of the library
+ * itself and for tests that should not depend on the network. Where losing
+ * the odd packet is acceptable, UDP sockets send and receive datagrams as is,
+ * many at a time, without the cost of a connection. Over slow links, sockets
+ * can compress the packets they send with zlib.
  *
  * The library is thread-safe and is suitable for clients and servers that
- * receive a moderate number of connections. The file comlib.h contains all
- * declarations needed to use the library.
+ * receive a moderate number of connections. Sockets can be kept apart in
+ * library contexts, each with its own network threads, so that for example
+ * bulk transfers never delay latency sensitive connections. The file comlib.h
+ * contains all declarations needed to use the library.
  *
  * comlib.dll is dependent on the following DLL's and requires them to be in
  * the DLL search path if you wish to use the library:
@@ -22,10 +39,12 @@
  * For Debug builds:
  *   - boost_date_time-vc80-mt-gd-1_37.dll
  *   - boost_thread-vc80-mt-gd-1_37.dll
+ *   - zlib1.dll
  *
  * For Release builds:
  *   - boost_date_time-vc80-mt-1_37.dll
  *   - boost_thread-vc80-mt-1_37.dll
+ *   - zlib1.dll
  *
  * Also, as comlib.dll is built with the multithread- and DLL-specific version
  * of the Microsoft Visual C++ run-time library, either Microsoft Visual Studio
@@ -64,7 +83,9 @@ extern "C" {
 /**
  * This is returned when the data stream sent to the remote host has corrupted.
  * The only way to recover is to delete then recreate the socket and try
- * resending the data.
+ * resending the data. It is also passed to the socket closed callback function
+ * when compressed data received from the remote host cannot be inflated, in
+ * which case the socket has been closed.
  */
 #define CL_ERR_DATA_STREAM_CORRUPTED -2
 /** This is returned when one of the given arguments has an illegal value. */
@@ -73,6 +94,88 @@ extern "C" {
 #define CL_ERR_NOT_INITIALIZED -4
 /** This is returned when the given socket or server socket was not found. */
 #define CL_ERR_SOCKET_NOT_FOUND -5
+/** This is given when no response to a request arrived in time. */
+#define CL_ERR_TIMED_OUT -6
+/**
+ * This is given when a request arrived at a socket that has no request
+ * received callback function set.
+ */
+#define CL_ERR_NO_REQUEST_RECV_FN -7
+/**
+ * This is given when the socket closed before a response to a request
+ * arrived.
+ */
+#define CL_ERR_SOCKET_CLOSED -8
+/**
+ * This is returned when a socket already has as many requests waiting for a
+ * response as it can keep track of.
+ */
+#define CL_ERR_TOO_MANY_REQUESTS -9
+/**
+ * This is returned when a connection cannot be accepted as the server socket,
+ * or the library as a whole, already has as many connections as it may, see
+ * CLSetMaxCons(). The connection is left queued until there is room.
+ */
+#define CL_ERR_TOO_MANY_CONS -10
+/**
+ * This is returned when the specified context does not exist, either because
+ * it was never created or because it has been deleted.
+ */
+#define CL_ERR_CONTEXT_NOT_FOUND -11
+/**
+ * This is returned when data cannot be sent as the other end is not reading
+ * fast enough, see CLSetSlowConsumerPolicy(). It is also given when a socket
+ * is closed for that reason.
+ */
+#define CL_ERR_SLOW_CONSUMER -12
+
+/** The priority of data sent with CLSendData(), see CLSendDataPri(). */
+#define CL_PRI_NORMAL 0
+/**
+ * A priority for data that must not wait behind bulk data, such as
+ * heartbeats.
+ */
+#define CL_PRI_HIGH 1
+/** The highest priority, for data such as cancels. */
+#define CL_PRI_URGENT 2
+/** The number of priorities. */
+#define CL_PRI_COUNT 3
+
+/** A capture record of data received, see CLCaptureRecord. */
+#define CL_CAPTURE_RECV 0
+/** A capture record of data sent. */
+#define CL_CAPTURE_SEND 1
+/**
+ * A capture record of a socket being created or accepted, which has no data.
+ */
+#define CL_CAPTURE_OPEN 2
+/**
+ * A capture record of a socket being closed by the remote host or deleted,
+ * which has no data. A socket closed by the remote host then deleted has two.
+ */
+#define CL_CAPTURE_CLOSE 3
+/** The smallest segment length that CLStartCapture() accepts. */
+#define CL_CAPTURE_MIN_SEGMENT_LEN 0x100000
+/** The largest segment length that CLStartCapture() accepts. */
+#define CL_CAPTURE_MAX_SEGMENT_LEN 0x40000000
+
+/**
+ * The most connection attempts CLCreateSocketsAsync() has under way at once if
+ * it is not given a limit.
+ */
+#define CL_CONNECT_MAX_IN_FLIGHT 256
+
+/**
+ * No slow consumer policy, so sending blocks until the TCP stack takes the
+ * data, see CLSetSlowConsumerPolicy().
+ */
+#define CL_SLOW_CONSUMER_NONE 0
+/** Drop the oldest data queued at CL_PRI_NORMAL to keep within the limits. */
+#define CL_SLOW_CONSUMER_DROP 1
+/** Close the socket. */
+#define CL_SLOW_CONSUMER_DISCONNECT 2
+/** Call the slow consumer callback function. */
+#define CL_SLOW_CONSUMER_CALLBACK 3
 
 struct CLSrvSocket__;
 /** Represents a server socket. */
@@ -82,6 +185,304 @@ struct CLSocket__;
 /** Represents a socket. */
 typedef struct CLSocket__* CLSocket;
 
+struct CLUdpSocket__;
+/** Represents a UDP socket. */
+typedef struct CLUdpSocket__* CLUdpSocket;
+
+struct CLContext__;
+/**
+ * Represents a library context, see CLCreateContext(). A NULL context stands
+ * for the default context.
+ */
+typedef struct CLContext__* CLContext;
+
+/** Identifies a request received, see CLRespond(). */
+typedef unsigned int CLRequestId;
+
+/** A datagram to send, see CLSendDatagrams(). */
+typedef struct CLDatagram
+{
+    /** The data of the datagram. */
+    const char* buf;
+    /** The length of the data. */
+    int len;
+} CLDatagram;
+
+/** Statistics for a socket, see CLGetSocketStats(). */
+typedef struct CLSocketStats
+{
+    /**
+     * The number of frames sent at each priority, indexed by CL_PRI_NORMAL
+     * and so on. This includes requests, responses and any frames still held
+     * back in cork mode or queued, see CLSetSlowConsumerPolicy().
+     */
+    unsigned long long framesSent[CL_PRI_COUNT];
+    /** The number of bytes sent at each priority, length prefixes included. */
+    unsigned long long bytesSent[CL_PRI_COUNT];
+    /** The number of threads waiting to send at each priority right now. */
+    unsigned long sendersWaiting[CL_PRI_COUNT];
+    /**
+     * The number of bytes held back in cork mode at each priority right now.
+     */
+    unsigned long bytesCorked[CL_PRI_COUNT];
+    /**
+     * The number of times reading paused as the limit on bytes received was
+     * reached, see CLSetRateLimit().
+     */
+    unsigned long long recvByteLimitHits;
+    /**
+     * The number of times reading paused as the limit on frames received was
+     * reached.
+     */
+    unsigned long long recvFrameLimitHits;
+    /**
+     * The number of times a thread waited to send as the limit on bytes sent
+     * was reached.
+     */
+    unsigned long long sendByteLimitHits;
+    /**
+     * The number of bytes queued to send right now as the other end is not
+     * reading fast enough, see CLSetSlowConsumerPolicy().
+     */
+    unsigned long bytesQueued;
+    /** The number of times the queue was found over one of its limits. */
+    unsigned long long slowConsumerHits;
+    /** The number of frames dropped from the queue unsent. */
+    unsigned long long framesDropped;
+    /** The number of bytes dropped from the queue, length prefixes included. */
+    unsigned long long bytesDropped;
+    /** The number of frames refused with CL_ERR_SLOW_CONSUMER. */
+    unsigned long long framesRefused;
+} CLSocketStats;
+
+/**
+ * How the network threads of a library context are set up, see
+ * CLCreateContext(). A structure set to all zeros sets them up the way the
+ * default context does.
+ */
+typedef struct CLContextConfig
+{
+    /**
+     * The number of network threads to spread the context's sockets over,
+     * each socket going to the thread serving the fewest. If this is 0 then
+     * each thread is filled with as many sockets as it can serve before
+     * another is started, which uses the fewest threads. More threads are
+     * started either way if the ones there are cannot serve another socket.
+     */
+    int threadCount;
+    /**
+     * A bit mask of the CPUs the context's network threads may run on, or 0
+     * for any CPU.
+     */
+    unsigned long long affinityMask;
+    /**
+     * If this is not 0 then each network thread is pinned to a single CPU
+     * rather than moving between them, the CPU in affinityMask (or any the
+     * process may run on if that is 0) with the fewest network threads
+     * pinned to it. A thread and the sockets it serves then stay in one
+     * CPU's cache, and the buffers they receive into on its NUMA node.
+     */
+    int pinThreads;
+    /**
+     * If this is not 0, and pinThreads is not 0, then a TCP connection goes
+     * to a network thread pinned to the CPU that receive side scaling
+     * processes its packets on, if there is one that can serve another
+     * socket, so the packets and the thread handling them share a cache.
+     * This works best with threadCount set to the number of CPUs in
+     * affinityMask, and needs Windows 8 or later.
+     */
+    int alignWithRss;
+    /**
+     * How long in microseconds each network thread polls for network events
+     * before it waits to be woken, or 0 to always wait. Polling saves the
+     * time it takes to wake a thread, at the cost of keeping a CPU busy, so
+     * it suits pinned threads serving latency sensitive sockets. A thread
+     * that finds nothing while polling polls for half as long next time,
+     * down to not at all, so idle threads soon stop using CPU time, and
+     * polls for the full time again once network events arrive.
+     */
+    unsigned long spinMicros;
+    /**
+     * If this is not 0 then a network thread that is busy 80% of the time or
+     * more has its busiest sockets moved, one every couple of seconds, to
+     * the least busy thread that can serve another, so a few very busy
+     * sockets that happen to share a thread do not hold each other up while
+     * other threads idle. A socket only moves in between its network events,
+     * so none are lost or handled out of order, but its callbacks are called
+     * on the thread it moved to from then on. Sockets move most freely when
+     * threadCount is set, which leaves each thread room for more, and may
+     * move off the thread pinned to their receive side scaling CPU.
+     */
+    int rebalance;
+} CLContextConfig;
+
+/** Statistics for a network thread, see CLGetNetThreadStats(). */
+typedef struct CLNetThreadStats
+{
+    /** The CPU the thread is pinned to, or -1 if it is not pinned. */
+    int cpu;
+    /**
+     * The NUMA node of the CPU the thread is pinned to, or -1 if it is not
+     * pinned.
+     */
+    int numaNode;
+    /** The number of sockets and server sockets the thread serves. */
+    int socketCount;
+    /**
+     * The percentage of the time the thread was busy rather than waiting for
+     * network events, over the last second it was busy. Polling for network
+     * events counts as waiting.
+     */
+    int utilization;
+    /** The number of network events handled per second over the same time. */
+    unsigned long eventsPerSec;
+    /**
+     * The number of times per second the thread woke from waiting over the
+     * same time. Together with eventsPerSec this shows how many network
+     * events the thread handles each time it wakes.
+     */
+    unsigned long wakeupsPerSec;
+    /**
+     * The number of bytes the thread's sockets received per second over the
+     * same time.
+     */
+    unsigned long long bytesRecvPerSec;
+    /**
+     * The number of times the thread has woken from waiting since it
+     * started, for network events, timers or sockets being added or removed.
+     * This and the totals below are kept exactly, so the difference between
+     * two calls covers just the time in between.
+     */
+    unsigned long long wakeups;
+    /** The number of network events the thread has handled. */
+    unsigned long long eventsHandled;
+    /**
+     * The time in microseconds the thread has spent waiting for network
+     * events, polling included.
+     */
+    unsigned long long waitMicros;
+    /** The time in microseconds the thread has spent busy. */
+    unsigned long long busyMicros;
+    /**
+     * Of busyMicros, the time spent handling network events and timers for
+     * the thread's sockets, the application's callbacks included.
+     */
+    unsigned long long callbackMicros;
+    /** Of busyMicros, the time spent adding and removing sockets. */
+    unsigned long long changeMicros;
+} CLNetThreadStats;
+
+/**
+ * Token bucket limits on the data a socket receives and sends, see
+ * CLSetRateLimit(). A rate of 0 means no limit, and a burst of 0 means the
+ * same as the rate, so a structure set to all zeros turns every limit off.
+ */
+typedef struct CLRateLimit
+{
+    /** The average number of bytes received per second. */
+    unsigned long recvBytesPerSec;
+    /** The most bytes that can be received at once after a quiet spell. */
+    unsigned long recvBurstBytes;
+    /**
+     * The average number of frames received per second, counting each piece
+     * of data, request and response as one frame.
+     */
+    unsigned long recvFramesPerSec;
+    /** The most frames that can be received at once after a quiet spell. */
+    unsigned long recvBurstFrames;
+    /** The average number of bytes sent per second. */
+    unsigned long sendBytesPerSec;
+    /** The most bytes that can be sent at once after a quiet spell. */
+    unsigned long sendBurstBytes;
+} CLRateLimit;
+
+/**
+ * Limits on the data queued to send on a socket whose other end is not reading
+ * fast enough, and what is done once they are reached, see
+ * CLSetSlowConsumerPolicy().
+ */
+typedef struct CLSlowConsumerPolicy
+{
+    /**
+     * What is done once a limit is reached, one of the CL_SLOW_CONSUMER_
+     * values.
+     */
+    int action;
+    /** The most bytes queued, length prefixes included, or 0 for no limit. */
+    unsigned long maxQueuedBytes;
+    /**
+     * The longest time in milliseconds data is queued, or 0 for no limit.
+     */
+    unsigned long maxQueueAgeMs;
+} CLSlowConsumerPolicy;
+
+/**
+ * A socket to create with CLCreateSocketsAsync(), and the outcome of creating
+ * it.
+ */
+typedef struct CLConnectTarget
+{
+    /** The host address to connect to, as for CLCreateSocketAsync(). */
+    const char* hostAddr;
+    /** The host port to connect to, as for CLCreateSocketAsync(). */
+    unsigned short hostPort;
+    /**
+     * An optional argument that will be passed back as is in any of the
+     * socket's callback functions.
+     */
+    void* arg;
+    /** Set to the socket that was created, or NULL if it was not created. */
+    CLSocket skt;
+    /** Set to CL_ERR_OK if the socket was created, any other value otherwise. */
+    int err;
+} CLConnectTarget;
+
+/**
+ * The header at the start of each capture segment file, see
+ * CLStartCapture(). The first record follows it.
+ */
+typedef struct CLCaptureFileHeader
+{
+    /** The characters "CLCAPT01". */
+    char magic[8];
+    /** The number of ticks per second of the record timestamps. */
+    unsigned __int64 ticksPerSec;
+    /** The number of the segment, counting from 0. */
+    unsigned int segmentIdx;
+    /** The length of this header. */
+    unsigned int headerLen;
+    /** Reserved, set to 0. */
+    unsigned __int64 reserved;
+} CLCaptureFileHeader;
+
+/**
+ * A record in a capture segment file, which is followed by the data sent or
+ * received. The records run to the end of the file or to a record length of
+ * 0, whichever comes first.
+ */
+typedef struct CLCaptureRecord
+{
+    /**
+     * The length of this record including its data, which is a multiple of 8
+     * so that the next record is aligned.
+     */
+    unsigned int recordLen;
+    /** The length of the data. */
+    unsigned int dataLen;
+    /** When the data was sent or received, in ticks. */
+    unsigned __int64 ticks;
+    /**
+     * Identifies the socket, which is the same for all of its records. Each
+     * socket created or accepted is given the next id, counting from 1, so
+     * no two sockets in the same process have the same id.
+     */
+    unsigned __int64 socketId;
+    /** One of the CL_CAPTURE_ values. */
+    unsigned int direction;
+    /** Reserved, set to 0. */
+    unsigned int reserved;
+} CLCaptureRecord;
+
 /**
  * This will be called when a client connection is pending for the specified
  * server socket. The function CLAcceptCon() can then be called to accept the
@@ -139,6 +540,66 @@ typedef void (__cdecl *CLPDataRecvFn)(CLSocket skt, const char* buf, int len,
  * created.
  */
 typedef void (__cdecl *CLPSocketClosedFn)(CLSocket skt, int err, void* arg);
+/**
+ * This will be called when the specified socket received a request sent by
+ * CLRequest() at the other end. Note that the request must be responded to
+ * with CLRespond(), though that need not be done in this function.
+ *
+ * @param skt the socket that received the request.
+ * @param reqId identifies the request when responding to it.
+ * @param buf the request data that was received.
+ * @param len the length of the request data that was received.
+ * @param arg an optional argument that was specified when the socket was
+ * created or accepted.
+ */
+typedef void (__cdecl *CLPRequestRecvFn)(CLSocket skt, CLRequestId reqId,
+                                         const char* buf, int len, void* arg);
+/**
+ * This will be called when the response to a request made with CLRequest()
+ * has been received or the request has failed.
+ *
+ * @param skt the socket the request was made with.
+ * @param err indicates whether or not the request was successful. If the
+ * error code equals CL_ERR_OK then the response was received; otherwise it is
+ * CL_ERR_TIMED_OUT, CL_ERR_NO_REQUEST_RECV_FN or CL_ERR_SOCKET_CLOSED.
+ * @param buf the response data that was received, or NULL if the request
+ * failed.
+ * @param len the length of the response data that was received.
+ * @param reqArg the argument that was given to CLRequest().
+ */
+typedef void (__cdecl *CLPResponseRecvFn)(CLSocket skt, int err,
+                                          const char* buf, int len,
+                                          void* reqArg);
+/**
+ * This will be called when the data queued to send on the specified socket
+ * has reached a limit of its slow consumer policy, see
+ * CLSetSlowConsumerPolicy(). It is not called again until everything queued
+ * has been sent.
+ *
+ * @param skt the socket whose other end is not reading fast enough.
+ * @param bytesQueued the number of bytes queued.
+ * @param queueAgeMs how long in milliseconds the oldest data has been queued.
+ * @param arg an optional argument that was specified when the socket was
+ * created or accepted.
+ */
+typedef void (__cdecl *CLPSlowConsumerFn)(CLSocket skt,
+                                          unsigned long bytesQueued,
+                                          unsigned long queueAgeMs,
+                                          void* arg);
+/**
+ * This will be called when the specified UDP socket received a datagram.
+ *
+ * @param udpSkt the UDP socket that received the datagram.
+ * @param buf the datagram that was received.
+ * @param len the length of the datagram that was received.
+ * @param fromAddr the IP address the datagram was sent from.
+ * @param fromPort the port the datagram was sent from.
+ * @param arg an optional argument that was specified when the UDP socket was
+ * created.
+ */
+typedef void (__cdecl *CLPDatagramRecvFn)(CLUdpSocket udpSkt, const char* buf,
+                                          int len, const char* fromAddr,
+                                          unsigned short fromPort, void* arg);
 
 /**
  * Initializes the communication library. This function needs to be called
@@ -153,17 +614,125 @@ COMLIB_LIBSPEC int __cdecl CLStartup(void);
 
 /**
  * Uninitializes the communication library, which closes and deletes any open
- * sockets and server sockets and frees all other resources.
+ * sockets and server sockets and frees all other resources. This returns as
+ * soon as every network thread has exited, so it takes about as long as
+ * closing the sockets does.
  */
 COMLIB_LIBSPEC void __cdecl CLCleanup(void);
 
+/**
+ * Creates a library context. Each context has its own network threads, so
+ * the callbacks of sockets in one context are never delayed by sockets in
+ * another, for example latency sensitive connections by bulk transfers.
+ * Sockets are created in a context with the functions ending in "Ctx";
+ * connections accepted by a server socket are in the server socket's
+ * context. The functions without a context create sockets in the default
+ * context, which exists from CLStartup() to CLCleanup(). All the other
+ * functions work on sockets in any context.
+ *
+ * @param pConfig how the context's network threads are set up.
+ * @param pCtx if the function was successful this will be set to the context
+ * that was created.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateContext(const CLContextConfig* pConfig,
+    CLContext* pCtx);
+
+/**
+ * Deletes the specified library context, which closes and deletes any
+ * sockets and server sockets in it and waits a while for its network threads
+ * to finish. Contexts that are not deleted are deleted by CLCleanup(). This
+ * must not be called from a callback of a socket in the context, and the
+ * default context cannot be deleted.
+ *
+ * @param ctx the context to delete.
+ */
+COMLIB_LIBSPEC void __cdecl CLDeleteContext(CLContext ctx);
+
+/**
+ * Gets statistics for each network thread of the specified library context,
+ * which show how its sockets are laid out over CPUs and NUMA nodes and how
+ * busy each thread is.
+ *
+ * @param ctx the context to get statistics for, or NULL for the default
+ * context.
+ * @param pStats an array that will be filled in with the statistics of up to
+ * maxCount threads. This may be NULL if maxCount is 0.
+ * @param maxCount the number of elements in the array.
+ * @param pCount if the function was successful this will be set to the
+ * number of network threads the context has, which may be more than
+ * maxCount.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLGetNetThreadStats(CLContext ctx,
+    CLNetThreadStats* pStats, int maxCount, int* pCount);
+
+/**
+ * Turns tracing on or off. While tracing is on each thread records what the
+ * library does (connections accepted, made and closed, frames received and
+ * sent, callbacks and waits to send) in a ring buffer of its own, which holds
+ * its latest 4096 events and costs a few nanoseconds per event. Tracing is off
+ * until this is called, and it may be called whether or not the library is
+ * initialized.
+ *
+ * @param on whether or not to record events. This is not 0 if they should be.
+ */
+COMLIB_LIBSPEC void __cdecl CLSetTracing(int on);
+
+/**
+ * Writes the events recorded by every thread while tracing was on to a file
+ * in the Chrome trace event format, which can be loaded into chrome://tracing
+ * or Perfetto. Events recorded while the file is written may be left out.
+ *
+ * @param path the path of the file, which is replaced if it exists.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLDumpTrace(const char* path);
+
+/**
+ * Starts capturing the data that every socket sends and receives, for
+ * replaying later with capreplay.exe. Each piece of data is appended to a
+ * memory-mapped file as a CLCaptureRecord together with when it was sent or
+ * received and which socket it was, at about the cost of copying it. A
+ * record is also added when each socket is created or accepted and when it is
+ * closed, and data is only captured as sent once CLSendData() has succeeded.
+ * The files are written a segment at a time, named pathPrefix.000000.cap,
+ * pathPrefix.000001.cap and so on, and a segment that is full is trimmed and
+ * closed before the next is opened, so it can be moved or deleted while
+ * capturing carries on. Requests, responses and datagrams are not captured.
+ * Capturing that has already started is stopped first, and it may be started
+ * whether or not the library is initialized.
+ *
+ * @param pathPrefix the path that segment file names start with. Existing
+ * files with the same names are replaced.
+ * @param segmentLen the length of each segment file, from
+ * CL_CAPTURE_MIN_SEGMENT_LEN to CL_CAPTURE_MAX_SEGMENT_LEN bytes.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLStartCapture(const char* pathPrefix,
+    unsigned int segmentLen);
+
+/**
+ * Stops capturing data, trimming and closing the last segment file. This does
+ * nothing if capturing has not started.
+ */
+COMLIB_LIBSPEC void __cdecl CLStopCapture(void);
+
 /**
  * Creates a TCP server socket that is listening on the given local IP address
  * and port.
  *
  * @param ipAddr the IP address (both IPv4 and IPv6 are supported) that the
- * server socket will listen on.
- * @param port the port that the server socket will listen on.
+ * server socket will listen on. Alternatively this may be a Unix domain socket
+ * address of the form "unix:path", in which case the server socket listens on
+ * the socket file with the given path (a socket file left behind by a server
+ * that is no longer listening is replaced, but any other existing file at the
+ * path fails with WSAEADDRINUSE), or a shared memory address of the form
+ * "shm://name" (the name may be up to 64 characters long and may not contain
+ * backslashes), or an in-process address of the form "inproc://name". Only one
+ * server socket can listen on a shared memory or in-process name at a time.
+ * @param port the port that the server socket will listen on. This is ignored
+ * for Unix domain socket, shared memory and in-process addresses.
  * @param conPendingFn a pointer to a function that will be called when the
  * server socket has a connection request from a client pending.
  * @param srvSocketClosedFn a pointer to a function that will be called when
@@ -182,9 +751,50 @@ COMLIB_LIBSPEC int __cdecl CLCreateSrvSocket(const char* ipAddr,
     CLPSrvSocketClosedFn srvSocketClosedFn, int conBacklog, void* srvArg,
     CLSrvSocket* pSrvSkt);
 
+/**
+ * Creates a TCP server socket in the specified library context, as
+ * CLCreateSrvSocket() does in the default context. Connections the server
+ * socket accepts are in the same context.
+ *
+ * @param ctx the context to create the server socket in, or NULL for the
+ * default context.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateSrvSocketCtx(CLContext ctx,
+    const char* ipAddr, unsigned short port, CLPConPendingFn conPendingFn,
+    CLPSrvSocketClosedFn srvSocketClosedFn, int conBacklog, void* srvArg,
+    CLSrvSocket* pSrvSkt);
+
+/**
+ * Caps the number of connections accepted from all server sockets that are
+ * open at once. Once the cap is reached server sockets stop waiting for
+ * connections, so no callback is made and nothing is allocated for them, and
+ * further connections queue up in the backlog given to CLCreateSrvSocket()
+ * (beyond which the operating system refuses them). Accepting resumes by
+ * itself as accepted sockets are deleted.
+ *
+ * @param maxCons the maximum number of accepted connections, or 0 for no
+ * cap.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetMaxCons(int maxCons);
+
+/**
+ * Caps the number of connections accepted from the specified server socket
+ * that are open at once, as CLSetMaxCons() does for the library as a whole.
+ * Both caps apply.
+ *
+ * @param srvSkt the server socket to cap.
+ * @param maxCons the maximum number of accepted connections, or 0 for no
+ * cap.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetSrvMaxCons(CLSrvSocket srvSkt, int maxCons);
+
 /**
  * Accepts a connection from a client to the specified TCP server socket if one
- * is pending.
+ * is pending. The client socket is in the same library context as the server
+ * socket.
  *
  * @param srvSkt the server socket that will accept the connection.
  * @param dataRecvFn a pointer to a function that will be called when the
@@ -199,10 +809,13 @@ COMLIB_LIBSPEC int __cdecl CLCreateSrvSocket(const char* ipAddr,
  * with the IP address of the client. This must be long enough to hold the
  * entire IP address (IPv4 or IPv6 depending on the server socket) otherwise an
  * error will be returned. If the IP address is not required then this may be
- * NULL.
+ * NULL. For a Unix domain socket server socket this is filled in with the path
+ * the client is bound to, which is usually empty, and for a shared memory or
+ * in-process server socket it is always empty.
  * @param clientIpAddrLen the length of the given client IP address buffer.
  * @param pClientPort if the function was successful the variable pointed to
- * will be set to the port the client connected from. If the port is not
+ * will be set to the port the client connected from (0 for a Unix domain
+ * socket, shared memory or in-process server socket). If the port is not
  * required then this may be NULL.
  * @return CL_ERR_OK if the function was successful, any other value otherwise.
  */
@@ -226,8 +839,11 @@ COMLIB_LIBSPEC void __cdecl CLDeleteSrvSocket(CLSrvSocket srvSkt);
  *
  * @param hostAddr the host address to connect to. This may be either a host
  * name (in which case it will be resolved to an IP address via DNS lookup or a
- * "hosts" file) or an IPv4 or IPv6 address.
- * @param hostPort the host port to connect to.
+ * "hosts" file), an IPv4 or IPv6 address, a Unix domain socket address of the
+ * form "unix:path", a shared memory address of the form "shm://name", or an
+ * in-process address of the form "inproc://name".
+ * @param hostPort the host port to connect to. This is ignored for Unix domain
+ * socket, shared memory and in-process addresses.
  * @param dataRecvFn a pointer to a function that will be called when the
  * socket has received data.
  * @param socketClosedFn a pointer to a function that will be called when the
@@ -242,6 +858,18 @@ COMLIB_LIBSPEC int __cdecl CLCreateSocket(const char* hostAddr,
     unsigned short hostPort, CLPDataRecvFn dataRecvFn,
     CLPSocketClosedFn socketClosedFn, void* arg, CLSocket* pSkt);
 
+/**
+ * Creates a TCP socket in the specified library context, as CLCreateSocket()
+ * does in the default context.
+ *
+ * @param ctx the context to create the socket in, or NULL for the default
+ * context.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateSocketCtx(CLContext ctx,
+    const char* hostAddr, unsigned short hostPort, CLPDataRecvFn dataRecvFn,
+    CLPSocketClosedFn socketClosedFn, void* arg, CLSocket* pSkt);
+
 /**
  * Creates a TCP socket that connects asynchronously to the given host address
  * and port. Note that the connection attempt is asynchronous, therefore this
@@ -251,8 +879,11 @@ COMLIB_LIBSPEC int __cdecl CLCreateSocket(const char* hostAddr,
  *
  * @param hostAddr the host address to connect to. This may be either a host
  * name (in which case it will be resolved to an IP address via DNS lookup or a
- * "hosts" file) or an IPv4 or IPv6 address.
- * @param hostPort the host port to connect to.
+ * "hosts" file), an IPv4 or IPv6 address, a Unix domain socket address of the
+ * form "unix:path", a shared memory address of the form "shm://name", or an
+ * in-process address of the form "inproc://name".
+ * @param hostPort the host port to connect to. This is ignored for Unix domain
+ * socket, shared memory and in-process addresses.
  * @param conCompletedFn a pointer to a function that will be called when the
  * connection attempt has completed (either successfully or unsuccessfully).
  * @param dataRecvFn a pointer to a function that will be called when the
@@ -270,6 +901,68 @@ COMLIB_LIBSPEC int __cdecl CLCreateSocketAsync(const char* hostAddr,
     CLPDataRecvFn dataRecvFn, CLPSocketClosedFn socketClosedFn, void* arg,
     CLSocket* pSkt);
 
+/**
+ * Creates a TCP socket that connects asynchronously in the specified library
+ * context, as CLCreateSocketAsync() does in the default context.
+ *
+ * @param ctx the context to create the socket in, or NULL for the default
+ * context.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateSocketAsyncCtx(CLContext ctx,
+    const char* hostAddr, unsigned short hostPort,
+    CLPConCompletedFn conCompletedFn, CLPDataRecvFn dataRecvFn,
+    CLPSocketClosedFn socketClosedFn, void* arg, CLSocket* pSkt);
+
+/**
+ * Creates a TCP socket for each of the given targets that connects
+ * asynchronously, as CLCreateSocketAsync() does, for reconnecting many sockets
+ * at once. Each distinct host address and port is resolved only once, on a
+ * single thread for the whole batch, rather than on a thread for each socket;
+ * only maxInFlight connection attempts are under way at once, the next
+ * starting as each completes; and the sockets are added to the network
+ * threads in bulk. The function pointed to by conCompletedFn is called for
+ * each socket that was created when its connection attempt has completed,
+ * just as for CLCreateSocketAsync(). A socket may be deleted before its
+ * connection attempt has started, in which case it is never started, and
+ * CLDeleteContext() and CLCleanup() stop the batch and wait for its thread to
+ * exit.
+ *
+ * @param targets the sockets to create. The skt and err fields of each are
+ * filled in with the outcome of creating that socket.
+ * @param count the number of elements in the targets array.
+ * @param maxInFlight the most connection attempts under way at once, or 0 for
+ * CL_CONNECT_MAX_IN_FLIGHT. Connections to shared memory and in-process
+ * addresses are made straight away and do not count.
+ * @param conCompletedFn a pointer to a function that will be called when a
+ * socket's connection attempt has completed (either successfully or
+ * unsuccessfully).
+ * @param dataRecvFn a pointer to a function that will be called when a socket
+ * has received data.
+ * @param socketClosedFn a pointer to a function that will be called when a
+ * socket has closed.
+ * @return CL_ERR_OK if a socket was created for every target, otherwise the
+ * error of the first target a socket was not created for. Sockets are still
+ * created for the other targets.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateSocketsAsync(CLConnectTarget* targets,
+    int count, int maxInFlight, CLPConCompletedFn conCompletedFn,
+    CLPDataRecvFn dataRecvFn, CLPSocketClosedFn socketClosedFn);
+
+/**
+ * Creates TCP sockets that connect asynchronously in the specified library
+ * context, as CLCreateSocketsAsync() does in the default context.
+ *
+ * @param ctx the context to create the sockets in, or NULL for the default
+ * context.
+ * @return CL_ERR_OK if a socket was created for every target, otherwise the
+ * error of the first target a socket was not created for.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateSocketsAsyncCtx(CLContext ctx,
+    CLConnectTarget* targets, int count, int maxInFlight,
+    CLPConCompletedFn conCompletedFn, CLPDataRecvFn dataRecvFn,
+    CLPSocketClosedFn socketClosedFn);
+
 /**
  * Sends data using the specified socket.
  *
@@ -278,20 +971,408 @@ COMLIB_LIBSPEC int __cdecl CLCreateSocketAsync(const char* hostAddr,
  * buffer length specified must be less than or equal to 65535 bytes otherwise
  * an error will be returned.
  *
+ * A length prefix of 0 marks the frame that follows as a library frame, one
+ * carrying a request, a response or compressed data, so data of length 0 is
+ * refused with CL_ERR_ILLEGAL_ARG. This is a change to the wire format:
+ * earlier versions of the library ignored zero-length frames received, and
+ * treated sending data of length 0 as doing nothing. A peer that sends
+ * zero-length frames of its own cannot talk to this version.
+ *
  * @param skt the socket to use to send the data.
  * @param buf the data to send.
- * @param len the length of data to send.
+ * @param len the length of data to send, from 1 up to 65535 bytes.
  * @return CL_ERR_OK if the function was successful, any other value otherwise.
  */
 COMLIB_LIBSPEC int __cdecl CLSendData(CLSocket skt, const char* buf, int len);
 
 /**
- * Closes the specified socket and frees any resources allocated to it.
+ * Sends data using the specified socket at the given priority. CLSendData()
+ * sends at CL_PRI_NORMAL. A frame being written is never interrupted, but
+ * when several threads are waiting to send on the same socket the one with
+ * the highest priority goes next, and in cork mode data held back is written
+ * highest priority first. Data sent at a priority above CL_PRI_NORMAL is
+ * never held back by cork mode or compressed. Data sent at one priority
+ * arrives in the order it was sent, but may overtake data sent at a lower
+ * priority.
+ *
+ * @param skt the socket to use to send the data.
+ * @param buf the data to send.
+ * @param len the length of data to send, from 1 up to 65535 bytes, see
+ * CLSendData().
+ * @param pri the priority to send the data at, from CL_PRI_NORMAL up to
+ * CL_PRI_URGENT.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSendDataPri(CLSocket skt, const char* buf,
+    int len, int pri);
+
+/**
+ * Closes the specified socket and frees any resources allocated to it. With
+ * a slow consumer policy, data still queued is given a short time to be
+ * written first, see CLSetSlowConsumerPolicy().
  *
  * @param skt the socket to be deleted.
  */
 COMLIB_LIBSPEC void __cdecl CLDeleteSocket(CLSocket skt);
 
+/**
+ * Sets the function that will be called when the specified socket receives a
+ * request. Until this is set, requests the socket receives are answered with
+ * the error CL_ERR_NO_REQUEST_RECV_FN.
+ *
+ * @param skt the socket to set the function for.
+ * @param requestRecvFn a pointer to a function that will be called when the
+ * socket has received a request, or NULL to stop receiving requests.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetRequestRecvFn(CLSocket skt,
+    CLPRequestRecvFn requestRecvFn);
+
+/**
+ * Sets the function that will be called when sockets accepted by the
+ * specified server socket receive a request. Setting this on the server
+ * socket, rather than on each accepted socket, means no request can arrive
+ * before the function is in place.
+ *
+ * @param srvSkt the server socket to set the function for.
+ * @param requestRecvFn a pointer to a function that will be called when an
+ * accepted socket has received a request, or NULL for none.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetSrvRequestRecvFn(CLSrvSocket srvSkt,
+    CLPRequestRecvFn requestRecvFn);
+
+/**
+ * Sends a request using the specified socket. The function returns straight
+ * away without waiting for the response, so many requests can be waiting for
+ * a response on the same socket at once. The function pointed to by
+ * responseRecvFn will be called exactly once for each successful request:
+ * when the response arrives, when the timeout expires, or when the socket
+ * closes. It is not called for requests still waiting when the socket is
+ * deleted with CLDeleteSocket(). If this function fails it is never called.
+ *
+ * Requests and responses are sent as library frames that both ends of the
+ * connection must understand, so the other end must use this version of the
+ * library or later. They are not passed to the socket's data received
+ * callback function.
+ *
+ * @param skt the socket to use to send the request.
+ * @param buf the request data to send.
+ * @param len the length of the request data, which must be less than or equal
+ * to 65530 bytes otherwise an error will be returned.
+ * @param timeout how long in milliseconds to wait for the response, or
+ * INFINITE to wait for as long as the socket stays open.
+ * @param responseRecvFn a pointer to a function that will be called when the
+ * request has completed.
+ * @param reqArg an optional argument that will be passed back as is in the
+ * response received callback function.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLRequest(CLSocket skt, const char* buf, int len,
+    unsigned long timeout, CLPResponseRecvFn responseRecvFn, void* reqArg);
+
+/**
+ * Sends the response to a request received using the specified socket.
+ *
+ * @param skt the socket that received the request.
+ * @param reqId identifies the request being responded to.
+ * @param buf the response data to send.
+ * @param len the length of the response data, which must be less than or
+ * equal to 65530 bytes otherwise an error will be returned.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLRespond(CLSocket skt, CLRequestId reqId,
+    const char* buf, int len);
+
+/**
+ * Turns on compression of data sent using the specified socket. Data sent by
+ * CLSendData() that is at least minLen bytes long is compressed with zlib
+ * before it is sent and decompressed before it is passed to the data received
+ * callback function at the other end, shorter data is sent as is. Each socket
+ * keeps one compression stream for the life of the connection, so repeated
+ * content across many small sends compresses well.
+ *
+ * Both ends of the connection must turn compression on before data is
+ * compressed in either direction; until the other end has done so data is
+ * sent as is. The other end must use this version of the library or later.
+ * This is best called straight after the socket is created or accepted, and
+ * may be called before an asynchronous connection attempt has completed.
+ *
+ * Compression costs CPU time on both ends, so it is only worth turning on for
+ * data that compresses well over a connection where bandwidth is short.
+ *
+ * @param skt the socket to turn compression on for.
+ * @param minLen the minimum length of data to compress, or 0 to turn
+ * compression back off.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetCompression(CLSocket skt, int minLen);
+
+/**
+ * Turns on compression, as CLSetCompression() does, for every socket
+ * accepted from the specified server socket from now on.
+ *
+ * @param srvSkt the server socket to turn compression on for.
+ * @param minLen the minimum length of data to compress, or 0 for none.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetSrvCompression(CLSrvSocket srvSkt,
+    int minLen);
+
+/**
+ * Turns cork mode on or off for the specified socket. Sending many small
+ * pieces of data normally costs one system call, and usually one TCP segment,
+ * each. In cork mode data sent with CLSendData() (and requests and responses)
+ * is instead held back and written in one piece, either by the sending thread
+ * once maxBytes have built up or by the network thread once maxDelay has
+ * passed since the first of it was held back, whichever is first. CLFlush()
+ * sends anything held back straight away, for when the latency matters. The
+ * network thread never waits for the other end to read: what the TCP stack
+ * does not take straight away is queued and written as room becomes free,
+ * ahead of anything sent afterwards.
+ *
+ * The delay is measured with the system tick count, so in practice data can
+ * be held back for up to the resolution of the system timer (usually 10-16
+ * ms) longer than maxDelay unless the application raises the resolution with
+ * timeBeginPeriod().
+ *
+ * Because CLSendData() returns before data held back is written, an error
+ * writing it is reported by the next call to CLSendData() or CLFlush() as
+ * CL_ERR_DATA_STREAM_CORRUPTED. Data held back is written when the socket is
+ * deleted in the same way as data queued for a slow consumer, see
+ * CLSetSlowConsumerPolicy(). Sockets given a ring address are never corked,
+ * as sending over a ring makes no system call.
+ *
+ * @param skt the socket to turn cork mode on or off for.
+ * @param maxDelay the longest time in milliseconds data is held back, or 0 to
+ * turn cork mode off, sending anything held back straight away.
+ * @param maxBytes the number of bytes that once held back are sent straight
+ * away, which must be greater than 0 if maxDelay is not 0.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetCork(CLSocket skt, unsigned long maxDelay,
+    int maxBytes);
+
+/**
+ * Sends any data held back by cork mode on the specified socket straight
+ * away, see CLSetCork(). This does nothing if cork mode is off.
+ *
+ * @param skt the socket to flush.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLFlush(CLSocket skt);
+
+/**
+ * Sets token bucket limits on the data the specified socket receives and
+ * sends, so one busy or abusive peer cannot take over a network thread.
+ *
+ * Once a receive limit is reached the network thread stops reading from the
+ * socket until enough time has passed for the bucket to refill. The data is
+ * left with the TCP stack meanwhile, so its receive window fills up and the
+ * other end is slowed down. Once the send limit is reached CLSendData() (and
+ * CLRequest() and CLRespond()) waits until the bucket has refilled, which
+ * when called from a callback function holds up the network thread too.
+ *
+ * The buckets are refilled from the system tick count only when data is
+ * received or sent, so limits cost nothing on an idle socket. Each bucket
+ * may go into debt by up to the last frame received or sent, which must be
+ * paid back before any more is allowed. The number of times each limit was
+ * reached is given by CLGetSocketStats().
+ *
+ * @param skt the socket to set the limits for.
+ * @param pLimit the limits, which replace any set before and start with full
+ * buckets.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetRateLimit(CLSocket skt,
+    const CLRateLimit* pLimit);
+
+/**
+ * Sets token bucket limits, as CLSetRateLimit() does, for every socket
+ * accepted from the specified server socket from now on. Each socket gets
+ * its own buckets.
+ *
+ * @param srvSkt the server socket to set the limits for.
+ * @param pLimit the limits.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetSrvRateLimit(CLSrvSocket srvSkt,
+    const CLRateLimit* pLimit);
+
+/**
+ * Sets a slow consumer policy for the specified socket, so a remote host that
+ * stops reading cannot hold up the threads sending to it or have data build
+ * up without bound.
+ *
+ * Without a policy CLSendData() (and CLRequest() and CLRespond()) blocks once
+ * the TCP stack's buffers are full until the other end reads, which it may
+ * never do. With a policy nothing blocks: data the TCP stack cannot take
+ * straight away is queued, and the network thread writes it as the other end
+ * reads. Data queued at a higher priority goes ahead of data queued at a
+ * lower priority that has not started to be written. Once the queue would go
+ * over maxQueuedBytes, or its oldest data has waited longer than
+ * maxQueueAgeMs, the policy's action is taken:
+ *
+ * - CL_SLOW_CONSUMER_DROP drops the oldest data sent with CLSendData() at
+ *   CL_PRI_NORMAL that has not started to be written, enough to make room or
+ *   all that is too old. Compressed data, requests, responses, data at higher
+ *   priorities and data written together in cork mode are never dropped, as
+ *   the other end relies on receiving them, so if dropping cannot make room
+ *   the data being sent is refused with CL_ERR_SLOW_CONSUMER.
+ * - CL_SLOW_CONSUMER_DISCONNECT refuses the data being sent with
+ *   CL_ERR_SLOW_CONSUMER and resets the connection, discarding everything
+ *   queued. The socket closed callback function is called with
+ *   CL_ERR_SLOW_CONSUMER, and the socket must still be deleted.
+ * - CL_SLOW_CONSUMER_CALLBACK refuses the data being sent with
+ *   CL_ERR_SLOW_CONSUMER and calls slowConsumerFn from the network thread,
+ *   leaving what to do to the application.
+ *
+ * The number of times the limits were reached and the frames dropped and
+ * refused are given by CLGetSocketStats(). When the socket is deleted, data
+ * still queued is given up to 200 milliseconds to be written in the
+ * background, without CLDeleteSocket() waiting for it, and CLCleanup() waits
+ * for this to finish; anything left is discarded and reported in a debug
+ * message. Sockets given
+ * a ring address are left as they are, as the ring is itself a bounded
+ * queue.
+ *
+ * @param skt the socket to set the policy for.
+ * @param pPolicy the policy, which replaces any set before. With an action of
+ * CL_SLOW_CONSUMER_NONE anything still queued is written, blocking as
+ * sending without a policy does, and the limits are ignored; otherwise at
+ * least one limit must not be 0.
+ * @param slowConsumerFn a pointer to a function that will be called when a
+ * limit is reached, which must not be NULL if the action is
+ * CL_SLOW_CONSUMER_CALLBACK and is ignored otherwise.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetSlowConsumerPolicy(CLSocket skt,
+    const CLSlowConsumerPolicy* pPolicy, CLPSlowConsumerFn slowConsumerFn);
+
+/**
+ * Sets a slow consumer policy, as CLSetSlowConsumerPolicy() does, for every
+ * socket accepted from the specified server socket from now on. Each socket
+ * gets its own queue.
+ *
+ * @param srvSkt the server socket to set the policy for.
+ * @param pPolicy the policy.
+ * @param slowConsumerFn a pointer to a function that will be called when a
+ * limit is reached, see CLSetSlowConsumerPolicy().
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSetSrvSlowConsumerPolicy(CLSrvSocket srvSkt,
+    const CLSlowConsumerPolicy* pPolicy, CLPSlowConsumerFn slowConsumerFn);
+
+/**
+ * Gets statistics for the specified socket.
+ *
+ * @param skt the socket to get statistics for.
+ * @param pStats if the function was successful this will be filled in with
+ * the statistics.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLGetSocketStats(CLSocket skt,
+    CLSocketStats* pStats);
+
+/**
+ * Creates a UDP socket that is bound to the given local IP address and port,
+ * and optionally connected to the given remote host address and port.
+ * Datagrams are sent and received as is, without any length prefix, and may
+ * be lost, duplicated or arrive out of order.
+ *
+ * @param localAddr the IP address (both IPv4 and IPv6 are supported) to bind
+ * to, for example "0.0.0.0" or "::" for all local addresses.
+ * @param localPort the port to bind to, or 0 for any free port.
+ * @param remoteAddr the host address to connect to, which may be either a host
+ * name or an IP address of the same family as localAddr. If this is not NULL
+ * then only datagrams from this host address and port are received, and
+ * CLSendDatagram() and CLSendDatagrams() send to it. If this is NULL then
+ * datagrams from anywhere are received and only CLSendDatagramTo() can be
+ * used.
+ * @param remotePort the host port to connect to. This is ignored if remoteAddr
+ * is NULL.
+ * @param datagramRecvFn a pointer to a function that will be called when the
+ * UDP socket has received a datagram.
+ * @param arg an optional argument that will be passed back as is in the UDP
+ * socket's callback function.
+ * @param pUdpSkt if the function was successful this will be set to point to
+ * the UDP socket that was created.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateUdpSocket(const char* localAddr,
+    unsigned short localPort, const char* remoteAddr,
+    unsigned short remotePort, CLPDatagramRecvFn datagramRecvFn, void* arg,
+    CLUdpSocket* pUdpSkt);
+
+/**
+ * Creates a UDP socket in the specified library context, as
+ * CLCreateUdpSocket() does in the default context.
+ *
+ * @param ctx the context to create the UDP socket in, or NULL for the default
+ * context.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLCreateUdpSocketCtx(CLContext ctx,
+    const char* localAddr, unsigned short localPort, const char* remoteAddr,
+    unsigned short remotePort, CLPDatagramRecvFn datagramRecvFn, void* arg,
+    CLUdpSocket* pUdpSkt);
+
+/**
+ * Sends a datagram to the remote host the specified UDP socket is connected
+ * to. The function does not block: if the datagram cannot be sent straight
+ * away an error is returned and the datagram is not sent.
+ *
+ * @param udpSkt the UDP socket to use to send the datagram.
+ * @param buf the datagram to send.
+ * @param len the length of the datagram, which must be less than or equal to
+ * 65507 bytes otherwise an error will be returned.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSendDatagram(CLUdpSocket udpSkt, const char* buf,
+    int len);
+
+/**
+ * Sends a datagram to the given IP address and port using the specified UDP
+ * socket. The function does not block: if the datagram cannot be sent
+ * straight away an error is returned and the datagram is not sent.
+ *
+ * @param udpSkt the UDP socket to use to send the datagram.
+ * @param toAddr the IP address to send to, which must be of the same family as
+ * the address the UDP socket is bound to.
+ * @param toPort the port to send to.
+ * @param buf the datagram to send.
+ * @param len the length of the datagram, which must be less than or equal to
+ * 65507 bytes otherwise an error will be returned.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSendDatagramTo(CLUdpSocket udpSkt,
+    const char* toAddr, unsigned short toPort, const char* buf, int len);
+
+/**
+ * Sends a batch of datagrams to the remote host the specified UDP socket is
+ * connected to. This costs less per datagram than calling CLSendDatagram()
+ * for each one. Sending stops at the first datagram that cannot be sent
+ * straight away.
+ *
+ * @param udpSkt the UDP socket to use to send the datagrams.
+ * @param datagrams the datagrams to send, each of which must be less than or
+ * equal to 65507 bytes long otherwise an error will be returned.
+ * @param count the number of datagrams to send.
+ * @param pSentCount if this is not NULL the variable pointed to will be set to
+ * the number of datagrams that were sent.
+ * @return CL_ERR_OK if all of the datagrams were sent, any other value
+ * otherwise.
+ */
+COMLIB_LIBSPEC int __cdecl CLSendDatagrams(CLUdpSocket udpSkt,
+    const CLDatagram* datagrams, int count, int* pSentCount);
+
+/**
+ * Closes the specified UDP socket and frees any resources allocated to it.
+ *
+ * @param udpSkt the UDP socket to be deleted.
+ */
+COMLIB_LIBSPEC void __cdecl CLDeleteUdpSocket(CLUdpSocket udpSkt);
+
 #undef COMLIB_LIBSPEC
 
 #ifdef __cplusplus
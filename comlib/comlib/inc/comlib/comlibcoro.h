@@ -0,0 +1,783 @@
+/**
+ * @file
+ * A header-only C++20 coroutine front-end for the "comlib" communication
+ * library. It needs a compiler with C++20 coroutine support, for example
+ * Visual Studio 2019 16.8 or later with /std:c++latest, though the library
+ * itself does not.
+ *
+ * Each awaitable resumes the coroutine from the library callback that
+ * completes it, so after its first suspension a coroutine runs on the network
+ * thread that owns its socket with no thread hops. The one exception is a
+ * connection attempt that fails before it reaches the network, because the
+ * host address could not be resolved or the connect could not be started:
+ * the coroutine is then resumed on the library's host address resolver
+ * thread, and runs there until it next suspends. The awaitables live in the
+ * coroutine frame, and frames are recycled by FrameAllocator, so awaiting an
+ * operation never allocates from the heap. Frames of data that arrive while
+ * nothing is waiting to receive are copied into buffers that are reused, so
+ * they only allocate while the backlog is growing.
+ *
+ * @code
+ * comlib::Task serveClient(comlib::Socket skt)
+ * {
+ *     for (;;)
+ *     {
+ *         comlib::Frame frame = co_await skt.recv();
+ *         if (frame.err != CL_ERR_OK ||
+ *             co_await skt.send(frame.buf, frame.len) != CL_ERR_OK)
+ *         {
+ *             break;
+ *         }
+ *     }
+ * }
+ * @endcode
+ */
+
+#ifndef COMLIBCORO_H
+#define COMLIBCORO_H
+
+#if _MSC_VER > 1000
+#pragma once
+#endif
+
+#include <comlib/comlib.h>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace comlib
+{
+
+/**
+ * Recycles coroutine frames so that starting a coroutine does not usually
+ * allocate from the heap. Frames are kept in per-thread free lists by size,
+ * and a frame freed on a different thread from the one that allocated it
+ * simply joins that thread's list.
+ */
+class FrameAllocator
+{
+public:
+    /**
+     * Allocates memory for a coroutine frame.
+     *
+     * @param size the size of the frame.
+     * @return The memory for the frame.
+     */
+    static void* allocate(std::size_t size)
+    {
+        std::size_t sizeClass = toSizeClass(size);
+        if (sizeClass < SIZE_CLASS_COUNT)
+        {
+            FreeList& freeList = freeLists()[sizeClass];
+            if (freeList.first != nullptr)
+            {
+                FreeBlock* block = freeList.first;
+                freeList.first = block->next;
+                --freeList.count;
+                return block;
+            }
+            return ::operator new((sizeClass + 1) * GRANULARITY);
+        }
+        return ::operator new(size);
+    }
+
+    /**
+     * Frees memory allocated by allocate().
+     *
+     * @param mem the memory to free.
+     * @param size the size that was given to allocate().
+     */
+    static void deallocate(void* mem, std::size_t size) noexcept
+    {
+        std::size_t sizeClass = toSizeClass(size);
+        if (sizeClass < SIZE_CLASS_COUNT)
+        {
+            FreeList& freeList = freeLists()[sizeClass];
+            if (freeList.count < FREE_LIST_MAX_COUNT)
+            {
+                FreeBlock* block = static_cast<FreeBlock*>(mem);
+                block->next = freeList.first;
+                freeList.first = block;
+                ++freeList.count;
+                return;
+            }
+        }
+        ::operator delete(mem);
+    }
+
+private:
+    /** The size classes go up in steps of this many bytes. */
+    static const std::size_t GRANULARITY = 64;
+
+    /** The number of size classes, so frames up to 4 KiB are recycled. */
+    static const std::size_t SIZE_CLASS_COUNT = 64;
+
+    /** The maximum number of frames kept in each free list. */
+    static const std::size_t FREE_LIST_MAX_COUNT = 256;
+
+    /** A frame that is in a free list. */
+    struct FreeBlock
+    {
+        /** The next frame in the free list. */
+        FreeBlock* next;
+    };
+
+    /** A list of free frames of the same size class. */
+    struct FreeList
+    {
+        /** The first frame in the list. */
+        FreeBlock* first = nullptr;
+
+        /** The number of frames in the list. */
+        std::size_t count = 0;
+
+        ~FreeList()
+        {
+            while (first != nullptr)
+            {
+                FreeBlock* block = first;
+                first = block->next;
+                ::operator delete(block);
+            }
+        }
+    };
+
+    /**
+     * Returns the size class for the given size.
+     *
+     * @param size the size to get the size class for.
+     * @return The size class, which is SIZE_CLASS_COUNT or more if the size
+     * is too big to be recycled.
+     */
+    static std::size_t toSizeClass(std::size_t size)
+    {
+        return (size + GRANULARITY - 1) / GRANULARITY - 1;
+    }
+
+    /**
+     * Returns the free lists of the calling thread.
+     *
+     * @return The free lists of the calling thread.
+     */
+    static FreeList* freeLists()
+    {
+        thread_local FreeList s_freeLists[SIZE_CLASS_COUNT];
+        return s_freeLists;
+    }
+};
+
+/**
+ * The return type of a coroutine that is started straight away and runs to
+ * completion on its own, freeing its frame when it finishes. Nothing waits
+ * for it, so it must not throw.
+ */
+class Task
+{
+public:
+    /** The promise type of the coroutine. */
+    struct promise_type
+    {
+        Task get_return_object() noexcept { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+
+        static void* operator new(std::size_t size)
+        {
+            return FrameAllocator::allocate(size);
+        }
+
+        static void operator delete(void* mem, std::size_t size) noexcept
+        {
+            FrameAllocator::deallocate(mem, size);
+        }
+    };
+};
+
+/** A frame of data received, or the error that ended receiving. */
+struct Frame
+{
+    /**
+     * CL_ERR_OK if data was received, otherwise the error the socket closed
+     * with, or CL_ERR_SOCKET_CLOSED if it closed cleanly.
+     */
+    int err;
+
+    /**
+     * The data received. This stays valid until the coroutine next suspends
+     * or receives again, whichever comes first.
+     */
+    const char* buf;
+
+    /** The length of the data received. */
+    int len;
+};
+
+class Listener;
+
+/**
+ * A connected socket whose operations are awaited. Dispose of a socket from
+ * its own coroutine or once it has closed, so no callback is running for it
+ * at the time.
+ */
+class Socket
+{
+public:
+    /**
+     * Awaits the asynchronous connection attempt started by connect(). The
+     * coroutine is resumed on the network thread that owns the socket once
+     * the attempt has been made, or on the library's host address resolver
+     * thread if it failed before that.
+     */
+    class ConnectAwaitable
+    {
+    public:
+        ConnectAwaitable(Socket& skt, const char* hostAddr,
+                         unsigned short hostPort) :
+        m_skt(skt), m_hostAddr(hostAddr), m_hostPort(hostPort),
+        m_err(CL_ERR_OK)
+        {
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> awaiter)
+        {
+            State& state = *m_skt.m_state;
+            state.conAwaiter = awaiter;
+
+            // The connection completed callback may resume the coroutine
+            // before this returns, so only this object's members are
+            // touched afterwards, and only if no callback will be made
+            CLSocket skt = 0;
+            int err = CLCreateSocketAsync(m_hostAddr, m_hostPort,
+                &Socket::conCompleted, &Socket::dataRecv,
+                &Socket::socketClosed, &state, &skt);
+            if (err != CL_ERR_OK)
+            {
+                state.conAwaiter = nullptr;
+                m_err = err;
+                return false;
+            }
+            return true;
+        }
+
+        int await_resume() const noexcept
+        {
+            return (m_err != CL_ERR_OK) ? m_err : m_skt.m_state->conErr;
+        }
+
+    private:
+        Socket& m_skt;
+        const char* m_hostAddr;
+        unsigned short m_hostPort;
+        int m_err;
+    };
+
+    /** Awaits the next frame of data received. */
+    class RecvAwaitable
+    {
+    public:
+        explicit RecvAwaitable(Socket& skt) : m_skt(skt) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> awaiter)
+        {
+            State& state = *m_skt.m_state;
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.queueCount > 0 || state.closed)
+            {
+                // Something is already waiting, so do not suspend
+                return false;
+            }
+            state.recvAwaiter = awaiter;
+            return true;
+        }
+
+        Frame await_resume()
+        {
+            State& state = *m_skt.m_state;
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.inlineBuf != nullptr)
+            {
+                // Resumed by the data received callback, so the library's
+                // own buffer is used as is
+                Frame frame = { CL_ERR_OK, state.inlineBuf, state.inlineLen };
+                state.inlineBuf = nullptr;
+                return frame;
+            }
+            if (state.queueCount > 0)
+            {
+                state.popFrame(state.current);
+                Frame frame = { CL_ERR_OK,
+                    state.current.empty() ? nullptr : &state.current[0],
+                    static_cast<int>(state.current.size()) };
+                return frame;
+            }
+            Frame frame = { state.closeErr, nullptr, 0 };
+            return frame;
+        }
+
+    private:
+        Socket& m_skt;
+    };
+
+    /**
+     * Sends data. CLSendData() completes before it returns, so this never
+     * suspends; it is an awaitable so that code reads the same whichever
+     * operation it uses.
+     */
+    class SendAwaitable
+    {
+    public:
+        SendAwaitable(CLSocket skt, const char* buf, int len) :
+        m_skt(skt), m_buf(buf), m_len(len)
+        {
+        }
+
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) noexcept {}
+
+        int await_resume() const
+        {
+            return CLSendData(m_skt, m_buf, m_len);
+        }
+
+    private:
+        CLSocket m_skt;
+        const char* m_buf;
+        int m_len;
+    };
+
+    Socket() : m_state(new State) {}
+
+    Socket(Socket&& other) noexcept : m_state(std::move(other.m_state)) {}
+
+    Socket& operator=(Socket&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            m_state = std::move(other.m_state);
+        }
+        return *this;
+    }
+
+    ~Socket()
+    {
+        close();
+    }
+
+    /**
+     * Connects to the given host address and port, see CLCreateSocketAsync().
+     * The awaited result is CL_ERR_OK if the connection was made, any other
+     * value otherwise. If the host address cannot be resolved the coroutine
+     * is resumed on a thread of the library's own, not a network thread, so
+     * it should not block there before it next suspends.
+     *
+     * @param hostAddr the host address to connect to.
+     * @param hostPort the host port to connect to.
+     * @return The awaitable.
+     */
+    ConnectAwaitable connect(const char* hostAddr, unsigned short hostPort)
+    {
+        return ConnectAwaitable(*this, hostAddr, hostPort);
+    }
+
+    /**
+     * Receives the next frame of data. Frames that arrive while nothing is
+     * waiting are queued.
+     *
+     * @return The awaitable.
+     */
+    RecvAwaitable recv()
+    {
+        return RecvAwaitable(*this);
+    }
+
+    /**
+     * Sends data, see CLSendData(). The awaited result is CL_ERR_OK if the
+     * data was sent, any other value otherwise.
+     *
+     * @param buf the data to send.
+     * @param len the length of data to send.
+     * @return The awaitable.
+     */
+    SendAwaitable send(const char* buf, int len)
+    {
+        return SendAwaitable(handle(), buf, len);
+    }
+
+    /**
+     * Returns the library's handle for the socket.
+     *
+     * @return The library's handle for the socket, or 0 if there is none.
+     */
+    CLSocket handle() const
+    {
+        return (m_state.get() != nullptr) ? m_state->skt : 0;
+    }
+
+    /** Closes the socket, see CLDeleteSocket(). */
+    void close()
+    {
+        if (m_state.get() != nullptr && m_state->skt != 0)
+        {
+            CLDeleteSocket(m_state->skt);
+            m_state->skt = 0;
+        }
+    }
+
+private:
+    friend class Listener;
+
+    /**
+     * The state shared with the library callbacks. It lives on the heap so it
+     * stays put when the socket is moved.
+     */
+    struct State
+    {
+        /** The library's handle for the socket. */
+        CLSocket skt = 0;
+
+        /** Synchronizes access to the members below. */
+        std::mutex mutex;
+
+        /** The coroutine waiting for the connection to complete. */
+        std::coroutine_handle<> conAwaiter;
+
+        /** The result of the connection attempt. */
+        int conErr = CL_ERR_OK;
+
+        /** The coroutine waiting to receive, if any. */
+        std::coroutine_handle<> recvAwaiter;
+
+        /** Data handed straight to the waiting coroutine. */
+        const char* inlineBuf = nullptr;
+
+        /** The length of inlineBuf. */
+        int inlineLen = 0;
+
+        /**
+         * Frames that arrived while nothing was waiting to receive, in a ring
+         * whose buffers are kept when their frames are taken, so that
+         * queueing a frame reuses one rather than allocating.
+         */
+        std::vector<std::vector<char> > queue;
+
+        /** The index in queue of the oldest frame. */
+        std::size_t queueFirst = 0;
+
+        /** The number of frames in queue. */
+        std::size_t queueCount = 0;
+
+        /**
+         * The frame most recently taken from the queue, whose buffer goes
+         * back into the ring when the next frame is taken.
+         */
+        std::vector<char> current;
+
+        /** Has the socket closed? */
+        bool closed = false;
+
+        /** The error the socket closed with. */
+        int closeErr = CL_ERR_SOCKET_CLOSED;
+
+        /**
+         * Copies a frame to the back of the queue, growing the ring if it is
+         * full. The mutex must be locked by the caller.
+         *
+         * @param buf the data of the frame.
+         * @param len the length of the frame.
+         */
+        void pushFrame(const char* buf, int len)
+        {
+            if (queueCount == queue.size())
+            {
+                // Move the buffers, spare ones included, into a ring twice
+                // the size with the oldest frame first
+                std::vector<std::vector<char> > grown(
+                    (queue.size() > 0) ? queue.size() * 2 : 4);
+                for (std::size_t idx = 0; idx < queue.size(); ++idx)
+                {
+                    grown[idx].swap(queue[(queueFirst + idx) % queue.size()]);
+                }
+                queue.swap(grown);
+                queueFirst = 0;
+            }
+
+            queue[(queueFirst + queueCount) % queue.size()].assign(buf,
+                buf + len);
+            ++queueCount;
+        }
+
+        /**
+         * Takes the frame at the front of the queue, swapping its buffer
+         * with the one given. The mutex must be locked by the caller.
+         *
+         * @param frame this will be set to the frame, and its buffer before
+         * goes back into the ring to be reused.
+         */
+        void popFrame(std::vector<char>& frame)
+        {
+            frame.swap(queue[queueFirst]);
+            queueFirst = (queueFirst + 1) % queue.size();
+            --queueCount;
+        }
+    };
+
+    /**
+     * Called from the network thread once the connection attempt has been
+     * made, or from the host address resolver thread if it failed before
+     * that, in which case the coroutine runs on that thread until it next
+     * suspends.
+     */
+    static void __cdecl conCompleted(CLSocket skt, int err, void* arg)
+    {
+        State* state = static_cast<State*>(arg);
+        state->skt = skt;
+        state->conErr = err;
+        std::coroutine_handle<> awaiter = state->conAwaiter;
+        state->conAwaiter = nullptr;
+        awaiter.resume();
+    }
+
+    static void __cdecl dataRecv(CLSocket skt, const char* buf, int len,
+                                 void* arg)
+    {
+        State* state = static_cast<State*>(arg);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (state->recvAwaiter)
+        {
+            // Resume the waiting coroutine here on the network thread. The
+            // buffer stays valid until it suspends again
+            std::coroutine_handle<> awaiter = state->recvAwaiter;
+            state->recvAwaiter = nullptr;
+            state->inlineBuf = buf;
+            state->inlineLen = len;
+            lock.unlock();
+            awaiter.resume();
+        }
+        else
+        {
+            state->pushFrame(buf, len);
+        }
+    }
+
+    static void __cdecl socketClosed(CLSocket skt, int err, void* arg)
+    {
+        State* state = static_cast<State*>(arg);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->closed = true;
+        if (err != CL_ERR_OK)
+        {
+            state->closeErr = err;
+        }
+        std::coroutine_handle<> awaiter = state->recvAwaiter;
+        state->recvAwaiter = nullptr;
+        lock.unlock();
+        if (awaiter)
+        {
+            awaiter.resume();
+        }
+    }
+
+    /** The state shared with the library callbacks. */
+    std::unique_ptr<State> m_state;
+};
+
+/** A server socket whose accepts are awaited. */
+class Listener
+{
+public:
+    /** Awaits the next connection to accept. */
+    class AcceptAwaitable
+    {
+    public:
+        AcceptAwaitable(Listener& listener, Socket& skt) :
+        m_listener(listener), m_skt(skt), m_err(CL_ERR_OK)
+        {
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> awaiter)
+        {
+            State& state = *m_listener.m_state;
+            std::unique_lock<std::mutex> lock(state.mutex);
+            if (state.closed)
+            {
+                m_err = state.closeErr;
+                return false;
+            }
+            if (state.pendingCount > 0)
+            {
+                // A connection is already pending, so do not suspend
+                --state.pendingCount;
+                lock.unlock();
+                m_err = accept(state.srvSkt, m_skt);
+                return false;
+            }
+            state.awaiter = awaiter;
+            state.acceptSkt = &m_skt;
+            state.acceptErr = &m_err;
+            return true;
+        }
+
+        int await_resume() const noexcept { return m_err; }
+
+    private:
+        Listener& m_listener;
+        Socket& m_skt;
+        int m_err;
+    };
+
+    Listener() : m_state(new State) {}
+
+    Listener(const Listener&) = delete;
+    Listener& operator=(const Listener&) = delete;
+
+    ~Listener()
+    {
+        close();
+    }
+
+    /**
+     * Starts listening on the given local address and port, see
+     * CLCreateSrvSocket().
+     *
+     * @param ipAddr the address to listen on.
+     * @param port the port to listen on.
+     * @param conBacklog the maximum number of pending connections.
+     * @return CL_ERR_OK if the function was successful, any other value
+     * otherwise.
+     */
+    int listen(const char* ipAddr, unsigned short port, int conBacklog)
+    {
+        return CLCreateSrvSocket(ipAddr, port, &Listener::conPending,
+            &Listener::srvSocketClosed, conBacklog, m_state.get(),
+            &m_state->srvSkt);
+    }
+
+    /**
+     * Accepts the next connection into the given socket. The awaited result
+     * is CL_ERR_OK if a connection was accepted, any other value otherwise.
+     *
+     * @param skt the socket to accept the connection into.
+     * @return The awaitable.
+     */
+    AcceptAwaitable accept(Socket& skt)
+    {
+        return AcceptAwaitable(*this, skt);
+    }
+
+    /** Stops listening, see CLDeleteSrvSocket(). */
+    void close()
+    {
+        if (m_state->srvSkt != 0)
+        {
+            CLDeleteSrvSocket(m_state->srvSkt);
+            m_state->srvSkt = 0;
+        }
+    }
+
+private:
+    /** The state shared with the library callbacks. */
+    struct State
+    {
+        /** The library's handle for the server socket. */
+        CLSrvSocket srvSkt = 0;
+
+        /** Synchronizes access to the members below. */
+        std::mutex mutex;
+
+        /** The coroutine waiting to accept, if any. */
+        std::coroutine_handle<> awaiter;
+
+        /** The socket to accept into for the waiting coroutine. */
+        Socket* acceptSkt = nullptr;
+
+        /** Where to put the result for the waiting coroutine. */
+        int* acceptErr = nullptr;
+
+        /** The number of connections pending that nothing waited for. */
+        int pendingCount = 0;
+
+        /** Has the server socket closed? */
+        bool closed = false;
+
+        /** The error the server socket closed with. */
+        int closeErr = CL_ERR_SOCKET_CLOSED;
+    };
+
+    /**
+     * Accepts a pending connection into the given socket.
+     *
+     * @param srvSkt the server socket with the connection pending.
+     * @param skt the socket to accept the connection into.
+     * @return CL_ERR_OK if the function was successful, any other value
+     * otherwise.
+     */
+    static int accept(CLSrvSocket srvSkt, Socket& skt)
+    {
+        Socket::State* sktState = skt.m_state.get();
+        return CLAcceptCon(srvSkt, &Socket::dataRecv, &Socket::socketClosed,
+            sktState, &sktState->skt, NULL, 0, NULL);
+    }
+
+    static void __cdecl conPending(CLSrvSocket srvSkt, void* srvArg)
+    {
+        State* state = static_cast<State*>(srvArg);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (!state->awaiter)
+        {
+            ++state->pendingCount;
+            return;
+        }
+
+        std::coroutine_handle<> awaiter = state->awaiter;
+        state->awaiter = nullptr;
+        Socket* acceptSkt = state->acceptSkt;
+        int* acceptErr = state->acceptErr;
+        lock.unlock();
+
+        // Resume the waiting coroutine here on the network thread
+        *acceptErr = accept(srvSkt, *acceptSkt);
+        awaiter.resume();
+    }
+
+    static void __cdecl srvSocketClosed(CLSrvSocket srvSkt, int err,
+                                        void* srvArg)
+    {
+        State* state = static_cast<State*>(srvArg);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->closed = true;
+        if (err != CL_ERR_OK)
+        {
+            state->closeErr = err;
+        }
+        std::coroutine_handle<> awaiter = state->awaiter;
+        state->awaiter = nullptr;
+        int* acceptErr = state->acceptErr;
+        lock.unlock();
+        if (awaiter)
+        {
+            *acceptErr = state->closeErr;
+            awaiter.resume();
+        }
+    }
+
+    /** The state shared with the library callbacks. */
+    std::unique_ptr<State> m_state;
+};
+
+} // namespace comlib
+
+#endif // COMLIBCORO_H
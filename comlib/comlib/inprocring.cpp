@@ -0,0 +1,288 @@
+/**
+ * @file
+ * Defines the InprocRingMemory and InprocListener classes.
+ */
+
+#include "inprocring.h"
+#include <cassert>
+#include <cstring>
+#include <malloc.h>
+#include <map>
+#include <boost/thread/locks.hpp>
+#include "inc/comlib/comlib.h"
+
+// The prefix that identifies an in-process address
+static const char INPROC_ADDR_PREFIX[] = "inproc://";
+// The length of the prefix, not including the null
+static const size_t INPROC_ADDR_PREFIX_LEN = sizeof(INPROC_ADDR_PREFIX) - 1;
+
+// The maximum number of pending connections a listener can queue
+static const int INPROC_BACKLOG_MAX = 256;
+
+// The alignment of the ring memory, so each ring control block starts on a
+// cache line
+static const size_t INPROC_MEM_ALIGNMENT = 64;
+
+// The listeners in this process, by name
+typedef std::map<std::string, InprocListener*> InprocListenerMap;
+static InprocListenerMap s_inprocListeners;
+
+// Synchronizes access to the listener table and to every listener's queue of
+// pending connections. Connecting and accepting are rare enough that one
+// mutex for all of them is not a bottleneck
+static boost::mutex s_inprocMutex;
+
+bool isInprocAddr(const char* addr)
+{
+    return (addr != 0 &&
+        _strnicmp(addr, INPROC_ADDR_PREFIX, INPROC_ADDR_PREFIX_LEN) == 0);
+}
+
+int InprocRingMemory::create(InprocRingMemory** pMemory)
+{
+    InprocRingMemory* self = new InprocRingMemory;
+    int err = self->construct();
+    if (err == CL_ERR_OK)
+    {
+        *pMemory = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+InprocRingMemory::~InprocRingMemory()
+{
+    for (int dir = 0; dir < DIR_COUNT; ++dir)
+    {
+        if (m_dataEvents[dir] != NULL)
+        {
+            CloseHandle(m_dataEvents[dir]);
+        }
+        if (m_spaceEvents[dir] != NULL)
+        {
+            CloseHandle(m_spaceEvents[dir]);
+        }
+    }
+
+    if (m_mem != 0)
+    {
+        _aligned_free(m_mem);
+    }
+}
+
+InprocRingMemory::InprocRingMemory() :
+m_mem(0)
+{
+}
+
+int InprocRingMemory::construct()
+{
+    int err = CL_ERR_OK;
+
+    m_mem = static_cast<char*>(_aligned_malloc(TOTAL_SIZE,
+        INPROC_MEM_ALIGNMENT));
+    if (m_mem != 0)
+    {
+        layout(m_mem, true);
+    }
+    else
+    {
+        err = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Manual-reset data events and auto-reset space events, as for shared
+    // memory rings
+    for (int dir = 0; dir < DIR_COUNT && err == CL_ERR_OK; ++dir)
+    {
+        m_dataEvents[dir] = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_spaceEvents[dir] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (m_dataEvents[dir] == NULL || m_spaceEvents[dir] == NULL)
+        {
+            err = GetLastError();
+        }
+    }
+
+    return err;
+}
+
+int InprocListener::create(const char* addr, int conBacklog,
+                           RingListener** pListener)
+{
+    InprocListener* self = new InprocListener(conBacklog);
+    int err = self->construct(addr);
+    if (err == CL_ERR_OK)
+    {
+        *pListener = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+int InprocListener::connect(const char* addr, RingChannel** pChannel)
+{
+    assert(isInprocAddr(addr));
+
+    // Create the ring memory for the connection before taking the lock
+    InprocRingMemory* memory = 0;
+    int err = InprocRingMemory::create(&memory);
+    if (err != CL_ERR_OK)
+    {
+        return err;
+    }
+    RingMemorySPtr memorySPtr(memory);
+
+    {
+        boost::lock_guard<boost::mutex> lock(s_inprocMutex);
+
+        // If there is no listener then nothing is listening on the address,
+        // as with connecting to a port no socket is listening on
+        InprocListenerMap::iterator listenerIt =
+            s_inprocListeners.find(addr + INPROC_ADDR_PREFIX_LEN);
+        if (listenerIt == s_inprocListeners.end())
+        {
+            return WSAECONNREFUSED;
+        }
+
+        InprocListener* listener = listenerIt->second;
+        if (listener->m_pendingCons.size() >= listener->m_conBacklog)
+        {
+            return WSAECONNREFUSED;
+        }
+
+        listener->m_pendingCons.push_back(memorySPtr);
+        SetEvent(listener->m_acceptEvent);
+    }
+
+    *pChannel = new RingChannel(memorySPtr, false);
+    return CL_ERR_OK;
+}
+
+InprocListener::~InprocListener()
+{
+    close();
+
+    if (m_acceptEvent != NULL)
+    {
+        CloseHandle(m_acceptEvent);
+    }
+}
+
+WSAEVENT InprocListener::netEvent() const
+{
+    return m_acceptEvent;
+}
+
+void InprocListener::resetNetEvent()
+{
+    ResetEvent(m_acceptEvent);
+}
+
+int InprocListener::accept(RingChannel** pChannel)
+{
+    RingMemorySPtr memory;
+
+    {
+        boost::lock_guard<boost::mutex> lock(s_inprocMutex);
+
+        if (m_closed)
+        {
+            return WSAEINVAL;
+        }
+
+        if (m_pendingCons.empty())
+        {
+            return WSAEWOULDBLOCK;
+        }
+
+        memory = m_pendingCons.front();
+        m_pendingCons.pop_front();
+
+        if (!m_pendingCons.empty())
+        {
+            // More connections are pending, so signal again as FD_ACCEPT would
+            // be
+            SetEvent(m_acceptEvent);
+        }
+    }
+
+    *pChannel = new RingChannel(memory, true);
+    return CL_ERR_OK;
+}
+
+void InprocListener::close()
+{
+    std::deque<RingMemorySPtr> pendingCons;
+
+    {
+        boost::lock_guard<boost::mutex> lock(s_inprocMutex);
+
+        if (m_closed)
+        {
+            return;
+        }
+        m_closed = true;
+
+        if (!m_name.empty())
+        {
+            s_inprocListeners.erase(m_name);
+        }
+        pendingCons.swap(m_pendingCons);
+    }
+
+    // Reset the connections that are still pending, so their connecting ends
+    // see the connection close
+    for (size_t idx = 0; idx < pendingCons.size(); ++idx)
+    {
+        RingChannel channel(pendingCons[idx], true);
+        channel.close();
+    }
+}
+
+bool InprocListener::isClosed() const
+{
+    return m_closed;
+}
+
+InprocListener::InprocListener(int conBacklog) :
+m_conBacklog((conBacklog > 0 && conBacklog < INPROC_BACKLOG_MAX) ?
+    conBacklog : INPROC_BACKLOG_MAX),
+m_acceptEvent(NULL), m_closed(false)
+{
+}
+
+int InprocListener::construct(const char* addr)
+{
+    assert(isInprocAddr(addr));
+
+    std::string name(addr + INPROC_ADDR_PREFIX_LEN);
+    if (name.empty())
+    {
+        m_closed = true;
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    m_acceptEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_acceptEvent == NULL)
+    {
+        m_closed = true;
+        return GetLastError();
+    }
+
+    boost::lock_guard<boost::mutex> lock(s_inprocMutex);
+
+    // Only one listener is allowed per name, as with binding a socket
+    if (!s_inprocListeners.insert(std::make_pair(name, this)).second)
+    {
+        m_closed = true;
+        return WSAEADDRINUSE;
+    }
+
+    m_name = name;
+    return CL_ERR_OK;
+}
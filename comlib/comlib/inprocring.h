@@ -0,0 +1,131 @@
+/**
+ * @file
+ * Declares the InprocRingMemory and InprocListener classes, which carry ring
+ * connections between sockets in the same process.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <string>
+#include "ringchannel.h"
+
+/**
+ * Does the given address specify an in-process ring connection, i.e. does it
+ * have the form "inproc://name"?
+ *
+ * @param addr the address to check.
+ * @return Whether or not the given address specifies an in-process ring
+ * connection.
+ */
+bool isInprocAddr(const char* addr);
+
+/**
+ * Ring memory held on the heap, with unnamed events, shared by both ends of a
+ * ring connection within the same process.
+ */
+class InprocRingMemory : public RingMemory
+{
+public:
+    /**
+     * Creates the memory and events for a new ring connection.
+     *
+     * @param pMemory if the method was successful this will be set to point
+     * to the ring memory that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int create(InprocRingMemory** pMemory);
+
+    virtual ~InprocRingMemory();
+
+private:
+    /** The first stage of construction. */
+    InprocRingMemory();
+
+    /**
+     * The second stage of construction.
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int construct();
+
+    /** The memory holding the rings. */
+    char* m_mem;
+};
+
+/**
+ * Listens for in-process ring connections. Listeners are found by name in a
+ * table shared by the whole process, and connecting sockets hand the ring
+ * memory for the connection straight to the listener's queue.
+ */
+class InprocListener : public RingListener
+{
+public:
+    /**
+     * Creates a listener for the given in-process address.
+     *
+     * @param addr the in-process address to listen on.
+     * @param conBacklog the maximum number of pending connections.
+     * @param pListener if the method was successful this will be set to point
+     * to the listener that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int create(const char* addr, int conBacklog,
+        RingListener** pListener);
+
+    /**
+     * Connects to the listener for the given in-process address.
+     *
+     * @param addr the in-process address to connect to.
+     * @param pChannel if the method was successful this will be set to point
+     * to the connecting end of the connection.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int connect(const char* addr, RingChannel** pChannel);
+
+    virtual ~InprocListener();
+
+    // Inherited from RingListener
+    virtual WSAEVENT netEvent() const;
+    virtual void resetNetEvent();
+    virtual int accept(RingChannel** pChannel);
+    virtual void close();
+    virtual bool isClosed() const;
+
+private:
+    /**
+     * The first stage of construction.
+     *
+     * @param conBacklog the maximum number of pending connections.
+     */
+    explicit InprocListener(int conBacklog);
+
+    /**
+     * The second stage of construction.
+     *
+     * @param addr the in-process address to listen on.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int construct(const char* addr);
+
+    /** The name this listener is registered under, empty if not registered. */
+    std::string m_name;
+
+    /** The maximum number of pending connections. */
+    size_t m_conBacklog;
+
+    /** The ring memory of the connections waiting to be accepted. */
+    std::deque<RingMemorySPtr> m_pendingCons;
+
+    /** The event signaled when a connection is pending. */
+    HANDLE m_acceptEvent;
+
+    /** This is set when close() has been called. */
+    bool m_closed;
+};
@@ -6,10 +6,16 @@
 #pragma once
 
 #include <winsock2.h>
-#include <boost/shared_ptr.hpp>
+#include <windows.h>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/utility.hpp>
 
-/** An object that will receive notification of network events. */
+/**
+ * An object that will receive notification of network events. Network objects
+ * count their own references, so a pointer to one needs no separate
+ * allocation for the count, and are deleted when the last NetObjSPtr or
+ * pointer of a derived type to them goes away.
+ */
 class NetObj : private boost::noncopyable
 {
 public:
@@ -24,7 +30,83 @@ public:
 
     /** This will be called when a network event has occured. */
     virtual void onNetEvent() = 0;
+
+    /**
+     * Returns the tick count, as given by GetTickCount64(), when onTimer()
+     * next needs to be called. An object whose timer becomes earlier must
+     * signal its network event so the network thread notices.
+     *
+     * @return The tick count when onTimer() next needs to be called, or
+     * NO_TIMER if it does not.
+     */
+    virtual ULONGLONG timerDeadline() const { return NO_TIMER; }
+
+    /**
+     * This will be called when the tick count given by timerDeadline() has
+     * been reached.
+     *
+     * @param now the current tick count.
+     */
+    virtual void onTimer(ULONGLONG now) {}
+
+    /**
+     * Returns the CPU that receive side scaling processes this object's
+     * incoming packets on, so that it can be served by a network thread
+     * pinned to the same CPU.
+     *
+     * @return The number of the CPU within its processor group, or -1 if it
+     * is not known.
+     */
+    virtual int rssCpu() const { return -1; }
+
+    /**
+     * Returns the number of bytes this object has received so far, which its
+     * network thread samples to tell how busy the object keeps it. This is
+     * only called by the network thread serving the object.
+     *
+     * @return The number of bytes received, or 0 if the object does not
+     * receive data.
+     */
+    virtual ULONGLONG bytesRecv() const { return 0; }
+
+    /** The value of timerDeadline() when no timer is needed. */
+    static const ULONGLONG NO_TIMER = ~0ULL;
+
+protected:
+    NetObj() : m_refCount(0) {}
+
+private:
+    friend void intrusive_ptr_add_ref(NetObj* netObj);
+    friend void intrusive_ptr_release(NetObj* netObj);
+
+    /** The number of pointers to this object. */
+    volatile LONG m_refCount;
 };
 
+/**
+ * Adds a reference to the given network object, as called by
+ * boost::intrusive_ptr.
+ *
+ * @param netObj the network object.
+ */
+inline void intrusive_ptr_add_ref(NetObj* netObj)
+{
+    InterlockedIncrement(&netObj->m_refCount);
+}
+
+/**
+ * Removes a reference to the given network object, deleting it if that was
+ * the last, as called by boost::intrusive_ptr.
+ *
+ * @param netObj the network object.
+ */
+inline void intrusive_ptr_release(NetObj* netObj)
+{
+    if (InterlockedDecrement(&netObj->m_refCount) == 0)
+    {
+        delete netObj;
+    }
+}
+
 /** A shared pointer to a network object. */
-typedef boost::shared_ptr<NetObj> NetObjSPtr;
+typedef boost::intrusive_ptr<NetObj> NetObjSPtr;
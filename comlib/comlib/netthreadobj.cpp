@@ -6,11 +6,49 @@
 #include "netthreadobj.h"
 #include <algorithm>
 #include <boost/thread/locks.hpp>
+#include "debug.h"
 #include "inc/comlib/comlib.h"
+#include "netthreadpool.h"
+#include "socketobj.h"
 
-int NetThreadObj::create(NetThreadObj** pNetThreadObj)
+// The shortest time in microseconds a network thread that spins polls for
+// network events. A thread that would poll for less than this waits instead
+static const DWORD SPIN_MIN_MICROS = 5;
+
+// How often in ms a busy network thread samples its load
+static const ULONGLONG LOAD_SAMPLE_INTERVAL = 1000;
+
+// The utilization, as a percentage, at which a network thread asks its pool
+// to move some of its network objects to another thread
+static const int HOT_UTILIZATION = 80;
+
+// Reads a counter that another thread changes with interlocked operations,
+// all 64 bits at once even on 32-bit Windows
+static LONGLONG readCounter(volatile LONGLONG* counter)
+{
+    return InterlockedCompareExchange64(counter, 0, 0);
+}
+
+// Converts a number of performance counts to microseconds
+static ULONGLONG countsToMicros(LONGLONG counts, LONGLONG perfFreq)
 {
-    NetThreadObj* self = new NetThreadObj;
+    return static_cast<ULONGLONG>(counts) * 1000000 /
+        static_cast<ULONGLONG>(perfFreq);
+}
+
+// Converts a count over the given number of performance counts to a count per
+// second
+static ULONGLONG perSec(ULONGLONG count, LONGLONG elapsedCounts,
+    LONGLONG perfFreq)
+{
+    return count * static_cast<ULONGLONG>(perfFreq) /
+        static_cast<ULONGLONG>(elapsedCounts);
+}
+
+int NetThreadObj::create(DWORD_PTR affinityMask, DWORD spinMicros,
+    NetThreadPool* pool, NetThreadObj** pNetThreadObj)
+{
+    NetThreadObj* self = new NetThreadObj(affinityMask, spinMicros, pool);
     int err = self->construct();
     if (err == CL_ERR_OK)
     {
@@ -44,14 +82,33 @@ NetThreadObj::~NetThreadObj()
 
 void NetThreadObj::run()
 {
-    m_threadId = boost::this_thread::get_id();
+    if (m_affinityMask != 0 &&
+        SetThreadAffinityMask(GetCurrentThread(), m_affinityMask) == 0)
+    {
+        OUTPUT_FMT_DEBUG_STRING("Could not set the affinity mask of a network "
+            "thread to " << std::hex << m_affinityMask << ", error "
+            << std::dec << GetLastError());
+    }
+
+    LARGE_INTEGER busyStart;
+    QueryPerformanceCounter(&busyStart);
+    m_sampleStart = busyStart.QuadPart;
+    m_nextSampleTick = GetTickCount64() + LOAD_SAMPLE_INTERVAL;
 
     // Run until the start shutdown event is signaled
     while (WaitForSingleObject(m_startShutdownEvent, 0) != WAIT_OBJECT_0)
     {
-        DWORD wsaWaitErr = WSAWaitForMultipleEvents(
-            static_cast<DWORD>(m_netEvents.size()), &m_netEvents[0], FALSE,
-            WSA_INFINITE, FALSE);
+        LARGE_INTEGER waitStart;
+        QueryPerformanceCounter(&waitStart);
+        InterlockedExchangeAdd64(&m_counters.busyCounts,
+            waitStart.QuadPart - busyStart.QuadPart);
+
+        DWORD wsaWaitErr = waitForNetEvents();
+
+        QueryPerformanceCounter(&busyStart);
+        InterlockedExchangeAdd64(&m_counters.waitCounts,
+            busyStart.QuadPart - waitStart.QuadPart);
+        InterlockedIncrement64(&m_counters.wakeupCount);
 
         if (WSA_WAIT_EVENT_0 <= wsaWaitErr &&
             wsaWaitErr <= WSA_WAIT_EVENT_0 + (m_netEvents.size() - 1))
@@ -68,38 +125,13 @@ void NetThreadObj::run()
                     WAIT_OBJECT_0)
                 {
                     // We have net object additions and/or removals to handle
-                    boost::lock_guard<boost::mutex> lock(m_mutex);
-
-                    while (!m_changeRequests.empty())
-                    {
-                        ChangeRequest& changeRequest =
-                            m_changeRequests.front();
-                        if (changeRequest.add)
-                        {
-                            m_netObjs.push_back(changeRequest.netObj);
-                            m_netEvents.push_back(
-                                changeRequest.netObj->netEvent());
-                        }
-                        else
-                        {
-                            // Removal
-                            std::vector<NetObjSPtr>::iterator netObjIt =
-                                std::find(m_netObjs.begin(), m_netObjs.end(),
-                                    changeRequest.netObj);
-
-                            if (netObjIt != m_netObjs.end())
-                            {
-                                size_t netObjIdx = netObjIt -
-                                    m_netObjs.begin();
-                                m_netObjs.erase(netObjIt);
-
-                                std::vector<WSAEVENT>::iterator netEventIt =
-                                    m_netEvents.begin() + netObjIdx;
-                                m_netEvents.erase(netEventIt);
-                            }
-                        }
-                        m_changeRequests.pop();
-                    }
+                    LARGE_INTEGER changeStart;
+                    QueryPerformanceCounter(&changeStart);
+                    handleChangeRequests();
+                    LARGE_INTEGER changeEnd;
+                    QueryPerformanceCounter(&changeEnd);
+                    InterlockedExchangeAdd64(&m_counters.changeCounts,
+                        changeEnd.QuadPart - changeStart.QuadPart);
                 }
             }
             else
@@ -108,6 +140,8 @@ void NetThreadObj::run()
                 // Avoid socket starvation (caused by an event at the start of
                 // the array being frequently signaled) by also examining all
                 // the events after the one that was signaled
+                DWORD eventCount = 0;
+                LONGLONG callbackCounts = 0;
                 for (size_t idx = netEventIdx; idx < m_netEvents.size() &&
                     WaitForSingleObject(m_startShutdownEvent, 0) !=
                         WAIT_OBJECT_0;
@@ -116,12 +150,47 @@ void NetThreadObj::run()
                     if (WSAWaitForMultipleEvents(1, &m_netEvents[idx], FALSE,
                         0, FALSE) == WSA_WAIT_EVENT_0)
                     {
+                        LARGE_INTEGER callbackStart;
+                        QueryPerformanceCounter(&callbackStart);
                         m_netObjs[idx]->onNetEvent();
+                        LARGE_INTEGER callbackEnd;
+                        QueryPerformanceCounter(&callbackEnd);
+                        callbackCounts +=
+                            callbackEnd.QuadPart - callbackStart.QuadPart;
+                        ++m_netObjCounts[idx].eventCount;
+                        ++eventCount;
                     }
                 }
+
+                m_sampleEventCount += eventCount;
+                InterlockedExchangeAdd64(&m_counters.eventCount, eventCount);
+                InterlockedExchangeAdd64(&m_counters.callbackCounts,
+                    callbackCounts);
+            }
+        }
+
+        runDueTimers();
+        sampleLoadIfDue();
+    }
+
+    // Hand any network objects still waiting to be moved to the pool, as this
+    // thread will not serve them again
+    std::vector<NetObjSPtr> migratedObjs;
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        while (!m_changeRequests.empty())
+        {
+            if (m_changeRequests.front().type == CHANGE_MIGRATE)
+            {
+                migratedObjs.push_back(m_changeRequests.front().netObj);
             }
+            m_changeRequests.pop();
         }
     }
+    for (size_t idx = 0; idx < migratedObjs.size(); ++idx)
+    {
+        m_pool->completeMigration(migratedObjs[idx]);
+    }
 
     SetEvent(m_isShutdownEvent);
 }
@@ -135,7 +204,7 @@ void NetThreadObj::addNetObj(const NetObjSPtr& netObj)
     // associated with this object
 
     ChangeRequest changeRequest;
-    changeRequest.add = true;
+    changeRequest.type = CHANGE_ADD;
     changeRequest.netObj = netObj;
     m_changeRequests.push(changeRequest);
 
@@ -143,6 +212,22 @@ void NetThreadObj::addNetObj(const NetObjSPtr& netObj)
     SetEvent(m_netEvents[0]);
 }
 
+void NetThreadObj::addNetObjs(const std::vector<NetObjSPtr>& netObjs)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    for (size_t idx = 0; idx < netObjs.size(); ++idx)
+    {
+        ChangeRequest changeRequest;
+        changeRequest.type = CHANGE_ADD;
+        changeRequest.netObj = netObjs[idx];
+        m_changeRequests.push(changeRequest);
+    }
+
+    // Signal the interrupt event
+    SetEvent(m_netEvents[0]);
+}
+
 void NetThreadObj::removeNetObj(const NetObjSPtr& netObj)
 {
     boost::lock_guard<boost::mutex> lock(m_mutex);
@@ -152,7 +237,7 @@ void NetThreadObj::removeNetObj(const NetObjSPtr& netObj)
     // associated with this object
 
     ChangeRequest changeRequest;
-    changeRequest.add = false;
+    changeRequest.type = CHANGE_REMOVE;
     changeRequest.netObj = netObj;
     m_changeRequests.push(changeRequest);
 
@@ -160,32 +245,70 @@ void NetThreadObj::removeNetObj(const NetObjSPtr& netObj)
     SetEvent(m_netEvents[0]);
 }
 
-void NetThreadObj::startShutdown()
+void NetThreadObj::migrateNetObj(const NetObjSPtr& netObj)
 {
-    SetEvent(m_startShutdownEvent);
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    // The network object can only be removed by the thread associated with
+    // this object, in between calls to onNetEvent(), so it is never served
+    // by two threads at once
+
+    ChangeRequest changeRequest;
+    changeRequest.type = CHANGE_MIGRATE;
+    changeRequest.netObj = netObj;
+    m_changeRequests.push(changeRequest);
 
     // Signal the interrupt event
     SetEvent(m_netEvents[0]);
 }
 
-bool NetThreadObj::waitForShutdown(DWORD milliseconds)
+void NetThreadObj::getLoad(Load& load)
 {
-    if (boost::this_thread::get_id() == m_threadId)
-    {
-        // The thread that called this method is the thread associated with
-        // this object. Therefore there's no way the thread associated with
-        // this object can have shutdown yet or will shutdown in the time-out
-        // interval
-        return false;
-    }
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    load = m_load;
+}
+
+void NetThreadObj::getTotals(Totals& totals) const
+{
+    Counters& counters = const_cast<Counters&>(m_counters);
+    totals.wakeups = readCounter(&counters.wakeupCount);
+    totals.events = readCounter(&counters.eventCount);
+    totals.waitMicros = countsToMicros(readCounter(&counters.waitCounts),
+        m_perfFreq);
+    totals.busyMicros = countsToMicros(readCounter(&counters.busyCounts),
+        m_perfFreq);
+    totals.callbackMicros = countsToMicros(
+        readCounter(&counters.callbackCounts), m_perfFreq);
+    totals.changeMicros = countsToMicros(readCounter(&counters.changeCounts),
+        m_perfFreq);
+}
+
+void NetThreadObj::startShutdown()
+{
+    SetEvent(m_startShutdownEvent);
 
-    return (WaitForSingleObject(m_isShutdownEvent, milliseconds) ==
-        WAIT_OBJECT_0);
+    // Signal the interrupt event
+    SetEvent(m_netEvents[0]);
 }
 
-NetThreadObj::NetThreadObj() : m_startShutdownEvent(NULL),
-m_isShutdownEvent(NULL)
+NetThreadObj::NetThreadObj(DWORD_PTR affinityMask, DWORD spinMicros,
+    NetThreadPool* pool) :
+m_affinityMask(affinityMask), m_spinMicros(spinMicros),
+m_crntSpinMicros(spinMicros), m_perfFreq(0), m_pool(pool), m_sampleStart(0),
+m_sampleWaitCounts(0), m_sampleWakeupCount(0), m_sampleEventCount(0),
+m_nextSampleTick(0), m_startShutdownEvent(NULL), m_isShutdownEvent(NULL)
 {
+    m_counters.wakeupCount = 0;
+    m_counters.eventCount = 0;
+    m_counters.waitCounts = 0;
+    m_counters.busyCounts = 0;
+    m_counters.callbackCounts = 0;
+    m_counters.changeCounts = 0;
+
+    m_load.utilization = 0;
+    m_load.eventsPerSec = 0;
+    m_load.wakeupsPerSec = 0;
+    m_load.bytesRecvPerSec = 0;
 }
 
 int NetThreadObj::construct()
@@ -194,6 +317,11 @@ int NetThreadObj::construct()
 
     m_netEvents.reserve(WSA_MAXIMUM_WAIT_EVENTS);
     m_netObjs.reserve(WSA_MAXIMUM_WAIT_EVENTS);
+    m_netObjCounts.reserve(WSA_MAXIMUM_WAIT_EVENTS);
+
+    LARGE_INTEGER perfFreq;
+    QueryPerformanceFrequency(&perfFreq);
+    m_perfFreq = perfFreq.QuadPart;
 
     HANDLE interruptEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
         // Manual-reset, unsignaled
@@ -203,6 +331,8 @@ int NetThreadObj::construct()
         m_netEvents.push_back(interruptEvent);
         NetObjSPtr nullNetObj;
         m_netObjs.push_back(nullNetObj);
+        NetObjCounts nullCounts = { 0, 0 };
+        m_netObjCounts.push_back(nullCounts);
 
         m_startShutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
             // Manual-reset, unsignaled
@@ -227,3 +357,234 @@ int NetThreadObj::construct()
 
     return err;
 }
+
+DWORD NetThreadObj::timerWaitInterval() const
+{
+    // Wake to sample the load once more after network events are handled, so
+    // a thread that has gone idle does not go on showing the load it had
+    ULONGLONG deadline = NetObj::NO_TIMER;
+    if (m_sampleEventCount > 0 || m_load.eventsPerSec > 0)
+    {
+        deadline = m_nextSampleTick;
+    }
+    for (size_t idx = 1; idx < m_netObjs.size(); ++idx)
+    {
+        deadline = (std::min)(deadline, m_netObjs[idx]->timerDeadline());
+    }
+
+    // Also wake to trim the receive buffer pools, which otherwise are only
+    // trimmed as frames are received
+    deadline = (std::min)(deadline, SocketObj::recvBufTrimDeadline());
+
+    if (deadline == NetObj::NO_TIMER)
+    {
+        return WSA_INFINITE;
+    }
+
+    ULONGLONG now = GetTickCount64();
+    if (deadline <= now)
+    {
+        return 0;
+    }
+
+    // Keep the interval below WSA_INFINITE, which would mean no timeout
+    return static_cast<DWORD>(
+        (std::min)(deadline - now, static_cast<ULONGLONG>(WSA_INFINITE - 1)));
+}
+
+DWORD NetThreadObj::waitForNetEvents()
+{
+    DWORD netEventCount = static_cast<DWORD>(m_netEvents.size());
+    DWORD waitInterval = timerWaitInterval();
+
+    // Poll the network events first if spinning, but not beyond when the
+    // next timer is due
+    if (m_crntSpinMicros > 0 && waitInterval > 0)
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        ULONGLONG spinMicros = (std::min)(
+            static_cast<ULONGLONG>(m_crntSpinMicros), waitInterval * 1000ULL);
+        LONGLONG spinEnd = now.QuadPart + static_cast<LONGLONG>(
+            spinMicros * m_perfFreq / 1000000);
+        do
+        {
+            DWORD wsaWaitErr = WSAWaitForMultipleEvents(netEventCount,
+                &m_netEvents[0], FALSE, 0, FALSE);
+            if (wsaWaitErr != WSA_WAIT_TIMEOUT)
+            {
+                // Events are arriving, so keep spinning for the full time
+                m_crntSpinMicros = m_spinMicros;
+                return wsaWaitErr;
+            }
+            QueryPerformanceCounter(&now);
+        }
+        while (now.QuadPart < spinEnd);
+
+        // Nothing arrived, so spin for less next time, down to not at all
+        m_crntSpinMicros /= 2;
+        if (m_crntSpinMicros < SPIN_MIN_MICROS)
+        {
+            m_crntSpinMicros = 0;
+        }
+        waitInterval = timerWaitInterval();
+    }
+
+    DWORD wsaWaitErr = WSAWaitForMultipleEvents(netEventCount,
+        &m_netEvents[0], FALSE, waitInterval, FALSE);
+    if (wsaWaitErr != WSA_WAIT_TIMEOUT && m_crntSpinMicros < m_spinMicros)
+    {
+        // Events are arriving again, so spin for longer next time
+        m_crntSpinMicros = (std::min)(m_spinMicros,
+            (std::max)(m_crntSpinMicros * 2, SPIN_MIN_MICROS));
+    }
+    return wsaWaitErr;
+}
+
+void NetThreadObj::runDueTimers()
+{
+    ULONGLONG now = GetTickCount64();
+    for (size_t idx = 1; idx < m_netObjs.size(); ++idx)
+    {
+        if (m_netObjs[idx]->timerDeadline() <= now)
+        {
+            LARGE_INTEGER callbackStart;
+            QueryPerformanceCounter(&callbackStart);
+            m_netObjs[idx]->onTimer(now);
+            LARGE_INTEGER callbackEnd;
+            QueryPerformanceCounter(&callbackEnd);
+            InterlockedExchangeAdd64(&m_counters.callbackCounts,
+                callbackEnd.QuadPart - callbackStart.QuadPart);
+        }
+    }
+
+    if (SocketObj::recvBufTrimDeadline() <= now)
+    {
+        SocketObj::trimRecvBufPools();
+    }
+}
+
+void NetThreadObj::handleChangeRequests()
+{
+    std::vector<NetObjSPtr> migratedObjs;
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+
+        while (!m_changeRequests.empty())
+        {
+            ChangeRequest& changeRequest = m_changeRequests.front();
+            if (changeRequest.type == CHANGE_ADD)
+            {
+                m_netObjs.push_back(changeRequest.netObj);
+                m_netEvents.push_back(changeRequest.netObj->netEvent());
+                NetObjCounts counts = { 0, changeRequest.netObj->bytesRecv() };
+                m_netObjCounts.push_back(counts);
+            }
+            else
+            {
+                // Removal, or a move to another thread object
+                std::vector<NetObjSPtr>::iterator netObjIt = std::find(
+                    m_netObjs.begin(), m_netObjs.end(), changeRequest.netObj);
+
+                if (netObjIt != m_netObjs.end())
+                {
+                    size_t netObjIdx = netObjIt - m_netObjs.begin();
+                    m_netObjs.erase(netObjIt);
+                    m_netEvents.erase(m_netEvents.begin() + netObjIdx);
+                    m_netObjCounts.erase(m_netObjCounts.begin() + netObjIdx);
+
+                    if (changeRequest.type == CHANGE_MIGRATE)
+                    {
+                        migratedObjs.push_back(changeRequest.netObj);
+                    }
+                }
+
+                // Do not hold on to the network object until the next sample
+                for (size_t idx = 0; idx < m_load.netObjLoads.size(); ++idx)
+                {
+                    if (m_load.netObjLoads[idx].netObj == changeRequest.netObj)
+                    {
+                        m_load.netObjLoads.erase(
+                            m_load.netObjLoads.begin() + idx);
+                        break;
+                    }
+                }
+            }
+            m_changeRequests.pop();
+        }
+    }
+
+    // Only tell the pool once this object is unlocked, as the pool locks the
+    // thread object the network objects are moving to, which may be moving
+    // network objects to this one at the same time
+    for (size_t idx = 0; idx < migratedObjs.size(); ++idx)
+    {
+        m_pool->completeMigration(migratedObjs[idx]);
+    }
+}
+
+void NetThreadObj::sampleLoadIfDue()
+{
+    if (GetTickCount64() < m_nextSampleTick)
+    {
+        return;
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    LONGLONG elapsedCounts = (std::max)(now.QuadPart - m_sampleStart, 1LL);
+
+    // Only this thread changes the counters, so it can read them as is
+    LONGLONG waitCounts = m_counters.waitCounts;
+    LONGLONG wakeupCount = m_counters.wakeupCount;
+
+    Load load;
+    load.utilization = static_cast<int>(100 - (std::min)(
+        waitCounts - m_sampleWaitCounts, elapsedCounts) * 100 / elapsedCounts);
+    load.wakeupsPerSec = static_cast<DWORD>(perSec(
+        wakeupCount - m_sampleWakeupCount, elapsedCounts, m_perfFreq));
+    load.eventsPerSec = 0;
+    load.bytesRecvPerSec = 0;
+    load.netObjLoads.reserve(m_netObjs.size() - 1);
+    for (size_t idx = 1; idx < m_netObjs.size(); ++idx)
+    {
+        NetObjCounts& counts = m_netObjCounts[idx];
+        ULONGLONG bytesRecv = m_netObjs[idx]->bytesRecv();
+
+        NetObjLoad netObjLoad;
+        netObjLoad.netObj = m_netObjs[idx];
+        netObjLoad.eventsPerSec = static_cast<DWORD>(
+            perSec(counts.eventCount, elapsedCounts, m_perfFreq));
+        netObjLoad.bytesRecvPerSec = perSec(bytesRecv - counts.bytesRecv,
+            elapsedCounts, m_perfFreq);
+        load.eventsPerSec += netObjLoad.eventsPerSec;
+        load.bytesRecvPerSec += netObjLoad.bytesRecvPerSec;
+        load.netObjLoads.push_back(netObjLoad);
+
+        counts.eventCount = 0;
+        counts.bytesRecv = bytesRecv;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_load.utilization = load.utilization;
+        m_load.eventsPerSec = load.eventsPerSec;
+        m_load.wakeupsPerSec = load.wakeupsPerSec;
+        m_load.bytesRecvPerSec = load.bytesRecvPerSec;
+        m_load.netObjLoads.swap(load.netObjLoads);
+    }
+
+    m_sampleStart = now.QuadPart;
+    m_sampleWaitCounts = waitCounts;
+    m_sampleWakeupCount = wakeupCount;
+    m_sampleEventCount = 0;
+    m_nextSampleTick = GetTickCount64() + LOAD_SAMPLE_INTERVAL;
+
+    // Have the pool move some of this thread's network objects elsewhere if
+    // it cannot keep up
+    if (m_pool != 0 && load.utilization >= HOT_UTILIZATION &&
+        WaitForSingleObject(m_startShutdownEvent, 0) != WAIT_OBJECT_0)
+    {
+        m_pool->rebalance();
+    }
+}
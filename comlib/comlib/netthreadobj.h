@@ -15,6 +15,8 @@
 #include <vector>
 #include "netobj.h"
 
+class NetThreadPool;
+
 /**
  * An object that is responsible for notifying network objects registered with
  * it when a network event has occured.
@@ -28,15 +30,94 @@ public:
      */
     static const DWORD NET_OBJ_MAX_COUNT = WSA_MAXIMUM_WAIT_EVENTS - 1;
 
+    /** The load a network object put on its thread over the last sample. */
+    struct NetObjLoad
+    {
+        /** The network object. */
+        NetObjSPtr netObj;
+
+        /** The number of network events handled for the object per second. */
+        DWORD eventsPerSec;
+
+        /** The number of bytes the object received per second. */
+        ULONGLONG bytesRecvPerSec;
+    };
+
+    /** The load on a network thread over the last sample. */
+    struct Load
+    {
+        /**
+         * The percentage of the time the thread was busy rather than waiting
+         * for network events, polling counting as waiting.
+         */
+        int utilization;
+
+        /** The number of network events the thread handled per second. */
+        DWORD eventsPerSec;
+
+        /**
+         * The number of times per second the thread woke from waiting for
+         * network events.
+         */
+        DWORD wakeupsPerSec;
+
+        /**
+         * The number of bytes the thread's network objects received per
+         * second.
+         */
+        ULONGLONG bytesRecvPerSec;
+
+        /** The load each network object put on the thread. */
+        std::vector<NetObjLoad> netObjLoads;
+    };
+
+    /** What a network thread has done since it started. */
+    struct Totals
+    {
+        /**
+         * The number of times the thread woke from waiting for network
+         * events, for network events, timers or change requests.
+         */
+        ULONGLONG wakeups;
+
+        /** The number of network events the thread handled. */
+        ULONGLONG events;
+
+        /**
+         * The time in microseconds the thread spent waiting for network
+         * events, polling included.
+         */
+        ULONGLONG waitMicros;
+
+        /** The time in microseconds the thread spent busy. */
+        ULONGLONG busyMicros;
+
+        /** Of busyMicros, the time spent in onNetEvent() and onTimer(). */
+        ULONGLONG callbackMicros;
+
+        /** Of busyMicros, the time spent handling change requests. */
+        ULONGLONG changeMicros;
+    };
+
     /**
      * Creates a network thread object.
      *
+     * @param affinityMask the CPUs the thread associated with the object may
+     * run on, or 0 for any CPU.
+     * @param spinMicros how long in microseconds the thread associated with
+     * the object polls for network events before waiting, at most, or 0 to
+     * always wait.
+     * @param pool the pool to ask to rebalance its threads when this one is
+     * saturated, and to tell when a network object has been moved off this
+     * one, or 0 if network objects are never moved. The pool must outlive
+     * the thread associated with the object.
      * @param pNetThreadObj if the method was successful this will be set to
      * point to the network thread object that was created.
      * @return CL_ERR_OK if the method was successful, any other value
      * otherwise.
      */
-    static int create(NetThreadObj** pNetThreadObj);
+    static int create(DWORD_PTR affinityMask, DWORD spinMicros,
+        NetThreadPool* pool, NetThreadObj** pNetThreadObj);
 
     ~NetThreadObj();
 
@@ -50,6 +131,14 @@ public:
      */
     void addNetObj(const NetObjSPtr& netObj);
 
+    /**
+     * Adds the given network objects to this thread object, waking the thread
+     * only once for all of them.
+     *
+     * @param netObjs the network objects to add to this thread object.
+     */
+    void addNetObjs(const std::vector<NetObjSPtr>& netObjs);
+
     /**
      * Removes the given network object from this thread object.
      *
@@ -57,6 +146,33 @@ public:
      */
     void removeNetObj(const NetObjSPtr& netObj);
 
+    /**
+     * Removes the given network object from this thread object between two
+     * network events, then tells the pool so it can add the object to
+     * another thread object. The object's network event is left as it is,
+     * so any network events not yet handled are picked up, in order, by the
+     * thread that serves it next.
+     *
+     * @param netObj the network object to move off this thread object.
+     */
+    void migrateNetObj(const NetObjSPtr& netObj);
+
+    /**
+     * Gets the load on the thread associated with this object over the last
+     * sample, which is taken about once a second while it is busy.
+     *
+     * @param load this will be set to the load.
+     */
+    void getLoad(Load& load);
+
+    /**
+     * Gets what the thread associated with this object has done since it
+     * started. This does not lock the object.
+     *
+     * @param totals this will be set to the totals.
+     */
+    void getTotals(Totals& totals) const;
+
     /**
      * Signals the thread associated with this object that is should start
      * shutdown.
@@ -71,34 +187,85 @@ public:
      */
     inline bool isShutdown() const;
 
-    /**
-     * Waits until the thread associated with this object has completed
-     * shutdown or the time-out interval elapses.
-     *
-     * @param milliseconds the time-out interval in milliseconds.
-     * @return Whether or not the shutdown completed in the time-out interval.
-     */
-    bool waitForShutdown(DWORD milliseconds);
-
 private:
+    /** The kinds of network object change request. */
+    enum ChangeType
+    {
+        /** Add a network object to this thread object. */
+        CHANGE_ADD,
+
+        /** Remove a network object from this thread object. */
+        CHANGE_REMOVE,
+
+        /**
+         * Remove a network object from this thread object, then tell the pool
+         * so it can add the object to another.
+         */
+        CHANGE_MIGRATE
+    };
+
     /**
-     * Represents a network object change request, either an addition or a
-     * removal.
+     * Represents a network object change request, an addition, a removal or
+     * a move to another thread object.
      */
     struct ChangeRequest
     {
-        /**
-         * Are we adding a network object to this thread object or removing
-         * one?
-         */
-        bool add;
+        /** What is being done to the network object. */
+        ChangeType type;
 
-        /** The network object to add or remove. */
+        /** The network object to add, remove or move. */
         NetObjSPtr netObj;
     };
 
-    /** The first stage of construction. */
-    NetThreadObj();
+    /**
+     * The running totals behind Totals, in performance counts rather than
+     * microseconds. Only the thread associated with this object changes
+     * these, with interlocked operations, so any thread can read them with
+     * interlocked operations without locking.
+     */
+    struct Counters
+    {
+        /** The number of times the thread woke from waiting. */
+        volatile LONGLONG wakeupCount;
+
+        /** The number of network events the thread handled. */
+        volatile LONGLONG eventCount;
+
+        /** The time the thread spent waiting. */
+        volatile LONGLONG waitCounts;
+
+        /** The time the thread spent busy. */
+        volatile LONGLONG busyCounts;
+
+        /** The time the thread spent in onNetEvent() and onTimer(). */
+        volatile LONGLONG callbackCounts;
+
+        /** The time the thread spent handling change requests. */
+        volatile LONGLONG changeCounts;
+    };
+
+    /** What is counted for each network object between samples of the load. */
+    struct NetObjCounts
+    {
+        /** The number of network events handled since the last sample. */
+        DWORD eventCount;
+
+        /** The value of the object's bytesRecv() at the last sample. */
+        ULONGLONG bytesRecv;
+    };
+
+    /**
+     * The first stage of construction.
+     *
+     * @param affinityMask the CPUs the thread associated with this object may
+     * run on, or 0 for any CPU.
+     * @param spinMicros how long in microseconds the thread associated with
+     * this object polls for network events before waiting, at most.
+     * @param pool the pool this object belongs to, or 0 if network objects
+     * are never moved.
+     */
+    NetThreadObj(DWORD_PTR affinityMask, DWORD spinMicros,
+        NetThreadPool* pool);
 
     /**
      * The second stage of construction.
@@ -108,11 +275,96 @@ private:
      */
     int construct();
 
+    /**
+     * Returns how long the thread associated with this object can wait for a
+     * network event before a network object's timer is due.
+     *
+     * @return The wait interval in milliseconds, or WSA_INFINITE.
+     */
+    DWORD timerWaitInterval() const;
+
+    /**
+     * Waits for one of the network events to be signaled or a network
+     * object's timer to be due, polling the events for a while first if this
+     * object spins.
+     *
+     * @return The result of WSAWaitForMultipleEvents(), WSA_WAIT_TIMEOUT if a
+     * timer is due.
+     */
+    DWORD waitForNetEvents();
+
+    /**
+     * Calls onTimer() for the network objects whose timer is due, then trims
+     * the receive buffer pools if they are due to be trimmed.
+     */
+    void runDueTimers();
+
+    /**
+     * Adds and removes the network objects in the queue of change requests,
+     * telling the pool about those moved to another thread object.
+     */
+    void handleChangeRequests();
+
+    /**
+     * Samples the load on the thread associated with this object if it is
+     * time to, asking the pool to rebalance its threads if this one is
+     * saturated.
+     */
+    void sampleLoadIfDue();
+
     /** Synchronizes access to this object. */
     boost::mutex m_mutex;
 
-    /** The ID of the thread associated with this object. */
-    boost::thread::id m_threadId;
+    /**
+     * The CPUs the thread associated with this object may run on, or 0 for
+     * any CPU.
+     */
+    DWORD_PTR m_affinityMask;
+
+    /**
+     * The longest time in microseconds the thread associated with this object
+     * polls for network events before waiting, or 0 to always wait.
+     */
+    DWORD m_spinMicros;
+
+    /**
+     * How long in microseconds the thread associated with this object polls
+     * for network events next time, which shrinks while nothing is found.
+     */
+    DWORD m_crntSpinMicros;
+
+    /** The frequency of the performance counter in counts per second. */
+    LONGLONG m_perfFreq;
+
+    /**
+     * The pool this object belongs to, or 0 if network objects are never
+     * moved.
+     */
+    NetThreadPool* m_pool;
+
+    /** What the thread associated with this object has done so far. */
+    Counters m_counters;
+
+    /** The performance counter when the current sample of the load began. */
+    LONGLONG m_sampleStart;
+
+    /** The value of m_counters.waitCounts when the current sample began. */
+    LONGLONG m_sampleWaitCounts;
+
+    /** The value of m_counters.wakeupCount when the current sample began. */
+    LONGLONG m_sampleWakeupCount;
+
+    /** The number of network events handled since the current sample began. */
+    DWORD m_sampleEventCount;
+
+    /** The tick count when the load is next sampled. */
+    ULONGLONG m_nextSampleTick;
+
+    /**
+     * The load over the last sample. The thread associated with this object
+     * only locks m_mutex to change this, not to read it.
+     */
+    Load m_load;
 
     /**
      * The network events the thread associated with this object will wait on.
@@ -122,6 +374,12 @@ private:
     /** The network objects added to this thread object. */
     std::vector<NetObjSPtr> m_netObjs;
 
+    /**
+     * What has been counted for each network object since the last sample,
+     * in the same order as m_netObjs.
+     */
+    std::vector<NetObjCounts> m_netObjCounts;
+
     /** A queue of change requests for this thread object. */
     std::queue<ChangeRequest> m_changeRequests;
 
@@ -6,55 +6,137 @@
 #include "netthreadpool.h"
 #include <boost/thread/locks.hpp>
 #include <boost/thread/thread.hpp>
+#include <algorithm>
 #include <utility>
 #include "inc/comlib/comlib.h"
 
+// How often in ms at most a network object is moved between threads. This
+// leaves time for the threads to sample the load again after each move
+static const ULONGLONG REBALANCE_INTERVAL = 2000;
+
+// The least difference in utilization, as a percentage, between the busiest
+// thread and the least busy one that a network object is moved for
+static const int REBALANCE_MIN_GAP = 20;
+
+// The number of bytes received that count as much work for a thread as one
+// network event, when estimating how much of a thread's time each of its
+// network objects takes up
+static const ULONGLONG WORK_BYTES_PER_EVENT = 4096;
+
+NetThreadPool::NetThreadPool(const CLContextConfig& config) :
+m_threadCount(static_cast<DWORD>(config.threadCount)),
+m_affinityMask(static_cast<DWORD_PTR>(config.affinityMask)),
+m_spinMicros(config.spinMicros), m_pinThreads(config.pinThreads != 0),
+m_alignWithRss(config.pinThreads != 0 && config.alignWithRss != 0),
+m_rebalance(config.rebalance != 0), m_nextRebalance(0)
+{
+    if (m_pinThreads && m_affinityMask == 0)
+    {
+        // Pin threads to any of the CPUs the process may run on
+        DWORD_PTR systemAffinityMask = 0;
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &m_affinityMask,
+            &systemAffinityMask))
+        {
+            m_affinityMask = 0;
+        }
+    }
+}
+
 int NetThreadPool::addNetObj(const NetObjSPtr& netObj)
 {
     boost::lock_guard<boost::mutex> lock(m_mutex);
 
+    cleanupShuttingDownThreads();
+    return placeNetObj(netObj, 0);
+}
+
+int NetThreadPool::addNetObjs(const std::vector<NetObjSPtr>& netObjs,
+                              size_t* pAddedCount)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
     cleanupShuttingDownThreads();
     int err = CL_ERR_OK;
 
+    // Place every network object first, then hand each thread all of its
+    // objects at once so that it is only woken once for them
+    BulkAdds bulkAdds;
+    size_t addedCount = 0;
+    for (; addedCount < netObjs.size(); ++addedCount)
+    {
+        err = placeNetObj(netObjs[addedCount], &bulkAdds);
+        if (err != CL_ERR_OK)
+        {
+            break;
+        }
+    }
+
+    for (BulkAdds::iterator it = bulkAdds.begin(); it != bulkAdds.end(); ++it)
+    {
+        it->first->addNetObjs(it->second);
+    }
+
+    *pAddedCount = addedCount;
+    return err;
+}
+
+int NetThreadPool::placeNetObj(const NetObjSPtr& netObj, BulkAdds* bulkAdds)
+{
+    int err = CL_ERR_OK;
+
     // Find a thread that has not had the maximum number of network objects
-    // added to it and add the network object.
-    bool foundThread = false;
-    for (size_t i = m_threads.size(); !foundThread && i > 0; --i)
-    {
-        ThreadObjCountPair& aThreadObjCountPair = m_threads[i - 1];
-        if (*aThreadObjCountPair.count < NetThreadObj::NET_OBJ_MAX_COUNT)
-        {
-            aThreadObjCountPair.threadObj->addNetObj(netObj);
-            ++*aThreadObjCountPair.count;
-            std::pair<std::map<NetObjSPtr, ThreadObjCountPair>::iterator, bool>
-                insertResult = m_objToThreadMap.insert(
-                    std::make_pair(netObj, aThreadObjCountPair));
-            assert(insertResult.second);
-                // Socket obj cannot already have been added to a thread
+    // added to it and add the network object, preferring a thread on the
+    // object's receive side scaling CPU if asked to. If the objects are spread
+    // over a number of threads then start those threads first and after that
+    // pick the thread with the fewest objects.
+    bool foundThread = m_alignWithRss && addToRssThread(netObj, bulkAdds);
+    if (!foundThread && m_threadCount == 0)
+    {
+        for (size_t i = m_threads.size(); !foundThread && i > 0; --i)
+        {
+            if (*m_threads[i - 1].count < NetThreadObj::NET_OBJ_MAX_COUNT)
+            {
+                addToThread(netObj, m_threads[i - 1], bulkAdds);
+                foundThread = true;
+            }
+        }
+    }
+    else if (!foundThread && m_threads.size() >= m_threadCount)
+    {
+        size_t fewestIdx = 0;
+        for (size_t i = 1; i < m_threads.size(); ++i)
+        {
+            if (*m_threads[i].count < *m_threads[fewestIdx].count)
+            {
+                fewestIdx = i;
+            }
+        }
+        if (*m_threads[fewestIdx].count < NetThreadObj::NET_OBJ_MAX_COUNT)
+        {
+            addToThread(netObj, m_threads[fewestIdx], bulkAdds);
             foundThread = true;
         }
     }
 
-    // If all threads are full then create a new thread and add the network
-    // object to that.
+    // If all threads are full, or more are to be started, then create a new
+    // thread and add the network object to that.
     if (!foundThread)
     {
+        int cpu = m_pinThreads ? leastPinnedCpu() : -1;
         NetThreadObj* threadObj = 0;
-        err = NetThreadObj::create(&threadObj);
+        err = NetThreadObj::create((cpu >= 0) ?
+            (static_cast<DWORD_PTR>(1) << cpu) : m_affinityMask, m_spinMicros,
+            m_rebalance ? this : 0, &threadObj);
         if (err == CL_ERR_OK)
         {
             ThreadObjCountPair aThreadObjCountPair;
             aThreadObjCountPair.threadObj.reset(threadObj);
-            threadObj->addNetObj(netObj);
-            aThreadObjCountPair.count.reset(new DWORD(1));
+            aThreadObjCountPair.count.reset(new DWORD(0));
+            aThreadObjCountPair.cpu = cpu;
+            aThreadObjCountPair.thread.reset(new boost::thread(
+                &NetThreadObj::run, aThreadObjCountPair.threadObj));
             m_threads.push_back(aThreadObjCountPair);
-            std::pair<std::map<NetObjSPtr, ThreadObjCountPair>::iterator, bool>
-                insertResult = m_objToThreadMap.insert(
-                    std::make_pair(netObj, aThreadObjCountPair));
-            assert(insertResult.second);
-                // Socket obj cannot already have been added to a thread
-            boost::thread aThread(&NetThreadObj::run,
-                aThreadObjCountPair.threadObj);
+            addToThread(netObj, aThreadObjCountPair, bulkAdds);
         }
     }
 
@@ -73,80 +155,363 @@ void NetThreadPool::removeNetObj(const NetObjSPtr& netObj)
         m_objToThreadMap.find(netObj);
     if (objToThreadMapIt != m_objToThreadMap.end())
     {
-        objToThreadMapIt->second.threadObj->removeNetObj(netObj);
-        --*objToThreadMapIt->second.count;
-
-        // If the network object was the only one added to the thread then
-        // remove the thread
-        if (*objToThreadMapIt->second.count <= 0)
         {
-            std::vector<ThreadObjCountPair>::iterator threadsIt =
-                m_threads.begin();
-            for (; threadsIt != m_threads.end(); ++threadsIt)
-            {
-                if (threadsIt->threadObj == objToThreadMapIt->second.threadObj)
-                {
-                    // Found the thread in the m_threads container
-                    break;
-                }
-            }
-
-            if (threadsIt != m_threads.end())
-            {
-                threadsIt->threadObj->startShutdown();
-                m_shuttingDownThreads.push_back(threadsIt->threadObj);
-                m_threads.erase(threadsIt);
-            }
+            // If the network object is being moved to the thread then it
+            // will not be added to it after all
+            boost::lock_guard<boost::mutex> migrationLock(m_migrationMutex);
+            m_migratingObjs.erase(netObj);
         }
 
+        objToThreadMapIt->second.threadObj->removeNetObj(netObj);
+        releaseFromThread(objToThreadMapIt->second);
         m_objToThreadMap.erase(objToThreadMapIt);
     }
 }
 
+void NetThreadPool::removeAllNetObjs()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    {
+        boost::lock_guard<boost::mutex> migrationLock(m_migrationMutex);
+        m_migratingObjs.clear();
+    }
+
+    // Shut every thread down at once, each letting go of all of its network
+    // objects, rather than removing the objects from the threads one by one
+    for (size_t i = 0; i < m_threads.size(); ++i)
+    {
+        m_threads[i].threadObj->startShutdown();
+        m_shuttingDownThreads.push_back(m_threads[i]);
+    }
+    m_threads.clear();
+    m_objToThreadMap.clear();
+}
+
 bool NetThreadPool::waitForShutdown(DWORD milliseconds)
 {
     boost::lock_guard<boost::mutex> lock(m_mutex);
 
+    // Wait on the threads themselves, which are only signaled once they have
+    // exited, so that nothing they were doing is still going on afterwards. A
+    // thread cannot wait for itself to exit, so a network thread that called
+    // this method is left out and counted as not shut down.
+    std::vector<HANDLE> threadHandles;
     bool allThreadsShutdown = true;
-    DWORD timeOutInterval = milliseconds;
+    for (size_t i = 0; i < m_shuttingDownThreads.size(); ++i)
+    {
+        const boost::shared_ptr<boost::thread>& aThread =
+            m_shuttingDownThreads[i].thread;
+        if (aThread->get_id() == boost::this_thread::get_id())
+        {
+            allThreadsShutdown = false;
+        }
+        else
+        {
+            threadHandles.push_back(aThread->native_handle());
+        }
+    }
+
     DWORD startTickCount = GetTickCount();
+    for (size_t i = 0; i < threadHandles.size(); i += MAXIMUM_WAIT_OBJECTS)
+    {
+        DWORD elapsedInterval = GetTickCount() - startTickCount;
+        DWORD timeOutInterval = (elapsedInterval < milliseconds) ?
+            milliseconds - elapsedInterval : 0;
+        DWORD handleCount = static_cast<DWORD>((std::min)(
+            threadHandles.size() - i,
+            static_cast<size_t>(MAXIMUM_WAIT_OBJECTS)));
+        DWORD waitErr = WaitForMultipleObjects(handleCount, &threadHandles[i],
+            TRUE, timeOutInterval);
+        if (waitErr == WAIT_TIMEOUT || waitErr == WAIT_FAILED)
+        {
+            allThreadsShutdown = false;
+            break;
+        }
+    }
 
+    // Join and discard the threads that have exited
     for (size_t i = m_shuttingDownThreads.size(); i > 0; --i)
     {
-        std::vector<NetThreadObjSPtr>::iterator it =
+        std::vector<ThreadObjCountPair>::iterator it =
             m_shuttingDownThreads.begin() + (i - 1);
-        if ((*it)->waitForShutdown(timeOutInterval))
+        if (it->thread->get_id() != boost::this_thread::get_id() &&
+            WaitForSingleObject(it->thread->native_handle(), 0) ==
+                WAIT_OBJECT_0)
         {
+            it->thread->join();
             m_shuttingDownThreads.erase(it);
         }
-        else
+    }
+
+    return allThreadsShutdown;
+}
+
+int NetThreadPool::getThreadStats(CLNetThreadStats* pStats, int maxCount)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    for (size_t i = 0; i < m_threads.size() &&
+        i < static_cast<size_t>(maxCount); ++i)
+    {
+        const ThreadObjCountPair& aThreadObjCountPair = m_threads[i];
+        UCHAR node = 0;
+        pStats[i].cpu = aThreadObjCountPair.cpu;
+        pStats[i].numaNode = (aThreadObjCountPair.cpu >= 0 &&
+            GetNumaProcessorNode(static_cast<UCHAR>(aThreadObjCountPair.cpu),
+                &node)) ? node : -1;
+        pStats[i].socketCount = static_cast<int>(*aThreadObjCountPair.count);
+
+        NetThreadObj::Load load;
+        aThreadObjCountPair.threadObj->getLoad(load);
+        pStats[i].utilization = load.utilization;
+        pStats[i].eventsPerSec = load.eventsPerSec;
+        pStats[i].wakeupsPerSec = load.wakeupsPerSec;
+        pStats[i].bytesRecvPerSec = load.bytesRecvPerSec;
+
+        NetThreadObj::Totals totals;
+        aThreadObjCountPair.threadObj->getTotals(totals);
+        pStats[i].wakeups = totals.wakeups;
+        pStats[i].eventsHandled = totals.events;
+        pStats[i].waitMicros = totals.waitMicros;
+        pStats[i].busyMicros = totals.busyMicros;
+        pStats[i].callbackMicros = totals.callbackMicros;
+        pStats[i].changeMicros = totals.changeMicros;
+    }
+    return static_cast<int>(m_threads.size());
+}
+
+void NetThreadPool::rebalance()
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex, boost::try_to_lock);
+
+    // Do not hold up the thread that called this, which is a network thread,
+    // if the pool is busy
+    ULONGLONG now = GetTickCount64();
+    if (!lock.owns_lock() || m_threads.size() < 2 || now < m_nextRebalance)
+    {
+        return;
+    }
+    m_nextRebalance = now + REBALANCE_INTERVAL;
+
+    // Find the busiest thread and the least busy thread that has room
+    std::vector<NetThreadObj::Load> loads(m_threads.size());
+    size_t hotIdx = 0;
+    size_t coolIdx = m_threads.size();
+    for (size_t i = 0; i < m_threads.size(); ++i)
+    {
+        m_threads[i].threadObj->getLoad(loads[i]);
+        if (loads[i].utilization > loads[hotIdx].utilization)
         {
-            allThreadsShutdown = false;
+            hotIdx = i;
         }
-
-        DWORD elapsedInterval = GetTickCount() - startTickCount;
-        if (elapsedInterval < timeOutInterval)
+        if (*m_threads[i].count < NetThreadObj::NET_OBJ_MAX_COUNT &&
+            (coolIdx == m_threads.size() ||
+                loads[i].utilization < loads[coolIdx].utilization))
         {
-            timeOutInterval -= elapsedInterval;
+            coolIdx = i;
         }
-        else
+    }
+    if (coolIdx == m_threads.size() || coolIdx == hotIdx)
+    {
+        return;
+    }
+    int gap = loads[hotIdx].utilization - loads[coolIdx].utilization;
+    if (gap < REBALANCE_MIN_GAP)
+    {
+        return;
+    }
+
+    // Estimate how much of the busy thread's time each of its network objects
+    // takes up from its share of the work the thread does, then pick the one
+    // that comes closest to evening the two threads out. Moving an object
+    // that takes up the whole gap or more only moves the hot spot.
+    const std::vector<NetThreadObj::NetObjLoad>& netObjLoads =
+        loads[hotIdx].netObjLoads;
+    ULONGLONG totalWork = 0;
+    for (size_t i = 0; i < netObjLoads.size(); ++i)
+    {
+        totalWork += netObjLoads[i].eventsPerSec +
+            netObjLoads[i].bytesRecvPerSec / WORK_BYTES_PER_EVENT;
+    }
+    if (totalWork == 0)
+    {
+        return;
+    }
+
+    boost::lock_guard<boost::mutex> migrationLock(m_migrationMutex);
+
+    NetObjSPtr bestNetObj;
+    int bestDistance = gap;
+    for (size_t i = 0; i < netObjLoads.size(); ++i)
+    {
+        const NetObjSPtr& netObj = netObjLoads[i].netObj;
+        ULONGLONG work = netObjLoads[i].eventsPerSec +
+            netObjLoads[i].bytesRecvPerSec / WORK_BYTES_PER_EVENT;
+        int share = static_cast<int>(
+            loads[hotIdx].utilization * work / totalWork);
+        int distance = (share * 2 > gap) ? share * 2 - gap : gap - share * 2;
+        std::map<NetObjSPtr, ThreadObjCountPair>::const_iterator
+            objToThreadMapIt = m_objToThreadMap.find(netObj);
+        if (share > 0 && share < gap && distance < bestDistance &&
+            objToThreadMapIt != m_objToThreadMap.end() &&
+            objToThreadMapIt->second.threadObj ==
+                m_threads[hotIdx].threadObj &&
+            m_migratingObjs.find(netObj) == m_migratingObjs.end())
         {
-            timeOutInterval = 0;
+            bestNetObj = netObj;
+            bestDistance = distance;
         }
     }
+    if (bestNetObj.get() == 0)
+    {
+        return;
+    }
 
-    return allThreadsShutdown;
+    // Count the network object as added to the thread it is moving to
+    // straight away, so the thread it is moving from cannot run out of
+    // objects and shut down, and the other cannot fill up, in the meantime
+    ThreadObjCountPair& hotThread = m_threads[hotIdx];
+    ThreadObjCountPair& coolThread = m_threads[coolIdx];
+    --*hotThread.count;
+    ++*coolThread.count;
+    m_objToThreadMap[bestNetObj] = coolThread;
+    m_migratingObjs.insert(std::make_pair(bestNetObj, coolThread.threadObj));
+    hotThread.threadObj->migrateNetObj(bestNetObj);
+}
+
+void NetThreadPool::completeMigration(const NetObjSPtr& netObj)
+{
+    boost::lock_guard<boost::mutex> lock(m_migrationMutex);
+
+    std::map<NetObjSPtr, NetThreadObjSPtr>::iterator migratingObjsIt =
+        m_migratingObjs.find(netObj);
+    if (migratingObjsIt != m_migratingObjs.end())
+    {
+        migratingObjsIt->second->addNetObj(netObj);
+        m_migratingObjs.erase(migratingObjsIt);
+    }
 }
 
 void NetThreadPool::cleanupShuttingDownThreads()
 {
     for (size_t i = m_shuttingDownThreads.size(); i > 0; --i)
     {
-        std::vector<NetThreadObjSPtr>::iterator it =
+        std::vector<ThreadObjCountPair>::iterator it =
             m_shuttingDownThreads.begin() + (i - 1);
-        if ((*it)->isShutdown())
+        if (it->threadObj->isShutdown())
         {
+            // Only the last of the thread's return is left once it has
+            // signaled that it is shut down
+            it->thread->join();
             m_shuttingDownThreads.erase(it);
         }
     }
 }
+
+void NetThreadPool::releaseFromThread(
+    const ThreadObjCountPair& threadObjCountPair)
+{
+    --*threadObjCountPair.count;
+
+    // If the network object was the only one added to the thread then
+    // remove the thread
+    if (*threadObjCountPair.count <= 0)
+    {
+        std::vector<ThreadObjCountPair>::iterator threadsIt =
+            m_threads.begin();
+        for (; threadsIt != m_threads.end(); ++threadsIt)
+        {
+            if (threadsIt->threadObj == threadObjCountPair.threadObj)
+            {
+                // Found the thread in the m_threads container
+                break;
+            }
+        }
+
+        if (threadsIt != m_threads.end())
+        {
+            threadsIt->threadObj->startShutdown();
+            m_shuttingDownThreads.push_back(*threadsIt);
+            m_threads.erase(threadsIt);
+        }
+    }
+}
+
+void NetThreadPool::addToThread(const NetObjSPtr& netObj,
+    const ThreadObjCountPair& threadObjCountPair, BulkAdds* bulkAdds)
+{
+    if (bulkAdds != 0)
+    {
+        (*bulkAdds)[threadObjCountPair.threadObj].push_back(netObj);
+    }
+    else
+    {
+        threadObjCountPair.threadObj->addNetObj(netObj);
+    }
+    ++*threadObjCountPair.count;
+    std::pair<std::map<NetObjSPtr, ThreadObjCountPair>::iterator, bool>
+        insertResult = m_objToThreadMap.insert(
+            std::make_pair(netObj, threadObjCountPair));
+    assert(insertResult.second);
+        // Socket obj cannot already have been added to a thread
+}
+
+bool NetThreadPool::addToRssThread(const NetObjSPtr& netObj,
+                                   BulkAdds* bulkAdds)
+{
+    int rssCpu = netObj->rssCpu();
+    if (rssCpu < 0)
+    {
+        return false;
+    }
+
+    ThreadObjCountPair* fewestThread = 0;
+    for (size_t i = 0; i < m_threads.size(); ++i)
+    {
+        ThreadObjCountPair& aThreadObjCountPair = m_threads[i];
+        if (aThreadObjCountPair.cpu == rssCpu &&
+            *aThreadObjCountPair.count < NetThreadObj::NET_OBJ_MAX_COUNT &&
+            (fewestThread == 0 ||
+                *aThreadObjCountPair.count < *fewestThread->count))
+        {
+            fewestThread = &aThreadObjCountPair;
+        }
+    }
+
+    if (fewestThread == 0)
+    {
+        return false;
+    }
+    addToThread(netObj, *fewestThread, bulkAdds);
+    return true;
+}
+
+int NetThreadPool::leastPinnedCpu() const
+{
+    int leastCpu = -1;
+    size_t leastCount = 0;
+    for (int cpu = 0; cpu < static_cast<int>(sizeof(DWORD_PTR) * 8); ++cpu)
+    {
+        if ((m_affinityMask & (static_cast<DWORD_PTR>(1) << cpu)) == 0)
+        {
+            continue;
+        }
+
+        size_t pinnedCount = 0;
+        for (size_t i = 0; i < m_threads.size(); ++i)
+        {
+            if (m_threads[i].cpu == cpu)
+            {
+                ++pinnedCount;
+            }
+        }
+
+        if (leastCpu < 0 || pinnedCount < leastCount)
+        {
+            leastCpu = cpu;
+            leastCount = pinnedCount;
+        }
+    }
+    return leastCpu;
+}
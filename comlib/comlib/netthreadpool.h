@@ -9,9 +9,11 @@
 #include <windows.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/utility.hpp>
 #include <map>
 #include <vector>
+#include "inc/comlib/comlib.h"
 #include "netobj.h"
 #include "netthreadobj.h"
 
@@ -19,6 +21,15 @@
 class NetThreadPool : private boost::noncopyable
 {
 public:
+    /**
+     * Constructs a network thread pool. No threads are started until the
+     * first network object is added.
+     *
+     * @param config how the threads in this pool are set up, as described
+     * for CLContextConfig.
+     */
+    explicit NetThreadPool(const CLContextConfig& config);
+
     /**
      * Adds the given network object to a thread in this pool.
      *
@@ -28,6 +39,21 @@ public:
      */
     int addNetObj(const NetObjSPtr& netObj);
 
+    /**
+     * Adds the given network objects to the threads in this pool, as
+     * addNetObj() does for each, but waking each thread only once for all of
+     * the objects it is given.
+     *
+     * @param netObjs the network objects to add to this thread pool.
+     * @param pAddedCount this will be set to the number of network objects
+     * added, which are those at the start of netObjs. All are added if the
+     * method was successful.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int addNetObjs(const std::vector<NetObjSPtr>& netObjs,
+        size_t* pAddedCount);
+
     /**
      * Removes the given network object from the thread it was added to in this
      * pool. If the network object was the only one added to the thread then
@@ -38,8 +64,15 @@ public:
     void removeNetObj(const NetObjSPtr& netObj);
 
     /**
-     * Waits until all shutting down threads in this pool have completed
-     * shutdown or the time-out interval elapses.
+     * Removes every network object from this pool by starting the shutdown of
+     * all of its threads at once, each of which lets go of the network
+     * objects added to it.
+     */
+    void removeAllNetObjs();
+
+    /**
+     * Waits until all shutting down threads in this pool have exited or the
+     * time-out interval elapses, joining those that have exited.
      *
      * @param milliseconds the time-out interval in milliseconds.
      * @return Whether or not all shutting down threads in this pool completed
@@ -47,6 +80,36 @@ public:
      */
     bool waitForShutdown(DWORD milliseconds);
 
+    /**
+     * Gets statistics for each thread in this pool.
+     *
+     * @param pStats an array that will be filled in with the statistics of up
+     * to maxCount threads.
+     * @param maxCount the number of elements in the array.
+     * @return The number of threads in this pool, which may be more than
+     * maxCount.
+     */
+    int getThreadStats(CLNetThreadStats* pStats, int maxCount);
+
+    /**
+     * Moves a network object from the busiest thread in this pool to the
+     * least busy one that has room, if that evens their load out. This is
+     * called by a thread that is saturated, and does nothing if the pool is
+     * busy, or it has been called less than a second ago, as the threads'
+     * load will not show the last move yet.
+     */
+    void rebalance();
+
+    /**
+     * Adds a network object that a thread in this pool has removed itself,
+     * as asked by rebalance(), to the thread it is moving to, unless it has
+     * been removed from this pool since. This is called by the thread the
+     * network object is moving from.
+     *
+     * @param netObj the network object.
+     */
+    void completeMigration(const NetObjSPtr& netObj);
+
 private:
     /**
      * A network thread object and the number of network objects added to it.
@@ -58,14 +121,125 @@ private:
 
         /** The number of network objects added to the thread object. */
         boost::shared_ptr<DWORD> count;
+
+        /** The CPU the thread is pinned to, or -1 if it is not pinned. */
+        int cpu;
+
+        /** The thread running the thread object, joined once it exits. */
+        boost::shared_ptr<boost::thread> thread;
     };
 
+    /**
+     * The network objects to add to each thread once they have all been
+     * placed, see addNetObjs().
+     */
+    typedef std::map<NetThreadObjSPtr, std::vector<NetObjSPtr> > BulkAdds;
+
+    /**
+     * Picks a thread for the given network object, starting one if needed,
+     * and counts the object as added to it. m_mutex must be locked by the
+     * caller.
+     *
+     * @param netObj the network object to add.
+     * @param bulkAdds where to leave the network object to be added to the
+     * thread later, or NULL to add it straight away.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int placeNetObj(const NetObjSPtr& netObj, BulkAdds* bulkAdds);
+
     /** Discards any threads in this pool that have completed shutdown. */
     void cleanupShuttingDownThreads();
 
+    /**
+     * Counts one network object fewer as added to the given thread, starting
+     * its shutdown if it has none left.
+     *
+     * @param threadObjCountPair the thread.
+     */
+    void releaseFromThread(const ThreadObjCountPair& threadObjCountPair);
+
+    /**
+     * Adds the given network object to the given thread.
+     *
+     * @param netObj the network object to add.
+     * @param threadObjCountPair the thread to add the network object to.
+     * @param bulkAdds where to leave the network object to be added to the
+     * thread later, or NULL to add it straight away.
+     */
+    void addToThread(const NetObjSPtr& netObj,
+        const ThreadObjCountPair& threadObjCountPair, BulkAdds* bulkAdds);
+
+    /**
+     * Adds the given network object to the thread with the fewest objects
+     * of those pinned to the CPU receive side scaling processes the object's
+     * packets on, if there is one that has room.
+     *
+     * @param netObj the network object to add.
+     * @param bulkAdds where to leave the network object to be added to the
+     * thread later, or NULL to add it straight away.
+     * @return Whether or not the network object was added.
+     */
+    bool addToRssThread(const NetObjSPtr& netObj, BulkAdds* bulkAdds);
+
+    /**
+     * Returns the CPU to pin a new thread to, the one in m_affinityMask with
+     * the fewest threads pinned to it.
+     *
+     * @return The CPU, or -1 if m_affinityMask is 0.
+     */
+    int leastPinnedCpu() const;
+
+    /**
+     * The number of threads to spread network objects over, or 0 to fill
+     * each thread before starting another.
+     */
+    DWORD m_threadCount;
+
+    /**
+     * The CPUs the threads in this pool may run on, or 0 for any CPU. If
+     * threads are pinned this is never 0 unless the CPUs the process may run
+     * on could not be found.
+     */
+    DWORD_PTR m_affinityMask;
+
+    /**
+     * The longest time in microseconds the threads in this pool poll for
+     * network events before waiting, or 0 to always wait.
+     */
+    DWORD m_spinMicros;
+
+    /** Is each thread pinned to a single CPU in m_affinityMask? */
+    bool m_pinThreads;
+
+    /**
+     * Do network objects go to a thread pinned to the CPU receive side
+     * scaling processes their packets on, where there is one?
+     */
+    bool m_alignWithRss;
+
+    /** Are network objects moved off threads that are saturated? */
+    bool m_rebalance;
+
     /** Synchronizes access to this object. */
     boost::mutex m_mutex;
 
+    /** The tick count before which rebalance() does nothing. */
+    ULONGLONG m_nextRebalance;
+
+    /**
+     * Synchronizes access to m_migratingObjs. This may be locked while
+     * m_mutex is, but not the other way round.
+     */
+    boost::mutex m_migrationMutex;
+
+    /**
+     * A mapping from the network objects that are being moved between
+     * threads, and have not yet been removed from the thread they are moving
+     * from, to the thread object they are moving to.
+     */
+    std::map<NetObjSPtr, NetThreadObjSPtr> m_migratingObjs;
+
     /** The currently running network threads. */
     std::vector<ThreadObjCountPair> m_threads;
 
@@ -73,5 +247,5 @@ private:
     std::map<NetObjSPtr, ThreadObjCountPair> m_objToThreadMap;
 
     /** The threads in this pool that are in the process of shutting down. */
-    std::vector<NetThreadObjSPtr> m_shuttingDownThreads;
+    std::vector<ThreadObjCountPair> m_shuttingDownThreads;
 };
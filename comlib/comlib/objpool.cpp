@@ -0,0 +1,98 @@
+/**
+ * @file
+ * Defines the ObjPool class.
+ */
+
+#include "objpool.h"
+#include <boost/thread/locks.hpp>
+#include <malloc.h>
+#include <new>
+
+ObjPool::ObjPool(size_t blockSize, size_t blocksPerSlab) :
+m_freeHead(0), m_freeTail(0), m_freeCount(0),
+m_blockSize((blockSize + MEMORY_ALLOCATION_ALIGNMENT - 1) &
+    ~static_cast<size_t>(MEMORY_ALLOCATION_ALIGNMENT - 1)),
+m_blocksPerSlab(blocksPerSlab), m_minFreeCount(blocksPerSlab / 2),
+m_blocksInUse(0)
+{
+}
+
+ObjPool::~ObjPool()
+{
+    if (m_blocksInUse != 0)
+    {
+        return;
+    }
+
+    for (size_t slabIdx = 0; slabIdx < m_slabs.size(); ++slabIdx)
+    {
+        _aligned_free(m_slabs[slabIdx]);
+    }
+}
+
+void* ObjPool::alloc()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    // Rather than reuse a block freed only a moment ago, go to the heap for
+    // more blocks
+    if (m_freeCount <= m_minFreeCount)
+    {
+        allocSlab();
+    }
+
+    FreeBlock* block = m_freeHead;
+    m_freeHead = block->next;
+    if (m_freeHead == 0)
+    {
+        m_freeTail = 0;
+    }
+    --m_freeCount;
+    ++m_blocksInUse;
+    return block;
+}
+
+void ObjPool::free(void* block)
+{
+    if (block != NULL)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+
+        pushFree(block);
+        --m_blocksInUse;
+    }
+}
+
+void ObjPool::allocSlab()
+{
+    m_slabs.reserve(m_slabs.size() + 1);
+    char* slab = static_cast<char*>(_aligned_malloc(
+        m_blockSize * m_blocksPerSlab, MEMORY_ALLOCATION_ALIGNMENT));
+    if (slab == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    m_slabs.push_back(slab);
+
+    // Push the blocks in order, so they are handed out in address order
+    for (size_t blockIdx = 0; blockIdx < m_blocksPerSlab; ++blockIdx)
+    {
+        pushFree(slab + blockIdx * m_blockSize);
+    }
+}
+
+void ObjPool::pushFree(void* block)
+{
+    FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+    freeBlock->next = 0;
+    if (m_freeTail != 0)
+    {
+        m_freeTail->next = freeBlock;
+    }
+    else
+    {
+        m_freeHead = freeBlock;
+    }
+    m_freeTail = freeBlock;
+    ++m_freeCount;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file
+ * Declares the ObjPool class.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+#include <vector>
+
+/**
+ * A pool of fixed size blocks of memory for objects that are created and
+ * deleted often, such as the socket object for each connection. Blocks are
+ * carved from slabs of many blocks at once and, once freed, are kept on a
+ * free list for later allocations rather than going back to the heap.
+ *
+ * The least recently freed block is reused first, and at least half a slab of
+ * blocks is always left on the free list, so a block is only reused once that
+ * many other blocks have been allocated since it was freed. The addresses of
+ * socket objects are their handles, so this keeps a stale handle to a socket
+ * that has been deleted from finding the next socket created, as it would if
+ * the most recently freed block were reused first.
+ *
+ * Slabs are only returned to the heap when the pool is destroyed, and then
+ * only if every block has been freed. Otherwise they are left allocated, so a
+ * block freed afterwards, for example by a static object destroyed later,
+ * does no harm. A pool is thread safe.
+ */
+class ObjPool : private boost::noncopyable
+{
+public:
+    /**
+     * Constructs an object pool. No memory is allocated until the first
+     * block is.
+     *
+     * @param blockSize the size of each block, the largest object the pool
+     * can hold.
+     * @param blocksPerSlab the number of blocks allocated from the heap at
+     * once.
+     */
+    ObjPool(size_t blockSize, size_t blocksPerSlab);
+
+    ~ObjPool();
+
+    /**
+     * Allocates a block, throwing std::bad_alloc if there is not enough
+     * memory as operator new does.
+     *
+     * @return The block allocated.
+     */
+    void* alloc();
+
+    /**
+     * Returns a block allocated by alloc() to the pool.
+     *
+     * @param block the block to free, or NULL to do nothing.
+     */
+    void free(void* block);
+
+    /**
+     * Returns the size of each block.
+     *
+     * @return The size of each block.
+     */
+    size_t blockSize() const { return m_blockSize; }
+
+private:
+    /** A block on the free list, which holds the link to the next one. */
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    /**
+     * Allocates a new slab, putting all of its blocks on the end of the free
+     * list. m_mutex must be locked by the caller.
+     */
+    void allocSlab();
+
+    /**
+     * Puts a block on the end of the free list. m_mutex must be locked by the
+     * caller.
+     *
+     * @param block the block to put on the free list.
+     */
+    void pushFree(void* block);
+
+    /** Synchronizes access to the free list and the slabs. */
+    boost::mutex m_mutex;
+
+    /**
+     * The blocks that are free, least recently freed first, and the last of
+     * them.
+     */
+    FreeBlock* m_freeHead;
+    FreeBlock* m_freeTail;
+
+    /** The number of blocks on the free list. */
+    size_t m_freeCount;
+
+    /**
+     * The size of each block, rounded up so every block is aligned as memory
+     * from the heap is.
+     */
+    size_t m_blockSize;
+
+    /** The number of blocks allocated from the heap at once. */
+    size_t m_blocksPerSlab;
+
+    /** The fewest blocks left on the free list when one is allocated. */
+    size_t m_minFreeCount;
+
+    /** The number of blocks allocated and not yet freed. */
+    size_t m_blocksInUse;
+
+    /** The slabs allocated, freed when the pool is destroyed. */
+    std::vector<void*> m_slabs;
+};
@@ -0,0 +1,196 @@
+/**
+ * @file
+ * Defines the PendingTable class.
+ */
+
+#include "pendingtable.h"
+
+PendingTable::PendingTable() : m_slots(new Slot[SLOT_COUNT]),
+m_lastReqId(0), m_nextDeadline(static_cast<LONGLONG>(NO_DEADLINE))
+{
+    for (ULONG slotIdx = 0; slotIdx < SLOT_COUNT; ++slotIdx)
+    {
+        m_slots[slotIdx].state = SLOT_FREE;
+    }
+}
+
+PendingTable::~PendingTable()
+{
+    delete[] m_slots;
+}
+
+int PendingTable::add(CLPResponseRecvFn responseRecvFn, void* reqArg,
+                      DWORD timeout, CLRequestId* pReqId,
+                      bool* pEarlierDeadline)
+{
+    // Claim the slot of the next ID, skipping IDs whose slot is still in use
+    // by an older request
+    for (ULONG tryIdx = 0; tryIdx < SLOT_COUNT; ++tryIdx)
+    {
+        CLRequestId reqId =
+            static_cast<CLRequestId>(InterlockedIncrement(&m_lastReqId));
+        Slot& slot = m_slots[reqId % SLOT_COUNT];
+        if (InterlockedCompareExchange(&slot.state, SLOT_BUSY, SLOT_FREE) !=
+            SLOT_FREE)
+        {
+            continue;
+        }
+
+        slot.reqId = reqId;
+        slot.responseRecvFn = responseRecvFn;
+        slot.reqArg = reqArg;
+        slot.deadline = (timeout == INFINITE) ? NO_DEADLINE :
+            GetTickCount64() + timeout;
+
+        // The exchange is a full barrier, so the slot is filled in before
+        // anyone can see it is pending
+        InterlockedExchange(&slot.state, SLOT_PENDING);
+
+        *pReqId = reqId;
+        *pEarlierDeadline = (slot.deadline != NO_DEADLINE) &&
+            lowerNextDeadline(slot.deadline);
+        return CL_ERR_OK;
+    }
+
+    return CL_ERR_TOO_MANY_REQUESTS;
+}
+
+bool PendingTable::take(CLRequestId reqId, Completion* pCompletion)
+{
+    Slot& slot = m_slots[reqId % SLOT_COUNT];
+    if (slot.state != SLOT_PENDING || slot.reqId != reqId)
+    {
+        // Already completed, for example by its timeout
+        return false;
+    }
+
+    if (InterlockedCompareExchange(&slot.state, SLOT_BUSY, SLOT_PENDING) !=
+        SLOT_PENDING)
+    {
+        return false;
+    }
+
+    if (slot.reqId != reqId)
+    {
+        // The slot was reused by a newer request in the meantime
+        InterlockedExchange(&slot.state, SLOT_PENDING);
+        return false;
+    }
+
+    pCompletion->responseRecvFn = slot.responseRecvFn;
+    pCompletion->reqArg = slot.reqArg;
+    InterlockedExchange(&slot.state, SLOT_FREE);
+    return true;
+}
+
+void PendingTable::takeExpired(ULONGLONG now,
+                               std::vector<Completion>& completions)
+{
+    // Start the next deadline again from scratch. A request added during the
+    // scan either is seen by it or lowers the next deadline itself afterwards
+    InterlockedExchange64(&m_nextDeadline,
+        static_cast<LONGLONG>(NO_DEADLINE));
+
+    ULONGLONG nextDeadline = NO_DEADLINE;
+    for (ULONG slotIdx = 0; slotIdx < SLOT_COUNT; ++slotIdx)
+    {
+        Slot& slot = m_slots[slotIdx];
+        if (slot.state != SLOT_PENDING)
+        {
+            continue;
+        }
+
+        if (slot.deadline > now)
+        {
+            if (slot.deadline < nextDeadline)
+            {
+                nextDeadline = slot.deadline;
+            }
+            continue;
+        }
+
+        if (InterlockedCompareExchange(&slot.state, SLOT_BUSY,
+            SLOT_PENDING) != SLOT_PENDING)
+        {
+            continue;
+        }
+
+        if (slot.deadline > now)
+        {
+            // The request was completed and the slot reused by a newer one
+            // between reading the deadline and claiming the slot
+            ULONGLONG deadline = slot.deadline;
+            InterlockedExchange(&slot.state, SLOT_PENDING);
+            if (deadline < nextDeadline)
+            {
+                nextDeadline = deadline;
+            }
+            continue;
+        }
+
+        Completion completion;
+        completion.responseRecvFn = slot.responseRecvFn;
+        completion.reqArg = slot.reqArg;
+        InterlockedExchange(&slot.state, SLOT_FREE);
+        completions.push_back(completion);
+    }
+
+    if (nextDeadline != NO_DEADLINE)
+    {
+        lowerNextDeadline(nextDeadline);
+    }
+}
+
+void PendingTable::takeAll(std::vector<Completion>& completions)
+{
+    for (ULONG slotIdx = 0; slotIdx < SLOT_COUNT; ++slotIdx)
+    {
+        Completion completion;
+        if (m_slots[slotIdx].state == SLOT_PENDING &&
+            takeSlot(m_slots[slotIdx], &completion))
+        {
+            completions.push_back(completion);
+        }
+    }
+}
+
+ULONGLONG PendingTable::nextDeadline() const
+{
+    // Read all 64 bits at once, even on 32-bit Windows
+    return static_cast<ULONGLONG>(InterlockedCompareExchange64(
+        const_cast<volatile LONGLONG*>(&m_nextDeadline), 0, 0));
+}
+
+bool PendingTable::takeSlot(Slot& slot, Completion* pCompletion)
+{
+    if (InterlockedCompareExchange(&slot.state, SLOT_BUSY, SLOT_PENDING) !=
+        SLOT_PENDING)
+    {
+        return false;
+    }
+
+    pCompletion->responseRecvFn = slot.responseRecvFn;
+    pCompletion->reqArg = slot.reqArg;
+    InterlockedExchange(&slot.state, SLOT_FREE);
+    return true;
+}
+
+bool PendingTable::lowerNextDeadline(ULONGLONG deadline)
+{
+    for (;;)
+    {
+        ULONGLONG crntDeadline = nextDeadline();
+        if (deadline >= crntDeadline)
+        {
+            return false;
+        }
+
+        if (InterlockedCompareExchange64(&m_nextDeadline,
+            static_cast<LONGLONG>(deadline),
+            static_cast<LONGLONG>(crntDeadline)) ==
+            static_cast<LONGLONG>(crntDeadline))
+        {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,149 @@
+/**
+ * @file
+ * Declares the PendingTable class.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <boost/utility.hpp>
+#include <vector>
+#include "inc/comlib/comlib.h"
+
+/**
+ * Keeps track of the requests sent by a socket object that are waiting for a
+ * response. Requests are added by any thread and completed by the network
+ * thread without a lock: each request has a slot picked by its ID, and
+ * whoever moves the slot out of the pending state owns its completion.
+ */
+class PendingTable : private boost::noncopyable
+{
+public:
+    /** A request taken out of the table that needs completing. */
+    struct Completion
+    {
+        /** This will be called to complete the request. */
+        CLPResponseRecvFn responseRecvFn;
+
+        /** This will be passed back as is in the callback function. */
+        void* reqArg;
+    };
+
+    /** The value of nextDeadline() when no request has a timeout. */
+    static const ULONGLONG NO_DEADLINE = ~0ULL;
+
+    PendingTable();
+
+    ~PendingTable();
+
+    /**
+     * Adds a request to the table.
+     *
+     * @param responseRecvFn this will be called to complete the request.
+     * @param reqArg this will be passed back as is in the callback function.
+     * @param timeout how long in milliseconds to wait for the response, or
+     * INFINITE for no timeout.
+     * @param pReqId if the method was successful this will be set to the ID of
+     * the request.
+     * @param pEarlierDeadline if the method was successful this will be set to
+     * whether or not the request made nextDeadline() earlier.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int add(CLPResponseRecvFn responseRecvFn, void* reqArg, DWORD timeout,
+        CLRequestId* pReqId, bool* pEarlierDeadline);
+
+    /**
+     * Takes the given request out of the table if it is still waiting.
+     *
+     * @param reqId the ID of the request.
+     * @param pCompletion if the method was successful this will be filled in
+     * with how to complete the request.
+     * @return Whether or not the request was still waiting.
+     */
+    bool take(CLRequestId reqId, Completion* pCompletion);
+
+    /**
+     * Takes every request whose timeout has expired out of the table.
+     *
+     * @param now the current tick count.
+     * @param completions the expired requests are appended to this.
+     */
+    void takeExpired(ULONGLONG now, std::vector<Completion>& completions);
+
+    /**
+     * Takes every request out of the table.
+     *
+     * @param completions the requests are appended to this.
+     */
+    void takeAll(std::vector<Completion>& completions);
+
+    /**
+     * Returns the tick count when the earliest timeout expires.
+     *
+     * @return The tick count when the earliest timeout expires, or
+     * NO_DEADLINE if no request has a timeout.
+     */
+    ULONGLONG nextDeadline() const;
+
+private:
+    /** The maximum number of requests that can be waiting at once. */
+    static const ULONG SLOT_COUNT = 1024;
+
+    /** The states a slot moves between. */
+    enum SlotState
+    {
+        /** The slot is not in use. */
+        SLOT_FREE,
+        /** The slot is being filled in or emptied by whoever claimed it. */
+        SLOT_BUSY,
+        /** The slot holds a request waiting for a response. */
+        SLOT_PENDING
+    };
+
+    /** Holds one request. */
+    struct Slot
+    {
+        /** The state of the slot, one of the SlotState values. */
+        volatile LONG state;
+
+        /** The ID of the request. */
+        CLRequestId reqId;
+
+        /** This will be called to complete the request. */
+        CLPResponseRecvFn responseRecvFn;
+
+        /** This will be passed back as is in the callback function. */
+        void* reqArg;
+
+        /** The tick count when the timeout expires, or NO_DEADLINE. */
+        ULONGLONG deadline;
+    };
+
+    /**
+     * Takes the request out of the given slot if the slot is still pending.
+     *
+     * @param slot the slot to take the request out of.
+     * @param pCompletion if the method was successful this will be filled in
+     * with how to complete the request.
+     * @return Whether or not the slot was still pending.
+     */
+    bool takeSlot(Slot& slot, Completion* pCompletion);
+
+    /**
+     * Lowers m_nextDeadline to the given deadline if that is earlier.
+     *
+     * @param deadline the deadline to lower m_nextDeadline to.
+     * @return Whether or not m_nextDeadline was lowered.
+     */
+    bool lowerNextDeadline(ULONGLONG deadline);
+
+    /** The slots, indexed by request ID modulo SLOT_COUNT. */
+    Slot* m_slots;
+
+    /** The ID most recently given to a request. */
+    volatile LONG m_lastReqId;
+
+    /** The tick count when the earliest timeout expires, or NO_DEADLINE. */
+    volatile LONGLONG m_nextDeadline;
+};
@@ -1,2 +1,3 @@
 copy "%BOOST_ROOT%\lib\boost_date_time-vc80-mt-gd-1_37.dll" ..\debug\
 copy "%BOOST_ROOT%\lib\boost_thread-vc80-mt-gd-1_37.dll" ..\debug\
+copy ..\..\zlib128-dll\zlib1.dll ..\debug\
@@ -1,2 +1,3 @@
 copy "%BOOST_ROOT%\lib\boost_date_time-vc80-mt-1_37.dll" ..\release\
 copy "%BOOST_ROOT%\lib\boost_thread-vc80-mt-1_37.dll" ..\release\
+copy ..\..\zlib128-dll\zlib1.dll ..\release\
@@ -0,0 +1,367 @@
+/**
+ * @file
+ * Defines the RingMemory and RingChannel classes and the ring address
+ * functions.
+ */
+
+#include "ringchannel.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <boost/thread/locks.hpp>
+#include "inc/comlib/comlib.h"
+#include "inprocring.h"
+#include "shmring.h"
+
+// The mask that turns a free running ring position into an offset. The ring
+// capacity is a power of two so that this works after the position wraps
+static const ULONG RING_MASK = RingMemory::RING_CAPACITY - 1;
+
+RingMemory::RingMemory()
+{
+    for (int dir = 0; dir < DIR_COUNT; ++dir)
+    {
+        m_headers[dir] = 0;
+        m_data[dir] = 0;
+        m_dataEvents[dir] = NULL;
+        m_spaceEvents[dir] = NULL;
+    }
+}
+
+void RingMemory::layout(char* mem, bool init)
+{
+    assert((RING_CAPACITY & RING_MASK) == 0);
+
+    for (int dir = 0; dir < DIR_COUNT; ++dir)
+    {
+        m_headers[dir] = reinterpret_cast<RingHeader*>(mem) + dir;
+        m_data[dir] =
+            mem + DIR_COUNT * sizeof(RingHeader) + dir * RING_CAPACITY;
+
+        if (init)
+        {
+            memset(m_headers[dir], 0, sizeof(RingHeader));
+
+            // The consumer starts off idle so the first write wakes it up
+            m_headers[dir]->consumerWaiting = 1;
+        }
+    }
+}
+
+RingChannel::RingChannel(const RingMemorySPtr& memory, bool accepted) :
+m_memory(memory), m_sendDir(accepted ? 1 : 0), m_recvDir(accepted ? 0 : 1),
+m_closed(false), m_peerClosedTaken(false),
+m_nextPeerCheck(memory->peerCanExit() ?
+    GetTickCount64() + PEER_CHECK_INTERVAL : NetObj::NO_TIMER),
+m_peerExited(false)
+{
+}
+
+RingChannel::~RingChannel()
+{
+    close();
+}
+
+WSAEVENT RingChannel::netEvent() const
+{
+    return m_memory->dataEvent(m_recvDir);
+}
+
+void RingChannel::resetNetEvent()
+{
+    ResetEvent(m_memory->dataEvent(m_recvDir));
+}
+
+void RingChannel::signalNetEvent()
+{
+    SetEvent(m_memory->dataEvent(m_recvDir));
+}
+
+int RingChannel::send(const WSABUF* bufs, DWORD bufCount)
+{
+    boost::lock_guard<boost::mutex> lock(m_sendMutex);
+
+    RingHeader* header = m_memory->header(m_sendDir);
+    char* data = m_memory->data(m_sendDir);
+
+    for (DWORD bufIdx = 0; bufIdx < bufCount; ++bufIdx)
+    {
+        const char* buf = bufs[bufIdx].buf;
+        ULONG remaining = bufs[bufIdx].len;
+        while (remaining > 0)
+        {
+            if (m_closed || header->readerClosed != 0)
+            {
+                return WSAECONNRESET;
+            }
+
+            ULONG tail = static_cast<ULONG>(header->tail);
+            ULONG space = RingMemory::RING_CAPACITY -
+                (tail - static_cast<ULONG>(header->head));
+            if (space == 0)
+            {
+                // Make sure the consumer is working on what is already in the
+                // ring before waiting for it to make some space
+                wakeConsumer(m_sendDir);
+                InterlockedExchange(&header->producerWaiting, 1);
+                ULONG head = static_cast<ULONG>(header->head);
+                if (tail - head == RingMemory::RING_CAPACITY && !m_closed &&
+                    header->readerClosed == 0)
+                {
+                    WaitForSingleObject(m_memory->spaceEvent(m_sendDir),
+                        SPACE_WAIT_INTERVAL);
+                }
+                continue;
+            }
+
+            // Copy in up to two pieces, as the free space may wrap around the
+            // end of the ring
+            ULONG len = (std::min)(space, remaining);
+            ULONG offset = tail & RING_MASK;
+            ULONG firstLen =
+                (std::min)(len, RingMemory::RING_CAPACITY - offset);
+            memcpy(data + offset, buf, firstLen);
+            memcpy(data, buf + firstLen, len - firstLen);
+
+            // The data must be visible before the new tail is
+            MemoryBarrier();
+            header->tail = static_cast<LONG>(tail + len);
+
+            buf += len;
+            remaining -= len;
+        }
+    }
+
+    wakeConsumer(m_sendDir);
+    return CL_ERR_OK;
+}
+
+int RingChannel::trySend(const WSABUF* bufs, DWORD bufCount)
+{
+    boost::unique_lock<boost::mutex> lock(m_sendMutex, boost::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        // Another thread is sending, and may be waiting for space
+        return WSAEWOULDBLOCK;
+    }
+
+    RingHeader* header = m_memory->header(m_sendDir);
+    char* data = m_memory->data(m_sendDir);
+
+    if (m_closed || header->readerClosed != 0)
+    {
+        return WSAECONNRESET;
+    }
+
+    ULONG len = 0;
+    for (DWORD bufIdx = 0; bufIdx < bufCount; ++bufIdx)
+    {
+        len += bufs[bufIdx].len;
+    }
+
+    ULONG tail = static_cast<ULONG>(header->tail);
+    ULONG space = RingMemory::RING_CAPACITY -
+        (tail - static_cast<ULONG>(header->head));
+    if (space < len)
+    {
+        return WSAEWOULDBLOCK;
+    }
+
+    // Copy each buffer in up to two pieces, as the free space may wrap around
+    // the end of the ring
+    ULONG newTail = tail;
+    for (DWORD bufIdx = 0; bufIdx < bufCount; ++bufIdx)
+    {
+        ULONG bufLen = bufs[bufIdx].len;
+        ULONG offset = newTail & RING_MASK;
+        ULONG firstLen =
+            (std::min)(bufLen, RingMemory::RING_CAPACITY - offset);
+        memcpy(data + offset, bufs[bufIdx].buf, firstLen);
+        memcpy(data, bufs[bufIdx].buf + firstLen, bufLen - firstLen);
+        newTail += bufLen;
+    }
+
+    // The data must be visible before the new tail is
+    MemoryBarrier();
+    header->tail = static_cast<LONG>(newTail);
+
+    wakeConsumer(m_sendDir);
+    return CL_ERR_OK;
+}
+
+int RingChannel::recv(char* buf, int len, int& bytesRecv)
+{
+    bytesRecv = 0;
+
+    RingHeader* header = m_memory->header(m_recvDir);
+    const char* data = m_memory->data(m_recvDir);
+
+    ULONG head = static_cast<ULONG>(header->head);
+    ULONG avail = static_cast<ULONG>(header->tail) - head;
+    if (avail == 0)
+    {
+        return WSAEWOULDBLOCK;
+    }
+
+    // The tail must be read before the data it covers is
+    MemoryBarrier();
+
+    ULONG recvLen = (std::min)(avail, static_cast<ULONG>(len));
+    ULONG offset = head & RING_MASK;
+    ULONG firstLen =
+        (std::min)(recvLen, RingMemory::RING_CAPACITY - offset);
+    memcpy(buf, data + offset, firstLen);
+    memcpy(buf + firstLen, data, recvLen - firstLen);
+
+    // The data must be copied out before the space is handed back
+    MemoryBarrier();
+    header->head = static_cast<LONG>(head + recvLen);
+
+    wakeProducer(m_recvDir);
+
+    bytesRecv = static_cast<int>(recvLen);
+    return CL_ERR_OK;
+}
+
+bool RingChannel::hasData() const
+{
+    const RingHeader* header = m_memory->header(m_recvDir);
+    return header->tail != header->head;
+}
+
+void RingChannel::armWakeup()
+{
+    // The exchange is a full barrier, so either the producer sees the flag or
+    // this sees the producer's data, never neither
+    InterlockedExchange(&m_memory->header(m_recvDir)->consumerWaiting, 1);
+    if (hasData())
+    {
+        signalNetEvent();
+    }
+}
+
+bool RingChannel::takePeerClosed()
+{
+    if (m_peerClosedTaken ||
+        m_memory->header(m_recvDir)->writerClosed == 0 || hasData())
+    {
+        return false;
+    }
+
+    m_peerClosedTaken = true;
+    return true;
+}
+
+void RingChannel::close()
+{
+    if (m_closed)
+    {
+        return;
+    }
+    m_closed = true;
+
+    // Tell the other end that no more data is coming and that no more data
+    // will be read, waking both its receiver and any blocked sender
+    InterlockedExchange(&m_memory->header(m_sendDir)->writerClosed, 1);
+    InterlockedExchange(&m_memory->header(m_recvDir)->readerClosed, 1);
+    SetEvent(m_memory->dataEvent(m_sendDir));
+    SetEvent(m_memory->spaceEvent(m_recvDir));
+
+    // Wake any sender of this end that is blocked waiting for space
+    SetEvent(m_memory->spaceEvent(m_sendDir));
+}
+
+bool RingChannel::isClosed() const
+{
+    return m_closed;
+}
+
+ULONGLONG RingChannel::peerCheckDeadline() const
+{
+    if (m_closed || m_peerExited ||
+        m_memory->header(m_recvDir)->writerClosed != 0)
+    {
+        return NetObj::NO_TIMER;
+    }
+    return m_nextPeerCheck;
+}
+
+void RingChannel::checkPeer(ULONGLONG now)
+{
+    if (peerCheckDeadline() > now)
+    {
+        return;
+    }
+    m_nextPeerCheck = now + PEER_CHECK_INTERVAL;
+
+    if (!m_memory->peerExited(m_recvDir))
+    {
+        return;
+    }
+    m_peerExited = true;
+
+    // A process that exits never closes its end, so close it on its behalf:
+    // no more data is coming and no more data will be read. Wake this end's
+    // receiver to report the close, and any sender blocked waiting for space
+    InterlockedExchange(&m_memory->header(m_recvDir)->writerClosed, 1);
+    InterlockedExchange(&m_memory->header(m_sendDir)->readerClosed, 1);
+    SetEvent(m_memory->dataEvent(m_recvDir));
+    SetEvent(m_memory->spaceEvent(m_sendDir));
+}
+
+bool RingChannel::peerExited() const
+{
+    return m_peerExited;
+}
+
+void RingChannel::wakeConsumer(int dir)
+{
+    RingHeader* header = m_memory->header(dir);
+
+    // The new tail must be visible before the flag is checked
+    MemoryBarrier();
+    if (header->consumerWaiting != 0 &&
+        InterlockedExchange(&header->consumerWaiting, 0) != 0)
+    {
+        SetEvent(m_memory->dataEvent(dir));
+    }
+}
+
+void RingChannel::wakeProducer(int dir)
+{
+    RingHeader* header = m_memory->header(dir);
+
+    // The new head must be visible before the flag is checked
+    MemoryBarrier();
+    if (header->producerWaiting != 0 &&
+        InterlockedExchange(&header->producerWaiting, 0) != 0)
+    {
+        SetEvent(m_memory->spaceEvent(dir));
+    }
+}
+
+bool isRingAddr(const char* addr)
+{
+    return isShmAddr(addr) || isInprocAddr(addr);
+}
+
+int createRingListener(const char* addr, int conBacklog,
+    RingListener** pListener)
+{
+    assert(isRingAddr(addr));
+    if (isInprocAddr(addr))
+    {
+        return InprocListener::create(addr, conBacklog, pListener);
+    }
+    return ShmListener::create(addr, conBacklog, pListener);
+}
+
+int connectRingChannel(const char* addr, RingChannel** pChannel)
+{
+    assert(isRingAddr(addr));
+    if (isInprocAddr(addr))
+    {
+        return InprocListener::connect(addr, pChannel);
+    }
+    return ShmListener::connect(addr, pChannel);
+}
@@ -0,0 +1,414 @@
+/**
+ * @file
+ * Declares the RingHeader structure and the RingMemory, RingChannel and
+ * RingListener classes.
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+#include "netobj.h"
+
+/**
+ * The control block of a single producer, single consumer ring of bytes. The
+ * producer and consumer positions are free running counters, so the number of
+ * bytes in the ring is always tail - head even after the counters wrap. Each
+ * counter is on its own cache line so that the producer and consumer do not
+ * contend.
+ */
+struct RingHeader
+{
+    /** The number of bytes the consumer has read. */
+    volatile LONG head;
+    char headPad[60];
+
+    /** The number of bytes the producer has written. */
+    volatile LONG tail;
+    char tailPad[60];
+
+    /**
+     * Set by the consumer when it has run out of data and needs to be woken
+     * up when more arrives.
+     */
+    volatile LONG consumerWaiting;
+
+    /**
+     * Set by the producer when the ring is full and it needs to be woken up
+     * when space becomes available.
+     */
+    volatile LONG producerWaiting;
+
+    /** Set when the producer has closed its end of the ring. */
+    volatile LONG writerClosed;
+
+    /** Set when the consumer has closed its end of the ring. */
+    volatile LONG readerClosed;
+
+    /**
+     * The ID of the producer's process, or 0 if the ring memory does not
+     * record it.
+     */
+    volatile LONG writerProcessId;
+    char flagsPad[44];
+};
+
+/**
+ * The memory and wakeup events shared by the two ends of a ring connection.
+ * There is one ring per direction: direction 0 carries data from the end that
+ * connected to the end that accepted, direction 1 carries data back. Derived
+ * classes decide where the memory and events live.
+ */
+class RingMemory : private boost::noncopyable
+{
+public:
+    /** The number of bytes in the ring for each direction. */
+    static const ULONG RING_CAPACITY = 256 * 1024;
+
+    /** The number of directions, and so rings, in a ring connection. */
+    static const int DIR_COUNT = 2;
+
+    virtual ~RingMemory() {}
+
+    /**
+     * Can the other end of the connection be in a process that exits without
+     * closing its end?
+     *
+     * @return Whether or not peerExited() needs checking.
+     */
+    virtual bool peerCanExit() const { return false; }
+
+    /**
+     * Has the process of the producer of the ring for the given direction
+     * exited? This is only called by one thread at a time.
+     *
+     * @param dir the direction.
+     * @return Whether or not the producer's process has exited.
+     */
+    virtual bool peerExited(int dir) { return false; }
+
+    /**
+     * Returns the control block of the ring for the given direction.
+     *
+     * @param dir the direction.
+     * @return The control block of the ring.
+     */
+    RingHeader* header(int dir) const { return m_headers[dir]; }
+
+    /**
+     * Returns the data of the ring for the given direction, which is
+     * RING_CAPACITY bytes long.
+     *
+     * @param dir the direction.
+     * @return The data of the ring.
+     */
+    char* data(int dir) const { return m_data[dir]; }
+
+    /**
+     * Returns the manual-reset event that is signaled when data is written to
+     * the ring for the given direction while its consumer is waiting.
+     *
+     * @param dir the direction.
+     * @return The data event for the ring.
+     */
+    HANDLE dataEvent(int dir) const { return m_dataEvents[dir]; }
+
+    /**
+     * Returns the auto-reset event that is signaled when data is read from
+     * the ring for the given direction while its producer is waiting.
+     *
+     * @param dir the direction.
+     * @return The space event for the ring.
+     */
+    HANDLE spaceEvent(int dir) const { return m_spaceEvents[dir]; }
+
+protected:
+    /** The first stage of construction. */
+    RingMemory();
+
+    /**
+     * Points the ring control blocks and data at the given block of memory,
+     * which must be at least TOTAL_SIZE bytes long, and initializes the
+     * control blocks if required.
+     *
+     * @param mem the memory to use.
+     * @param init whether or not the control blocks should be initialized.
+     */
+    void layout(char* mem, bool init);
+
+    /** The size of the memory block passed to layout(). */
+    static const ULONG TOTAL_SIZE =
+        DIR_COUNT * (sizeof(RingHeader) + RING_CAPACITY);
+
+    /** The ring control blocks, indexed by direction. */
+    RingHeader* m_headers[DIR_COUNT];
+
+    /** The ring data, indexed by direction. */
+    char* m_data[DIR_COUNT];
+
+    /** The data events, indexed by direction. */
+    HANDLE m_dataEvents[DIR_COUNT];
+
+    /** The space events, indexed by direction. */
+    HANDLE m_spaceEvents[DIR_COUNT];
+};
+
+/** A shared pointer to ring memory. */
+typedef boost::shared_ptr<RingMemory> RingMemorySPtr;
+
+/**
+ * One end of a ring connection, providing a byte stream much like a connected
+ * TCP socket but without any system calls on the data path. Data is copied
+ * straight into the peer's ring, and the peer's event is only signaled when
+ * the peer has run out of data and is waiting for more.
+ *
+ * Any number of threads may send at the same time, but only one thread may
+ * receive at a time.
+ */
+class RingChannel : private boost::noncopyable
+{
+public:
+    /**
+     * Creates one end of a ring connection.
+     *
+     * @param memory the memory shared with the other end.
+     * @param accepted false for the end that connected, true for the end that
+     * accepted the connection.
+     */
+    RingChannel(const RingMemorySPtr& memory, bool accepted);
+
+    /** Closes this end if it is still open. */
+    ~RingChannel();
+
+    /**
+     * Returns the event that is signaled when this end has data to receive or
+     * the other end has closed.
+     *
+     * @return The network event for this end.
+     */
+    WSAEVENT netEvent() const;
+
+    /** Resets the network event before pending data is processed. */
+    void resetNetEvent();
+
+    /** Signals the network event so that this end is processed again. */
+    void signalNetEvent();
+
+    /**
+     * Sends the contents of the given buffers as one contiguous piece of data,
+     * waiting for space in the ring if required.
+     *
+     * @param bufs the buffers to send.
+     * @param bufCount the number of buffers.
+     * @return CL_ERR_OK if all the data was sent, any other value otherwise.
+     */
+    int send(const WSABUF* bufs, DWORD bufCount);
+
+    /**
+     * Sends the contents of the given buffers as one contiguous piece of data,
+     * as send() does, but only if that can be done without waiting, either
+     * for space in the ring or for another thread that is sending.
+     *
+     * @param bufs the buffers to send.
+     * @param bufCount the number of buffers.
+     * @return CL_ERR_OK if all the data was sent, WSAEWOULDBLOCK if none of
+     * it could be sent without waiting, any other value otherwise.
+     */
+    int trySend(const WSABUF* bufs, DWORD bufCount);
+
+    /**
+     * Receives as much data as is available without waiting.
+     *
+     * @param buf the buffer to receive data into.
+     * @param len the length of the buffer.
+     * @param bytesRecv this will be set to the number of bytes received.
+     * @return CL_ERR_OK if some data was received, WSAEWOULDBLOCK if there was
+     * no data to receive, any other value otherwise.
+     */
+    int recv(char* buf, int len, int& bytesRecv);
+
+    /**
+     * Is there data to receive?
+     *
+     * @return Whether or not there is data to receive.
+     */
+    bool hasData() const;
+
+    /**
+     * Tells the other end that this end is about to wait on the network event
+     * for more data. If data arrived in the meantime the network event is
+     * signaled so that it is not missed.
+     */
+    void armWakeup();
+
+    /**
+     * Returns true, once only, when the other end has closed and all of the
+     * data it sent has been received.
+     *
+     * @return Whether or not the close of the other end needs reporting.
+     */
+    bool takePeerClosed();
+
+    /** Closes this end, which wakes both ends up. */
+    void close();
+
+    /**
+     * Returns the tick count, as given by GetTickCount64(), when checkPeer()
+     * next needs to be called.
+     *
+     * @return The tick count, or NetObj::NO_TIMER if the other end cannot
+     * exit without closing or the connection has closed.
+     */
+    ULONGLONG peerCheckDeadline() const;
+
+    /**
+     * Checks whether the process of the other end has exited without closing
+     * its end, in which case its end is closed on its behalf. This wakes this
+     * end's receiver, to report the close, and any blocked sender. Only the
+     * network thread serving this end calls this.
+     *
+     * @param now the current tick count.
+     */
+    void checkPeer(ULONGLONG now);
+
+    /**
+     * Did the other end's process exit without closing its end?
+     *
+     * @return Whether or not the other end's process exited.
+     */
+    bool peerExited() const;
+
+    /**
+     * Has this end been closed?
+     *
+     * @return Whether or not this end has been closed.
+     */
+    bool isClosed() const;
+
+private:
+    /** How long in ms a sender waits for space before checking again. */
+    static const DWORD SPACE_WAIT_INTERVAL = 100;
+
+    /**
+     * How often in ms the network thread checks whether the other end's
+     * process has exited.
+     */
+    static const ULONGLONG PEER_CHECK_INTERVAL = 1000;
+
+    /**
+     * Signals the consumer of the given ring if it is waiting for data.
+     *
+     * @param dir the direction of the ring.
+     */
+    void wakeConsumer(int dir);
+
+    /**
+     * Signals the producer of the given ring if it is waiting for space.
+     *
+     * @param dir the direction of the ring.
+     */
+    void wakeProducer(int dir);
+
+    /** The memory shared with the other end. */
+    RingMemorySPtr m_memory;
+
+    /** The direction of the ring this end sends on. */
+    int m_sendDir;
+
+    /** The direction of the ring this end receives on. */
+    int m_recvDir;
+
+    /** Serializes senders, as each ring has a single producer. */
+    boost::mutex m_sendMutex;
+
+    /** This is set when close() has been called. */
+    volatile bool m_closed;
+
+    /** This is set when takePeerClosed() has returned true. */
+    bool m_peerClosedTaken;
+
+    /** The tick count when checkPeer() is next due, or NetObj::NO_TIMER. */
+    ULONGLONG m_nextPeerCheck;
+
+    /** This is set when checkPeer() finds the other end's process exited. */
+    volatile bool m_peerExited;
+};
+
+/**
+ * Listens for ring connections. This plays the part of a listening socket for
+ * a server socket object with a ring address.
+ */
+class RingListener : private boost::noncopyable
+{
+public:
+    virtual ~RingListener() {}
+
+    /**
+     * Returns the event that is signaled when a connection is pending.
+     *
+     * @return The network event for this listener.
+     */
+    virtual WSAEVENT netEvent() const = 0;
+
+    /**
+     * Resets the network event before the pending connection callback is
+     * called. As with FD_ACCEPT, the event is signaled again by accept() if
+     * there are still connections pending.
+     */
+    virtual void resetNetEvent() = 0;
+
+    /**
+     * Accepts a pending connection.
+     *
+     * @param pChannel if the method was successful this will be set to point
+     * to the accepting end of the connection.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    virtual int accept(RingChannel** pChannel) = 0;
+
+    /**
+     * Stops listening. Connections that are still pending are closed.
+     */
+    virtual void close() = 0;
+
+    /**
+     * Has this listener been closed?
+     *
+     * @return Whether or not this listener has been closed.
+     */
+    virtual bool isClosed() const = 0;
+};
+
+/**
+ * Does the given address specify a ring connection rather than a socket?
+ *
+ * @param addr the address to check.
+ * @return Whether or not the given address specifies a ring connection.
+ */
+bool isRingAddr(const char* addr);
+
+/**
+ * Creates a listener for the given ring address.
+ *
+ * @param addr the ring address to listen on.
+ * @param conBacklog the maximum number of pending connections.
+ * @param pListener if the function was successful this will be set to point to
+ * the listener that was created.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+int createRingListener(const char* addr, int conBacklog,
+    RingListener** pListener);
+
+/**
+ * Connects to the listener for the given ring address.
+ *
+ * @param addr the ring address to connect to.
+ * @param pChannel if the function was successful this will be set to point to
+ * the connecting end of the connection.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+int connectRingChannel(const char* addr, RingChannel** pChannel);
@@ -0,0 +1,163 @@
+/**
+ * @file
+ * Defines the SendLinger class.
+ */
+
+#include "sendlinger.h"
+#include <algorithm>
+#include <climits>
+#include <list>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "debug.h"
+#include "inc/comlib/comlib.h"
+
+// The longest time in ms the thread waits for room to write before looking
+// for sockets handed over since
+static const ULONGLONG POLL_MS = 10;
+
+namespace
+{
+    // A socket with data still to be written. sentLen bytes of data have
+    // been written so far
+    struct LingeringSocket
+    {
+        SOCKET socket;
+        std::vector<char> data;
+        size_t sentLen;
+        ULONGLONG deadline;
+    };
+}
+
+// Synchronizes access to s_added and s_running
+static boost::mutex s_mutex;
+// Notified when the thread exits with no socket left
+static boost::condition_variable s_idleCondVar;
+// The sockets handed over that the thread has not taken yet
+static std::list<LingeringSocket> s_added;
+// Is the thread running?
+static bool s_running = false;
+
+// Writes as much of the socket's data as it takes, returning CL_ERR_OK once
+// all of it has been written
+static int writeLingering(LingeringSocket& lingering)
+{
+    while (lingering.sentLen < lingering.data.size())
+    {
+        size_t len = (std::min)(lingering.data.size() - lingering.sentLen,
+            static_cast<size_t>(INT_MAX));
+        int sendRetVal = send(lingering.socket,
+            &lingering.data[lingering.sentLen], static_cast<int>(len), 0);
+        if (sendRetVal == SOCKET_ERROR)
+        {
+            return WSAGetLastError();
+        }
+        lingering.sentLen += sendRetVal;
+    }
+
+    return CL_ERR_OK;
+}
+
+void SendLinger::add(SOCKET socket, std::vector<char>& data,
+                     ULONGLONG deadline)
+{
+    boost::lock_guard<boost::mutex> lock(s_mutex);
+
+    s_added.push_back(LingeringSocket());
+    LingeringSocket& lingering = s_added.back();
+    lingering.socket = socket;
+    lingering.data.swap(data);
+    lingering.sentLen = 0;
+    lingering.deadline = deadline;
+
+    if (!s_running)
+    {
+        s_running = true;
+        boost::thread aThread(run);
+    }
+}
+
+bool SendLinger::waitForIdle(DWORD milliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(s_mutex);
+
+    boost::system_time waitEnd = boost::get_system_time() +
+        boost::posix_time::milliseconds(milliseconds);
+    while (s_running)
+    {
+        if (!s_idleCondVar.timed_wait(lock, waitEnd))
+        {
+            return !s_running;
+        }
+    }
+
+    return true;
+}
+
+void SendLinger::run()
+{
+    std::list<LingeringSocket> sockets;
+
+    for (;;)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(s_mutex);
+
+            sockets.splice(sockets.end(), s_added);
+            if (sockets.empty())
+            {
+                s_running = false;
+                s_idleCondVar.notify_all();
+                return;
+            }
+        }
+
+        // Write what each socket takes, closing those that are done with
+        ULONGLONG now = GetTickCount64();
+        ULONGLONG waitMs = POLL_MS;
+        fd_set writeFds;
+        FD_ZERO(&writeFds);
+        size_t writeFdCount = 0;
+        std::list<LingeringSocket>::iterator it = sockets.begin();
+        while (it != sockets.end())
+        {
+            int err = writeLingering(*it);
+            if (err == WSAEWOULDBLOCK && now < it->deadline)
+            {
+                waitMs = (std::min)(waitMs, it->deadline - now);
+                if (writeFdCount < FD_SETSIZE)
+                {
+                    FD_SET(it->socket, &writeFds);
+                    ++writeFdCount;
+                }
+                ++it;
+                continue;
+            }
+
+            if (err == CL_ERR_OK)
+            {
+                // Let the other end read to the end of the data before the
+                // connection closes
+                shutdown(it->socket, SD_SEND);
+            }
+            else
+            {
+                OUTPUT_FMT_DEBUG_STRING("Send queue discarded on close, "
+                    "bytes=" << it->data.size() - it->sentLen << ", error "
+                    << err);
+            }
+            closesocket(it->socket);
+            it = sockets.erase(it);
+        }
+
+        if (writeFdCount != 0)
+        {
+            timeval timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = static_cast<long>(waitMs * 1000);
+            select(0, NULL, &writeFds, NULL, &timeout);
+        }
+    }
+}
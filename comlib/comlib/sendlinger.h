@@ -0,0 +1,50 @@
+/**
+ * @file
+ * Declares the SendLinger class.
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <vector>
+
+/**
+ * Finishes writing the data still queued on sockets that have been closed, in
+ * the background, so that closing a socket never waits for the other end to
+ * take it. A thread is started when the first socket is handed over and exits
+ * once every socket has been written out or given up on, so nothing runs while
+ * no socket lingers. Each socket is closed gracefully once its data has been
+ * written, or closed anyway when its deadline passes, discarding the rest and
+ * reporting it in a debug message. The methods are thread safe.
+ */
+class SendLinger
+{
+public:
+    /**
+     * Hands over a socket with data still to be written, which takes
+     * ownership of the socket.
+     *
+     * @param socket the socket, which must be connected and non-blocking and
+     * must not be selected for network events.
+     * @param data the data still to be written, in order. This is swapped
+     * out, leaving it empty.
+     * @param deadline the tick count, as given by GetTickCount64(), to give up
+     * writing the data and close the socket at.
+     */
+    static void add(SOCKET socket, std::vector<char>& data,
+        ULONGLONG deadline);
+
+    /**
+     * Waits for every socket handed over to be closed, so that Winsock can be
+     * cleaned up.
+     *
+     * @param milliseconds the longest time in milliseconds to wait.
+     * @return Whether or not every socket was closed in time.
+     */
+    static bool waitForIdle(DWORD milliseconds);
+
+private:
+    /** The method the thread that writes out the sockets runs. */
+    static void run();
+};
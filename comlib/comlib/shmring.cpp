@@ -0,0 +1,556 @@
+/**
+ * @file
+ * Defines the ShmRingMemory and ShmListener classes.
+ */
+
+#include "shmring.h"
+#include <cassert>
+#include <cstring>
+#include <sstream>
+#include "inc/comlib/comlib.h"
+
+// The prefix that identifies a shared memory address
+static const char SHM_ADDR_PREFIX[] = "shm://";
+// The length of the prefix, not including the null
+static const size_t SHM_ADDR_PREFIX_LEN = sizeof(SHM_ADDR_PREFIX) - 1;
+
+// The maximum length of the name in a shared memory address
+static const size_t SHM_NAME_MAX_LEN = 64;
+
+// The prefix for the names of all the kernel objects. These are kept in the
+// session namespace so no special privileges are needed
+static const char SHM_OBJ_NAME_PREFIX[] = "Local\\comlib.shm.";
+
+// The maximum number of pending connections a listener can queue
+static const LONG SHM_BACKLOG_MAX = 256;
+
+// A connection waiting to be accepted, identified by the process that created
+// its ring memory and a number unique within that process
+struct ShmPendingCon
+{
+    DWORD processId;
+    LONG conId;
+};
+
+// The queue of pending connections held in the listener's file mapping
+struct ShmConQueue
+{
+    LONG closed;
+    LONG backlog;
+    LONG first;
+    LONG count;
+    ShmPendingCon cons[SHM_BACKLOG_MAX];
+};
+
+// The source of unique connection numbers within this process
+static volatile LONG s_nextConId = 0;
+
+// Returns the prefix for the names of the kernel objects of the listener for
+// the given address, or an empty string if the address is not valid
+static std::string listenerObjName(const char* addr)
+{
+    assert(isShmAddr(addr));
+
+    const char* name = addr + SHM_ADDR_PREFIX_LEN;
+    size_t nameLen = strlen(name);
+    if (nameLen == 0 || nameLen > SHM_NAME_MAX_LEN ||
+        strchr(name, '\\') != NULL)
+    {
+        return std::string();
+    }
+
+    return std::string(SHM_OBJ_NAME_PREFIX) + name;
+}
+
+// Returns the prefix for the names of the kernel objects of the given pending
+// connection to the listener with the given object name prefix
+static std::string conObjName(const std::string& listenerObjName,
+                              const ShmPendingCon& pendingCon)
+{
+    std::ostringstream objName;
+    objName << listenerObjName << '.' << pendingCon.processId << '.' <<
+        pendingCon.conId;
+    return objName.str();
+}
+
+// Waits for the given named mutex. A mutex abandoned by a process that exited
+// while holding it is still acquired, and the queue it guards is always left
+// consistent
+static void lockQueue(HANDLE lock)
+{
+    WaitForSingleObject(lock, INFINITE);
+}
+
+bool isShmAddr(const char* addr)
+{
+    return (addr != 0 &&
+        _strnicmp(addr, SHM_ADDR_PREFIX, SHM_ADDR_PREFIX_LEN) == 0);
+}
+
+int ShmRingMemory::create(const std::string& objName,
+                          ShmRingMemory** pMemory)
+{
+    ShmRingMemory* self = new ShmRingMemory;
+    int err = self->construct(objName, true);
+    if (err == CL_ERR_OK)
+    {
+        *pMemory = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+int ShmRingMemory::open(const std::string& objName, ShmRingMemory** pMemory)
+{
+    ShmRingMemory* self = new ShmRingMemory;
+    int err = self->construct(objName, false);
+    if (err == CL_ERR_OK)
+    {
+        *pMemory = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+ShmRingMemory::~ShmRingMemory()
+{
+    for (int dir = 0; dir < DIR_COUNT; ++dir)
+    {
+        if (m_dataEvents[dir] != NULL)
+        {
+            CloseHandle(m_dataEvents[dir]);
+        }
+        if (m_spaceEvents[dir] != NULL)
+        {
+            CloseHandle(m_spaceEvents[dir]);
+        }
+    }
+
+    if (m_view != 0)
+    {
+        UnmapViewOfFile(m_view);
+    }
+
+    if (m_mapping != NULL)
+    {
+        CloseHandle(m_mapping);
+    }
+
+    if (m_peerProcess != NULL)
+    {
+        CloseHandle(m_peerProcess);
+    }
+}
+
+bool ShmRingMemory::peerCanExit() const
+{
+    return true;
+}
+
+bool ShmRingMemory::peerExited(int dir)
+{
+    if (m_peerProcess == NULL)
+    {
+        // The accepting end only records its process ID once it has accepted
+        // the connection
+        DWORD processId = static_cast<DWORD>(header(dir)->writerProcessId);
+        if (processId == 0)
+        {
+            return false;
+        }
+
+        m_peerProcess = OpenProcess(SYNCHRONIZE, FALSE, processId);
+        if (m_peerProcess == NULL)
+        {
+            // The ID of a process that has gone is refused as not valid. Any
+            // other failure means it cannot be watched, not that it exited
+            return (GetLastError() == ERROR_INVALID_PARAMETER);
+        }
+    }
+
+    return (WaitForSingleObject(m_peerProcess, 0) == WAIT_OBJECT_0);
+}
+
+ShmRingMemory::ShmRingMemory() :
+m_mapping(NULL), m_view(0), m_peerProcess(NULL)
+{
+}
+
+int ShmRingMemory::construct(const std::string& objName, bool create)
+{
+    int err = CL_ERR_OK;
+
+    if (create)
+    {
+        m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+            PAGE_READWRITE, 0, TOTAL_SIZE, objName.c_str());
+    }
+    else
+    {
+        m_mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE,
+            objName.c_str());
+    }
+    if (m_mapping == NULL)
+    {
+        // A connection that has gone away before being accepted looks the
+        // same as one that was reset
+        err = create ? GetLastError() : WSAECONNRESET;
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        m_view = static_cast<char*>(MapViewOfFile(m_mapping,
+            FILE_MAP_ALL_ACCESS, 0, 0, TOTAL_SIZE));
+        if (m_view != 0)
+        {
+            layout(m_view, create);
+
+            // Record this process as the producer of the ring this end sends
+            // on, so the other end can tell if it exits without closing. The
+            // accepting end opens the connecting process straight away,
+            // before its ID could be reused
+            int sendDir = create ? 0 : 1;
+            header(sendDir)->writerProcessId =
+                static_cast<LONG>(GetCurrentProcessId());
+            if (!create)
+            {
+                peerExited(0);
+            }
+        }
+        else
+        {
+            err = GetLastError();
+        }
+    }
+
+    // The data events are manual-reset as each is waited on by a network
+    // thread which resets it before processing the data. The space events are
+    // auto-reset as each is waited on by a single blocked sender
+    for (int dir = 0; dir < DIR_COUNT && err == CL_ERR_OK; ++dir)
+    {
+        std::ostringstream dataName;
+        dataName << objName << ".data" << dir;
+        std::ostringstream spaceName;
+        spaceName << objName << ".space" << dir;
+
+        if (create)
+        {
+            m_dataEvents[dir] = CreateEventA(NULL, TRUE, FALSE,
+                dataName.str().c_str());
+            m_spaceEvents[dir] = CreateEventA(NULL, FALSE, FALSE,
+                spaceName.str().c_str());
+        }
+        else
+        {
+            m_dataEvents[dir] = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE,
+                FALSE, dataName.str().c_str());
+            m_spaceEvents[dir] = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE,
+                FALSE, spaceName.str().c_str());
+        }
+
+        if (m_dataEvents[dir] == NULL || m_spaceEvents[dir] == NULL)
+        {
+            err = GetLastError();
+        }
+    }
+
+    return err;
+}
+
+int ShmListener::create(const char* addr, int conBacklog,
+                        RingListener** pListener)
+{
+    ShmListener* self = new ShmListener;
+    int err = self->construct(addr, conBacklog);
+    if (err == CL_ERR_OK)
+    {
+        *pListener = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+int ShmListener::connect(const char* addr, RingChannel** pChannel)
+{
+    std::string objName = listenerObjName(addr);
+    if (objName.empty())
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    // Open the listener. If it is not there then nothing is listening on the
+    // address, as with connecting to a port no socket is listening on
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE,
+        objName.c_str());
+    HANDLE lock = OpenMutexA(SYNCHRONIZE | MUTEX_MODIFY_STATE, FALSE,
+        (objName + ".lock").c_str());
+    HANDLE acceptEvent = OpenEventA(EVENT_MODIFY_STATE, FALSE,
+        (objName + ".accept").c_str());
+    ShmConQueue* queue = 0;
+    if (mapping != NULL)
+    {
+        queue = static_cast<ShmConQueue*>(MapViewOfFile(mapping,
+            FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShmConQueue)));
+    }
+
+    int err = CL_ERR_OK;
+    if (queue == 0 || lock == NULL || acceptEvent == NULL)
+    {
+        err = WSAECONNREFUSED;
+    }
+
+    // Create the ring memory for the connection before queueing it, so that
+    // it is there for the listener to open as soon as it is accepted
+    ShmPendingCon pendingCon;
+    pendingCon.processId = GetCurrentProcessId();
+    pendingCon.conId = InterlockedIncrement(&s_nextConId);
+
+    ShmRingMemory* memory = 0;
+    if (err == CL_ERR_OK)
+    {
+        err = ShmRingMemory::create(conObjName(objName, pendingCon), &memory);
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        lockQueue(lock);
+
+        if (queue->closed == 0 && queue->count < queue->backlog)
+        {
+            queue->cons[(queue->first + queue->count) % SHM_BACKLOG_MAX] =
+                pendingCon;
+            ++queue->count;
+            SetEvent(acceptEvent);
+        }
+        else
+        {
+            err = WSAECONNREFUSED;
+        }
+
+        ReleaseMutex(lock);
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        *pChannel = new RingChannel(RingMemorySPtr(memory), false);
+    }
+    else
+    {
+        delete memory;
+    }
+
+    if (queue != 0)
+    {
+        UnmapViewOfFile(queue);
+    }
+    if (mapping != NULL)
+    {
+        CloseHandle(mapping);
+    }
+    if (lock != NULL)
+    {
+        CloseHandle(lock);
+    }
+    if (acceptEvent != NULL)
+    {
+        CloseHandle(acceptEvent);
+    }
+
+    return err;
+}
+
+ShmListener::~ShmListener()
+{
+    close();
+
+    if (m_acceptEvent != NULL)
+    {
+        CloseHandle(m_acceptEvent);
+    }
+
+    if (m_lock != NULL)
+    {
+        CloseHandle(m_lock);
+    }
+
+    if (m_queue != 0)
+    {
+        UnmapViewOfFile(m_queue);
+    }
+
+    if (m_mapping != NULL)
+    {
+        CloseHandle(m_mapping);
+    }
+}
+
+WSAEVENT ShmListener::netEvent() const
+{
+    return m_acceptEvent;
+}
+
+void ShmListener::resetNetEvent()
+{
+    ResetEvent(m_acceptEvent);
+}
+
+int ShmListener::accept(RingChannel** pChannel)
+{
+    if (m_closed)
+    {
+        return WSAEINVAL;
+    }
+
+    lockQueue(m_lock);
+
+    if (m_queue->count == 0)
+    {
+        ReleaseMutex(m_lock);
+        return WSAEWOULDBLOCK;
+    }
+
+    ShmPendingCon pendingCon = m_queue->cons[m_queue->first];
+    m_queue->first = (m_queue->first + 1) % SHM_BACKLOG_MAX;
+    --m_queue->count;
+
+    if (m_queue->count > 0)
+    {
+        // More connections are pending, so signal again as FD_ACCEPT would be
+        SetEvent(m_acceptEvent);
+    }
+
+    ReleaseMutex(m_lock);
+
+    ShmRingMemory* memory = 0;
+    int err = ShmRingMemory::open(conObjName(m_objName, pendingCon), &memory);
+    if (err == CL_ERR_OK)
+    {
+        *pChannel = new RingChannel(RingMemorySPtr(memory), true);
+    }
+
+    return err;
+}
+
+void ShmListener::close()
+{
+    if (m_closed || m_queue == 0)
+    {
+        return;
+    }
+    m_closed = true;
+
+    // Stop any more connections being queued then reset the ones that are
+    // still pending, so their connecting ends see the connection close
+    lockQueue(m_lock);
+
+    m_queue->closed = 1;
+    while (m_queue->count > 0)
+    {
+        ShmPendingCon pendingCon = m_queue->cons[m_queue->first];
+        m_queue->first = (m_queue->first + 1) % SHM_BACKLOG_MAX;
+        --m_queue->count;
+
+        ShmRingMemory* memory = 0;
+        if (ShmRingMemory::open(conObjName(m_objName, pendingCon), &memory) ==
+            CL_ERR_OK)
+        {
+            RingChannel channel(RingMemorySPtr(memory), true);
+            channel.close();
+        }
+    }
+
+    ReleaseMutex(m_lock);
+}
+
+bool ShmListener::isClosed() const
+{
+    return m_closed;
+}
+
+ShmListener::ShmListener() :
+m_mapping(NULL), m_queue(0), m_lock(NULL), m_acceptEvent(NULL),
+m_closed(false)
+{
+}
+
+int ShmListener::construct(const char* addr, int conBacklog)
+{
+    int err = CL_ERR_OK;
+
+    m_objName = listenerObjName(addr);
+    if (m_objName.empty())
+    {
+        err = CL_ERR_ILLEGAL_ARG;
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        // Only one listener is allowed per name, as with binding a socket
+        m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+            PAGE_READWRITE, 0, sizeof(ShmConQueue), m_objName.c_str());
+        if (m_mapping == NULL)
+        {
+            err = GetLastError();
+        }
+        else if (GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            err = WSAEADDRINUSE;
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        m_queue = static_cast<ShmConQueue*>(MapViewOfFile(m_mapping,
+            FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShmConQueue)));
+        if (m_queue != 0)
+        {
+            // New file mappings are zero filled, so only the backlog needs
+            // setting
+            m_queue->backlog = conBacklog;
+            if (m_queue->backlog <= 0 || m_queue->backlog > SHM_BACKLOG_MAX)
+            {
+                m_queue->backlog = SHM_BACKLOG_MAX;
+            }
+        }
+        else
+        {
+            err = GetLastError();
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        m_lock = CreateMutexA(NULL, FALSE, (m_objName + ".lock").c_str());
+        if (m_lock == NULL)
+        {
+            err = GetLastError();
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        m_acceptEvent = CreateEventA(NULL, TRUE, FALSE,
+            (m_objName + ".accept").c_str());
+        if (m_acceptEvent == NULL)
+        {
+            err = GetLastError();
+        }
+    }
+
+    if (err != CL_ERR_OK)
+    {
+        // Nothing has been queued yet, so there is nothing to reset
+        m_closed = true;
+    }
+
+    return err;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file
+ * Declares the ShmRingMemory and ShmListener classes, which carry ring
+ * connections between processes on the same host through shared memory.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include "ringchannel.h"
+
+struct ShmConQueue;
+
+/**
+ * Does the given address specify a shared memory ring connection, i.e. does
+ * it have the form "shm://name"?
+ *
+ * @param addr the address to check.
+ * @return Whether or not the given address specifies a shared memory ring
+ * connection.
+ */
+bool isShmAddr(const char* addr);
+
+/**
+ * Ring memory held in a named file mapping, with named events, so that the
+ * two ends of a ring connection can be in different processes.
+ */
+class ShmRingMemory : public RingMemory
+{
+public:
+    /**
+     * Creates the named shared memory and events for a new ring connection.
+     *
+     * @param objName the prefix for the names of the kernel objects.
+     * @param pMemory if the method was successful this will be set to point
+     * to the ring memory that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int create(const std::string& objName, ShmRingMemory** pMemory);
+
+    /**
+     * Opens the named shared memory and events created by the other end of a
+     * ring connection.
+     *
+     * @param objName the prefix for the names of the kernel objects.
+     * @param pMemory if the method was successful this will be set to point
+     * to the ring memory that was opened.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int open(const std::string& objName, ShmRingMemory** pMemory);
+
+    virtual ~ShmRingMemory();
+
+    // Inherited from RingMemory
+    virtual bool peerCanExit() const;
+    virtual bool peerExited(int dir);
+
+private:
+    /** The first stage of construction. */
+    ShmRingMemory();
+
+    /**
+     * The second stage of construction.
+     *
+     * @param objName the prefix for the names of the kernel objects.
+     * @param create true to create the kernel objects, false to open them.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int construct(const std::string& objName, bool create);
+
+    /** The file mapping holding the rings. */
+    HANDLE m_mapping;
+
+    /** The view of the file mapping. */
+    char* m_view;
+
+    /**
+     * The process of the other end, opened with SYNCHRONIZE so that it is
+     * signaled when the process exits, or NULL until its ID is known.
+     */
+    HANDLE m_peerProcess;
+};
+
+/**
+ * Listens for shared memory ring connections. Connecting processes create the
+ * ring memory for the connection themselves and then queue its name with the
+ * listener, through a small named file mapping guarded by a named mutex.
+ */
+class ShmListener : public RingListener
+{
+public:
+    /**
+     * Creates a listener for the given shared memory address.
+     *
+     * @param addr the shared memory address to listen on.
+     * @param conBacklog the maximum number of pending connections.
+     * @param pListener if the method was successful this will be set to point
+     * to the listener that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int create(const char* addr, int conBacklog,
+        RingListener** pListener);
+
+    /**
+     * Connects to the listener for the given shared memory address.
+     *
+     * @param addr the shared memory address to connect to.
+     * @param pChannel if the method was successful this will be set to point
+     * to the connecting end of the connection.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int connect(const char* addr, RingChannel** pChannel);
+
+    virtual ~ShmListener();
+
+    // Inherited from RingListener
+    virtual WSAEVENT netEvent() const;
+    virtual void resetNetEvent();
+    virtual int accept(RingChannel** pChannel);
+    virtual void close();
+    virtual bool isClosed() const;
+
+private:
+    /** The first stage of construction. */
+    ShmListener();
+
+    /**
+     * The second stage of construction.
+     *
+     * @param addr the shared memory address to listen on.
+     * @param conBacklog the maximum number of pending connections.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int construct(const char* addr, int conBacklog);
+
+    /** The prefix for the names of the kernel objects of this listener. */
+    std::string m_objName;
+
+    /** The file mapping holding the queue of pending connections. */
+    HANDLE m_mapping;
+
+    /** The view of the queue of pending connections. */
+    ShmConQueue* m_queue;
+
+    /** The mutex guarding the queue of pending connections. */
+    HANDLE m_lock;
+
+    /** The event signaled when a connection is pending. */
+    HANDLE m_acceptEvent;
+
+    /** This is set when close() has been called. */
+    bool m_closed;
+};
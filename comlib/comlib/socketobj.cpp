@@ -4,17 +4,84 @@
  */
 
 #include "socketobj.h"
+#include <algorithm>
 #include <boost/thread/thread.hpp>
+#include <cstring>
+#include <mstcpip.h>
+#include "capture.h"
+#include "connectbatch.h"
 #include "debug.h"
+#include "sendlinger.h"
 #include "socketregistry.h"
+#include "trace.h"
+#include "unixaddr.h"
+
+// The maximum number of reads made from a ring channel for each network event.
+// This stops a fast sender from keeping the network thread to itself, as the
+// event is signaled again if there is still data left
+static const int CHANNEL_READS_PER_EVENT = 64;
+
+// The maximum length of data that is compressed, anything longer is sent as
+// is. Data that does not compress grows slightly when deflated, so this leaves
+// room for that within the longest library frame
+static const int DEFLATE_MAX_LEN = SocketObj::REQUEST_MAX_LEN - 1024;
+
+// The number of socket objects allocated from the heap at once by the pool
+static const size_t SKT_OBJ_POOL_SLAB_LEN = 64;
+
+// The memory for all socket objects
+static ObjPool s_sktObjPool(sizeof(SocketObj), SKT_OBJ_POOL_SLAB_LEN);
+
+// The number of pools of buffers socket objects receive frames into, one for
+// each NUMA node Windows supports
+static const int RECV_BUF_POOL_COUNT = 64;
+
+// The buffers socket objects receive frames into. There is a pool for each
+// NUMA node, so a buffer first used, and so placed in memory, by a network
+// thread on one node is not reused by a network thread on another
+static BufPool s_recvBufPools[RECV_BUF_POOL_COUNT];
+
+// Returns the index in s_recvBufPools of the pool for the NUMA node of the CPU
+// the calling thread is running on
+static unsigned char currentRecvBufPoolIdx()
+{
+    UCHAR node = 0;
+    if (!GetNumaProcessorNode(static_cast<UCHAR>(GetCurrentProcessorNumber()),
+        &node))
+    {
+        node = 0;
+    }
+    return static_cast<unsigned char>(node % RECV_BUF_POOL_COUNT);
+}
+
+// The capture id given to the last socket object created
+static volatile LONGLONG s_lastCaptureId = 0;
+
+// Returns the capture id for a new socket object, counting up from 1
+static unsigned __int64 nextCaptureId()
+{
+    return static_cast<unsigned __int64>(
+        InterlockedIncrement64(&s_lastCaptureId));
+}
+
+// This is notified when any host address resolver thread has completed. It is
+// shared by all socket objects, rather than each keeping its own for the rare
+// times it connects asynchronously, so close() waits for its own flag
+static boost::condition_variable_any s_resolveAsyncCompletedCondVar;
 
 WSAEVENT SocketObj::netEvent() const
 {
-    return m_netEvent;
+    return (m_channel.get() != 0) ? m_channel->netEvent() : m_netEvent;
 }
 
 void SocketObj::onNetEvent()
 {
+    if (m_channel.get() != 0)
+    {
+        onChannelEvent();
+        return;
+    }
+
     boost::unique_lock<boost::mutex> lock(m_mutex);
 
     if (m_socket == INVALID_SOCKET)
@@ -48,6 +115,19 @@ void SocketObj::onNetEvent()
         onFdConnect(err);
     }
 
+    if ((wsaNetworkEvents.lNetworkEvents & FD_WRITE) != 0)
+    {
+        if (wsaNetworkEvents.iErrorCode[FD_WRITE_BIT] == 0)
+        {
+            onFdWrite();
+        }
+        else
+        {
+            OUTPUT_FMT_DEBUG_STRING("FD_WRITE failed, err=" <<
+                wsaNetworkEvents.iErrorCode[FD_WRITE_BIT]);
+        }
+    }
+
     if ((wsaNetworkEvents.lNetworkEvents & FD_READ) != 0)
     {
         if (wsaNetworkEvents.iErrorCode[FD_READ_BIT] == 0)
@@ -73,6 +153,130 @@ void SocketObj::onNetEvent()
     }
 }
 
+ULONGLONG SocketObj::timerDeadline() const
+{
+    PendingTable* table = m_pendingTable;
+    ULONGLONG deadline = (table != NULL) ? table->nextDeadline() : NO_TIMER;
+    deadline = (std::min)(deadline, corkDeadline());
+    deadline = (std::min)(deadline, sendQueueDeadline());
+    if (m_channel.get() != 0)
+    {
+        deadline = (std::min)(deadline, m_channel->peerCheckDeadline());
+    }
+    return (std::min)(deadline, recvResumeDeadline());
+}
+
+void SocketObj::onTimer(ULONGLONG now)
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    if (isClosed())
+    {
+        // Socket closed
+        return;
+    }
+
+    if (corkDeadline() <= now)
+    {
+        // The network thread must not wait for the other end to read, as
+        // that would hold up every other socket it looks after
+        int err = flushCork(false);
+        if (err != CL_ERR_OK)
+        {
+            OUTPUT_FMT_DEBUG_STRING("Cork flush failed, err=" << err);
+        }
+    }
+
+    if (m_channel.get() != 0)
+    {
+        // This signals the network event if the other end's process has
+        // exited, so the close is reported from onChannelEvent()
+        m_channel->checkPeer(now);
+    }
+
+    bool recvResumed = false;
+    if (recvResumeDeadline() <= now)
+    {
+        InterlockedExchange64(&m_recvResumeDeadline,
+            static_cast<LONGLONG>(NO_TIMER));
+        recvResumed = true;
+    }
+
+    int slowConsumerAction = CL_SLOW_CONSUMER_NONE;
+    CLPSlowConsumerFn slowConsumerFn = 0;
+    ULONG bytesQueued = 0;
+    ULONG queueAgeMs = 0;
+    if (sendQueueDeadline() <= now)
+    {
+        slowConsumerAction = checkSendQueue(now, bytesQueued, queueAgeMs);
+        slowConsumerFn = m_slowConsumer->slowConsumerFn;
+    }
+
+    // Unlock the mutex because we do not want this object to be locked when we
+    // call any of the callback functions
+    lock.unlock();
+
+    if (slowConsumerAction == CL_SLOW_CONSUMER_DISCONNECT)
+    {
+        notifyClosed(CL_ERR_SLOW_CONSUMER);
+        return;
+    }
+
+    if (slowConsumerAction == CL_SLOW_CONSUMER_CALLBACK)
+    {
+        slowConsumerFn(SocketRegistry::toHandle(this), bytesQueued,
+            queueAgeMs, m_arg);
+    }
+
+    if (recvResumed)
+    {
+        // Reading again re-enables FD_READ, which is not signaled while data
+        // is left unread, or picks up anything sent over a ring channel while
+        // reading was paused
+        if (m_channel.get() != 0)
+        {
+            onChannelEvent();
+        }
+        else
+        {
+            onFdRead();
+        }
+    }
+
+    PendingTable* table = m_pendingTable;
+    if (table != NULL && table->nextDeadline() <= now)
+    {
+        std::vector<PendingTable::Completion> completions;
+        table->takeExpired(now, completions);
+        completeRequests(completions, CL_ERR_TIMED_OUT);
+    }
+}
+
+int SocketObj::rssCpu() const
+{
+    if (m_channel.get() != 0 || m_socket == INVALID_SOCKET)
+    {
+        // Ring channels do not go through the network stack
+        return -1;
+    }
+
+    // This fails for Unix domain sockets, sockets that are not connected yet
+    // and on Windows versions before 8
+    SOCKET_PROCESSOR_AFFINITY affinity;
+    DWORD bytesReturned = 0;
+    if (WSAIoctl(m_socket, SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0, &affinity,
+        sizeof(affinity), &bytesReturned, NULL, NULL) != 0)
+    {
+        return -1;
+    }
+    return affinity.Processor.Number;
+}
+
+ULONGLONG SocketObj::bytesRecv() const
+{
+    return m_bytesRecv;
+}
+
 int SocketObj::create(const char* hostAddr, unsigned short hostPort,
                       CLPDataRecvFn dataRecvFn,
                       CLPSocketClosedFn socketClosedFn, void* arg,
@@ -82,6 +286,7 @@ int SocketObj::create(const char* hostAddr, unsigned short hostPort,
     int err = self->construct(hostAddr, hostPort);
     if (err == CL_ERR_OK)
     {
+        Capture::record(CL_CAPTURE_OPEN, self->m_captureId, 0, 0);
         *pSktObj = self;
     }
     else
@@ -102,6 +307,28 @@ int SocketObj::createAsync(const char* hostAddr, unsigned short hostPort,
     int err = self->constructAsync(hostAddr, hostPort);
     if (err == CL_ERR_OK)
     {
+        Capture::record(CL_CAPTURE_OPEN, self->m_captureId, 0, 0);
+        *pSktObj = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+int SocketObj::createBatched(const char* hostAddr,
+                             CLPConCompletedFn conCompletedFn,
+                             CLPDataRecvFn dataRecvFn,
+                             CLPSocketClosedFn socketClosedFn, void* arg,
+                             SocketObj** pSktObj)
+{
+    SocketObj* self = new SocketObj(conCompletedFn, dataRecvFn, socketClosedFn,
+        arg);
+    int err = self->constructBatched(hostAddr);
+    if (err == CL_ERR_OK)
+    {
+        Capture::record(CL_CAPTURE_OPEN, self->m_captureId, 0, 0);
         *pSktObj = self;
     }
     else
@@ -120,6 +347,7 @@ int SocketObj::createAccepted(SOCKET clientSocket, CLPDataRecvFn dataRecvFn,
     int err = self->constructAccepted();
     if (err == CL_ERR_OK)
     {
+        Capture::record(CL_CAPTURE_OPEN, self->m_captureId, 0, 0);
         *pSktObj = self;
     }
     else
@@ -129,201 +357,611 @@ int SocketObj::createAccepted(SOCKET clientSocket, CLPDataRecvFn dataRecvFn,
     return err;
 }
 
+int SocketObj::createAccepted(RingChannel* clientChannel,
+                              CLPDataRecvFn dataRecvFn,
+                              CLPSocketClosedFn socketClosedFn, void* arg,
+                              SocketObj** pSktObj)
+{
+    // Nothing can fail once the socket object has the channel
+    SocketObj* self = new SocketObj(clientChannel, dataRecvFn, socketClosedFn,
+        arg);
+    Capture::record(CL_CAPTURE_OPEN, self->m_captureId, 0, 0);
+    *pSktObj = self;
+    return CL_ERR_OK;
+}
+
 SocketObj::~SocketObj()
 {
-    freeaddrinfo(m_addrInfo);
+    if (m_DataRecvBuf != NULL)
+    {
+        // Closed part way through receiving a frame
+        s_recvBufPools[m_DataRecvBufPoolIdx].giveBack(m_DataRecvBuf,
+            ntohs(*(reinterpret_cast<PrefixType*>(m_DataRecvPrefix))));
+    }
+
+    freeAddrInfo(m_addrInfo);
 
     if (m_netEvent != WSA_INVALID_EVENT)
     {
         WSACloseEvent(m_netEvent);
     }
+
+    delete m_pendingTable;
+    delete m_sendTurn;
+    delete m_compression;
 }
 
-int SocketObj::sendData(const char* buf, int len)
+ULONGLONG SocketObj::recvBufTrimDeadline()
 {
-    boost::lock_guard<boost::mutex> lock(m_mutex);
-
-    if (m_dataStreamCorrupted)
+    ULONGLONG deadline = NO_TIMER;
+    for (int idx = 0; idx < RECV_BUF_POOL_COUNT; ++idx)
     {
-        return CL_ERR_DATA_STREAM_CORRUPTED;
+        ULONGLONG trimDeadline = s_recvBufPools[idx].trimDeadline();
+        if (trimDeadline != BufPool::NO_TRIM)
+        {
+            deadline = (std::min)(deadline, trimDeadline);
+        }
     }
+    return deadline;
+}
 
-    // Switch the socket to blocking mode then back to non-blocking mode when
-    // we are finished
-    int err = SetBlockingMode();
-    if (err != CL_ERR_OK)
+void SocketObj::trimRecvBufPools()
+{
+    for (int idx = 0; idx < RECV_BUF_POOL_COUNT; ++idx)
     {
-        return err;
+        s_recvBufPools[idx].trimIfDue();
     }
+}
 
-    // Fill out the length prefix array in network byte format
-    char prefix[PREFIX_LEN];
-    *(reinterpret_cast<PrefixType*>(prefix)) =
-        htons(static_cast<PrefixType>(len));
+void* SocketObj::operator new(size_t size)
+{
+    assert(size <= s_sktObjPool.blockSize());
+    return s_sktObjPool.alloc();
+}
 
-    // Send the length prefix then the supplied buffer
-    int bytesSent = 0;
-    err = sendAll(prefix, PREFIX_LEN, bytesSent);
-    if (err == CL_ERR_OK)
+void SocketObj::operator delete(void* p)
+{
+    s_sktObjPool.free(p);
+}
+
+int SocketObj::sendData(const char* buf, int len, int pri)
+{
+    assert(len > 0);
+
+    int err = CL_ERR_OK;
+    bool deflated = false;
+
+    // Most sockets never compress, so only lock when this one might. Data
+    // above normal priority is left as is, as the other end must decompress
+    // data in the order it was compressed and that could overtake it
+    if (m_compressing && len <= DEFLATE_MAX_LEN && pri == CL_PRI_NORMAL)
     {
-        // The prefix was sent. Send the supplied buffer
-        err = sendAll(buf, len, bytesSent);
-        if (err != CL_ERR_OK)
+        Compression& comp = compression();
+        boost::lock_guard<boost::mutex> deflateLock(comp.mutex);
+
+        if (m_compressing && len >= comp.minLen)
         {
-            m_dataStreamCorrupted = true;
+            err = sendDeflated(buf, len);
+            deflated = true;
         }
     }
-    else
+
+    if (!deflated)
     {
-        if (bytesSent > 0)
-        {
-            m_dataStreamCorrupted = true;
-        }
+        // Fill out the length prefix array in network byte format
+        char prefix[PREFIX_LEN];
+        *(reinterpret_cast<PrefixType*>(prefix)) =
+            htons(static_cast<PrefixType>(len));
+
+        // Send the length prefix then the supplied buffer
+        WSABUF bufs[2];
+        bufs[0].buf = prefix;
+        bufs[0].len = PREFIX_LEN;
+        bufs[1].buf = const_cast<char*>(buf);
+        bufs[1].len = len;
+        err = sendBufs(bufs, 2, pri, pri == CL_PRI_NORMAL);
     }
 
-    int setNonBlockingModeErr = SetNonBlockingMode();
+    // Only capture data that was sent, so a replay does not send data the
+    // other end never got
     if (err == CL_ERR_OK)
     {
-        err = setNonBlockingModeErr;
+        Capture::record(CL_CAPTURE_SEND, m_captureId, buf, len);
     }
-
     return err;
 }
 
-void SocketObj::close()
+void SocketObj::setRequestRecvFn(CLPRequestRecvFn requestRecvFn)
 {
-    boost::unique_lock<boost::mutex> lock(m_mutex);
-
-    m_closeCalled = true;
-
-    // Wait for the host address resolver thread to complete
-    while (!m_resolveAsyncCompleted)
-    {
-        m_resolveAsyncCompletedCondVar.wait(lock);
-    }
+    boost::lock_guard<boost::mutex> lock(m_mutex);
 
-    if (m_socket != INVALID_SOCKET)
-    {
-        closesocket(m_socket);
-        m_socket = INVALID_SOCKET;
-    }
+    m_requestRecvFn = requestRecvFn;
 }
 
-int SocketObj::resolveHostAddr(const char* hostAddr, unsigned short hostPort,
-                               ADDRINFOA** pAddrInfo)
+int SocketObj::request(const char* buf, int len, DWORD timeout,
+                       CLPResponseRecvFn responseRecvFn, void* reqArg)
 {
-    assert(pAddrInfo != 0);
-
-    int err = CL_ERR_OK;
-
-    char hostPortStr[NI_MAXSERV];
-    _ultoa_s(hostPort, hostPortStr, 10);
+    PendingTable* table = pendingTable();
 
-    ADDRINFOA hints = {};
-    // hints.ai_flags is left as 0 so both host names and IP addresses will
-    // be resolved
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+    CLRequestId reqId = 0;
+    bool earlierDeadline = false;
+    int err = table->add(responseRecvFn, reqArg, timeout, &reqId,
+        &earlierDeadline);
+    if (err != CL_ERR_OK)
+    {
+        return err;
+    }
 
-    ADDRINFOA* addrInfo = NULL;
-    int getAddrInfoErr = getaddrinfo(hostAddr, hostPortStr, &hints, &addrInfo);
-    if (getAddrInfoErr == 0)
+    if (earlierDeadline)
     {
-        *pAddrInfo = addrInfo;
+        // Wake the network thread so that it does not wait past the new
+        // timeout
+        if (m_channel.get() != 0)
+        {
+            m_channel->signalNetEvent();
+        }
+        else
+        {
+            WSASetEvent(m_netEvent);
+        }
     }
-    else
+
+    // The request goes in the table before it is sent, as the response may
+    // arrive before sending returns
+    err = sendLibFrame(LIB_FRAME_REQUEST, reqId, buf, len);
+    PendingTable::Completion completion;
+    if (err != CL_ERR_OK && !table->take(reqId, &completion))
     {
-        err = getAddrInfoErr;
+        // The request has already been completed, for example because the
+        // socket closed, so the callback function has been called for it
+        err = CL_ERR_OK;
     }
 
     return err;
 }
 
-void SocketObj::resolveHostAddrThreadProc(std::string hostAddr,
-    unsigned short hostPort, SocketObj* self)
+int SocketObj::respond(CLRequestId reqId, const char* buf, int len)
 {
-    ADDRINFOA* addrInfo = NULL;
-    int err = resolveHostAddr(hostAddr.c_str(), hostPort, &addrInfo);
-    self->onHostAddrResolved(addrInfo, err);
+    return sendLibFrame(LIB_FRAME_RESPONSE, reqId, buf, len);
 }
 
-SocketObj::SocketObj(CLPDataRecvFn dataRecvFn,
-                     CLPSocketClosedFn socketClosedFn, void* arg) :
-m_conCompletedFn(0), m_dataRecvFn(dataRecvFn),
-m_socketClosedFn(socketClosedFn), m_arg(arg), m_netEvent(WSA_INVALID_EVENT),
-m_socket(INVALID_SOCKET), m_closeCalled(false), m_addrInfo(NULL),
-m_crntAddrInfo(NULL), m_resolveAsyncCompleted(true),
-m_dataStreamCorrupted(false), m_DataRecvLen(0)
+int SocketObj::setCompression(int minLen)
 {
-}
+    if (minLen == 0 && m_compression == NULL)
+    {
+        // Compression has never been turned on
+        return CL_ERR_OK;
+    }
 
-SocketObj::SocketObj(CLPConCompletedFn conCompletedFn,
-                     CLPDataRecvFn dataRecvFn,
-                     CLPSocketClosedFn socketClosedFn, void* arg) :
-m_conCompletedFn(conCompletedFn), m_dataRecvFn(dataRecvFn),
-m_socketClosedFn(socketClosedFn), m_arg(arg), m_netEvent(WSA_INVALID_EVENT),
-m_socket(INVALID_SOCKET), m_closeCalled(false), m_addrInfo(NULL),
-m_crntAddrInfo(NULL), m_resolveAsyncCompleted(true),
-m_dataStreamCorrupted(false), m_DataRecvLen(0)
-{
-}
+    Compression& comp = compression();
+    boost::lock_guard<boost::mutex> deflateLock(comp.mutex);
 
-SocketObj::SocketObj(SOCKET clientSocket, CLPDataRecvFn dataRecvFn,
-                     CLPSocketClosedFn socketClosedFn, void* arg) :
-m_conCompletedFn(0), m_dataRecvFn(dataRecvFn),
-m_socketClosedFn(socketClosedFn), m_arg(arg), m_netEvent(WSA_INVALID_EVENT),
-m_socket(clientSocket), m_closeCalled(false), m_addrInfo(NULL),
-m_crntAddrInfo(NULL), m_resolveAsyncCompleted(true),
-m_dataStreamCorrupted(false), m_DataRecvLen(0)
-{
+    if (minLen > 0 && comp.deflater.get() == 0)
+    {
+        FrameDeflater* deflater = 0;
+        int err = FrameDeflater::create(&deflater);
+        if (err != CL_ERR_OK)
+        {
+            return err;
+        }
+
+        comp.deflater.reset(deflater);
+        comp.deflateBuf.resize(REQUEST_MAX_LEN);
+    }
+
+    comp.minLen = minLen;
+    m_compressing = (comp.minLen > 0 && comp.peerInflates &&
+        !comp.deflateFailed);
+
+    return sendCompressHello();
 }
 
-int SocketObj::construct(const char* hostAddr, unsigned short hostPort)
+int SocketObj::setCork(DWORD maxDelay, int maxBytes)
 {
-    int err = createNetEvent();
+    boost::lock_guard<boost::mutex> lock(m_mutex);
 
-    ADDRINFOA* addrInfo = NULL;
-    if (err == CL_ERR_OK)
+    if (m_channel.get() != 0)
     {
-        err = resolveHostAddr(hostAddr, hostPort, &addrInfo);
+        return CL_ERR_OK;
     }
 
-    if (err == CL_ERR_OK)
+    if (m_cork.get() == 0)
     {
-        ADDRINFOA* crntAddrInfo = addrInfo;
-        err = doConnect(&crntAddrInfo);
+        if (maxDelay == 0)
+        {
+            return flushCork(true);
+        }
+        m_cork.reset(new Cork);
     }
 
-    // Free the address info now that it is no longer needed
-    if (addrInfo != NULL)
+    m_cork->maxDelay = maxDelay;
+    m_cork->maxBytes = maxBytes;
+    if (maxDelay == 0)
     {
-        freeaddrinfo(addrInfo);
-        addrInfo = NULL;
+        return flushCork(true);
     }
 
-    if (err == CL_ERR_OK)
-    {
-        // Associate the event object with the socket and select what network
-        // events we want to be notified about
-        err = SetNonBlockingMode();
-    }
+    m_cork->bufs[CL_PRI_NORMAL].reserve(maxBytes);
+    return CL_ERR_OK;
+}
 
-    // If construction failed, close the socket if it is open
-    if (err != CL_ERR_OK)
+int SocketObj::flush()
+{
+    if (m_channel.get() != 0)
     {
-        if (m_socket != INVALID_SOCKET)
-        {
-            closesocket(m_socket);
-            m_socket = INVALID_SOCKET;
-        }
+        return CL_ERR_OK;
     }
 
-    return err;
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    return flushCork(true);
+}
+
+void SocketObj::setRateLimit(const CLRateLimit& limit)
+{
+    boost::lock_guard<boost::mutex> turnLock(sendTurn().mutex);
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (m_rateLimits.get() == 0)
+    {
+        m_rateLimits.reset(new RateLimits);
+    }
+
+    ULONGLONG now = GetTickCount64();
+    m_rateLimits->sendByteBucket.setLimit(limit.sendBytesPerSec,
+        limit.sendBurstBytes, now);
+    m_rateLimits->recvByteBucket.setLimit(limit.recvBytesPerSec,
+        limit.recvBurstBytes, now);
+    m_rateLimits->recvFrameBucket.setLimit(limit.recvFramesPerSec,
+        limit.recvBurstFrames, now);
+
+    if (recvResumeDeadline() != NO_TIMER)
+    {
+        // The buckets are full again, so have the network thread resume
+        // reading straight away
+        InterlockedExchange64(&m_recvResumeDeadline,
+            static_cast<LONGLONG>(now));
+        WSASetEvent(netEvent());
+    }
+}
+
+int SocketObj::setSlowConsumerPolicy(const CLSlowConsumerPolicy& policy,
+                                     CLPSlowConsumerFn slowConsumerFn)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (m_channel.get() != 0)
+    {
+        return CL_ERR_OK;
+    }
+
+    if (m_slowConsumer.get() == 0)
+    {
+        if (policy.action == CL_SLOW_CONSUMER_NONE)
+        {
+            return CL_ERR_OK;
+        }
+        m_slowConsumer.reset(new SlowConsumer);
+    }
+
+    bool wasQueueing = isQueueing();
+    m_slowConsumer->policy = policy;
+    m_slowConsumer->slowConsumerFn = slowConsumerFn;
+
+    if (policy.action == CL_SLOW_CONSUMER_NONE)
+    {
+        return wasQueueing ? flushSendQueue() : CL_ERR_OK;
+    }
+
+    if (!m_slowConsumer->queue.empty())
+    {
+        // Wake the network thread so that it checks the queue against the new
+        // limits
+        resetSendQueueDeadline();
+        WSASetEvent(m_netEvent);
+    }
+
+    if (!wasQueueing && m_socket != INVALID_SOCKET)
+    {
+        // Select FD_WRITE, so the network thread writes what is queued
+        return SetNonBlockingMode();
+    }
+    return CL_ERR_OK;
+}
+
+void SocketObj::setAdmission(
+    const boost::shared_ptr<ConAdmission>& admission)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    m_admission = admission;
+}
+
+void SocketObj::getStats(CLSocketStats* pStats)
+{
+    // A socket object that has never sent has no send turn state to read
+    SendLane lanes[CL_PRI_COUNT];
+    SendTurn* turn = m_sendTurn;
+    if (turn != NULL)
+    {
+        boost::lock_guard<boost::mutex> turnLock(turn->mutex);
+        std::copy(turn->lanes, turn->lanes + CL_PRI_COUNT, lanes);
+    }
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    for (int pri = 0; pri < CL_PRI_COUNT; ++pri)
+    {
+        const SendLane& lane = lanes[pri];
+        pStats->framesSent[pri] = lane.framesSent;
+        pStats->bytesSent[pri] = lane.bytesSent;
+        pStats->sendersWaiting[pri] = lane.sendersWaiting;
+        pStats->bytesCorked[pri] = (m_cork.get() == 0) ? 0 :
+            static_cast<unsigned long>(m_cork->bufs[pri].size());
+    }
+
+    if (m_rateLimits.get() != 0)
+    {
+        pStats->recvByteLimitHits = m_rateLimits->recvByteLimitHits;
+        pStats->recvFrameLimitHits = m_rateLimits->recvFrameLimitHits;
+        pStats->sendByteLimitHits = m_rateLimits->sendByteLimitHits;
+    }
+    else
+    {
+        pStats->recvByteLimitHits = 0;
+        pStats->recvFrameLimitHits = 0;
+        pStats->sendByteLimitHits = 0;
+    }
+
+    if (m_slowConsumer.get() != 0)
+    {
+        pStats->bytesQueued = static_cast<unsigned long>(
+            m_slowConsumer->queuedLen);
+        pStats->slowConsumerHits = m_slowConsumer->hits;
+        pStats->framesDropped = m_slowConsumer->framesDropped;
+        pStats->bytesDropped = m_slowConsumer->bytesDropped;
+        pStats->framesRefused = m_slowConsumer->framesRefused;
+    }
+    else
+    {
+        pStats->bytesQueued = 0;
+        pStats->slowConsumerHits = 0;
+        pStats->framesDropped = 0;
+        pStats->bytesDropped = 0;
+        pStats->framesRefused = 0;
+    }
+}
+
+void SocketObj::close()
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    Trace::record(TRACE_CLOSE, SocketRegistry::toHandle(this), 0);
+    Capture::record(CL_CAPTURE_CLOSE, m_captureId, 0, 0);
+    m_closeCalled = true;
+
+    if (m_admission.get() != 0)
+    {
+        // Make room for the server socket object to accept another connection
+        m_admission->release();
+        m_admission.reset();
+    }
+
+    // Wait for the host address resolver thread to complete
+    while (!m_resolveAsyncCompleted)
+    {
+        s_resolveAsyncCompletedCondVar.wait(lock);
+    }
+
+    // Make room for the connect batch's next connection attempt if this
+    // one is still under way
+    freeConnectAddrInfo();
+
+    if (m_socket != INVALID_SOCKET)
+    {
+        // Anything held back in cork mode was sent as far as the caller
+        // knows. It is queued, rather than written blocking, so that closing
+        // cannot hang on a remote host that has stopped reading
+        flushCork(false);
+
+        if (m_slowConsumer.get() != 0)
+        {
+            // This hands the socket over if anything is still queued
+            lingerSendQueue();
+        }
+
+        if (m_socket != INVALID_SOCKET)
+        {
+            closesocket(m_socket);
+            m_socket = INVALID_SOCKET;
+        }
+    }
+
+    if (m_channel.get() != 0)
+    {
+        m_channel->close();
+    }
+}
+
+int SocketObj::resolveHostAddr(const char* hostAddr, unsigned short hostPort,
+                               ADDRINFOA** pAddrInfo)
+{
+    assert(pAddrInfo != 0);
+
+    if (isUnixAddr(hostAddr))
+    {
+        // A Unix domain socket path, the host port is not used
+        return resolveUnixAddr(hostAddr, pAddrInfo);
+    }
+
+    int err = CL_ERR_OK;
+
+    char hostPortStr[NI_MAXSERV];
+    _ultoa_s(hostPort, hostPortStr, 10);
+
+    ADDRINFOA hints = {};
+    // hints.ai_flags is left as 0 so both host names and IP addresses will
+    // be resolved
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    ADDRINFOA* addrInfo = NULL;
+    int getAddrInfoErr = getaddrinfo(hostAddr, hostPortStr, &hints, &addrInfo);
+    if (getAddrInfoErr == 0)
+    {
+        *pAddrInfo = addrInfo;
+    }
+    else
+    {
+        err = getAddrInfoErr;
+    }
+
+    return err;
+}
+
+void SocketObj::resolveHostAddrThreadProc(std::string hostAddr,
+    unsigned short hostPort, SocketObj* self)
+{
+    ADDRINFOA* addrInfo = NULL;
+    int err = resolveHostAddr(hostAddr.c_str(), hostPort, &addrInfo);
+    self->onHostAddrResolved(addrInfo, err);
+}
+
+SocketObj::SocketObj(CLPDataRecvFn dataRecvFn,
+                     CLPSocketClosedFn socketClosedFn, void* arg) :
+m_conCompletedFn(0), m_dataRecvFn(dataRecvFn),
+m_socketClosedFn(socketClosedFn), m_requestRecvFn(0), m_arg(arg),
+m_captureId(nextCaptureId()), m_netEvent(WSA_INVALID_EVENT),
+m_socket(INVALID_SOCKET), m_conCompletedPending(false), m_closeCalled(false),
+m_conCompleted(false), m_addrInfo(NULL), m_crntAddrInfo(NULL),
+m_resolveAsyncCompleted(true), m_dataStreamCorrupted(false),
+m_sendTurn(NULL), m_corkDeadline(static_cast<LONGLONG>(NO_TIMER)),
+m_sendQueueDeadline(static_cast<LONGLONG>(NO_TIMER)), m_DataRecvBuf(NULL),
+m_DataRecvLen(0), m_libFrameNext(false),
+m_DataRecvBufPoolIdx(0), m_recvResumeDeadline(static_cast<LONGLONG>(NO_TIMER)),
+m_bytesRecv(0), m_pendingTable(NULL), m_compression(NULL),
+m_compressing(false)
+{
+}
+
+SocketObj::SocketObj(CLPConCompletedFn conCompletedFn,
+                     CLPDataRecvFn dataRecvFn,
+                     CLPSocketClosedFn socketClosedFn, void* arg) :
+m_conCompletedFn(conCompletedFn), m_dataRecvFn(dataRecvFn),
+m_socketClosedFn(socketClosedFn), m_requestRecvFn(0), m_arg(arg),
+m_captureId(nextCaptureId()), m_netEvent(WSA_INVALID_EVENT),
+m_socket(INVALID_SOCKET), m_conCompletedPending(false), m_closeCalled(false),
+m_conCompleted(false), m_addrInfo(NULL), m_crntAddrInfo(NULL),
+m_resolveAsyncCompleted(true), m_dataStreamCorrupted(false),
+m_sendTurn(NULL), m_corkDeadline(static_cast<LONGLONG>(NO_TIMER)),
+m_sendQueueDeadline(static_cast<LONGLONG>(NO_TIMER)), m_DataRecvBuf(NULL),
+m_DataRecvLen(0), m_libFrameNext(false),
+m_DataRecvBufPoolIdx(0), m_recvResumeDeadline(static_cast<LONGLONG>(NO_TIMER)),
+m_bytesRecv(0), m_pendingTable(NULL), m_compression(NULL),
+m_compressing(false)
+{
+}
+
+SocketObj::SocketObj(SOCKET clientSocket, CLPDataRecvFn dataRecvFn,
+                     CLPSocketClosedFn socketClosedFn, void* arg) :
+m_conCompletedFn(0), m_dataRecvFn(dataRecvFn),
+m_socketClosedFn(socketClosedFn), m_requestRecvFn(0), m_arg(arg),
+m_captureId(nextCaptureId()), m_netEvent(WSA_INVALID_EVENT),
+m_socket(clientSocket), m_conCompletedPending(false), m_closeCalled(false),
+m_conCompleted(false), m_addrInfo(NULL), m_crntAddrInfo(NULL),
+m_resolveAsyncCompleted(true), m_dataStreamCorrupted(false),
+m_sendTurn(NULL), m_corkDeadline(static_cast<LONGLONG>(NO_TIMER)),
+m_sendQueueDeadline(static_cast<LONGLONG>(NO_TIMER)), m_DataRecvBuf(NULL),
+m_DataRecvLen(0), m_libFrameNext(false),
+m_DataRecvBufPoolIdx(0), m_recvResumeDeadline(static_cast<LONGLONG>(NO_TIMER)),
+m_bytesRecv(0), m_pendingTable(NULL), m_compression(NULL),
+m_compressing(false)
+{
+}
+
+SocketObj::SocketObj(RingChannel* clientChannel, CLPDataRecvFn dataRecvFn,
+                     CLPSocketClosedFn socketClosedFn, void* arg) :
+m_conCompletedFn(0), m_dataRecvFn(dataRecvFn),
+m_socketClosedFn(socketClosedFn), m_requestRecvFn(0), m_arg(arg),
+m_captureId(nextCaptureId()), m_netEvent(WSA_INVALID_EVENT),
+m_socket(INVALID_SOCKET), m_channel(clientChannel),
+m_conCompletedPending(false), m_closeCalled(false),
+m_conCompleted(false), m_addrInfo(NULL), m_crntAddrInfo(NULL),
+m_resolveAsyncCompleted(true), m_dataStreamCorrupted(false),
+m_sendTurn(NULL), m_corkDeadline(static_cast<LONGLONG>(NO_TIMER)),
+m_sendQueueDeadline(static_cast<LONGLONG>(NO_TIMER)), m_DataRecvBuf(NULL),
+m_DataRecvLen(0), m_libFrameNext(false), m_DataRecvBufPoolIdx(0),
+m_recvResumeDeadline(static_cast<LONGLONG>(NO_TIMER)), m_bytesRecv(0),
+m_pendingTable(NULL), m_compression(NULL), m_compressing(false)
+{
+}
+
+int SocketObj::construct(const char* hostAddr, unsigned short hostPort)
+{
+    if (isRingAddr(hostAddr))
+    {
+        return constructRing(hostAddr);
+    }
+
+    int err = createNetEvent();
+
+    ADDRINFOA* addrInfo = NULL;
+    if (err == CL_ERR_OK)
+    {
+        err = resolveHostAddr(hostAddr, hostPort, &addrInfo);
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        ADDRINFOA* crntAddrInfo = addrInfo;
+        err = doConnect(&crntAddrInfo);
+    }
+
+    // Free the address info now that it is no longer needed
+    if (addrInfo != NULL)
+    {
+        freeAddrInfo(addrInfo);
+        addrInfo = NULL;
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        // Associate the event object with the socket and select what network
+        // events we want to be notified about
+        err = SetNonBlockingMode();
+    }
+
+    Trace::record(TRACE_CONNECT, SocketRegistry::toHandle(this), err);
+
+    // If construction failed, close the socket if it is open
+    if (err != CL_ERR_OK)
+    {
+        if (m_socket != INVALID_SOCKET)
+        {
+            closesocket(m_socket);
+            m_socket = INVALID_SOCKET;
+        }
+    }
+
+    return err;
 }
 
 int SocketObj::constructAsync(const char* hostAddr, unsigned short hostPort)
 {
+    if (isRingAddr(hostAddr))
+    {
+        // Connect straight away, then have the network thread call the
+        // connection completed callback function as it would for a socket
+        int err = constructRing(hostAddr);
+        if (err == CL_ERR_OK)
+        {
+            m_conCompletedPending = true;
+            m_channel->signalNetEvent();
+        }
+        return err;
+    }
+
     int err = createNetEvent();
 
     if (err == CL_ERR_OK)
@@ -339,6 +977,18 @@ int SocketObj::constructAsync(const char* hostAddr, unsigned short hostPort)
     return err;
 }
 
+int SocketObj::constructBatched(const char* hostAddr)
+{
+    if (isRingAddr(hostAddr))
+    {
+        // Ring channels connect straight away, the host port is not used
+        return constructAsync(hostAddr, 0);
+    }
+
+    // The connect batch resolves the host address then connects
+    return createNetEvent();
+}
+
 int SocketObj::constructAccepted()
 {
     int err = createNetEvent();
@@ -360,6 +1010,39 @@ int SocketObj::constructAccepted()
     return err;
 }
 
+int SocketObj::constructRing(const char* hostAddr)
+{
+    RingChannel* channel = 0;
+    int err = connectRingChannel(hostAddr, &channel);
+    if (err == CL_ERR_OK)
+    {
+        m_channel.reset(channel);
+    }
+    return err;
+}
+
+bool SocketObj::isClosed() const
+{
+    return (m_channel.get() != 0) ? m_channel->isClosed() :
+        (m_socket == INVALID_SOCKET);
+}
+
+void SocketObj::resetConnection()
+{
+    if (m_channel.get() != 0)
+    {
+        m_channel->close();
+        return;
+    }
+    LINGER lingerOpt;
+    lingerOpt.l_onoff = 1;
+    lingerOpt.l_linger = 0;
+    setsockopt(m_socket, SOL_SOCKET, SO_LINGER,
+        reinterpret_cast<const char*>(&lingerOpt), sizeof(lingerOpt));
+    closesocket(m_socket);
+    m_socket = INVALID_SOCKET;
+}
+
 int SocketObj::createNetEvent()
 {
     int err = CL_ERR_OK;
@@ -382,6 +1065,13 @@ int SocketObj::SetNonBlockingMode()
         networkEvents |= FD_CONNECT;
     }
 
+    if (m_slowConsumer.get() != 0 &&
+        (isQueueing() || !m_slowConsumer->queue.empty()))
+    {
+        // The network thread writes what is queued as room becomes free
+        networkEvents |= FD_WRITE;
+    }
+
     if (WSAEventSelect(m_socket, m_netEvent, networkEvents) == SOCKET_ERROR)
     {
         err = WSAGetLastError();
@@ -434,38 +1124,105 @@ void SocketObj::onHostAddrResolved(ADDRINFOA* addrInfo,
             err = doConnectAsync(&m_crntAddrInfo);
         }
 
+        if (err != CL_ERR_OK || m_closeCalled)
+        {
+            // No connection attempt is under way
+            freeConnectAddrInfo();
+        }
+
         // Signal that the host address resolver thread has completed and
         // unlock the mutex before we call the callback function to avoid
         // possible deadlocks. Also, don't access any member data after we have
         // unlocked the mutex as the object may have been deleted (admittedly
         // rather unlikely)
         m_resolveAsyncCompleted = true;
-        m_resolveAsyncCompletedCondVar.notify_all();
+        s_resolveAsyncCompletedCondVar.notify_all();
     }
 
     if (err != CL_ERR_OK)
     {
+        Trace::record(TRACE_CONNECT, sktObjHandle, err);
         conCompletedFn(sktObjHandle, err, arg);
     }
 }
 
-int SocketObj::doConnect(ADDRINFOA** pCrntAddrInfo)
+void SocketObj::freeConnectAddrInfo()
 {
-    assert(pCrntAddrInfo != 0);
-    assert(*pCrntAddrInfo != NULL);
+    freeAddrInfo(m_addrInfo);
+    m_addrInfo = NULL;
+    m_crntAddrInfo = NULL;
 
-    int err = CL_ERR_OK;
+    if (m_connectBatch.get() != 0)
+    {
+        // The address information belongs to the batch, which can now start
+        // another connection attempt
+        m_connectBatch->onConnectCompleted();
+        m_connectBatch.reset();
+    }
+}
+
+bool SocketObj::connectBatched(const boost::shared_ptr<ConnectBatch>& batch,
+                               ADDRINFOA* addrInfo, int resolveErr)
+{
+    int err = resolveErr;
 
-    // Create the socket and connect synchronously to the first address in the
-    // given linked list of addresses. If the connection attempt fails then try
-    // the next address in the list and so on until we reach the end of the
-    // list
-    do
     {
-        err = CL_ERR_OK;
+        boost::lock_guard<boost::mutex> lock(m_mutex);
 
-        // Close the socket if it has already been created
-        if (m_socket != INVALID_SOCKET)
+        if (m_closeCalled)
+        {
+            return false;
+        }
+
+        m_connectBatch = batch;
+
+        if (err == CL_ERR_OK)
+        {
+            m_crntAddrInfo = addrInfo;
+            err = doConnectAsync(&m_crntAddrInfo);
+        }
+
+        if (err != CL_ERR_OK)
+        {
+            // No connection attempt is under way
+            freeConnectAddrInfo();
+        }
+    }
+
+    // The batch holds on to this object while it is called, so it cannot be
+    // deleted once the mutex is unlocked
+    if (err != CL_ERR_OK)
+    {
+        Trace::record(TRACE_CONNECT, SocketRegistry::toHandle(this), err);
+        m_conCompletedFn(SocketRegistry::toHandle(this), err, m_arg);
+    }
+    return true;
+}
+
+bool SocketObj::closeCalled()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    return m_closeCalled;
+}
+
+int SocketObj::doConnect(ADDRINFOA** pCrntAddrInfo)
+{
+    assert(pCrntAddrInfo != 0);
+    assert(*pCrntAddrInfo != NULL);
+
+    int err = CL_ERR_OK;
+
+    // Create the socket and connect synchronously to the first address in the
+    // given linked list of addresses. If the connection attempt fails then try
+    // the next address in the list and so on until we reach the end of the
+    // list
+    do
+    {
+        err = CL_ERR_OK;
+
+        // Close the socket if it has already been created
+        if (m_socket != INVALID_SOCKET)
         {
             closesocket(m_socket);
         }
@@ -558,7 +1315,7 @@ void SocketObj::onFdConnect(int fdConnectErr)
 
     assert(m_conCompletedFn != 0);
 
-    if (m_socket == INVALID_SOCKET)
+    if (isClosed())
     {
         // Socket closed
         return;
@@ -573,19 +1330,42 @@ void SocketObj::onFdConnect(int fdConnectErr)
 
         if (err != CL_ERR_OK)
         {
+            freeConnectAddrInfo();
+
             // Unlock the mutex because we do not want this object to be locked
             // when we call the callback function
             lock.unlock();
 
+            Trace::record(TRACE_CONNECT, SocketRegistry::toHandle(this), err);
             m_conCompletedFn(SocketRegistry::toHandle(this), err, m_arg);
         }
     }
     else
     {
+        m_conCompleted = (err == CL_ERR_OK);
+        freeConnectAddrInfo();
+
         // Unlock the mutex because we do not want this object to be locked
         // when we call the callback function
         lock.unlock();
 
+        if (err == CL_ERR_OK)
+        {
+            // Compression may have been turned on while connecting
+            Compression* comp = m_compression;
+            if (comp != NULL)
+            {
+                boost::lock_guard<boost::mutex> deflateLock(comp->mutex);
+                int helloErr = sendCompressHello();
+                if (helloErr != CL_ERR_OK)
+                {
+                    OUTPUT_FMT_DEBUG_STRING(
+                        "Compression hello failed, err=" << helloErr);
+                }
+            }
+        }
+
+        Trace::record(TRACE_CONNECT, SocketRegistry::toHandle(this), err);
         m_conCompletedFn(SocketRegistry::toHandle(this), err, m_arg);
     }
 }
@@ -594,25 +1374,34 @@ void SocketObj::onFdRead()
 {
     boost::unique_lock<boost::mutex> lock(m_mutex);
 
-    if (m_socket == INVALID_SOCKET)
+    if (isClosed())
     {
         // Socket closed
         return;
     }
 
+    ULONGLONG now = GetTickCount64();
+    if (pauseRecvIfLimited(now))
+    {
+        // Leave the data unread. FD_READ is not signaled again until recv()
+        // is called, which onTimer() does once the buckets have refilled
+        return;
+    }
+
     if (m_DataRecvLen < PREFIX_LEN)
     {
         // Read the length prefix so we know how much data follows
-        m_DataRecvBuf.resize(PREFIX_LEN);
-        int recvRetVal = recv(m_socket, &m_DataRecvBuf[m_DataRecvLen],
-            static_cast<int>(m_DataRecvBuf.size()) - m_DataRecvLen, 0);
-        if (recvRetVal != SOCKET_ERROR )
+        int bytesRecv = 0;
+        int err = recvSome(&m_DataRecvPrefix[m_DataRecvLen],
+            PREFIX_LEN - m_DataRecvLen, bytesRecv);
+        if (err == CL_ERR_OK)
         {
-            m_DataRecvLen += recvRetVal;
+            m_DataRecvLen += bytesRecv;
+            takeRecvTokens(bytesRecv, 0, now);
         }
-        else if (WSAGetLastError() != WSAEWOULDBLOCK)
+        else if (err != WSAEWOULDBLOCK)
         {
-            OUTPUT_FMT_DEBUG_STRING("recv failed, err=" << WSAGetLastError());
+            OUTPUT_FMT_DEBUG_STRING("recv failed, err=" << err);
         }
     }
 
@@ -621,62 +1410,269 @@ void SocketObj::onFdRead()
         // Calculate the value of the length prefix - note that it is in
         // network byte format
         int prefixValue =
-            ntohs(*(reinterpret_cast<PrefixType*>(&m_DataRecvBuf[0])));
+            ntohs(*(reinterpret_cast<PrefixType*>(m_DataRecvPrefix)));
 
         if (prefixValue > 0)
         {
-            // Read data following the length prefix
-            m_DataRecvBuf.resize(PREFIX_LEN + prefixValue);
-            int recvRetVal = recv(m_socket, &m_DataRecvBuf[m_DataRecvLen],
-                static_cast<int>(m_DataRecvBuf.size()) - m_DataRecvLen, 0);
-            if (recvRetVal != SOCKET_ERROR )
+            // Read data following the length prefix, borrowing a buffer for
+            // it the first time
+            if (m_DataRecvBuf == NULL)
             {
-                m_DataRecvLen += recvRetVal;
+                m_DataRecvBufPoolIdx = currentRecvBufPoolIdx();
+                m_DataRecvBuf =
+                    s_recvBufPools[m_DataRecvBufPoolIdx].borrow(prefixValue);
             }
-            else if (WSAGetLastError() != WSAEWOULDBLOCK)
+            int dataLen = m_DataRecvLen - PREFIX_LEN;
+            int bytesRecv = 0;
+            int err = recvSome(&m_DataRecvBuf[dataLen], prefixValue - dataLen,
+                bytesRecv);
+            if (err == CL_ERR_OK)
+            {
+                m_DataRecvLen += bytesRecv;
+                takeRecvTokens(bytesRecv, 0, now);
+            }
+            else if (err != WSAEWOULDBLOCK)
             {
-                OUTPUT_FMT_DEBUG_STRING("recv failed, err=" <<
-                    WSAGetLastError());
+                OUTPUT_FMT_DEBUG_STRING("recv failed, err=" << err);
             }
         }
 
         if (m_DataRecvLen == PREFIX_LEN + prefixValue)
         {
-            // We have received all data, so notify the caller
-            std::vector<char> localDataRecvBuf;
-            localDataRecvBuf.swap(m_DataRecvBuf);
-                // N.B. using swap() in this way sets vector capacity of
-                // m_DataRecvBuf back to default
+            // We have received all data, so notify the caller. The buffer is
+            // given back once the data has been handled
+            Trace::record(TRACE_FRAME_RX, SocketRegistry::toHandle(this),
+                prefixValue);
+            char* dataRecvBuf = m_DataRecvBuf;
+            unsigned char dataRecvBufPoolIdx = m_DataRecvBufPoolIdx;
+            m_DataRecvBuf = NULL;
             m_DataRecvLen = 0;
 
             if (prefixValue > 0)
+            {
+                // A library frame and the zero-length frame marking it count
+                // as one
+                takeRecvTokens(0, 1, now);
+            }
+
+            if (prefixValue == 0)
+            {
+                // CLSendData() refuses data of length 0, so this marks the
+                // next frame as a library frame
+                m_libFrameNext = true;
+            }
+            else if (m_libFrameNext)
+            {
+                m_libFrameNext = false;
+
+                // Unlock the mutex because we do not want this object to be
+                // locked when we call any of the callback functions
+                lock.unlock();
+
+                onLibFrame(dataRecvBuf, prefixValue);
+            }
+            else
             {
                 // Unlock the mutex because we do not want this object to be
                 // locked when we call the callback function
                 lock.unlock();
 
-                m_dataRecvFn(SocketRegistry::toHandle(this),
-                    &localDataRecvBuf[PREFIX_LEN], prefixValue, m_arg);
+                Capture::record(CL_CAPTURE_RECV, m_captureId, dataRecvBuf,
+                    prefixValue);
+                Trace::record(TRACE_CALLBACK_BEGIN,
+                    SocketRegistry::toHandle(this), TRACE_CALLBACK_DATA_RECV);
+                m_dataRecvFn(SocketRegistry::toHandle(this), dataRecvBuf,
+                    prefixValue, m_arg);
+                Trace::record(TRACE_CALLBACK_END,
+                    SocketRegistry::toHandle(this), TRACE_CALLBACK_DATA_RECV);
+            }
+
+            if (dataRecvBuf != NULL)
+            {
+                s_recvBufPools[dataRecvBufPoolIdx].giveBack(dataRecvBuf,
+                    prefixValue);
             }
         }
     }
 }
 
+void SocketObj::onFdWrite()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (isClosed() || m_slowConsumer.get() == 0)
+    {
+        // Socket closed, or there has never been anything to queue
+        return;
+    }
+
+    int err = drainSendQueue();
+    if (err != CL_ERR_OK)
+    {
+        OUTPUT_FMT_DEBUG_STRING("Send queue write failed, err=" << err);
+    }
+}
+
+bool SocketObj::pauseRecvIfLimited(ULONGLONG now)
+{
+    if (m_rateLimits.get() == 0)
+    {
+        // No limits have been set
+        return false;
+    }
+
+    ULONGLONG byteReadyTime = m_rateLimits->recvByteBucket.readyTime(now);
+    ULONGLONG frameReadyTime = m_rateLimits->recvFrameBucket.readyTime(now);
+    if (byteReadyTime <= now && frameReadyTime <= now)
+    {
+        return false;
+    }
+
+    if (recvResumeDeadline() == NO_TIMER)
+    {
+        // Count each pause once, however many times the network event is
+        // signaled while it lasts
+        if (byteReadyTime > now)
+        {
+            ++m_rateLimits->recvByteLimitHits;
+        }
+        if (frameReadyTime > now)
+        {
+            ++m_rateLimits->recvFrameLimitHits;
+        }
+    }
+
+    // This is only called by the network thread, which looks at the timer
+    // deadlines again before it next waits
+    InterlockedExchange64(&m_recvResumeDeadline, static_cast<LONGLONG>(
+        (std::max)(byteReadyTime, frameReadyTime)));
+    return true;
+}
+
+void SocketObj::takeRecvTokens(int bytes, int frames, ULONGLONG now)
+{
+    if (m_rateLimits.get() == 0)
+    {
+        return;
+    }
+
+    if (bytes > 0)
+    {
+        m_rateLimits->recvByteBucket.take(bytes, now);
+    }
+    if (frames > 0)
+    {
+        m_rateLimits->recvFrameBucket.take(frames, now);
+    }
+}
+
+ULONGLONG SocketObj::recvResumeDeadline() const
+{
+    // Read all 64 bits at once, even on 32-bit Windows
+    return static_cast<ULONGLONG>(InterlockedCompareExchange64(
+        const_cast<volatile LONGLONG*>(&m_recvResumeDeadline), 0, 0));
+}
+
+void SocketObj::onChannelEvent()
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    if (isClosed())
+    {
+        // Channel closed
+        return;
+    }
+
+    // Reset the event before looking at the channel, so anything the other
+    // end does from now on signals it again
+    m_channel->resetNetEvent();
+
+    bool conCompletedPending = m_conCompletedPending;
+    m_conCompletedPending = false;
+
+    // Unlock the mutex because we do not want this object to be locked when we
+    // call any of the callback functions
+    lock.unlock();
+
+    if (conCompletedPending)
+    {
+        onFdConnect(CL_ERR_OK);
+    }
+
+    for (int readIdx = 0; readIdx < CHANNEL_READS_PER_EVENT &&
+        m_channel->hasData() && !m_channel->isClosed() &&
+        recvResumeDeadline() == NO_TIMER; ++readIdx)
+    {
+        onFdRead();
+    }
+
+    if (m_channel->takePeerClosed())
+    {
+        // A peer process that exited without closing looks the same as a
+        // connection that was reset
+        onFdClose(m_channel->peerExited() ? WSAECONNRESET : CL_ERR_OK);
+    }
+
+    m_channel->armWakeup();
+}
+
 void SocketObj::onFdClose(int fdCloseErr)
 {
     boost::unique_lock<boost::mutex> lock(m_mutex);
 
-    if (m_socket == INVALID_SOCKET)
+    if (isClosed())
     {
         // Socket closed
         return;
     }
 
     // Unlock the mutex because we do not want this object to be locked when we
-    // call the callback function
+    // call any of the callback functions
     lock.unlock();
 
-    m_socketClosedFn(SocketRegistry::toHandle(this), fdCloseErr, m_arg);
+    notifyClosed(fdCloseErr);
+}
+
+void SocketObj::notifyClosed(int err)
+{
+    // No responses can arrive now, so fail the requests still waiting
+    PendingTable* table = m_pendingTable;
+    if (table != NULL)
+    {
+        std::vector<PendingTable::Completion> completions;
+        table->takeAll(completions);
+        completeRequests(completions, CL_ERR_SOCKET_CLOSED);
+    }
+
+    Trace::record(TRACE_CLOSE, SocketRegistry::toHandle(this), err);
+    Capture::record(CL_CAPTURE_CLOSE, m_captureId, 0, 0);
+    m_socketClosedFn(SocketRegistry::toHandle(this), err, m_arg);
+}
+
+int SocketObj::recvSome(char* buf, int len, int& bytesRecv)
+{
+    bytesRecv = 0;
+    int err = CL_ERR_OK;
+
+    if (m_channel.get() != 0)
+    {
+        err = m_channel->recv(buf, len, bytesRecv);
+    }
+    else
+    {
+        int recvRetVal = recv(m_socket, buf, len, 0);
+        if (recvRetVal != SOCKET_ERROR)
+        {
+            bytesRecv = recvRetVal;
+        }
+        else
+        {
+            err = WSAGetLastError();
+        }
+    }
+
+    m_bytesRecv += bytesRecv;
+    return err;
 }
 
 int SocketObj::sendAll(const char* buf, int len, int& bytesSent)
@@ -700,3 +1696,1116 @@ int SocketObj::sendAll(const char* buf, int len, int& bytesSent)
 
     return err;
 }
+
+int SocketObj::sendBufs(const WSABUF* bufs, DWORD bufCount, int pri,
+                        bool droppable)
+{
+    ULONG len = 0;
+    for (DWORD bufIdx = 0; bufIdx < bufCount; ++bufIdx)
+    {
+        len += bufs[bufIdx].len;
+    }
+
+    acquireSendTurn(pri);
+    waitForSendTokens(len);
+
+    int err = CL_ERR_OK;
+    if (m_channel.get() != 0)
+    {
+        // The channel writes the buffers as one piece, so this object does not
+        // need to stay locked while waiting for the other end to make space
+        err = m_channel->send(bufs, bufCount);
+    }
+    else
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+
+        if (m_dataStreamCorrupted)
+        {
+            err = CL_ERR_DATA_STREAM_CORRUPTED;
+        }
+        else if (isQueueing() && !makeRoomToQueue(len))
+        {
+            err = CL_ERR_SLOW_CONSUMER;
+        }
+        else if (m_cork.get() != 0 && m_cork->maxDelay != 0)
+        {
+            err = corkBufs(bufs, bufCount, pri);
+        }
+        else
+        {
+            err = writeBufs(bufs, bufCount, pri, droppable);
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        Trace::record(TRACE_FRAME_TX, SocketRegistry::toHandle(this), len);
+    }
+
+    releaseSendTurn(pri, (err == CL_ERR_OK) ? len : 0);
+    return err;
+}
+
+void SocketObj::acquireSendTurn(int pri)
+{
+    SendTurn& turn = sendTurn();
+    boost::unique_lock<boost::mutex> turnLock(turn.mutex);
+
+    ++turn.lanes[pri].sendersWaiting;
+
+    bool blocked = false;
+    for (;;)
+    {
+        bool higherPriWaiting = false;
+        for (int higherPri = pri + 1; higherPri < CL_PRI_COUNT; ++higherPri)
+        {
+            if (turn.lanes[higherPri].sendersWaiting > 0)
+            {
+                higherPriWaiting = true;
+            }
+        }
+
+        if (!turn.turnTaken && !higherPriWaiting)
+        {
+            break;
+        }
+
+        if (!blocked)
+        {
+            blocked = true;
+            Trace::record(TRACE_SEND_BLOCK_BEGIN,
+                SocketRegistry::toHandle(this), 0);
+        }
+        turn.condVar.wait(turnLock);
+    }
+
+    if (blocked)
+    {
+        Trace::record(TRACE_SEND_BLOCK_END, SocketRegistry::toHandle(this),
+            0);
+    }
+
+    --turn.lanes[pri].sendersWaiting;
+    turn.turnTaken = true;
+}
+
+void SocketObj::releaseSendTurn(int pri, ULONG bytesSent)
+{
+    SendTurn& turn = *m_sendTurn;
+    boost::lock_guard<boost::mutex> turnLock(turn.mutex);
+
+    turn.turnTaken = false;
+    if (bytesSent > 0)
+    {
+        ++turn.lanes[pri].framesSent;
+        turn.lanes[pri].bytesSent += bytesSent;
+    }
+
+    // Wake every waiting thread, as only the one with the highest priority
+    // can take the turn
+    turn.condVar.notify_all();
+}
+
+void SocketObj::waitForSendTokens(ULONG len)
+{
+    boost::unique_lock<boost::mutex> turnLock(m_sendTurn->mutex);
+
+    if (m_rateLimits.get() == 0)
+    {
+        // No limits have been set
+        return;
+    }
+
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG readyTime = m_rateLimits->sendByteBucket.readyTime(now);
+    if (readyTime > now)
+    {
+        ++m_rateLimits->sendByteLimitHits;
+        Trace::record(TRACE_SEND_BLOCK_BEGIN, SocketRegistry::toHandle(this),
+            0);
+    }
+    bool blocked = (readyTime > now);
+
+    while (readyTime > now)
+    {
+        // Keep the turn while waiting, so the data is still sent in order
+        turnLock.unlock();
+        Sleep(static_cast<DWORD>(readyTime - now));
+        turnLock.lock();
+
+        now = GetTickCount64();
+        readyTime = m_rateLimits->sendByteBucket.readyTime(now);
+    }
+
+    if (blocked)
+    {
+        Trace::record(TRACE_SEND_BLOCK_END, SocketRegistry::toHandle(this),
+            0);
+    }
+
+    m_rateLimits->sendByteBucket.take(len, now);
+}
+
+int SocketObj::writeBufs(const WSABUF* bufs, DWORD bufCount, int pri,
+                         bool droppable)
+{
+    if (isQueueing())
+    {
+        return queueBufs(bufs, bufCount, pri, droppable);
+    }
+
+    if (m_slowConsumer.get() != 0 && !m_slowConsumer->queue.empty())
+    {
+        // Data that the network thread queued goes out first
+        int err = flushSendQueue();
+        if (err != CL_ERR_OK)
+        {
+            return err;
+        }
+    }
+
+    return writeBufsBlocking(bufs, bufCount);
+}
+
+int SocketObj::writeBufsBlocking(const WSABUF* bufs, DWORD bufCount)
+{
+    // Switch the socket to blocking mode then back to non-blocking mode when
+    // we are finished
+    int err = SetBlockingMode();
+    if (err != CL_ERR_OK)
+    {
+        return err;
+    }
+
+    // Send each buffer in turn. If any bytes were sent before an error then
+    // the other end can no longer tell where frames start
+    bool anySent = false;
+    for (DWORD bufIdx = 0; bufIdx < bufCount && err == CL_ERR_OK; ++bufIdx)
+    {
+        int bytesSent = 0;
+        err = sendAll(bufs[bufIdx].buf, static_cast<int>(bufs[bufIdx].len),
+            bytesSent);
+        if (bytesSent > 0)
+        {
+            anySent = true;
+        }
+    }
+
+    if (err != CL_ERR_OK && anySent)
+    {
+        m_dataStreamCorrupted = true;
+    }
+
+    int setNonBlockingModeErr = SetNonBlockingMode();
+    if (err == CL_ERR_OK)
+    {
+        err = setNonBlockingModeErr;
+    }
+
+    return err;
+}
+
+int SocketObj::corkBufs(const WSABUF* bufs, DWORD bufCount, int pri)
+{
+    bool wasEmpty = (corkedLen() == 0);
+    std::vector<char>& corkBuf = m_cork->bufs[pri];
+    for (DWORD bufIdx = 0; bufIdx < bufCount; ++bufIdx)
+    {
+        corkBuf.insert(corkBuf.end(), bufs[bufIdx].buf,
+            bufs[bufIdx].buf + bufs[bufIdx].len);
+    }
+
+    // Data above normal priority is never held back, it goes out ahead of
+    // anything else held back
+    if (pri != CL_PRI_NORMAL ||
+        static_cast<int>(corkedLen()) >= m_cork->maxBytes)
+    {
+        return flushCork(true);
+    }
+
+    if (wasEmpty)
+    {
+        // Wake the network thread so that it does not wait past the new
+        // deadline
+        InterlockedExchange64(&m_corkDeadline,
+            static_cast<LONGLONG>(GetTickCount64() + m_cork->maxDelay));
+        WSASetEvent(m_netEvent);
+    }
+
+    return CL_ERR_OK;
+}
+
+int SocketObj::flushCork(bool mayBlock)
+{
+    InterlockedExchange64(&m_corkDeadline, static_cast<LONGLONG>(NO_TIMER));
+
+    if (m_dataStreamCorrupted)
+    {
+        for (int pri = 0; m_cork.get() != 0 && pri < CL_PRI_COUNT; ++pri)
+        {
+            m_cork->bufs[pri].clear();
+        }
+        return CL_ERR_DATA_STREAM_CORRUPTED;
+    }
+
+    if (m_cork.get() == 0)
+    {
+        // Cork mode has never been turned on
+        return CL_ERR_OK;
+    }
+
+    // Gather the data held back, highest priority first
+    WSABUF bufs[CL_PRI_COUNT];
+    DWORD bufCount = 0;
+    int topPri = CL_PRI_NORMAL;
+    for (int pri = CL_PRI_COUNT - 1; pri >= 0; --pri)
+    {
+        std::vector<char>& corkBuf = m_cork->bufs[pri];
+        if (!corkBuf.empty())
+        {
+            if (bufCount == 0)
+            {
+                topPri = pri;
+            }
+            bufs[bufCount].buf = &corkBuf[0];
+            bufs[bufCount].len = static_cast<ULONG>(corkBuf.size());
+            ++bufCount;
+        }
+    }
+
+    if (bufCount == 0)
+    {
+        return CL_ERR_OK;
+    }
+
+    // Data written together is queued as one frame, at the priority of the
+    // most urgent part of it
+    int err = CL_ERR_OK;
+    if (mayBlock || isQueueing())
+    {
+        err = writeBufs(bufs, bufCount, topPri, false);
+    }
+    else
+    {
+        // Queue what the socket does not take straight away for the network
+        // thread to write on FD_WRITE, as a slow consumer policy would
+        if (m_slowConsumer.get() == 0)
+        {
+            m_slowConsumer.reset(new SlowConsumer);
+        }
+        err = queueBufs(bufs, bufCount, topPri, false);
+    }
+    for (int pri = 0; pri < CL_PRI_COUNT; ++pri)
+    {
+        m_cork->bufs[pri].clear();
+    }
+
+    if (err != CL_ERR_OK)
+    {
+        // The callers were told the data held back had been sent, so losing
+        // any of it leaves a gap the other end cannot know about
+        m_dataStreamCorrupted = true;
+    }
+
+    return err;
+}
+
+size_t SocketObj::corkedLen() const
+{
+    size_t len = 0;
+    for (int pri = 0; m_cork.get() != 0 && pri < CL_PRI_COUNT; ++pri)
+    {
+        len += m_cork->bufs[pri].size();
+    }
+    return len;
+}
+
+ULONGLONG SocketObj::corkDeadline() const
+{
+    // Read all 64 bits at once, even on 32-bit Windows
+    return static_cast<ULONGLONG>(InterlockedCompareExchange64(
+        const_cast<volatile LONGLONG*>(&m_corkDeadline), 0, 0));
+}
+
+bool SocketObj::isQueueing() const
+{
+    return m_slowConsumer.get() != 0 &&
+        m_slowConsumer->policy.action != CL_SLOW_CONSUMER_NONE;
+}
+
+bool SocketObj::makeRoomToQueue(ULONG len)
+{
+    SlowConsumer& slow = *m_slowConsumer;
+
+    if (slow.disconnected)
+    {
+        ++slow.framesRefused;
+        return false;
+    }
+
+    // A frame is always let through when nothing is queued, as it may well
+    // be written straight away
+    size_t maxLen = slow.policy.maxQueuedBytes;
+    if (maxLen == 0 || slow.queue.empty() || slow.queuedLen + len <= maxLen)
+    {
+        return true;
+    }
+
+    ++slow.hits;
+    if (slow.policy.action == CL_SLOW_CONSUMER_DROP)
+    {
+        // Only drop anything if that makes enough room
+        if (slow.queuedLen - slow.droppableLen + len <= maxLen)
+        {
+            std::list<QueuedFrame>::iterator it = slow.queue.begin();
+            while (it != slow.queue.end() && slow.queuedLen + len > maxLen)
+            {
+                if (it->droppable)
+                {
+                    it = dropQueuedFrame(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            resetSendQueueDeadline();
+            return true;
+        }
+    }
+    else
+    {
+        // Have the network thread disconnect or call back straight away
+        slow.limitReached = true;
+        InterlockedExchange64(&m_sendQueueDeadline,
+            static_cast<LONGLONG>(GetTickCount64()));
+        WSASetEvent(m_netEvent);
+    }
+
+    ++slow.framesRefused;
+    return false;
+}
+
+int SocketObj::queueBufs(const WSABUF* bufs, DWORD bufCount, int pri,
+                         bool droppable)
+{
+    SlowConsumer& slow = *m_slowConsumer;
+
+    ULONG len = 0;
+    for (DWORD bufIdx = 0; bufIdx < bufCount; ++bufIdx)
+    {
+        len += bufs[bufIdx].len;
+    }
+
+    ULONG sentLen = 0;
+    if (slow.queue.empty())
+    {
+        // Nothing is queued ahead, so write what the socket takes now
+        DWORD bytesSent = 0;
+        if (WSASend(m_socket, const_cast<WSABUF*>(bufs), bufCount, &bytesSent,
+            0, NULL, NULL) != SOCKET_ERROR)
+        {
+            sentLen = bytesSent;
+        }
+        else
+        {
+            int err = WSAGetLastError();
+            if (err != WSAEWOULDBLOCK)
+            {
+                return err;
+            }
+        }
+
+        if (sentLen == len)
+        {
+            return CL_ERR_OK;
+        }
+    }
+
+    // Queue the frame for the network thread to write as room becomes free,
+    // ahead of frames at a lower priority. A frame that has started to be
+    // written is never overtaken, as the other end would lose its place
+    std::list<QueuedFrame>::iterator pos = slow.queue.end();
+    while (pos != slow.queue.begin())
+    {
+        std::list<QueuedFrame>::iterator prev = pos;
+        --prev;
+        if (prev->pri >= pri || prev->sentLen > 0)
+        {
+            break;
+        }
+        pos = prev;
+    }
+
+    bool wasEmpty = slow.queue.empty();
+    QueuedFrame& frame = *slow.queue.insert(pos, QueuedFrame());
+    frame.data.reserve(len);
+    for (DWORD bufIdx = 0; bufIdx < bufCount; ++bufIdx)
+    {
+        frame.data.insert(frame.data.end(), bufs[bufIdx].buf,
+            bufs[bufIdx].buf + bufs[bufIdx].len);
+    }
+    frame.sentLen = sentLen;
+    frame.pri = pri;
+    frame.queuedTick = GetTickCount64();
+    frame.droppable = droppable && sentLen == 0;
+
+    slow.queuedLen += len - sentLen;
+    if (frame.droppable)
+    {
+        slow.droppableLen += frame.data.size();
+    }
+
+    if (sendQueueDeadline() == NO_TIMER && slow.policy.maxQueueAgeMs != 0 &&
+        !slow.signaled)
+    {
+        // Wake the network thread so that it does not wait past the new
+        // deadline
+        InterlockedExchange64(&m_sendQueueDeadline, static_cast<LONGLONG>(
+            frame.queuedTick + slow.policy.maxQueueAgeMs));
+        WSASetEvent(m_netEvent);
+    }
+
+    if (wasEmpty && !isQueueing())
+    {
+        // Without a policy FD_WRITE is only selected while data the network
+        // thread could not write straight away is queued
+        int err = SetNonBlockingMode();
+        if (err != CL_ERR_OK)
+        {
+            return err;
+        }
+    }
+
+    if (sentLen > 0)
+    {
+        // FD_WRITE is only signaled once a write has failed for want of room,
+        // so keep writing until one does
+        return drainSendQueue();
+    }
+    return CL_ERR_OK;
+}
+
+int SocketObj::drainSendQueue()
+{
+    SlowConsumer& slow = *m_slowConsumer;
+
+    int err = CL_ERR_OK;
+    bool frameSent = false;
+    while (!slow.queue.empty())
+    {
+        QueuedFrame& frame = slow.queue.front();
+        int sendRetVal = send(m_socket, &frame.data[frame.sentLen],
+            static_cast<int>(frame.data.size() - frame.sentLen), 0);
+        if (sendRetVal == SOCKET_ERROR)
+        {
+            err = WSAGetLastError();
+            break;
+        }
+
+        if (frame.droppable)
+        {
+            // Once any of it is written the rest must follow
+            frame.droppable = false;
+            slow.droppableLen -= frame.data.size();
+        }
+
+        frame.sentLen += sendRetVal;
+        slow.queuedLen -= sendRetVal;
+        if (frame.sentLen == frame.data.size())
+        {
+            slow.queue.pop_front();
+            frameSent = true;
+        }
+    }
+
+    if (err == WSAEWOULDBLOCK)
+    {
+        // FD_WRITE is signaled once there is room again
+        err = CL_ERR_OK;
+    }
+    else if (err != CL_ERR_OK)
+    {
+        // The callers were told the data queued had been sent, so losing any
+        // of it leaves a gap the other end cannot know about
+        m_dataStreamCorrupted = true;
+        slow.queue.clear();
+        slow.queuedLen = 0;
+        slow.droppableLen = 0;
+    }
+
+    if (slow.queue.empty())
+    {
+        // The other end has caught up, so call back again the next time a
+        // limit is reached
+        slow.signaled = false;
+        slow.limitReached = false;
+        InterlockedExchange64(&m_sendQueueDeadline,
+            static_cast<LONGLONG>(NO_TIMER));
+    }
+    else if (frameSent)
+    {
+        resetSendQueueDeadline();
+    }
+
+    return err;
+}
+
+int SocketObj::flushSendQueue()
+{
+    SlowConsumer& slow = *m_slowConsumer;
+
+    InterlockedExchange64(&m_sendQueueDeadline,
+        static_cast<LONGLONG>(NO_TIMER));
+    slow.signaled = false;
+
+    if (m_socket == INVALID_SOCKET)
+    {
+        // The connection was reset, taking the queue with it
+        return CL_ERR_OK;
+    }
+
+    // Write what is still queued ahead of anything sent from now on, which
+    // also selects network events without FD_WRITE again once the queue is
+    // empty
+    std::list<QueuedFrame> frames;
+    frames.swap(slow.queue);
+    slow.queuedLen = 0;
+    slow.droppableLen = 0;
+
+    std::vector<WSABUF> bufs;
+    std::list<QueuedFrame>::iterator it = frames.begin();
+    for (; it != frames.end(); ++it)
+    {
+        WSABUF buf;
+        buf.buf = &it->data[it->sentLen];
+        buf.len = static_cast<ULONG>(it->data.size() - it->sentLen);
+        bufs.push_back(buf);
+    }
+
+    int err = bufs.empty() ? SetNonBlockingMode() :
+        writeBufsBlocking(&bufs[0], static_cast<DWORD>(bufs.size()));
+
+    if (err != CL_ERR_OK && !bufs.empty())
+    {
+        // As for data held back in cork mode, the callers were told this had
+        // been sent
+        m_dataStreamCorrupted = true;
+    }
+
+    return err;
+}
+
+void SocketObj::lingerSendQueue()
+{
+    SlowConsumer& slow = *m_slowConsumer;
+
+    // Write what the socket takes straight away, which is often all of it
+    if (drainSendQueue() != CL_ERR_OK || slow.queue.empty())
+    {
+        return;
+    }
+
+    // The callers were told the data queued had been sent, so the rest is
+    // written in the background rather than waiting here, with m_mutex
+    // locked, for the other end to take it
+    std::vector<char> data;
+    data.reserve(slow.queuedLen);
+    std::list<QueuedFrame>::const_iterator it = slow.queue.begin();
+    for (; it != slow.queue.end(); ++it)
+    {
+        data.insert(data.end(), it->data.begin() + it->sentLen,
+            it->data.end());
+    }
+    slow.queue.clear();
+    slow.queuedLen = 0;
+    slow.droppableLen = 0;
+    InterlockedExchange64(&m_sendQueueDeadline,
+        static_cast<LONGLONG>(NO_TIMER));
+
+    // The socket is left non-blocking once network events are no longer
+    // selected
+    WSAEventSelect(m_socket, NULL, 0);
+    SendLinger::add(m_socket, data, GetTickCount64() + CLOSE_DRAIN_MS);
+    m_socket = INVALID_SOCKET;
+}
+
+std::list<SocketObj::QueuedFrame>::iterator SocketObj::dropQueuedFrame(
+    std::list<QueuedFrame>::iterator it)
+{
+    SlowConsumer& slow = *m_slowConsumer;
+
+    ++slow.framesDropped;
+    slow.bytesDropped += it->data.size();
+    slow.queuedLen -= it->data.size();
+    slow.droppableLen -= it->data.size();
+    return slow.queue.erase(it);
+}
+
+int SocketObj::checkSendQueue(ULONGLONG now, ULONG& bytesQueued,
+                              ULONG& queueAgeMs)
+{
+    InterlockedExchange64(&m_sendQueueDeadline,
+        static_cast<LONGLONG>(NO_TIMER));
+
+    SlowConsumer& slow = *m_slowConsumer;
+    ULONGLONG maxAge = slow.policy.maxQueueAgeMs;
+    ULONGLONG oldestTick = oldestQueuedTick();
+    bool tooOld = (maxAge != 0 && oldestTick != NO_TIMER &&
+        oldestTick + maxAge <= now);
+
+    if (slow.policy.action == CL_SLOW_CONSUMER_DROP)
+    {
+        if (!tooOld)
+        {
+            resetSendQueueDeadline();
+            return CL_SLOW_CONSUMER_NONE;
+        }
+
+        // Drop every frame that is too old and may be dropped. Only plain
+        // data at CL_PRI_NORMAL may be, and that is queued in order, so the
+        // first such frame that is not too old is the next to become so
+        ++slow.hits;
+        std::list<QueuedFrame>::iterator it = slow.queue.begin();
+        while (it != slow.queue.end() &&
+            (!it->droppable || it->queuedTick + maxAge <= now))
+        {
+            if (it->droppable)
+            {
+                it = dropQueuedFrame(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        if (it != slow.queue.end())
+        {
+            InterlockedExchange64(&m_sendQueueDeadline,
+                static_cast<LONGLONG>(it->queuedTick + maxAge));
+        }
+        return CL_SLOW_CONSUMER_NONE;
+    }
+
+    if (slow.policy.action == CL_SLOW_CONSUMER_NONE ||
+        (!tooOld && !slow.limitReached))
+    {
+        resetSendQueueDeadline();
+        return CL_SLOW_CONSUMER_NONE;
+    }
+
+    if (tooOld)
+    {
+        ++slow.hits;
+    }
+    slow.limitReached = false;
+    bytesQueued = static_cast<ULONG>(slow.queuedLen);
+    queueAgeMs = (oldestTick == NO_TIMER) ? 0 :
+        static_cast<ULONG>(now - oldestTick);
+
+    if (slow.policy.action == CL_SLOW_CONSUMER_CALLBACK)
+    {
+        if (slow.signaled)
+        {
+            return CL_SLOW_CONSUMER_NONE;
+        }
+
+        // The deadline stays off until the queue next empties
+        slow.signaled = true;
+        return CL_SLOW_CONSUMER_CALLBACK;
+    }
+
+    // Reset the connection rather than have the TCP stack go on holding data
+    // the other end is not reading
+    resetConnection();
+
+    slow.disconnected = true;
+    slow.queue.clear();
+    slow.queuedLen = 0;
+    slow.droppableLen = 0;
+    return CL_SLOW_CONSUMER_DISCONNECT;
+}
+
+ULONGLONG SocketObj::oldestQueuedTick() const
+{
+    const SlowConsumer& slow = *m_slowConsumer;
+
+    std::list<QueuedFrame>::const_iterator it = slow.queue.begin();
+    if (it == slow.queue.end())
+    {
+        return NO_TIMER;
+    }
+
+    // Behind the front frame the queue is in priority order, oldest first
+    // within each priority, so only the first frame at each priority needs
+    // looking at. Nothing follows the first frame at CL_PRI_NORMAL but more
+    // of the same
+    ULONGLONG oldestTick = it->queuedTick;
+    int lastPri = CL_PRI_COUNT;
+    for (++it; it != slow.queue.end(); ++it)
+    {
+        if (it->pri != lastPri)
+        {
+            oldestTick = (std::min)(oldestTick, it->queuedTick);
+            if (it->pri == CL_PRI_NORMAL)
+            {
+                break;
+            }
+            lastPri = it->pri;
+        }
+    }
+    return oldestTick;
+}
+
+void SocketObj::resetSendQueueDeadline()
+{
+    const SlowConsumer& slow = *m_slowConsumer;
+
+    ULONGLONG deadline = NO_TIMER;
+    if (slow.policy.maxQueueAgeMs != 0 && !slow.queue.empty() &&
+        !slow.signaled)
+    {
+        deadline = oldestQueuedTick() + slow.policy.maxQueueAgeMs;
+    }
+    InterlockedExchange64(&m_sendQueueDeadline,
+        static_cast<LONGLONG>(deadline));
+}
+
+ULONGLONG SocketObj::sendQueueDeadline() const
+{
+    // Read all 64 bits at once, even on 32-bit Windows
+    return static_cast<ULONGLONG>(InterlockedCompareExchange64(
+        const_cast<volatile LONGLONG*>(&m_sendQueueDeadline), 0, 0));
+}
+
+void SocketObj::fillLibFrameHeader(char* header, char frameType,
+                                   CLRequestId reqId, int len)
+{
+    // A zero-length frame followed by the length prefix and header of the
+    // library frame, all in network byte format
+    *(reinterpret_cast<PrefixType*>(header)) = 0;
+    *(reinterpret_cast<PrefixType*>(header + PREFIX_LEN)) =
+        htons(static_cast<PrefixType>(LIB_FRAME_HEADER_LEN + len));
+    header[2 * PREFIX_LEN] = frameType;
+    u_long netReqId = htonl(reqId);
+    memcpy(&header[2 * PREFIX_LEN + 1], &netReqId, sizeof(netReqId));
+}
+
+int SocketObj::sendLibFrame(char frameType, CLRequestId reqId,
+                            const char* buf, int len)
+{
+    char header[LIB_FRAME_MARK_LEN];
+    fillLibFrameHeader(header, frameType, reqId, len);
+
+    WSABUF bufs[2];
+    bufs[0].buf = header;
+    bufs[0].len = sizeof(header);
+    bufs[1].buf = const_cast<char*>(buf);
+    bufs[1].len = len;
+    return sendBufs(bufs, (len > 0) ? 2 : 1, CL_PRI_NORMAL, false);
+}
+
+int SocketObj::queueLibFrame(char frameType, CLRequestId reqId)
+{
+    char header[LIB_FRAME_MARK_LEN];
+    fillLibFrameHeader(header, frameType, reqId, 0);
+
+    WSABUF buf;
+    buf.buf = header;
+    buf.len = sizeof(header);
+
+    int err = CL_ERR_OK;
+    if (m_channel.get() != 0)
+    {
+        // The frame is dropped if the ring is full or another thread is
+        // sending
+        err = m_channel->trySend(&buf, 1);
+    }
+    else
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+
+        if (m_dataStreamCorrupted)
+        {
+            err = CL_ERR_DATA_STREAM_CORRUPTED;
+        }
+        else
+        {
+            // Queue what the socket does not take straight away for the
+            // network thread to write on FD_WRITE, as for data held back in
+            // cork mode. The send turn and the send rate limit are passed
+            // over, as waiting for either would block the network thread
+            if (m_slowConsumer.get() == 0)
+            {
+                m_slowConsumer.reset(new SlowConsumer);
+            }
+            err = queueBufs(&buf, 1, CL_PRI_NORMAL, false);
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        Trace::record(TRACE_FRAME_TX, SocketRegistry::toHandle(this),
+            buf.len);
+    }
+    else
+    {
+        OUTPUT_FMT_DEBUG_STRING("Library frame not sent, type=" <<
+            static_cast<int>(frameType) << ", err=" << err);
+    }
+
+    return err;
+}
+
+void SocketObj::onLibFrame(const char* buf, int len)
+{
+    if (len < LIB_FRAME_HEADER_LEN)
+    {
+        OUTPUT_FMT_DEBUG_STRING("Library frame too short, len=" << len);
+        return;
+    }
+
+    char frameType = buf[0];
+    u_long netReqId = 0;
+    memcpy(&netReqId, &buf[1], sizeof(netReqId));
+    CLRequestId reqId = ntohl(netReqId);
+    const char* data = buf + LIB_FRAME_HEADER_LEN;
+    int dataLen = len - LIB_FRAME_HEADER_LEN;
+
+    if (frameType == LIB_FRAME_REQUEST)
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        CLPRequestRecvFn requestRecvFn = m_requestRecvFn;
+        lock.unlock();
+
+        if (requestRecvFn != 0)
+        {
+            Trace::record(TRACE_CALLBACK_BEGIN, SocketRegistry::toHandle(this),
+                TRACE_CALLBACK_REQUEST_RECV);
+            requestRecvFn(SocketRegistry::toHandle(this), reqId, data, dataLen,
+                m_arg);
+            Trace::record(TRACE_CALLBACK_END, SocketRegistry::toHandle(this),
+                TRACE_CALLBACK_REQUEST_RECV);
+        }
+        else
+        {
+            // Tell the other end rather than leave it waiting for a timeout,
+            // unless that would block the network thread
+            queueLibFrame(LIB_FRAME_NO_REQUEST_RECV_FN, reqId);
+        }
+    }
+    else if (frameType == LIB_FRAME_RESPONSE ||
+        frameType == LIB_FRAME_NO_REQUEST_RECV_FN)
+    {
+        // If the request is not found it has timed out, so the response is
+        // dropped
+        PendingTable* table = m_pendingTable;
+        PendingTable::Completion completion;
+        if (table != NULL && table->take(reqId, &completion))
+        {
+            if (frameType == LIB_FRAME_RESPONSE)
+            {
+                completion.responseRecvFn(SocketRegistry::toHandle(this),
+                    CL_ERR_OK, data, dataLen, completion.reqArg);
+            }
+            else
+            {
+                completion.responseRecvFn(SocketRegistry::toHandle(this),
+                    CL_ERR_NO_REQUEST_RECV_FN, NULL, 0, completion.reqArg);
+            }
+        }
+    }
+    else if (frameType == LIB_FRAME_COMPRESS_HELLO)
+    {
+        Compression& comp = compression();
+        boost::lock_guard<boost::mutex> deflateLock(comp.mutex);
+
+        comp.peerInflates = true;
+        m_compressing = (comp.minLen > 0 && !comp.deflateFailed);
+    }
+    else if (frameType == LIB_FRAME_DEFLATED_DATA)
+    {
+        onDeflatedData(data, dataLen);
+    }
+    else
+    {
+        OUTPUT_FMT_DEBUG_STRING("Unknown library frame, type=" <<
+            static_cast<int>(frameType));
+    }
+}
+
+int SocketObj::sendCompressHello()
+{
+    Compression& comp = *m_compression;
+    if (comp.minLen == 0 || comp.helloSent)
+    {
+        return CL_ERR_OK;
+    }
+
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    bool connecting = (m_conCompletedFn != 0 && !m_conCompleted);
+    lock.unlock();
+
+    if (connecting)
+    {
+        // onFdConnect() sends it once connected
+        return CL_ERR_OK;
+    }
+
+    int err = sendLibFrame(LIB_FRAME_COMPRESS_HELLO, 0, NULL, 0);
+    if (err == CL_ERR_OK)
+    {
+        comp.helloSent = true;
+    }
+    return err;
+}
+
+int SocketObj::sendDeflated(const char* buf, int len)
+{
+    Compression& comp = *m_compression;
+    int deflatedLen = 0;
+    int err = comp.deflater->deflateFrame(buf, len, &comp.deflateBuf[0],
+        static_cast<int>(comp.deflateBuf.size()), deflatedLen);
+    if (err == CL_ERR_OK)
+    {
+        err = sendLibFrame(LIB_FRAME_DEFLATED_DATA, 0, &comp.deflateBuf[0],
+            deflatedLen);
+    }
+
+    if (err != CL_ERR_OK)
+    {
+        // The data is now in the history of the deflate stream but not of the
+        // inflate stream at the other end, so nothing more can be compressed
+        comp.deflateFailed = true;
+        m_compressing = false;
+    }
+
+    return err;
+}
+
+void SocketObj::onDeflatedData(const char* buf, int len)
+{
+    Compression& comp = compression();
+    int err = CL_ERR_OK;
+    if (comp.inflater.get() == 0)
+    {
+        FrameInflater* inflater = 0;
+        err = FrameInflater::create(DATA_MAX_LEN, &inflater);
+        if (err == CL_ERR_OK)
+        {
+            comp.inflater.reset(inflater);
+        }
+    }
+
+    int inflatedLen = 0;
+    if (err == CL_ERR_OK)
+    {
+        err = comp.inflater->inflateFrame(buf, len, inflatedLen);
+    }
+    if (err != CL_ERR_OK)
+    {
+        OUTPUT_FMT_DEBUG_STRING("Inflating data failed, err=" << err);
+
+        // The frames that follow were compressed against this one so none of
+        // them can be inflated either
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            if (isClosed())
+            {
+                return;
+            }
+            resetConnection();
+        }
+        notifyClosed(CL_ERR_DATA_STREAM_CORRUPTED);
+        return;
+    }
+
+    Capture::record(CL_CAPTURE_RECV, m_captureId, comp.inflater->buf(),
+        inflatedLen);
+    Trace::record(TRACE_CALLBACK_BEGIN, SocketRegistry::toHandle(this),
+        TRACE_CALLBACK_DATA_RECV);
+    m_dataRecvFn(SocketRegistry::toHandle(this), comp.inflater->buf(),
+        inflatedLen, m_arg);
+    Trace::record(TRACE_CALLBACK_END, SocketRegistry::toHandle(this),
+        TRACE_CALLBACK_DATA_RECV);
+}
+
+PendingTable* SocketObj::pendingTable()
+{
+    PendingTable* table = m_pendingTable;
+    if (table == NULL)
+    {
+        // Most sockets never send a request, so the table is only created
+        // once one does. If another thread got in first use its table
+        PendingTable* newTable = new PendingTable;
+        table = static_cast<PendingTable*>(InterlockedCompareExchangePointer(
+            reinterpret_cast<PVOID volatile*>(&m_pendingTable), newTable,
+            NULL));
+        if (table == NULL)
+        {
+            table = newTable;
+        }
+        else
+        {
+            delete newTable;
+        }
+    }
+    return table;
+}
+
+SocketObj::SendTurn& SocketObj::sendTurn()
+{
+    SendTurn* turn = m_sendTurn;
+    if (turn == NULL)
+    {
+        // An idle socket object never sends, so the state is only created
+        // once a thread does. If another thread got in first use its state
+        SendTurn* newTurn = new SendTurn;
+        turn = static_cast<SendTurn*>(InterlockedCompareExchangePointer(
+            reinterpret_cast<PVOID volatile*>(&m_sendTurn), newTurn, NULL));
+        if (turn == NULL)
+        {
+            turn = newTurn;
+        }
+        else
+        {
+            delete newTurn;
+        }
+    }
+    return *turn;
+}
+
+SocketObj::Compression& SocketObj::compression()
+{
+    Compression* comp = m_compression;
+    if (comp == NULL)
+    {
+        // Most sockets never compress, so the state is only created once
+        // either end turns compression on. If another thread got in first
+        // use its state
+        Compression* newComp = new Compression;
+        comp = static_cast<Compression*>(InterlockedCompareExchangePointer(
+            reinterpret_cast<PVOID volatile*>(&m_compression), newComp,
+            NULL));
+        if (comp == NULL)
+        {
+            comp = newComp;
+        }
+        else
+        {
+            delete newComp;
+        }
+    }
+    return *comp;
+}
+
+void SocketObj::completeRequests(
+    const std::vector<PendingTable::Completion>& completions, int err)
+{
+    for (size_t idx = 0; idx < completions.size(); ++idx)
+    {
+        completions[idx].responseRecvFn(SocketRegistry::toHandle(this), err,
+            NULL, 0, completions[idx].reqArg);
+    }
+}
@@ -8,17 +8,31 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <list>
 #include <string>
 #include <vector>
 #include "inc/comlib/comlib.h"
+#include "bufpool.h"
+#include "conadmission.h"
+#include "framedeflate.h"
 #include "netobj.h"
+#include "objpool.h"
+#include "pendingtable.h"
+#include "ringchannel.h"
+#include "tokenbucket.h"
+
+class ConnectBatch;
 
 /**
  * Represents a TCP socket that connects to another TCP socket listening on a
  * local or remote IP address and port to be able to send and receive data.
+ * A socket object given a ring address instead carries the same data over a
+ * ring channel, see RingChannel.
  */
 class SocketObj : public NetObj
 {
@@ -32,14 +46,39 @@ private:
      */
     static const int PREFIX_LEN = sizeof(PrefixType);
 
+    /**
+     * The number of bytes at the start of a library frame ahead of the data
+     * it carries: the frame type then the request ID in network byte order.
+     */
+    static const int LIB_FRAME_HEADER_LEN = 1 + sizeof(CLRequestId);
+
+    /**
+     * The number of bytes sent ahead of the data a library frame carries: the
+     * zero-length frame marking it, then its length prefix and header.
+     */
+    static const int LIB_FRAME_MARK_LEN = 2 * PREFIX_LEN + LIB_FRAME_HEADER_LEN;
+
 public:
     // Inherited from NetObj
     virtual WSAEVENT netEvent() const;
     virtual void onNetEvent();
+    virtual ULONGLONG timerDeadline() const;
+    virtual void onTimer(ULONGLONG now);
+    virtual int rssCpu() const;
+    virtual ULONGLONG bytesRecv() const;
 
     /** The maximum length of data that can be sent and received. */
     static const int DATA_MAX_LEN = static_cast<PrefixType>(~0);
 
+    /** The maximum length of a request or response. */
+    static const int REQUEST_MAX_LEN = DATA_MAX_LEN - LIB_FRAME_HEADER_LEN;
+
+    /**
+     * The longest time in milliseconds data still queued when close() is
+     * called is given to be written, in the background.
+     */
+    static const DWORD CLOSE_DRAIN_MS = 200;
+
     /**
      * Creates a socket object that is connected to the given host address and
      * port.
@@ -85,6 +124,49 @@ public:
         CLPDataRecvFn dataRecvFn, CLPSocketClosedFn socketClosedFn, void* arg,
         SocketObj** pSktObj);
 
+    /**
+     * Creates a socket object that connects asynchronously to the given host
+     * address once a connect batch starts its connection attempt, see
+     * connectBatched(). A socket object given a ring address connects straight
+     * away instead, as for createAsync().
+     *
+     * @param hostAddr the host address to connect to.
+     * @param conCompletedFn this will be called when the connection attempt
+     * has completed.
+     * @param dataRecvFn this will be called when the socket object has
+     * received data.
+     * @param socketClosedFn this will be called when the socket object has
+     * closed.
+     * @param arg this will be passed back as is in any of the socket object's
+     * callback functions.
+     * @param pSktObj if the method was successful this will be set to point to
+     * the socket object that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int createBatched(const char* hostAddr,
+        CLPConCompletedFn conCompletedFn, CLPDataRecvFn dataRecvFn,
+        CLPSocketClosedFn socketClosedFn, void* arg, SocketObj** pSktObj);
+
+    /**
+     * Resolves the given host address and port into one or more sockaddr
+     * structures (since a host address can map to more than one IP address),
+     * each suitable for passing to the winsock connect() function. If the host
+     * address is a Unix domain socket address then the host port is ignored.
+     *
+     * @param hostAddr the host address to resolve.
+     * @param hostPort the host port to resolve.
+     * @param pAddrInfo if the method was successful this will be set to point
+     * to a linked list of address information structures containing the needed
+     * information. Note that since the address information is allocated
+     * dynamically, the caller will need to use the function freeAddrInfo() to
+     * delete the address information once finished with it.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int resolveHostAddr(const char* hostAddr, unsigned short hostPort,
+        ADDRINFOA** pAddrInfo);
+
     /**
      * Creates a socket object given an already accepted connection. Note that
      * this method takes ownership of the given socket and is guaranteed to
@@ -105,42 +187,479 @@ public:
     static int createAccepted(SOCKET clientSocket, CLPDataRecvFn dataRecvFn,
         CLPSocketClosedFn socketClosedFn, void* arg, SocketObj** pSktObj);
 
+    /**
+     * Creates a socket object given an already accepted ring connection. Note
+     * that this method takes ownership of the given channel and is guaranteed
+     * to delete it regardless of whether of not the method call was
+     * successful.
+     *
+     * @param clientChannel the already accepted ring connection.
+     * @param dataRecvFn this will be called when the client channel has
+     * received data.
+     * @param socketClosedFn this will be called when the client channel has
+     * closed.
+     * @param arg this will be passed back as is in any of the client channel's
+     * callback functions.
+     * @param pSktObj if the method was successful this will be set to point to
+     * the socket object that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int createAccepted(RingChannel* clientChannel,
+        CLPDataRecvFn dataRecvFn, CLPSocketClosedFn socketClosedFn, void* arg,
+        SocketObj** pSktObj);
+
     virtual ~SocketObj();
 
+    /**
+     * Allocates the memory for a socket object from a pool shared by all
+     * socket objects, so connections that come and go reuse the same memory
+     * rather than going to the heap each time.
+     *
+     * @param size the size of the socket object.
+     * @return The memory allocated.
+     */
+    static void* operator new(size_t size);
+
+    /**
+     * Returns the memory for a socket object to the pool.
+     *
+     * @param p the memory to return.
+     */
+    static void operator delete(void* p);
+
+    /**
+     * Returns when the pools of buffers socket objects receive frames into
+     * are next to be trimmed.
+     *
+     * @return The tick count when trimRecvBufPools() should next be called,
+     * or NetObj::NO_TIMER if no pool keeps any buffers.
+     */
+    static ULONGLONG recvBufTrimDeadline();
+
+    /**
+     * Trims the pools of buffers socket objects receive frames into that are
+     * due to be trimmed, so buffers kept after a burst of frames go back to
+     * the heap even if no more frames arrive to give buffers back.
+     */
+    static void trimRecvBufPools();
+
     /**
      * Sends the given data over the connection.
      *
      * @param buf the data to send.
-     * @param len the length of data to send.
+     * @param len the length of data to send, which must be greater than 0.
+     * @param pri the priority to send the data at, one of the CL_PRI_
+     * values.
      * @return CL_ERR_OK if the method was successful, any other value
      * otherwise.
      */
-    int sendData(const char* buf, int len);
+    int sendData(const char* buf, int len, int pri);
 
     /**
-     * Closes this socket object, which closes the connection so afterwards
-     * data can no longer be sent and received.
+     * Sets the function that will be called when this socket object receives
+     * a request.
+     *
+     * @param requestRecvFn this will be called when the socket object has
+     * received a request, or NULL for none.
      */
-    void close();
+    void setRequestRecvFn(CLPRequestRecvFn requestRecvFn);
 
-private:
     /**
-     * Resolves the given host address and port into one or more sockaddr
-     * structures (since a host address can map to more than one IP address),
-     * each suitable for passing to the winsock connect() function.
+     * Sends a request over the connection without waiting for the response.
      *
-     * @param hostAddr the host address to resolve.
-     * @param hostPort the host port to resolve.
-     * @param pAddrInfo if the method was successful this will be set to point
-     * to a linked list of address information structures containing the needed
-     * information. Note that since the address information is allocated
-     * dynamically, the caller will need to use the winsock function
-     * freeaddrinfo() to delete the address information once finished with it.
+     * @param buf the request data to send.
+     * @param len the length of request data to send.
+     * @param timeout how long in milliseconds to wait for the response, or
+     * INFINITE for no timeout.
+     * @param responseRecvFn this will be called when the request has
+     * completed, but only if the method was successful.
+     * @param reqArg this will be passed back as is in the callback function.
      * @return CL_ERR_OK if the method was successful, any other value
      * otherwise.
      */
-    static int resolveHostAddr(const char* hostAddr, unsigned short hostPort,
-        ADDRINFOA** pAddrInfo);
+    int request(const char* buf, int len, DWORD timeout,
+        CLPResponseRecvFn responseRecvFn, void* reqArg);
+
+    /**
+     * Sends the response to a request received over the connection.
+     *
+     * @param reqId the ID of the request being responded to.
+     * @param buf the response data to send.
+     * @param len the length of response data to send.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int respond(CLRequestId reqId, const char* buf, int len);
+
+    /**
+     * Sets the length from which data sent by sendData() is compressed. Data
+     * is only compressed once the other end has turned compression on too,
+     * until then it is sent as is.
+     *
+     * @param minLen the minimum length of data to compress, or 0 to stop
+     * compressing.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int setCompression(int minLen);
+
+    /**
+     * Turns cork mode on or off. In cork mode data sent is held back and
+     * written to the socket in one piece once maxBytes have built up, once
+     * maxDelay has passed since the first of it was held back, or when
+     * flush() is called, whichever is first. Ring channels are not corked, as
+     * sending over them makes no system call.
+     *
+     * @param maxDelay the longest time in milliseconds data is held back, or
+     * 0 to turn cork mode off, sending anything held back straight away.
+     * @param maxBytes the number of bytes that, once held back, are sent
+     * straight away.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int setCork(DWORD maxDelay, int maxBytes);
+
+    /**
+     * Sends any data held back by cork mode straight away.
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int flush();
+
+    /**
+     * Sets the token bucket limits on data received and sent, refilling the
+     * buckets. Once a receive limit is reached reading stops, leaving data
+     * with the TCP stack so the other end is slowed down, until the bucket
+     * has refilled. Once the send limit is reached the sending thread waits
+     * until the bucket has refilled.
+     *
+     * @param limit the limits, where a rate of 0 means no limit.
+     */
+    void setRateLimit(const CLRateLimit& limit);
+
+    /**
+     * Sets the slow consumer policy. With a policy sending never blocks: data
+     * the TCP stack cannot take straight away is queued and written by the
+     * network thread on FD_WRITE, and the policy's action is taken once the
+     * queue reaches a limit. Ring channels are left as they are.
+     *
+     * @param policy the policy, where an action of CL_SLOW_CONSUMER_NONE
+     * writes anything queued, blocking, and goes back to blocking sends.
+     * @param slowConsumerFn this will be called when a limit is reached if
+     * the action is CL_SLOW_CONSUMER_CALLBACK.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int setSlowConsumerPolicy(const CLSlowConsumerPolicy& policy,
+        CLPSlowConsumerFn slowConsumerFn);
+
+    /**
+     * Sets what the connection of this socket object was counted against
+     * when it was accepted, so it is uncounted when this object is closed.
+     *
+     * @param admission the connection admission of the server socket object
+     * that accepted the connection.
+     */
+    void setAdmission(const boost::shared_ptr<ConAdmission>& admission);
+
+    /**
+     * Gets statistics for this socket object.
+     *
+     * @param pStats this will be filled in with the statistics.
+     */
+    void getStats(CLSocketStats* pStats);
+
+    /**
+     * Starts the connection attempt of a socket object created by
+     * createBatched(). This is called by the connect batch's thread.
+     *
+     * @param batch the connect batch, which this socket object holds on to
+     * until the connection attempt has completed.
+     * @param addrInfo the address information to connect to, which belongs to
+     * the batch, or NULL if the resolve failed.
+     * @param resolveErr CL_ERR_OK if the host address and port was resolved
+     * successfully, any other value otherwise.
+     * @return Whether or not the connection attempt was started, which it is
+     * not if this socket object has been closed.
+     */
+    bool connectBatched(const boost::shared_ptr<ConnectBatch>& batch,
+        ADDRINFOA* addrInfo, int resolveErr);
+
+    /**
+     * Returns whether or not close() has been called, so that the connect
+     * batch's thread can skip a socket object deleted before its turn came.
+     *
+     * @return Whether or not close() has been called.
+     */
+    bool closeCalled();
+
+    /**
+     * Closes this socket object, which closes the connection so afterwards
+     * data can no longer be sent and received. Data still queued, or held
+     * back in cork mode, is handed to SendLinger with the socket, to be
+     * written within CLOSE_DRAIN_MS without waiting here.
+     */
+    void close();
+
+private:
+    /** The sending state kept for each priority. */
+    struct SendLane
+    {
+        SendLane() : sendersWaiting(0), framesSent(0), bytesSent(0) {}
+
+        /** The number of threads waiting for their turn to send. */
+        int sendersWaiting;
+
+        /** The number of frames sent. */
+        ULONGLONG framesSent;
+
+        /** The number of bytes sent. */
+        ULONGLONG bytesSent;
+    };
+
+    /**
+     * The state of the threads taking turns to send, and what they sent.
+     * An idle socket object never needs this, so it is only allocated when a
+     * thread first sends.
+     */
+    struct SendTurn
+    {
+        SendTurn() : turnTaken(false) {}
+
+        /**
+         * Synchronizes taking turns to send. Never lock this while m_mutex is
+         * locked.
+         */
+        boost::mutex mutex;
+
+        /** This is notified when a thread's turn to send has ended. */
+        boost::condition_variable condVar;
+
+        /** This is set while a thread is taking its turn to send. */
+        bool turnTaken;
+
+        /**
+         * The sending state for each priority, indexed by CL_PRI_NORMAL and
+         * so on.
+         */
+        SendLane lanes[CL_PRI_COUNT];
+    };
+
+    /**
+     * The cork mode settings of a socket object and the data it holds back.
+     * Most sockets never use cork mode, so this is only allocated once it is
+     * first turned on.
+     */
+    struct Cork
+    {
+        Cork() : maxDelay(0), maxBytes(0) {}
+
+        /**
+         * The longest time in milliseconds data is held back, or 0 when cork
+         * mode is off.
+         */
+        DWORD maxDelay;
+
+        /** The number of bytes held back that are sent at once. */
+        int maxBytes;
+
+        /**
+         * The data held back at each priority, indexed by CL_PRI_NORMAL and so
+         * on, length prefixes included.
+         */
+        std::vector<char> bufs[CL_PRI_COUNT];
+    };
+
+    /**
+     * The compression state of a socket object. Most sockets never compress,
+     * so this is only allocated once compression is turned on at either end.
+     */
+    struct Compression
+    {
+        Compression() : minLen(0), helloSent(false), peerInflates(false),
+            deflateFailed(false) {}
+
+        /**
+         * Synchronizes compressing data and sending it, as the other end must
+         * decompress it in the same order. Lock this before m_mutex.
+         */
+        boost::mutex mutex;
+
+        /** The minimum length of data to compress, or 0 for none. */
+        int minLen;
+
+        /** This is set once the compression hello library frame was sent. */
+        bool helloSent;
+
+        /**
+         * This is set once the compression hello library frame has been
+         * received.
+         */
+        bool peerInflates;
+
+        /**
+         * This is set when compressing has failed, after which the other end
+         * can no longer decompress anything more so data is always sent as
+         * is.
+         */
+        bool deflateFailed;
+
+        /** Compresses data, or NULL until compression is first turned on. */
+        boost::scoped_ptr<FrameDeflater> deflater;
+
+        /** A buffer for compressed data to send. */
+        std::vector<char> deflateBuf;
+
+        /**
+         * Decompresses data received, or NULL until compressed data is first
+         * received. Only used by the network thread.
+         */
+        boost::scoped_ptr<FrameInflater> inflater;
+    };
+
+    /**
+     * The rate limits of a socket object and how often they were reached.
+     * Most sockets are never limited, so this is only allocated once a limit
+     * is first set.
+     */
+    struct RateLimits
+    {
+        RateLimits() : sendByteLimitHits(0), recvByteLimitHits(0),
+            recvFrameLimitHits(0) {}
+
+        /** Limits the bytes sent. */
+        TokenBucket sendByteBucket;
+
+        /**
+         * The number of times a thread had to wait to send as sendByteBucket
+         * was empty.
+         */
+        ULONGLONG sendByteLimitHits;
+
+        /** Limits the bytes received. */
+        TokenBucket recvByteBucket;
+
+        /** Limits the frames received, library frames included. */
+        TokenBucket recvFrameBucket;
+
+        /** The number of times reading paused as recvByteBucket was empty. */
+        ULONGLONG recvByteLimitHits;
+
+        /** The number of times reading paused as recvFrameBucket was empty. */
+        ULONGLONG recvFrameLimitHits;
+    };
+
+    /** A frame queued to send. */
+    struct QueuedFrame
+    {
+        /** The frame's data, length prefixes included. */
+        std::vector<char> data;
+
+        /**
+         * The number of bytes of data written so far, including any written
+         * before the frame was queued.
+         */
+        size_t sentLen;
+
+        /** The priority the frame was sent at, one of the CL_PRI_ values. */
+        int pri;
+
+        /** The tick count when the frame was queued. */
+        ULONGLONG queuedTick;
+
+        /**
+         * This is set while the frame may be dropped, which is only for plain
+         * data at CL_PRI_NORMAL none of which has been written.
+         */
+        bool droppable;
+    };
+
+    /**
+     * The slow consumer policy of a socket object, its send queue and how
+     * often the limits were reached. Most sockets never have a policy, so
+     * this is only allocated once one is first set.
+     */
+    struct SlowConsumer
+    {
+        SlowConsumer() : slowConsumerFn(0), queuedLen(0), droppableLen(0),
+            limitReached(false), signaled(false), disconnected(false),
+            hits(0), framesDropped(0), bytesDropped(0), framesRefused(0)
+        {
+            policy.action = CL_SLOW_CONSUMER_NONE;
+            policy.maxQueuedBytes = 0;
+            policy.maxQueueAgeMs = 0;
+        }
+
+        /** The policy. */
+        CLSlowConsumerPolicy policy;
+
+        /** This will be called when a limit is reached. */
+        CLPSlowConsumerFn slowConsumerFn;
+
+        /**
+         * The frames queued to send, highest priority first and oldest first
+         * within each priority, except that a frame that has started to be
+         * written stays at the front.
+         */
+        std::list<QueuedFrame> queue;
+
+        /** The number of bytes queued still to write. */
+        size_t queuedLen;
+
+        /** The number of bytes queued in frames that may be dropped. */
+        size_t droppableLen;
+
+        /**
+         * This is set when a sending thread refused a frame, for the network
+         * thread to take the policy's action.
+         */
+        bool limitReached;
+
+        /**
+         * This is set once the slow consumer callback function has been
+         * called, until the queue next empties.
+         */
+        bool signaled;
+
+        /** This is set once the connection was reset by the policy. */
+        bool disconnected;
+
+        /** The number of times the queue was found over a limit. */
+        ULONGLONG hits;
+
+        /** The number of frames dropped. */
+        ULONGLONG framesDropped;
+
+        /** The number of bytes dropped. */
+        ULONGLONG bytesDropped;
+
+        /** The number of frames refused with CL_ERR_SLOW_CONSUMER. */
+        ULONGLONG framesRefused;
+    };
+
+    /**
+     * The types of library frame. A library frame is sent as a zero-length
+     * frame, which is never sent as data, followed by a frame starting with
+     * one of these.
+     */
+    enum LibFrameType
+    {
+        /** A request sent by request(). */
+        LIB_FRAME_REQUEST = 1,
+        /** A response sent by respond(). */
+        LIB_FRAME_RESPONSE,
+        /** Sent back for a request when there is no request callback. */
+        LIB_FRAME_NO_REQUEST_RECV_FN,
+        /**
+         * Sent once compression is turned on, to say the other end can send
+         * compressed data.
+         */
+        LIB_FRAME_COMPRESS_HELLO,
+        /** Data compressed by sendData(). */
+        LIB_FRAME_DEFLATED_DATA
+    };
 
     /**
      * The thread procedure for the host address resolver thread, which
@@ -196,6 +715,21 @@ private:
     SocketObj(SOCKET clientSocket, CLPDataRecvFn dataRecvFn,
         CLPSocketClosedFn socketClosedFn, void* arg);
 
+    /**
+     * The first stage of construction for an already accepted ring
+     * connection.
+     *
+     * @param clientChannel the already accepted ring connection.
+     * @param dataRecvFn this will be called when the client channel has
+     * received data.
+     * @param socketClosedFn this will be called when the client channel has
+     * closed.
+     * @param arg this will be passed back as is in any of the client channel's
+     * callback functions.
+     */
+    SocketObj(RingChannel* clientChannel, CLPDataRecvFn dataRecvFn,
+        CLPSocketClosedFn socketClosedFn, void* arg);
+
     /**
      * The second stage of construction for synchronous connection.
      *
@@ -216,6 +750,15 @@ private:
      */
     int constructAsync(const char* hostAddr, unsigned short hostPort);
 
+    /**
+     * The second stage of construction for connection by a connect batch.
+     *
+     * @param hostAddr the host address to connect to.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int constructBatched(const char* hostAddr);
+
     /**
      * The second stage of construction for an already accepted connection.
      *
@@ -224,6 +767,25 @@ private:
      */
     int constructAccepted();
 
+    /**
+     * The second stage of construction for a ring connection, used by both
+     * synchronous and asynchronous connection since connecting a ring channel
+     * never blocks.
+     *
+     * @param hostAddr the ring address to connect to.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int constructRing(const char* hostAddr);
+
+    /**
+     * Has this socket object been closed? For a socket this is when the
+     * socket is not open, for a ring channel when close() has been called.
+     *
+     * @return Whether or not this socket object has been closed.
+     */
+    bool isClosed() const;
+
     /**
      * Creates the network event for this socket object.
      *
@@ -256,7 +818,7 @@ private:
      * this will point to a linked list of address information structures
      * containing the information needed to connect. Note that since the
      * address information is allocated dynamically, this socket object will
-     * need to use the winsock function freeaddrinfo() to delete the address
+     * need to use the function freeAddrInfo() to delete the address
      * information once finished with it.
      * @param hostAddrResolvedErr this indicates whether or not the host
      * address and port was resolved successfully. If the error code
@@ -265,6 +827,14 @@ private:
      */
     void onHostAddrResolved(ADDRINFOA* addrInfo, int hostAddrResolvedErr);
 
+    /**
+     * Frees the address information used to connect asynchronously, once the
+     * connection attempt has completed or this object has closed, and lets
+     * go of the connect batch if there is one. m_mutex must be locked by the
+     * caller.
+     */
+    void freeConnectAddrInfo();
+
     /**
      * Attempts to connect synchronously to the first address in the given
      * linked list of address information structures. If the connection attempt
@@ -306,6 +876,62 @@ private:
     /** Handles the FD_READ network event. */
     void onFdRead();
 
+    /** Handles the FD_WRITE network event. */
+    void onFdWrite();
+
+    /**
+     * Checks the receive token buckets, pausing reading until they have
+     * refilled if either is empty. m_mutex must be locked by the caller.
+     *
+     * @param now the current tick count.
+     * @return Whether or not reading is paused.
+     */
+    bool pauseRecvIfLimited(ULONGLONG now);
+
+    /**
+     * Takes what was received from the receive token buckets, if any limits
+     * have been set. m_mutex must be locked by the caller.
+     *
+     * @param bytes the number of bytes received.
+     * @param frames the number of frames received.
+     * @param now the current tick count.
+     */
+    void takeRecvTokens(int bytes, int frames, ULONGLONG now);
+
+    /**
+     * Returns the tick count when reading paused by the receive limits is
+     * resumed.
+     *
+     * @return The tick count, or NO_TIMER if reading is not paused.
+     */
+    ULONGLONG recvResumeDeadline() const;
+
+    /**
+     * Waits until the send token bucket allows sending, then takes the given
+     * number of bytes from it. The caller must have the turn to send.
+     *
+     * @param len the number of bytes about to be sent.
+     */
+    void waitForSendTokens(ULONG len);
+
+    /**
+     * Handles the network event of a ring channel, which stands in for
+     * FD_CONNECT, FD_READ and FD_CLOSE.
+     */
+    void onChannelEvent();
+
+    /**
+     * Receives as much data as is available into the given buffer without
+     * blocking, from either the socket or the ring channel.
+     *
+     * @param buf the buffer to receive data into.
+     * @param len the length of the buffer.
+     * @param bytesRecv this will be set to the number of bytes received.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int recvSome(char* buf, int len, int& bytesRecv);
+
     /**
      * Handles the FD_CLOSE network event.
      *
@@ -314,6 +940,22 @@ private:
      */
     void onFdClose(int fdCloseErr);
 
+    /**
+     * Fails the requests still waiting for a response then calls the socket
+     * closed callback function. m_mutex must not be locked by the caller.
+     *
+     * @param err the error code to pass to the socket closed callback
+     * function.
+     */
+    void notifyClosed(int err);
+
+    /**
+     * Closes the connection at once, resetting it rather than waiting for the
+     * other end to read data the TCP stack is still holding. m_mutex must be
+     * locked by the caller.
+     */
+    void resetConnection();
+
     /**
      * Sends as much data as possible from the given buffer.
      *
@@ -325,6 +967,328 @@ private:
      */
     int sendAll(const char* buf, int len, int& bytesSent);
 
+    /**
+     * Sends the given buffers over the connection one after the other without
+     * anything else in between.
+     *
+     * @param bufs the buffers to send.
+     * @param bufCount the number of buffers to send.
+     * @param pri the priority to send the buffers at, one of the CL_PRI_
+     * values.
+     * @param droppable whether or not the slow consumer policy may drop the
+     * buffers if they are queued.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int sendBufs(const WSABUF* bufs, DWORD bufCount, int pri,
+        bool droppable);
+
+    /**
+     * Waits until it is the calling thread's turn to send. The turn goes to
+     * the waiting thread with the highest priority.
+     *
+     * @param pri the priority the calling thread is sending at.
+     */
+    void acquireSendTurn(int pri);
+
+    /**
+     * Ends the calling thread's turn to send, letting the next thread go.
+     *
+     * @param pri the priority the calling thread was sending at.
+     * @param bytesSent the number of bytes the calling thread sent, or 0 if
+     * sending failed.
+     */
+    void releaseSendTurn(int pri, ULONG bytesSent);
+
+    /**
+     * Writes the given buffers to the socket one after the other, blocking
+     * until they have all been written behind anything already queued, or
+     * with a slow consumer policy queuing what cannot be written straight
+     * away. m_mutex must be locked by the caller.
+     *
+     * @param bufs the buffers to write.
+     * @param bufCount the number of buffers to write.
+     * @param pri the priority to queue the buffers at, one of the CL_PRI_
+     * values.
+     * @param droppable whether or not the slow consumer policy may drop the
+     * buffers if they are queued.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int writeBufs(const WSABUF* bufs, DWORD bufCount, int pri,
+        bool droppable);
+
+    /**
+     * Writes the given buffers to the socket one after the other, blocking
+     * until they have all been written. m_mutex must be locked by the caller.
+     *
+     * @param bufs the buffers to write.
+     * @param bufCount the number of buffers to write.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int writeBufsBlocking(const WSABUF* bufs, DWORD bufCount);
+
+    /**
+     * Does this socket object queue what cannot be written straight away, as
+     * it has a slow consumer policy? m_mutex must be locked by the caller.
+     *
+     * @return Whether or not this socket object queues.
+     */
+    bool isQueueing() const;
+
+    /**
+     * Checks there is room in the send queue for a frame of the given length,
+     * dropping frames to make room or having the network thread take the
+     * policy's action if there is not. m_mutex must be locked by the caller.
+     *
+     * @param len the length of the frame, length prefix included.
+     * @return Whether or not the frame may be sent.
+     */
+    bool makeRoomToQueue(ULONG len);
+
+    /**
+     * Writes as much of the given buffers as the socket takes without
+     * blocking, provided nothing is queued ahead of them, then queues the
+     * rest ahead of any frames at a lower priority that have not started to
+     * be written. m_mutex must be locked by the caller.
+     *
+     * @param bufs the buffers to write.
+     * @param bufCount the number of buffers to write.
+     * @param pri the priority to queue the buffers at, one of the CL_PRI_
+     * values.
+     * @param droppable whether or not the buffers may be dropped.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int queueBufs(const WSABUF* bufs, DWORD bufCount, int pri,
+        bool droppable);
+
+    /**
+     * Writes as much of the send queue as the socket takes without blocking.
+     * m_mutex must be locked by the caller.
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int drainSendQueue();
+
+    /**
+     * Writes everything in the send queue, blocking until it has all been
+     * written, then empties it. The policy's action must already be
+     * CL_SLOW_CONSUMER_NONE. m_mutex must be locked by the caller.
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int flushSendQueue();
+
+    /**
+     * Writes what the socket takes of the send queue without waiting, then
+     * hands the socket and the rest of the queue to SendLinger, leaving
+     * m_socket invalid, if anything is left. This is for when this object is
+     * being closed. m_mutex must be locked by the caller.
+     */
+    void lingerSendQueue();
+
+    /**
+     * Drops a frame from the send queue. m_mutex must be locked by the
+     * caller.
+     *
+     * @param it the frame, which must be droppable.
+     * @return The frame after the one dropped.
+     */
+    std::list<QueuedFrame>::iterator dropQueuedFrame(
+        std::list<QueuedFrame>::iterator it);
+
+    /**
+     * Checks the send queue against the slow consumer policy once its
+     * deadline has passed, dropping frames that are too old or, for the other
+     * actions, working out what is to be done. A connection to be closed is
+     * reset here. m_mutex must be locked by the caller.
+     *
+     * @param now the current tick count.
+     * @param bytesQueued this will be set to the number of bytes queued.
+     * @param queueAgeMs this will be set to how long in milliseconds the
+     * oldest frame has been queued.
+     * @return CL_SLOW_CONSUMER_DISCONNECT if the connection was reset,
+     * CL_SLOW_CONSUMER_CALLBACK if the slow consumer callback function is to
+     * be called, otherwise CL_SLOW_CONSUMER_NONE.
+     */
+    int checkSendQueue(ULONGLONG now, ULONG& bytesQueued, ULONG& queueAgeMs);
+
+    /**
+     * Returns the tick count when the oldest frame in the send queue was
+     * queued. m_mutex must be locked by the caller.
+     *
+     * @return The tick count, or NO_TIMER if nothing is queued.
+     */
+    ULONGLONG oldestQueuedTick() const;
+
+    /**
+     * Sets the send queue deadline to when the oldest frame queued becomes
+     * too old. m_mutex must be locked by the caller.
+     */
+    void resetSendQueueDeadline();
+
+    /**
+     * Returns the tick count when the send queue must next be checked against
+     * the slow consumer policy.
+     *
+     * @return The tick count, or NO_TIMER if there is nothing to check.
+     */
+    ULONGLONG sendQueueDeadline() const;
+
+    /**
+     * Holds back the given buffers in cork mode, writing everything held back
+     * if that reaches the cork byte limit or the buffers are above
+     * CL_PRI_NORMAL. m_mutex must be locked by the caller.
+     *
+     * @param bufs the buffers to hold back.
+     * @param bufCount the number of buffers to hold back.
+     * @param pri the priority to hold the buffers back at.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int corkBufs(const WSABUF* bufs, DWORD bufCount, int pri);
+
+    /**
+     * Returns the number of bytes held back in cork mode at all priorities.
+     * m_mutex must be locked by the caller.
+     *
+     * @return The number of bytes held back.
+     */
+    size_t corkedLen() const;
+
+    /**
+     * Writes everything held back in cork mode to the socket, highest
+     * priority first. m_mutex must be locked by the caller.
+     *
+     * @param mayBlock whether or not the calling thread may wait for the
+     * other end to read. If not, what the socket does not take straight away
+     * is queued and written by the network thread on FD_WRITE, whether or not
+     * there is a slow consumer policy.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int flushCork(bool mayBlock);
+
+    /**
+     * Returns the tick count when data held back in cork mode must be sent.
+     *
+     * @return The tick count, or NO_TIMER if nothing is held back.
+     */
+    ULONGLONG corkDeadline() const;
+
+    /**
+     * Sends a library frame over the connection.
+     *
+     * @param frameType the type of library frame, one of the LibFrameType
+     * values.
+     * @param reqId the request ID the frame is for.
+     * @param buf the data the frame carries.
+     * @param len the length of the data the frame carries.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int sendLibFrame(char frameType, CLRequestId reqId, const char* buf,
+        int len);
+
+    /**
+     * Sends a library frame that carries no data from the network thread,
+     * without blocking. What the socket does not take straight away is
+     * queued, as data held back in cork mode is, and the frame is dropped if
+     * a ring channel has no space for it.
+     *
+     * @param frameType the type of library frame, one of the LibFrameType
+     * values.
+     * @param reqId the request ID the frame is for.
+     * @return CL_ERR_OK if the frame was sent or queued, any other value
+     * otherwise.
+     */
+    int queueLibFrame(char frameType, CLRequestId reqId);
+
+    /**
+     * Fills out the zero-length frame that marks a library frame, followed
+     * by the length prefix and header of the library frame.
+     *
+     * @param header the buffer to fill out, LIB_FRAME_MARK_LEN bytes long.
+     * @param frameType the type of library frame.
+     * @param reqId the request ID the frame is for.
+     * @param len the length of the data the frame carries.
+     */
+    static void fillLibFrameHeader(char* header, char frameType,
+        CLRequestId reqId, int len);
+
+    /**
+     * Handles a library frame received over the connection.
+     *
+     * @param buf the frame that was received.
+     * @param len the length of the frame that was received.
+     */
+    void onLibFrame(const char* buf, int len);
+
+    /**
+     * Sends the compression hello library frame if compression is turned on
+     * and the frame has not been sent yet. If the socket is still connecting
+     * the frame is sent once the connection completes. The compression mutex
+     * must be locked by the caller.
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int sendCompressHello();
+
+    /**
+     * Compresses the given data and sends it over the connection. The
+     * compression mutex must be locked by the caller.
+     *
+     * @param buf the data to send.
+     * @param len the length of data to send.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int sendDeflated(const char* buf, int len);
+
+    /**
+     * Handles compressed data received over the connection.
+     *
+     * @param buf the compressed data that was received.
+     * @param len the length of the compressed data that was received.
+     */
+    void onDeflatedData(const char* buf, int len);
+
+    /**
+     * Returns the table of requests waiting for a response, creating it the
+     * first time.
+     *
+     * @return The table of requests waiting for a response.
+     */
+    PendingTable* pendingTable();
+
+    /**
+     * Returns the state for taking turns to send, creating it the first time.
+     *
+     * @return The state for taking turns to send.
+     */
+    SendTurn& sendTurn();
+
+    /**
+     * Returns the compression state, creating it the first time.
+     *
+     * @return The compression state.
+     */
+    Compression& compression();
+
+    /**
+     * Completes the given requests by calling their callback functions.
+     *
+     * @param completions the requests to complete.
+     * @param err the error code to complete the requests with.
+     */
+    void completeRequests(
+        const std::vector<PendingTable::Completion>& completions, int err);
+
     /** Synchronizes access to this object. */
     boost::mutex m_mutex;
 
@@ -340,24 +1304,58 @@ private:
     /** This will be called when the socket object has closed. */
     CLPSocketClosedFn m_socketClosedFn;
 
+    /** This will be called when the socket object has received a request. */
+    CLPRequestRecvFn m_requestRecvFn;
+
     /**
      * This will be passed back as is in any of the socket object's callback
      * functions.
      */
     void* m_arg;
 
+    /**
+     * Identifies this socket object in captures. Unlike the handle it is
+     * never reused, so the captures of two connections are never merged.
+     */
+    const unsigned __int64 m_captureId;
+
     /** The network event for this object. */
     WSAEVENT m_netEvent;
 
     /** The socket for this object. */
     SOCKET m_socket;
 
+    /**
+     * The ring channel for this object if it was given a ring address, in
+     * which case m_socket and m_netEvent are not used, otherwise NULL.
+     */
+    boost::scoped_ptr<RingChannel> m_channel;
+
+    /**
+     * This is set when a ring channel connected asynchronously and the
+     * connection completed callback function is still to be called.
+     */
+    bool m_conCompletedPending;
+
     /** This is set when close() has been called. */
     bool m_closeCalled;
 
+    /**
+     * What the connection was counted against if it was accepted, until
+     * close() is called, otherwise NULL.
+     */
+    boost::shared_ptr<ConAdmission> m_admission;
+
+    /**
+     * This is set when an asynchronous connection attempt has completed
+     * successfully.
+     */
+    bool m_conCompleted;
+
     /**
      * A linked list of address information structures, each containing
-     * information needed to connect. Only used when connecting asynchronously.
+     * information needed to connect. Only used when connecting asynchronously,
+     * and freed again once the connection attempt has completed.
      */
     ADDRINFOA* m_addrInfo;
 
@@ -371,21 +1369,119 @@ private:
     bool m_resolveAsyncCompleted;
 
     /**
-     * This is notified when the host address resolver thread has completed.
+     * The connect batch that started the connection attempt and owns the
+     * address information in m_crntAddrInfo, until the attempt has completed,
+     * otherwise NULL.
      */
-    boost::condition_variable m_resolveAsyncCompletedCondVar;
+    boost::shared_ptr<ConnectBatch> m_connectBatch;
 
     /**
      * This is set when the data stream sent to the remote host has corrupted.
      */
     bool m_dataStreamCorrupted;
 
-    /** A buffer for data received. */
-    std::vector<char> m_DataRecvBuf;
+    /**
+     * The cork mode settings and the data held back, or NULL until cork mode
+     * is first turned on. This is protected by m_mutex.
+     */
+    boost::scoped_ptr<Cork> m_cork;
+
+    /**
+     * The state for taking turns to send, or NULL until a thread first sends.
+     * Everything in it is protected by its own mutex.
+     */
+    SendTurn* volatile m_sendTurn;
+
+    /**
+     * The rate limits, or NULL until a limit is first set. This is set with
+     * both the send turn mutex and m_mutex locked, after which the send limit
+     * is protected by the send turn mutex and the receive limits by m_mutex.
+     */
+    boost::scoped_ptr<RateLimits> m_rateLimits;
+
+    /**
+     * The tick count when the data held back in cork mode must be sent, or
+     * NO_TIMER if nothing is held back. This is read by the network thread
+     * without locking m_mutex.
+     */
+    volatile LONGLONG m_corkDeadline;
+
+    /**
+     * The slow consumer policy and send queue, or NULL until a policy is
+     * first set or the network thread has to queue data, held back in cork
+     * mode or a library frame it sends. This is protected by m_mutex.
+     */
+    boost::scoped_ptr<SlowConsumer> m_slowConsumer;
+
+    /**
+     * The tick count when the send queue must next be checked against the
+     * slow consumer policy, or NO_TIMER. This is read by the network thread
+     * without locking m_mutex.
+     */
+    volatile LONGLONG m_sendQueueDeadline;
+
+    /** The length prefix of the frame being received. */
+    char m_DataRecvPrefix[PREFIX_LEN];
+
+    /**
+     * A buffer for the data following the length prefix, borrowed from a
+     * pool once the length prefix has been received and given back once the
+     * frame has been handled, otherwise NULL. So an idle socket object holds
+     * no receive buffer.
+     */
+    char* m_DataRecvBuf;
 
-    /** The length of data in the data received buffer. */
+    /**
+     * The length of the frame being received so far, its length prefix
+     * included.
+     */
     int m_DataRecvLen;
+
+    /**
+     * This is set when a zero-length frame has been received, so the next
+     * frame is a library frame.
+     */
+    bool m_libFrameNext;
+
+    /**
+     * The index of the pool m_DataRecvBuf was borrowed from, the one for the
+     * NUMA node of the network thread that borrowed it.
+     */
+    unsigned char m_DataRecvBufPoolIdx;
+
+    /**
+     * The tick count when reading paused by the receive limits is resumed, or
+     * NO_TIMER if reading is not paused. This is read by the network thread
+     * without locking m_mutex.
+     */
+    volatile LONGLONG m_recvResumeDeadline;
+
+    /**
+     * The number of bytes received so far. Only the network thread receives,
+     * so this needs no lock.
+     */
+    ULONGLONG m_bytesRecv;
+
+    /**
+     * The requests sent that are waiting for a response, or NULL until the
+     * first request is sent.
+     */
+    PendingTable* volatile m_pendingTable;
+
+    /**
+     * The compression state, or NULL until compression is first turned on at
+     * either end. Everything in it but the inflater is protected by its own
+     * mutex.
+     */
+    Compression* volatile m_compression;
+
+    /**
+     * This is set when data is being compressed, so sendData() can skip the
+     * compression mutex when it is not. It is only set once m_compression
+     * has been allocated.
+     */
+    volatile bool m_compressing;
 };
 
 /** A shared pointer to a socket object. */
-typedef boost::shared_ptr<SocketObj> SocketObjSPtr;
+typedef boost::intrusive_ptr<SocketObj> SocketObjSPtr;
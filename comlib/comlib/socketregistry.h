@@ -1,24 +1,28 @@
 /**
  * @file
- * Declares the SktObjTypeRegistry template class and the SrvSocketRegistry and
- * SocketRegistry typedefs.
+ * Declares the SktObjTypeRegistry template class and the SrvSocketRegistry,
+ * SocketRegistry and UdpSocketRegistry typedefs.
  */
 
 #pragma once
 
-#include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/thread/locks.hpp>
-#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/utility.hpp>
 #include <map>
 #include <utility>
+#include <vector>
 #include "inc/comlib/comlib.h"
 #include "socketobj.h"
 #include "srvsocketobj.h"
+#include "udpsocketobj.h"
 
 /**
  * A registry for socket objects, parameterized by the type of socket handle
- * and type of socket object.
+ * and type of socket object. Any number of threads can find socket objects at
+ * once, as each library context has its own registries and a handle is
+ * looked for in each of them in turn.
  */
 template<class SktHndType, class SktObjType>
 class SktObjTypeRegistry : private boost::noncopyable
@@ -40,7 +44,7 @@ public:
      * @param sktObj the socket object to add to this registry.
      */
     void addSocketObj(const SktHndType& sktHnd,
-        const boost::shared_ptr<SktObjType>& sktObj);
+        const boost::intrusive_ptr<SktObjType>& sktObj);
 
     /**
      * Finds the socket object for the given handle in this registry.
@@ -48,9 +52,9 @@ public:
      * @param sktHnd the handle of the socket object to find in this registry.
      * @return The socket object for the given handle. If the socket object
      * could not be found then a default instance of type
-     * boost::shared_ptr<SktObjType> will be returned.
+     * boost::intrusive_ptr<SktObjType> will be returned.
      */
-    boost::shared_ptr<SktObjType> findSocketObj(SktHndType sktHnd);
+    boost::intrusive_ptr<SktObjType> findSocketObj(SktHndType sktHnd);
 
     /**
      * Removes and returns the socket object specified by the given handle from
@@ -60,25 +64,28 @@ public:
      * this registry.
      * @return The socket object for the given handle. If the socket object
      * could not be found then a default instance of type
-     * boost::shared_ptr<SktObjType> will be returned.
+     * boost::intrusive_ptr<SktObjType> will be returned.
      */
-    boost::shared_ptr<SktObjType> removeSocketObj(SktHndType sktHnd);
+    boost::intrusive_ptr<SktObjType> removeSocketObj(SktHndType sktHnd);
 
     /**
-     * Removes and returns the front socket object from this registry.
+     * Removes every socket object from this registry at once.
      *
-     * @return The front socket object from this registry. If the registry was
-     * empty then a default instance of type boost::shared_ptr<SktObjType> will
-     * be returned.
+     * @param sktObjs this will be filled in with the socket objects that were
+     * in this registry.
      */
-    boost::shared_ptr<SktObjType> removeFrontSocketObj();
+    void removeAllSocketObjs(
+        std::vector<boost::intrusive_ptr<SktObjType> >& sktObjs);
 
 private:
-    /** Synchronizes access to this object. */
-    boost::mutex m_mutex;
+    /**
+     * Synchronizes access to this object, shared by threads finding socket
+     * objects.
+     */
+    boost::shared_mutex m_mutex;
 
     /** A mapping from socket handle to socket object. */
-    std::map<SktHndType, boost::shared_ptr<SktObjType> > m_hndToSktObjMap;
+    std::map<SktHndType, boost::intrusive_ptr<SktObjType> > m_hndToSktObjMap;
 };
 
 #include "socketregistry.inl"
@@ -88,3 +95,6 @@ typedef SktObjTypeRegistry<CLSrvSocket, SrvSocketObj> SrvSocketRegistry;
 
 /** A registry for socket objects. */
 typedef SktObjTypeRegistry<CLSocket, SocketObj> SocketRegistry;
+
+/** A registry for UDP socket objects. */
+typedef SktObjTypeRegistry<CLUdpSocket, UdpSocketObj> UdpSocketRegistry;
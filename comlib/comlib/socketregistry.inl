@@ -12,23 +12,23 @@ inline SktHndType SktObjTypeRegistry<SktHndType, SktObjType>::toHandle(
 
 template<class SktHndType, class SktObjType>
 void SktObjTypeRegistry<SktHndType, SktObjType>::addSocketObj(
-    const SktHndType& sktHnd, const boost::shared_ptr<SktObjType>& sktObj)
+    const SktHndType& sktHnd, const boost::intrusive_ptr<SktObjType>& sktObj)
 {
-    boost::lock_guard<boost::mutex> lock(m_mutex);
+    boost::lock_guard<boost::shared_mutex> lock(m_mutex);
 
-    std::pair<std::map<SktHndType, boost::shared_ptr<SktObjType> >::iterator,
-        bool> insertResult = m_hndToSktObjMap.insert(
-        std::make_pair(sktHnd, sktObj));
+    std::pair<std::map<SktHndType,
+        boost::intrusive_ptr<SktObjType> >::iterator, bool> insertResult =
+        m_hndToSktObjMap.insert(std::make_pair(sktHnd, sktObj));
     assert(insertResult.second); // Socket cannot already exist in registry
 }
 
-template<class SktHndType, class SktObjType> boost::shared_ptr<SktObjType>
+template<class SktHndType, class SktObjType> boost::intrusive_ptr<SktObjType>
 SktObjTypeRegistry<SktHndType, SktObjType>::findSocketObj(SktHndType sktHnd)
 {
-    boost::lock_guard<boost::mutex> lock(m_mutex);
+    boost::shared_lock<boost::shared_mutex> lock(m_mutex);
 
-    boost::shared_ptr<SktObjType> sktObj;
-    std::map<SktHndType, boost::shared_ptr<SktObjType> >::iterator it =
+    boost::intrusive_ptr<SktObjType> sktObj;
+    std::map<SktHndType, boost::intrusive_ptr<SktObjType> >::iterator it =
         m_hndToSktObjMap.find(sktHnd);
     if (it != m_hndToSktObjMap.end())
     {
@@ -37,13 +37,13 @@ SktObjTypeRegistry<SktHndType, SktObjType>::findSocketObj(SktHndType sktHnd)
     return sktObj;
 }
 
-template<class SktHndType, class SktObjType> boost::shared_ptr<SktObjType>
+template<class SktHndType, class SktObjType> boost::intrusive_ptr<SktObjType>
 SktObjTypeRegistry<SktHndType, SktObjType>::removeSocketObj(SktHndType sktHnd)
 {
-    boost::lock_guard<boost::mutex> lock(m_mutex);
+    boost::lock_guard<boost::shared_mutex> lock(m_mutex);
 
-    boost::shared_ptr<SktObjType> sktObj;
-    std::map<SktHndType, boost::shared_ptr<SktObjType> >::iterator it =
+    boost::intrusive_ptr<SktObjType> sktObj;
+    std::map<SktHndType, boost::intrusive_ptr<SktObjType> >::iterator it =
         m_hndToSktObjMap.find(sktHnd);
     if (it != m_hndToSktObjMap.end())
     {
@@ -53,18 +53,18 @@ SktObjTypeRegistry<SktHndType, SktObjType>::removeSocketObj(SktHndType sktHnd)
     return sktObj;
 }
 
-template<class SktHndType, class SktObjType> boost::shared_ptr<SktObjType>
-SktObjTypeRegistry<SktHndType, SktObjType>::removeFrontSocketObj()
+template<class SktHndType, class SktObjType>
+void SktObjTypeRegistry<SktHndType, SktObjType>::removeAllSocketObjs(
+    std::vector<boost::intrusive_ptr<SktObjType> >& sktObjs)
 {
-    boost::lock_guard<boost::mutex> lock(m_mutex);
+    boost::lock_guard<boost::shared_mutex> lock(m_mutex);
 
-    boost::shared_ptr<SktObjType> sktObj;
-    std::map<SktHndType, boost::shared_ptr<SktObjType> >::iterator it =
+    sktObjs.reserve(sktObjs.size() + m_hndToSktObjMap.size());
+    std::map<SktHndType, boost::intrusive_ptr<SktObjType> >::iterator it =
         m_hndToSktObjMap.begin();
-    if (it != m_hndToSktObjMap.end())
+    for (; it != m_hndToSktObjMap.end(); ++it)
     {
-        sktObj = it->second;
-        m_hndToSktObjMap.erase(it);
+        sktObjs.push_back(it->second);
     }
-    return sktObj;
+    m_hndToSktObjMap.clear();
 }
@@ -6,22 +6,35 @@
 #include "srvsocketobj.h"
 #include "debug.h"
 #include "socketregistry.h"
+#include "trace.h"
+#include "unixaddr.h"
 
 WSAEVENT SrvSocketObj::netEvent() const
 {
-    return m_netEvent;
+    return (m_ringListener.get() != 0) ? m_ringListener->netEvent() :
+        m_netEvent;
 }
 
 void SrvSocketObj::onNetEvent()
 {
     boost::unique_lock<boost::mutex> lock(m_mutex);
 
-    if (m_socket == INVALID_SOCKET)
+    if (isClosed())
     {
         // Socket closed
         return;
     }
 
+    if (m_ringListener.get() != 0)
+    {
+        // A ring listener only ever signals pending connections
+        m_ringListener->resetNetEvent();
+        lock.unlock();
+
+        onFdAccept();
+        return;
+    }
+
     WSANETWORKEVENTS wsaNetworkEvents;
     int wsaEnumNetworkEventsErr = WSAEnumNetworkEvents(m_socket, m_netEvent,
         &wsaNetworkEvents);
@@ -83,6 +96,10 @@ int SrvSocketObj::create(const char* ipAddr, unsigned short port,
 
 SrvSocketObj::~SrvSocketObj()
 {
+    // First, so a connection closing elsewhere cannot resume this object
+    // while it is being destroyed
+    m_admission->removeWaiter(this);
+
     delete[] m_clientAddr;
 
     if (m_netEvent != WSA_INVALID_EVENT)
@@ -92,62 +109,140 @@ SrvSocketObj::~SrvSocketObj()
 }
 
 int SrvSocketObj::acceptConnection(SOCKET* pAcceptedSocket,
+                                   RingChannel** pAcceptedChannel,
                                    char* clientIpAddr, int clientIpAddrLen,
                                    unsigned short* pClientPort)
 {
-    boost::lock_guard<boost::mutex> lock(m_mutex);
+    *pAcceptedSocket = INVALID_SOCKET;
+    *pAcceptedChannel = 0;
 
-    // Accept the connection and get the IP address and port of the client
-    // socket if required
-    int err = CL_ERR_OK;
-    assert(m_clientAddr != 0); // Already created
-    int clientAddrLen = m_clientAddrLen;
-        // Using a copy as accept can modify the value
-
-    *pAcceptedSocket = accept(m_socket, m_clientAddr, &clientAddrLen);
-    if (*pAcceptedSocket != INVALID_SOCKET)
+    if (!admitOrPause(true))
     {
-        char clientPortStr[NI_MAXSERV];
-        DWORD clientPortStrLen = sizeof(clientPortStr);
-
-        int getNameInfoErr = getnameinfo(m_clientAddr, clientAddrLen,
-            clientIpAddr, clientIpAddrLen,
-            ((pClientPort != NULL) ? clientPortStr : NULL),
-            ((pClientPort != NULL) ? clientPortStrLen : 0),
-            NI_NUMERICHOST | NI_NUMERICSERV);
-        if (getNameInfoErr == 0)
-        {
-            // Get name info succeeded
-            if (pClientPort != NULL)
-            {
-                *pClientPort = static_cast<unsigned short>(
-                    strtoul(clientPortStr, NULL, 10));
-            }
-        }
-        else
-        {
-            err = WSAGetLastError();
-
-            closesocket(*pAcceptedSocket);
-            *pAcceptedSocket = INVALID_SOCKET;
-        }
+        return CL_ERR_TOO_MANY_CONS;
     }
-    else
+
+    int err = acceptPending(pAcceptedSocket, pAcceptedChannel, clientIpAddr,
+        clientIpAddrLen, pClientPort);
+    if (err != CL_ERR_OK)
     {
-        err = WSAGetLastError();
+        m_admission->release();
     }
-
     return err;
 }
 
 void SrvSocketObj::close()
 {
+    m_admission->removeWaiter(this);
+
     boost::lock_guard<boost::mutex> lock(m_mutex);
 
+    if (m_ringListener.get() != 0)
+    {
+        m_ringListener->close();
+    }
+
     if (m_socket != INVALID_SOCKET)
     {
         closesocket(m_socket);
         m_socket = INVALID_SOCKET;
+
+        if (!m_unixPath.empty())
+        {
+            // Remove the socket file so the path can be listened on again
+            DeleteFileA(m_unixPath.c_str());
+        }
+    }
+}
+
+void SrvSocketObj::setRequestRecvFn(CLPRequestRecvFn requestRecvFn)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    m_requestRecvFn = requestRecvFn;
+}
+
+CLPRequestRecvFn SrvSocketObj::requestRecvFn()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    return m_requestRecvFn;
+}
+
+void SrvSocketObj::setCompression(int minLen)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    m_compressMinLen = minLen;
+}
+
+int SrvSocketObj::compressMinLen()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    return m_compressMinLen;
+}
+
+void SrvSocketObj::setRateLimit(const CLRateLimit& limit)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    m_rateLimit = limit;
+}
+
+CLRateLimit SrvSocketObj::rateLimit()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    return m_rateLimit;
+}
+
+void SrvSocketObj::setSlowConsumerPolicy(const CLSlowConsumerPolicy& policy,
+                                         CLPSlowConsumerFn slowConsumerFn)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    m_slowConsumerPolicy = policy;
+    m_slowConsumerFn = slowConsumerFn;
+}
+
+CLSlowConsumerPolicy SrvSocketObj::slowConsumerPolicy(
+    CLPSlowConsumerFn* pSlowConsumerFn)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    *pSlowConsumerFn = m_slowConsumerFn;
+    return m_slowConsumerPolicy;
+}
+
+void SrvSocketObj::setMaxCons(int maxCons)
+{
+    m_admission->setMaxCons(maxCons);
+}
+
+void SrvSocketObj::resumeAccepting()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (isClosed() || !m_acceptPaused)
+    {
+        return;
+    }
+
+    m_acceptPaused = false;
+    if (m_ringListener.get() != 0)
+    {
+        // Connections that arrived while paused are still pending
+        WSASetEvent(m_ringListener->netEvent());
+        return;
+    }
+
+    // Selecting FD_ACCEPT again signals it straight away if connections are
+    // queued in the backlog
+    if (WSAEventSelect(m_socket, m_netEvent, FD_ACCEPT | FD_CLOSE) ==
+        SOCKET_ERROR)
+    {
+        OUTPUT_FMT_DEBUG_STRING("WSAEventSelect failed, err=" <<
+            WSAGetLastError());
     }
 }
 
@@ -156,6 +251,12 @@ int SrvSocketObj::resolveIpAddr(const char* ipAddr, unsigned short port,
 {
     assert(pAddrInfo != 0);
 
+    if (isUnixAddr(ipAddr))
+    {
+        // A Unix domain socket path, the port is not used
+        return resolveUnixAddr(ipAddr, pAddrInfo);
+    }
+
     int err = CL_ERR_OK;
 
     char portStr[NI_MAXSERV];
@@ -185,13 +286,29 @@ SrvSocketObj::SrvSocketObj(CLPConPendingFn conPendingFn,
                            CLPSrvSocketClosedFn srvSocketClosedFn,
                            int conBacklog, void* srvArg) :
 m_conPendingFn(conPendingFn), m_srvSocketClosedFn(srvSocketClosedFn),
-m_conBacklog(conBacklog), m_srvArg(srvArg), m_netEvent(WSA_INVALID_EVENT),
-m_socket(INVALID_SOCKET), m_clientAddr(0), m_clientAddrLen(0)
+m_conBacklog(conBacklog), m_srvArg(srvArg), m_requestRecvFn(0),
+m_compressMinLen(0), m_rateLimit(), m_slowConsumerPolicy(),
+m_slowConsumerFn(0), m_admission(new ConAdmission(&ConAdmission::global())),
+m_acceptPaused(false),
+m_netEvent(WSA_INVALID_EVENT), m_socket(INVALID_SOCKET), m_clientAddr(0),
+m_clientAddrLen(0)
 {
 }
 
 int SrvSocketObj::construct(const char* ipAddr, unsigned short port)
 {
+    if (isRingAddr(ipAddr))
+    {
+        // Ring listeners have their own event, and the port is not used
+        RingListener* ringListener = 0;
+        int err = createRingListener(ipAddr, m_conBacklog, &ringListener);
+        if (err == CL_ERR_OK)
+        {
+            m_ringListener.reset(ringListener);
+        }
+        return err;
+    }
+
     int err = createNetEvent();
 
     ADDRINFOA* addrInfo = NULL;
@@ -224,6 +341,14 @@ int SrvSocketObj::construct(const char* ipAddr, unsigned short port)
         }
     }
 
+    if (err == CL_ERR_OK && addrInfo->ai_family == AF_UNIX)
+    {
+        // Binding fails if the socket file already exists, so delete a file
+        // left behind by a previous server that did not close cleanly
+        err = removeStaleUnixSocket(
+            *reinterpret_cast<SOCKADDR_UN*>(addrInfo->ai_addr));
+    }
+
     if (err == CL_ERR_OK)
     {
         // Bind the socket to the IP address and port
@@ -232,6 +357,13 @@ int SrvSocketObj::construct(const char* ipAddr, unsigned short port)
         {
             err = WSAGetLastError();
         }
+        else if (addrInfo->ai_family == AF_UNIX)
+        {
+            // Binding created the socket file, so it is this object's to
+            // delete
+            m_unixPath =
+                reinterpret_cast<SOCKADDR_UN*>(addrInfo->ai_addr)->sun_path;
+        }
     }
 
     if (err == CL_ERR_OK)
@@ -254,7 +386,7 @@ int SrvSocketObj::construct(const char* ipAddr, unsigned short port)
     // Free the address info now that it is no longer needed
     if (addrInfo != NULL)
     {
-        freeaddrinfo(addrInfo);
+        freeAddrInfo(addrInfo);
         addrInfo = NULL;
     }
 
@@ -266,6 +398,12 @@ int SrvSocketObj::construct(const char* ipAddr, unsigned short port)
             closesocket(m_socket);
             m_socket = INVALID_SOCKET;
         }
+
+        if (!m_unixPath.empty())
+        {
+            DeleteFileA(m_unixPath.c_str());
+            m_unixPath.clear();
+        }
     }
 
     return err;
@@ -282,11 +420,17 @@ int SrvSocketObj::createNetEvent()
     return err;
 }
 
+bool SrvSocketObj::isClosed() const
+{
+    return (m_ringListener.get() != 0) ? m_ringListener->isClosed() :
+        (m_socket == INVALID_SOCKET);
+}
+
 void SrvSocketObj::onFdAccept()
 {
     boost::unique_lock<boost::mutex> lock(m_mutex);
 
-    if (m_socket == INVALID_SOCKET)
+    if (isClosed())
     {
         // Socket closed
         return;
@@ -296,14 +440,162 @@ void SrvSocketObj::onFdAccept()
     // call the callback function
     lock.unlock();
 
+    if (!admitOrPause(false))
+    {
+        // The connection stays queued until there is room for it
+        return;
+    }
+
+    Trace::record(TRACE_CALLBACK_BEGIN, SrvSocketRegistry::toHandle(this),
+        TRACE_CALLBACK_CON_PENDING);
     m_conPendingFn(SrvSocketRegistry::toHandle(this), m_srvArg);
+    Trace::record(TRACE_CALLBACK_END, SrvSocketRegistry::toHandle(this),
+        TRACE_CALLBACK_CON_PENDING);
+}
+
+int SrvSocketObj::acceptPending(SOCKET* pAcceptedSocket,
+                                RingChannel** pAcceptedChannel,
+                                char* clientIpAddr, int clientIpAddrLen,
+                                unsigned short* pClientPort)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (m_ringListener.get() != 0)
+    {
+        // Ring clients have no IP address or port
+        if (clientIpAddr != NULL && clientIpAddrLen == 0)
+        {
+            return CL_ERR_ILLEGAL_ARG;
+        }
+
+        int err = m_ringListener->accept(pAcceptedChannel);
+        if (err == CL_ERR_OK)
+        {
+            if (clientIpAddr != NULL)
+            {
+                clientIpAddr[0] = '\0';
+            }
+
+            if (pClientPort != NULL)
+            {
+                *pClientPort = 0;
+            }
+        }
+        return err;
+    }
+
+    // Accept the connection and get the IP address and port of the client
+    // socket if required
+    int err = CL_ERR_OK;
+    assert(m_clientAddr != 0); // Already created
+    int clientAddrLen = m_clientAddrLen;
+        // Using a copy as accept can modify the value
+
+    *pAcceptedSocket = accept(m_socket, m_clientAddr, &clientAddrLen);
+    if (*pAcceptedSocket != INVALID_SOCKET && !m_unixPath.empty())
+    {
+        // Unix domain socket clients have no IP address or port, instead
+        // report the path the client is bound to (usually there is none)
+        if (clientIpAddr != NULL)
+        {
+            const char* clientPath =
+                reinterpret_cast<SOCKADDR_UN*>(m_clientAddr)->sun_path;
+            if (clientAddrLen <= static_cast<int>(sizeof(ADDRESS_FAMILY)))
+            {
+                // Unnamed client socket
+                clientPath = "";
+            }
+
+            if (clientIpAddrLen == 0 || strncpy_s(clientIpAddr,
+                clientIpAddrLen, clientPath, _TRUNCATE) == STRUNCATE)
+            {
+                err = CL_ERR_ILLEGAL_ARG;
+
+                closesocket(*pAcceptedSocket);
+                *pAcceptedSocket = INVALID_SOCKET;
+            }
+        }
+
+        if (pClientPort != NULL)
+        {
+            *pClientPort = 0;
+        }
+    }
+    else if (*pAcceptedSocket != INVALID_SOCKET)
+    {
+        char clientPortStr[NI_MAXSERV];
+        DWORD clientPortStrLen = sizeof(clientPortStr);
+
+        int getNameInfoErr = getnameinfo(m_clientAddr, clientAddrLen,
+            clientIpAddr, clientIpAddrLen,
+            ((pClientPort != NULL) ? clientPortStr : NULL),
+            ((pClientPort != NULL) ? clientPortStrLen : 0),
+            NI_NUMERICHOST | NI_NUMERICSERV);
+        if (getNameInfoErr == 0)
+        {
+            // Get name info succeeded
+            if (pClientPort != NULL)
+            {
+                *pClientPort = static_cast<unsigned short>(
+                    strtoul(clientPortStr, NULL, 10));
+            }
+        }
+        else
+        {
+            err = WSAGetLastError();
+
+            closesocket(*pAcceptedSocket);
+            *pAcceptedSocket = INVALID_SOCKET;
+        }
+    }
+    else
+    {
+        err = WSAGetLastError();
+    }
+
+    return err;
+}
+
+bool SrvSocketObj::admitOrPause(bool take)
+{
+    if (m_admission->tryAdmit(take))
+    {
+        return true;
+    }
+
+    // Pause before waiting for room, so a connection that closes in between
+    // still resumes accepting
+    pauseAccepting();
+    if (m_admission->waitForRoom(this))
+    {
+        resumeAccepting();
+    }
+    return false;
+}
+
+void SrvSocketObj::pauseAccepting()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (isClosed() || m_acceptPaused)
+    {
+        return;
+    }
+
+    m_acceptPaused = true;
+    if (m_ringListener.get() == 0 &&
+        WSAEventSelect(m_socket, m_netEvent, FD_CLOSE) == SOCKET_ERROR)
+    {
+        OUTPUT_FMT_DEBUG_STRING("WSAEventSelect failed, err=" <<
+            WSAGetLastError());
+    }
 }
 
 void SrvSocketObj::onFdClose(int fdCloseErr)
 {
     boost::unique_lock<boost::mutex> lock(m_mutex);
 
-    if (m_socket == INVALID_SOCKET)
+    if (isClosed())
     {
         // Socket closed
         return;
@@ -7,14 +7,20 @@
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <string>
 #include "inc/comlib/comlib.h"
+#include "conadmission.h"
 #include "netobj.h"
+#include "ringchannel.h"
 
 /**
  * Represents a TCP socket that listens for connections on a local IP address
- * and port.
+ * and port. A server socket object given a ring address instead listens for
+ * ring connections, see RingListener.
  */
 class SrvSocketObj : public NetObj
 {
@@ -51,10 +57,15 @@ public:
     virtual ~SrvSocketObj();
 
     /**
-     * Accepts a connection from a client if one is pending.
+     * Accepts a connection from a client if one is pending and the caps on
+     * connections allow, see setMaxCons(). The connection is counted until
+     * the socket object given it is closed, see SocketObj::setAdmission().
      *
-     * @param pAcceptedSocket if the method was successful this will be set to
-     * point to the accepted client socket.
+     * @param pAcceptedSocket if the method was successful and this object is
+     * listening on a socket this will be set to the accepted client socket.
+     * @param pAcceptedChannel if the method was successful and this object is
+     * listening for ring connections this will be set to point to the
+     * accepted client channel.
      * @param clientIpAddr if the method was successful and this is not NULL
      * this will be filled in with the IP address of the client.
      * @param clientIpAddrLen the length of the given client IP address buffer.
@@ -63,7 +74,8 @@ public:
      * @return CL_ERR_OK if the method was successful, any other value
      * otherwise.
      */
-    int acceptConnection(SOCKET* pAcceptedSocket, char* clientIpAddr,
+    int acceptConnection(SOCKET* pAcceptedSocket,
+        RingChannel** pAcceptedChannel, char* clientIpAddr,
         int clientIpAddrLen, unsigned short* pClientPort);
 
     /**
@@ -72,18 +84,114 @@ public:
      */
     void close();
 
+    /**
+     * Sets the function that will be called when socket objects accepted by
+     * this object receive a request.
+     *
+     * @param requestRecvFn this will be called when an accepted socket object
+     * has received a request, or NULL for none.
+     */
+    void setRequestRecvFn(CLPRequestRecvFn requestRecvFn);
+
+    /**
+     * Returns the function that will be called when socket objects accepted
+     * by this object receive a request.
+     *
+     * @return The function, or NULL for none.
+     */
+    CLPRequestRecvFn requestRecvFn();
+
+    /**
+     * Sets the length from which data sent by socket objects accepted by this
+     * object is compressed.
+     *
+     * @param minLen the minimum length of data to compress, or 0 for none.
+     */
+    void setCompression(int minLen);
+
+    /**
+     * Returns the length from which data sent by socket objects accepted by
+     * this object is compressed.
+     *
+     * @return The minimum length of data to compress, or 0 for none.
+     */
+    int compressMinLen();
+
+    /**
+     * Sets the token bucket limits given to socket objects accepted by this
+     * object.
+     *
+     * @param limit the limits, where a rate of 0 means no limit.
+     */
+    void setRateLimit(const CLRateLimit& limit);
+
+    /**
+     * Returns the token bucket limits given to socket objects accepted by
+     * this object.
+     *
+     * @return The limits, where a rate of 0 means no limit.
+     */
+    CLRateLimit rateLimit();
+
+    /**
+     * Sets the slow consumer policy given to socket objects accepted by this
+     * object.
+     *
+     * @param policy the policy.
+     * @param slowConsumerFn this will be called when a limit of the policy is
+     * reached if its action is CL_SLOW_CONSUMER_CALLBACK.
+     */
+    void setSlowConsumerPolicy(const CLSlowConsumerPolicy& policy,
+        CLPSlowConsumerFn slowConsumerFn);
+
+    /**
+     * Returns the slow consumer policy given to socket objects accepted by
+     * this object.
+     *
+     * @param pSlowConsumerFn this will be set to the slow consumer callback
+     * function.
+     * @return The policy, with an action of CL_SLOW_CONSUMER_NONE if none
+     * has been set.
+     */
+    CLSlowConsumerPolicy slowConsumerPolicy(
+        CLPSlowConsumerFn* pSlowConsumerFn);
+
+    /**
+     * Caps the number of connections accepted by this object that are open
+     * at once.
+     *
+     * @param maxCons the maximum number of connections, or 0 for no cap.
+     */
+    void setMaxCons(int maxCons);
+
+    /**
+     * Returns what the connections accepted by this object are counted
+     * against.
+     *
+     * @return The connection admission for this object.
+     */
+    const boost::shared_ptr<ConAdmission>& admission() const
+        { return m_admission; }
+
+    /**
+     * Starts waiting for connections again after a cap on connections was
+     * reached. This is called by ConAdmission.
+     */
+    void resumeAccepting();
+
 private:
     /**
      * Resolves the given IP address and port into a sockaddr structure
-     * suitable for passing to the winsock bind() function.
+     * suitable for passing to the winsock bind() function. If the IP address
+     * is a Unix domain socket address then the port is ignored.
      *
      * @param ipAddr the IP address to resolve.
      * @param port the port to resolve.
      * @param pAddrInfo if the method was successful this will be set to point
      * to an address information structure containing the needed information.
      * Note that since the address information is allocated dynamically, the
-     * caller will need to use the winsock function freeaddrinfo() to delete
-     * the address information once finished with it.
+     * caller will need to use the function freeAddrInfo() to delete the
+     * address information once finished with it.
      * @return CL_ERR_OK if the method was successful, any other value
      * otherwise.
      */
@@ -125,9 +233,42 @@ private:
      */
     int createNetEvent();
 
+    /**
+     * Has this server socket object been closed?
+     *
+     * @return Whether or not this server socket object has been closed.
+     */
+    bool isClosed() const;
+
     /** Handles the FD_ACCEPT network event. */
     void onFdAccept();
 
+    /**
+     * Accepts a connection from a client if one is pending, see
+     * acceptConnection().
+     *
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int acceptPending(SOCKET* pAcceptedSocket,
+        RingChannel** pAcceptedChannel, char* clientIpAddr,
+        int clientIpAddrLen, unsigned short* pClientPort);
+
+    /**
+     * Checks the caps on connections allow another, pausing accepting if
+     * not. m_mutex must not be locked by the caller.
+     *
+     * @param take whether to count the connection, or only check there is
+     * room for one.
+     * @return Whether or not there is room for another connection.
+     */
+    bool admitOrPause(bool take);
+
+    /**
+     * Stops waiting for connections, leaving them queued in the backlog.
+     */
+    void pauseAccepting();
+
     /**
      * Handles the FD_CLOSE network event.
      *
@@ -160,18 +301,64 @@ private:
      */
     void* m_srvArg;
 
+    /**
+     * This will be called when socket objects accepted by this object receive
+     * a request.
+     */
+    CLPRequestRecvFn m_requestRecvFn;
+
+    /**
+     * The minimum length of data to compress for socket objects accepted by
+     * this object, or 0 for none.
+     */
+    int m_compressMinLen;
+
+    /** The token bucket limits for socket objects accepted by this object. */
+    CLRateLimit m_rateLimit;
+
+    /** The slow consumer policy for socket objects accepted by this object. */
+    CLSlowConsumerPolicy m_slowConsumerPolicy;
+
+    /**
+     * The slow consumer callback function for socket objects accepted by this
+     * object.
+     */
+    CLPSlowConsumerFn m_slowConsumerFn;
+
+    /** What the connections accepted by this object are counted against. */
+    boost::shared_ptr<ConAdmission> m_admission;
+
+    /**
+     * This is set while accepting is paused as a cap on connections has been
+     * reached.
+     */
+    bool m_acceptPaused;
+
     /** The network event for this object. */
     WSAEVENT m_netEvent;
 
     /** The socket for this object. */
     SOCKET m_socket;
 
+    /**
+     * The listener for this object if it was given a ring address, in which
+     * case m_socket and m_netEvent are not used, otherwise NULL.
+     */
+    boost::scoped_ptr<RingListener> m_ringListener;
+
     /** This is used when accepting a connection from a client. */
     SOCKADDR* m_clientAddr;
 
     /** The length of the structure pointed to by m_clientAddr. */
     int m_clientAddrLen;
+
+    /**
+     * The path of the socket file if this object is listening on a Unix domain
+     * socket address and its bind created the file, otherwise empty. The file
+     * is deleted when this object is closed.
+     */
+    std::string m_unixPath;
 };
 
 /** A shared pointer to a server socket object. */
-typedef boost::shared_ptr<SrvSocketObj> SrvSocketObjSPtr;
+typedef boost::intrusive_ptr<SrvSocketObj> SrvSocketObjSPtr;
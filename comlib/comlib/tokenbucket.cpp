@@ -0,0 +1,72 @@
+/**
+ * @file
+ * Defines the TokenBucket class.
+ */
+
+#include "tokenbucket.h"
+#include <algorithm>
+
+// The number of thousandths in a token, tokens are counted in thousandths so
+// a bucket refilled every millisecond never loses a fraction
+static const LONGLONG MILLI_TOKENS_PER_TOKEN = 1000;
+
+TokenBucket::TokenBucket() : m_ratePerSec(0), m_maxMilliTokens(0),
+m_milliTokens(0), m_lastRefill(0)
+{
+}
+
+void TokenBucket::setLimit(ULONG ratePerSec, ULONG burst, ULONGLONG now)
+{
+    m_ratePerSec = ratePerSec;
+    m_maxMilliTokens = static_cast<LONGLONG>((burst != 0) ? burst :
+        ratePerSec) * MILLI_TOKENS_PER_TOKEN;
+    m_milliTokens = m_maxMilliTokens;
+    m_lastRefill = now;
+}
+
+ULONGLONG TokenBucket::readyTime(ULONGLONG now)
+{
+    if (m_ratePerSec == 0)
+    {
+        return now;
+    }
+
+    refill(now);
+    if (m_milliTokens > 0)
+    {
+        return now;
+    }
+
+    // Round up to the first millisecond with at least a thousandth of a token
+    // in the bucket
+    return now + static_cast<ULONGLONG>(-m_milliTokens / m_ratePerSec) + 1;
+}
+
+void TokenBucket::take(ULONG count, ULONGLONG now)
+{
+    if (m_ratePerSec == 0)
+    {
+        return;
+    }
+
+    refill(now);
+    m_milliTokens -= static_cast<LONGLONG>(count) * MILLI_TOKENS_PER_TOKEN;
+}
+
+void TokenBucket::refill(ULONGLONG now)
+{
+    if (now <= m_lastRefill)
+    {
+        return;
+    }
+
+    // Cap the time elapsed at what fills the bucket from empty, so a bucket
+    // left unused for a long time cannot overflow
+    ULONGLONG maxElapsed = static_cast<ULONGLONG>(
+        (m_maxMilliTokens - m_milliTokens) / m_ratePerSec) + 1;
+    ULONGLONG elapsed = (std::min)(now - m_lastRefill, maxElapsed);
+
+    m_milliTokens = (std::min)(m_maxMilliTokens,
+        m_milliTokens + static_cast<LONGLONG>(elapsed * m_ratePerSec));
+    m_lastRefill = now;
+}
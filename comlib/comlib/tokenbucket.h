@@ -0,0 +1,81 @@
+/**
+ * @file
+ * Declares the TokenBucket class.
+ */
+
+#pragma once
+
+#include <windows.h>
+
+/**
+ * Limits the rate of something, such as bytes or frames, to an average
+ * number per second while allowing bursts of up to a given number. The bucket
+ * is only refilled when it is looked at, from the tick count passed in, so a
+ * bucket nobody is using costs nothing.
+ *
+ * Tokens are taken after the fact, so the bucket can go into debt by up to
+ * the last amount taken, which is then paid back before any more is allowed.
+ * A token bucket is not thread safe, the caller must synchronize access.
+ */
+class TokenBucket
+{
+public:
+    /** Constructs a token bucket with no limit. */
+    TokenBucket();
+
+    /**
+     * Sets the limit, filling the bucket.
+     *
+     * @param ratePerSec the average number of tokens allowed per second, or
+     * 0 for no limit.
+     * @param burst the most tokens that can build up while unused, which is
+     * taken to be ratePerSec if 0.
+     * @param now the current tick count, as given by GetTickCount64().
+     */
+    void setLimit(ULONG ratePerSec, ULONG burst, ULONGLONG now);
+
+    /**
+     * Returns the tick count from which tokens can be taken again.
+     *
+     * @param now the current tick count, as given by GetTickCount64().
+     * @return now if tokens can be taken straight away, a later tick count
+     * otherwise.
+     */
+    ULONGLONG readyTime(ULONGLONG now);
+
+    /**
+     * Takes the given number of tokens from the bucket. This does nothing if
+     * there is no limit.
+     *
+     * @param count the number of tokens to take.
+     * @param now the current tick count, as given by GetTickCount64().
+     */
+    void take(ULONG count, ULONGLONG now);
+
+private:
+    /**
+     * Adds the tokens built up since the bucket was last refilled.
+     *
+     * @param now the current tick count, as given by GetTickCount64().
+     */
+    void refill(ULONGLONG now);
+
+    /**
+     * The average number of tokens allowed per second, which is also the
+     * number of thousandths of a token added each millisecond, or 0 for no
+     * limit.
+     */
+    ULONG m_ratePerSec;
+
+    /** The most thousandths of a token the bucket can hold. */
+    LONGLONG m_maxMilliTokens;
+
+    /**
+     * The thousandths of a token in the bucket, which is negative when the
+     * bucket is in debt.
+     */
+    LONGLONG m_milliTokens;
+
+    /** The tick count when the bucket was last refilled. */
+    ULONGLONG m_lastRefill;
+};
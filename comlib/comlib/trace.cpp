@@ -0,0 +1,274 @@
+/**
+ * @file
+ * Defines the Trace class.
+ */
+
+#include "trace.h"
+#include <intrin.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "inc/comlib/comlib.h"
+
+// The number of events each thread's ring holds, which must be a power of 2
+static const ULONG RING_LEN = 4096;
+
+// The most threads that can have a ring at once. Events recorded by any more
+// threads are dropped
+static const LONG MAX_RINGS = 256;
+
+// The names of the event types in the trace file, in TraceEventType order
+static const char* const EVENT_NAMES[] =
+{
+    "accept", "connect", "frame rx", "frame tx", 0, 0, "send block",
+    "send block", "close"
+};
+
+// The names of the callbacks in the trace file, in TraceCallback order
+static const char* const CALLBACK_NAMES[] =
+{
+    "dataRecvFn", "requestRecvFn", "conPendingFn", "datagramRecvFn"
+};
+
+namespace
+{
+    // An event, which is kept to at most 32 bytes so that two fit in a cache
+    // line. The thread that recorded it is kept with each event as a ring
+    // can pass from one thread to another
+    struct TraceEvent
+    {
+        ULONGLONG tsc;
+        ULONGLONG arg;
+        const void* handle;
+        LONG type;
+        DWORD threadId;
+    };
+
+    // A ring of events. Only the thread that owns the ring writes to it,
+    // moving head on once each event is written; events are read while they
+    // may be overwritten, and those that could have been are dropped. owned is
+    // 0 once the owning thread has exited, when another thread may take the
+    // ring over and go on from head
+    struct TraceRing
+    {
+        DWORD threadId;
+        volatile LONG owned;
+        volatile LONG head;
+        TraceEvent events[RING_LEN];
+    };
+}
+
+// The rings allocated so far, and the number of slots in s_rings that have
+// been claimed, which may be more than MAX_RINGS
+static TraceRing* volatile s_rings[MAX_RINGS];
+static volatile LONG s_ringCount = 0;
+
+// The calling thread's ring, and whether or not it was refused one. A thread
+// refused a ring is not given one later even if a ring is given up, rather
+// than looking for one every event
+static __declspec(thread) TraceRing* t_ring = 0;
+static __declspec(thread) bool t_noRing = false;
+
+// The time stamp counter and performance counter when tracing was first
+// turned on, which the times in the trace file are relative to
+static volatile LONGLONG s_baseTsc = 0;
+static LONGLONG s_baseQpc = 0;
+
+volatile LONG Trace::s_on = 0;
+
+void Trace::setOn(bool on)
+{
+    if (on && InterlockedCompareExchange64(&s_baseTsc, 0, 0) == 0)
+    {
+        LARGE_INTEGER qpc;
+        QueryPerformanceCounter(&qpc);
+        LONGLONG tsc = static_cast<LONGLONG>(__rdtsc());
+        if (InterlockedCompareExchange64(&s_baseTsc, tsc, 0) == 0)
+        {
+            s_baseQpc = qpc.QuadPart;
+        }
+    }
+    InterlockedExchange(&s_on, on ? 1 : 0);
+}
+
+int Trace::dump(const char* path)
+{
+    // Work out how many time stamp counter ticks there are per microsecond
+    // from how far both counters have moved on since tracing was turned on
+    LONGLONG baseTsc = InterlockedCompareExchange64(&s_baseTsc, 0, 0);
+    LARGE_INTEGER qpcFreq;
+    LARGE_INTEGER qpc;
+    QueryPerformanceFrequency(&qpcFreq);
+    QueryPerformanceCounter(&qpc);
+    LONGLONG tsc = static_cast<LONGLONG>(__rdtsc());
+    double elapsedMicros = static_cast<double>(qpc.QuadPart - s_baseQpc) *
+        1e6 / static_cast<double>(qpcFreq.QuadPart);
+    double ticksPerMicro = elapsedMicros > 0 ?
+        static_cast<double>(tsc - baseTsc) / elapsedMicros : 1;
+    if (ticksPerMicro <= 0)
+    {
+        ticksPerMicro = 1;
+    }
+
+    std::string json("{\"traceEvents\":[");
+    bool first = true;
+    char line[256];
+    DWORD pid = GetCurrentProcessId();
+    std::vector<TraceEvent> events(RING_LEN);
+
+    LONG claimedCount = s_ringCount;
+    LONG ringCount = (std::min)(claimedCount, MAX_RINGS);
+    for (LONG ringIdx = 0; ringIdx < ringCount; ++ringIdx)
+    {
+        TraceRing* ring = s_rings[ringIdx];
+        if (ring == 0)
+        {
+            // The slot has been claimed but the ring is not there yet
+            continue;
+        }
+
+        // Copy the ring oldest first, then drop those the owning thread may
+        // have overwritten while it was being copied
+        ULONG head = static_cast<ULONG>(ring->head);
+        for (ULONG idx = 0; idx < RING_LEN; ++idx)
+        {
+            events[idx] = ring->events[(head + idx) & (RING_LEN - 1)];
+        }
+        ULONG overwritten = static_cast<ULONG>(ring->head) - head + 1;
+
+        for (ULONG idx = overwritten; idx < RING_LEN; ++idx)
+        {
+            const TraceEvent& event = events[idx];
+            if (event.tsc == 0 || static_cast<LONGLONG>(event.tsc) < baseTsc)
+            {
+                // Never written, or written before tracing was calibrated
+                continue;
+            }
+
+            double ts = static_cast<double>(
+                static_cast<LONGLONG>(event.tsc) - baseTsc) / ticksPerMicro;
+            const char* name = 0;
+            const char* phase = "i";
+            switch (event.type)
+            {
+            case TRACE_CALLBACK_BEGIN:
+            case TRACE_CALLBACK_END:
+                name = event.arg < _countof(CALLBACK_NAMES) ?
+                    CALLBACK_NAMES[event.arg] : "callback";
+                phase = event.type == TRACE_CALLBACK_BEGIN ? "B" : "E";
+                break;
+            case TRACE_SEND_BLOCK_BEGIN:
+                phase = "B";
+                break;
+            case TRACE_SEND_BLOCK_END:
+                phase = "E";
+                break;
+            default:
+                break;
+            }
+            if (name == 0)
+            {
+                ULONG typeIdx = static_cast<ULONG>(event.type);
+                name = typeIdx < _countof(EVENT_NAMES) ?
+                    EVENT_NAMES[typeIdx] : "unknown";
+            }
+
+            sprintf_s(line, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",%s\"pid\":%lu,"
+                "\"tid\":%lu,\"ts\":%.3f,\"args\":{\"handle\":\"%p\","
+                "\"arg\":%llu}}", first ? "" : ",", name, phase,
+                phase[0] == 'i' ? "\"s\":\"t\"," : "", pid, event.threadId,
+                ts, event.handle, event.arg);
+            json += line;
+            first = false;
+        }
+    }
+    json += "\n]}\n";
+
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError();
+    }
+
+    int err = CL_ERR_OK;
+    DWORD written = 0;
+    if (!WriteFile(file, json.data(), static_cast<DWORD>(json.size()),
+        &written, NULL))
+    {
+        err = GetLastError();
+    }
+    CloseHandle(file);
+    return err;
+}
+
+void Trace::recordOn(TraceEventType type, const void* handle, ULONGLONG arg)
+{
+    TraceRing* ring = t_ring;
+    if (ring == 0)
+    {
+        if (t_noRing)
+        {
+            return;
+        }
+
+        // Claim a slot for a new ring, or once there are none left take over
+        // a ring given up by a thread that has exited
+        LONG ringIdx = InterlockedIncrement(&s_ringCount) - 1;
+        if (ringIdx < MAX_RINGS)
+        {
+            ring = static_cast<TraceRing*>(VirtualAlloc(NULL,
+                sizeof(TraceRing), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+            if (ring == NULL)
+            {
+                t_noRing = true;
+                return;
+            }
+            ring->threadId = GetCurrentThreadId();
+            ring->owned = 1;
+            s_rings[ringIdx] = ring;
+        }
+        else
+        {
+            for (LONG idx = 0; ring == 0 && idx < MAX_RINGS; ++idx)
+            {
+                TraceRing* givenUpRing = s_rings[idx];
+                if (givenUpRing != 0 &&
+                    InterlockedCompareExchange(&givenUpRing->owned, 1, 0) == 0)
+                {
+                    givenUpRing->threadId = GetCurrentThreadId();
+                    ring = givenUpRing;
+                }
+            }
+            if (ring == 0)
+            {
+                t_noRing = true;
+                return;
+            }
+        }
+        t_ring = ring;
+    }
+
+    // Write the event then publish it by moving head on, which as a volatile
+    // write cannot be reordered before the writes to the event
+    LONG head = ring->head;
+    TraceEvent& event = ring->events[static_cast<ULONG>(head) &
+        (RING_LEN - 1)];
+    event.tsc = __rdtsc();
+    event.arg = arg;
+    event.handle = handle;
+    event.type = type;
+    event.threadId = ring->threadId;
+    ring->head = head + 1;
+}
+
+void Trace::onThreadExit()
+{
+    TraceRing* ring = t_ring;
+    if (ring != 0)
+    {
+        t_ring = 0;
+        InterlockedExchange(&ring->owned, 0);
+    }
+}
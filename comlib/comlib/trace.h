@@ -0,0 +1,145 @@
+/**
+ * @file
+ * Declares the Trace class.
+ */
+
+#pragma once
+
+#include <windows.h>
+
+/** The kinds of event recorded in the trace. */
+enum TraceEventType
+{
+    /**
+     * A connection was accepted. The argument is the handle of the server
+     * socket that accepted it.
+     */
+    TRACE_ACCEPT,
+
+    /**
+     * A connection attempt completed. The argument is the error code, 0 if
+     * the connection was made.
+     */
+    TRACE_CONNECT,
+
+    /** A whole frame was received. The argument is its length. */
+    TRACE_FRAME_RX,
+
+    /** A frame was sent. The argument is its length. */
+    TRACE_FRAME_TX,
+
+    /**
+     * A callback function is about to be called. The argument is one of the
+     * TraceCallback values.
+     */
+    TRACE_CALLBACK_BEGIN,
+
+    /**
+     * A callback function has returned. The argument is one of the
+     * TraceCallback values.
+     */
+    TRACE_CALLBACK_END,
+
+    /**
+     * A sender has to wait for its turn to send, or for the rate limit to
+     * allow it. The argument is 0.
+     */
+    TRACE_SEND_BLOCK_BEGIN,
+
+    /** A sender has finished waiting. The argument is 0. */
+    TRACE_SEND_BLOCK_END,
+
+    /**
+     * A socket was closed. The argument is the error code the other end
+     * closed the connection with, or 0 if it was closed by this end.
+     */
+    TRACE_CLOSE
+};
+
+/** The callback functions whose calls are traced. */
+enum TraceCallback
+{
+    /** A CLPDataRecvFn. */
+    TRACE_CALLBACK_DATA_RECV,
+
+    /** A CLPRequestRecvFn. */
+    TRACE_CALLBACK_REQUEST_RECV,
+
+    /** A CLPConPendingFn. */
+    TRACE_CALLBACK_CON_PENDING,
+
+    /** A CLPDatagramRecvFn. */
+    TRACE_CALLBACK_DATAGRAM_RECV
+};
+
+/**
+ * Records what the library does, while tracing is on, so that it can be
+ * looked at after a latency spike. Each thread records fixed size events,
+ * timestamped with the CPU's time stamp counter, in a ring buffer of its own
+ * without taking any locks, so recording an event costs about as much as
+ * reading the counter. Only the latest events fit in each ring.
+ *
+ * The rings are allocated the first time each thread records an event, up to
+ * a limit. A thread's ring is given up when the thread exits but keeps its
+ * events, so that they can still be written out, until a new thread needs a
+ * ring once the limit has been reached and takes it over. The methods are
+ * thread safe.
+ */
+class Trace
+{
+public:
+    /**
+     * Turns tracing on or off.
+     *
+     * @param on whether or not events are recorded.
+     */
+    static void setOn(bool on);
+
+    /**
+     * Records an event in the calling thread's ring, if tracing is on.
+     *
+     * @param type what happened.
+     * @param handle the handle of the socket, server socket or UDP socket it
+     * happened to.
+     * @param arg the argument of the event, as described for the type.
+     */
+    static void record(TraceEventType type, const void* handle,
+        ULONGLONG arg)
+    {
+        if (s_on != 0)
+        {
+            recordOn(type, handle, arg);
+        }
+    }
+
+    /**
+     * Writes the events in every ring to a file in the Chrome trace event
+     * format.
+     *
+     * @param path the path of the file, which is replaced if it exists.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int dump(const char* path);
+
+    /**
+     * Gives up the calling thread's ring, if it has one, so that another
+     * thread can take it over. This must be called as each thread exits.
+     */
+    static void onThreadExit();
+
+private:
+    /**
+     * Records an event in the calling thread's ring, allocating the ring if
+     * the thread does not have one yet.
+     *
+     * @param type what happened.
+     * @param handle the handle of what it happened to.
+     * @param arg the argument of the event.
+     */
+    static void recordOn(TraceEventType type, const void* handle,
+        ULONGLONG arg);
+
+    /** Is tracing on? This is not 0 if it is. */
+    static volatile LONG s_on;
+};
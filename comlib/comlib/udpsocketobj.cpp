@@ -0,0 +1,392 @@
+/**
+ * @file
+ * Defines the UdpSocketObj class.
+ */
+
+#include "udpsocketobj.h"
+#include <mstcpip.h>
+#include <cstring>
+#include "debug.h"
+#include "socketregistry.h"
+#include "trace.h"
+
+WSAEVENT UdpSocketObj::netEvent() const
+{
+    return m_netEvent;
+}
+
+void UdpSocketObj::onNetEvent()
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    if (m_socket == INVALID_SOCKET)
+    {
+        // Socket closed
+        return;
+    }
+
+    WSANETWORKEVENTS wsaNetworkEvents;
+    int wsaEnumNetworkEventsErr = WSAEnumNetworkEvents(m_socket, m_netEvent,
+        &wsaNetworkEvents);
+    if (wsaEnumNetworkEventsErr == SOCKET_ERROR)
+    {
+        OUTPUT_FMT_DEBUG_STRING("WSAEnumNetworkEvents failed, err=" <<
+            WSAGetLastError());
+        return;
+    }
+
+    // Unlock the mutex because we do not want this object to be locked when we
+    // call the callback function
+    lock.unlock();
+
+    if ((wsaNetworkEvents.lNetworkEvents & FD_READ) != 0)
+    {
+        if (wsaNetworkEvents.iErrorCode[FD_READ_BIT] == 0)
+        {
+            onFdRead();
+        }
+        else
+        {
+            OUTPUT_FMT_DEBUG_STRING("FD_READ failed, err=" <<
+                wsaNetworkEvents.iErrorCode[FD_READ_BIT]);
+        }
+    }
+}
+
+ULONGLONG UdpSocketObj::bytesRecv() const
+{
+    return m_bytesRecv;
+}
+
+int UdpSocketObj::create(const char* localAddr, unsigned short localPort,
+                         const char* remoteAddr, unsigned short remotePort,
+                         CLPDatagramRecvFn datagramRecvFn, void* arg,
+                         UdpSocketObj** pUdpSktObj)
+{
+    UdpSocketObj* self = new UdpSocketObj(datagramRecvFn, arg);
+    int err = self->construct(localAddr, localPort, remoteAddr, remotePort);
+    if (err == CL_ERR_OK)
+    {
+        *pUdpSktObj = self;
+    }
+    else
+    {
+        delete self;
+    }
+    return err;
+}
+
+UdpSocketObj::~UdpSocketObj()
+{
+    if (m_netEvent != WSA_INVALID_EVENT)
+    {
+        WSACloseEvent(m_netEvent);
+    }
+}
+
+int UdpSocketObj::sendDatagram(const char* buf, int len)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    int err = CL_ERR_OK;
+    if (send(m_socket, buf, len, 0) == SOCKET_ERROR)
+    {
+        err = WSAGetLastError();
+    }
+    return err;
+}
+
+int UdpSocketObj::sendDatagramTo(const char* toAddr, unsigned short toPort,
+                                 const char* buf, int len)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    // Resolving the destination is the expensive part, so remember the last
+    // one as most callers send to the same peer many times in a row
+    if (m_lastToLen == 0 || toPort != m_lastToPort || m_lastToAddr != toAddr)
+    {
+        ADDRINFOA* addrInfo = NULL;
+        int err = resolveAddr(toAddr, toPort, AI_NUMERICHOST, m_family,
+            &addrInfo);
+        if (err != CL_ERR_OK)
+        {
+            return err;
+        }
+
+        memcpy(&m_lastTo, addrInfo->ai_addr, addrInfo->ai_addrlen);
+        m_lastToLen = static_cast<int>(addrInfo->ai_addrlen);
+        m_lastToAddr = toAddr;
+        m_lastToPort = toPort;
+
+        freeaddrinfo(addrInfo);
+    }
+
+    int err = CL_ERR_OK;
+    if (sendto(m_socket, buf, len, 0, reinterpret_cast<SOCKADDR*>(&m_lastTo),
+        m_lastToLen) == SOCKET_ERROR)
+    {
+        err = WSAGetLastError();
+    }
+    return err;
+}
+
+int UdpSocketObj::sendDatagrams(const CLDatagram* datagrams, int count,
+                                int* pSentCount)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    // Windows has no equivalent of sendmmsg(), so the batch is sent one
+    // datagram at a time under a single lock
+    int err = CL_ERR_OK;
+    int sentCount = 0;
+    while (sentCount < count && err == CL_ERR_OK)
+    {
+        if (send(m_socket, datagrams[sentCount].buf, datagrams[sentCount].len,
+            0) != SOCKET_ERROR)
+        {
+            ++sentCount;
+        }
+        else
+        {
+            err = WSAGetLastError();
+        }
+    }
+
+    if (pSentCount != 0)
+    {
+        *pSentCount = sentCount;
+    }
+    return err;
+}
+
+void UdpSocketObj::close()
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if (m_socket != INVALID_SOCKET)
+    {
+        closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+    }
+}
+
+int UdpSocketObj::resolveAddr(const char* addr, unsigned short port,
+                              int flags, int family, ADDRINFOA** pAddrInfo)
+{
+    assert(pAddrInfo != 0);
+
+    int err = CL_ERR_OK;
+
+    char portStr[NI_MAXSERV];
+    _ultoa_s(port, portStr, 10);
+
+    ADDRINFOA hints = {};
+    hints.ai_flags = flags;
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    ADDRINFOA* addrInfo = NULL;
+    int getAddrInfoErr = getaddrinfo(addr, portStr, &hints, &addrInfo);
+    if (getAddrInfoErr == 0)
+    {
+        *pAddrInfo = addrInfo;
+    }
+    else
+    {
+        err = getAddrInfoErr;
+    }
+
+    return err;
+}
+
+UdpSocketObj::UdpSocketObj(CLPDatagramRecvFn datagramRecvFn, void* arg) :
+m_datagramRecvFn(datagramRecvFn), m_arg(arg), m_netEvent(WSA_INVALID_EVENT),
+m_socket(INVALID_SOCKET), m_family(AF_UNSPEC), m_bytesRecv(0),
+m_prevFromAddrLen(0), m_prevFromPort(0), m_lastToPort(0), m_lastToLen(0)
+{
+    m_prevFromIpAddr[0] = '\0';
+}
+
+int UdpSocketObj::construct(const char* localAddr, unsigned short localPort,
+                            const char* remoteAddr, unsigned short remotePort)
+{
+    int err = CL_ERR_OK;
+    m_netEvent = WSACreateEvent();
+    if (m_netEvent == WSA_INVALID_EVENT)
+    {
+        err = WSAGetLastError();
+    }
+
+    ADDRINFOA* localAddrInfo = NULL;
+    if (err == CL_ERR_OK)
+    {
+        err = resolveAddr(localAddr, localPort, AI_NUMERICHOST | AI_PASSIVE,
+            AF_UNSPEC, &localAddrInfo);
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        // Create the socket
+        assert(localAddrInfo != NULL);
+        m_family = localAddrInfo->ai_family;
+        m_socket = socket(localAddrInfo->ai_family, localAddrInfo->ai_socktype,
+            localAddrInfo->ai_protocol);
+        if (m_socket == INVALID_SOCKET)
+        {
+            err = WSAGetLastError();
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        // Stop ICMP port unreachable messages for earlier datagrams showing up
+        // as WSAECONNRESET errors when receiving. This is best effort only
+        BOOL connReset = FALSE;
+        DWORD bytesReturned = 0;
+        WSAIoctl(m_socket, SIO_UDP_CONNRESET, &connReset, sizeof(connReset),
+            NULL, 0, &bytesReturned, NULL, NULL);
+
+        // Bind the socket to the local IP address and port
+        if (bind(m_socket, localAddrInfo->ai_addr,
+            static_cast<int>(localAddrInfo->ai_addrlen)) == SOCKET_ERROR)
+        {
+            err = WSAGetLastError();
+        }
+    }
+
+    if (err == CL_ERR_OK && remoteAddr != 0)
+    {
+        // Connect the socket to the remote host. For UDP this just sets the
+        // default destination and filters out datagrams from anywhere else
+        ADDRINFOA* remoteAddrInfo = NULL;
+        err = resolveAddr(remoteAddr, remotePort, 0, m_family,
+            &remoteAddrInfo);
+        if (err == CL_ERR_OK)
+        {
+            if (connect(m_socket, remoteAddrInfo->ai_addr,
+                static_cast<int>(remoteAddrInfo->ai_addrlen)) == SOCKET_ERROR)
+            {
+                err = WSAGetLastError();
+            }
+            freeaddrinfo(remoteAddrInfo);
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        // Associate the event object with the socket and select what network
+        // events we want to be notified about. Note that this switches the
+        // socket to non-blocking mode
+        if (WSAEventSelect(m_socket, m_netEvent, FD_READ) == SOCKET_ERROR)
+        {
+            err = WSAGetLastError();
+        }
+    }
+
+    if (err == CL_ERR_OK)
+    {
+        m_recvBuf.resize(DATA_MAX_LEN);
+    }
+
+    // Free the address info now that it is no longer needed
+    if (localAddrInfo != NULL)
+    {
+        freeaddrinfo(localAddrInfo);
+        localAddrInfo = NULL;
+    }
+
+    // If construction failed, close the socket if it is open
+    if (err != CL_ERR_OK)
+    {
+        if (m_socket != INVALID_SOCKET)
+        {
+            closesocket(m_socket);
+            m_socket = INVALID_SOCKET;
+        }
+    }
+
+    return err;
+}
+
+void UdpSocketObj::onFdRead()
+{
+    // Windows has no equivalent of recvmmsg(), so drain the socket one
+    // datagram at a time. Each receive re-enables FD_READ, so any datagrams
+    // left over when the limit is reached are picked up by the next event
+    for (int datagramIdx = 0; datagramIdx < DATAGRAMS_PER_EVENT;
+        ++datagramIdx)
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        if (m_socket == INVALID_SOCKET)
+        {
+            // Socket closed
+            return;
+        }
+
+        int fromAddrLen = sizeof(m_fromAddr);
+        int recvRetVal = recvfrom(m_socket, &m_recvBuf[0],
+            static_cast<int>(m_recvBuf.size()), 0,
+            reinterpret_cast<SOCKADDR*>(&m_fromAddr), &fromAddrLen);
+        if (recvRetVal == SOCKET_ERROR)
+        {
+            int err = WSAGetLastError();
+            if (err == WSAEMSGSIZE || err == WSAECONNRESET)
+            {
+                // Skip datagrams too big for the buffer and any late port
+                // unreachable reports
+                continue;
+            }
+            if (err != WSAEWOULDBLOCK)
+            {
+                OUTPUT_FMT_DEBUG_STRING("recvfrom failed, err=" << err);
+            }
+            return;
+        }
+        m_bytesRecv += recvRetVal;
+
+        unsigned short fromPort = 0;
+        const char* fromIpAddr = fromAddrStr(fromAddrLen, &fromPort);
+
+        // Unlock the mutex because we do not want this object to be locked
+        // when we call the callback function. The receive buffer and address
+        // strings are only touched by the network thread, which is this one
+        lock.unlock();
+
+        Trace::record(TRACE_CALLBACK_BEGIN, UdpSocketRegistry::toHandle(this),
+            TRACE_CALLBACK_DATAGRAM_RECV);
+        m_datagramRecvFn(UdpSocketRegistry::toHandle(this), &m_recvBuf[0],
+            recvRetVal, fromIpAddr, fromPort, m_arg);
+        Trace::record(TRACE_CALLBACK_END, UdpSocketRegistry::toHandle(this),
+            TRACE_CALLBACK_DATAGRAM_RECV);
+    }
+}
+
+const char* UdpSocketObj::fromAddrStr(int fromAddrLen,
+                                      unsigned short* pFromPort)
+{
+    if (fromAddrLen != m_prevFromAddrLen ||
+        memcmp(&m_fromAddr, &m_prevFromAddr, fromAddrLen) != 0)
+    {
+        char fromPortStr[NI_MAXSERV];
+        if (getnameinfo(reinterpret_cast<SOCKADDR*>(&m_fromAddr), fromAddrLen,
+            m_prevFromIpAddr, sizeof(m_prevFromIpAddr), fromPortStr,
+            sizeof(fromPortStr), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        {
+            memcpy(&m_prevFromAddr, &m_fromAddr, fromAddrLen);
+            m_prevFromAddrLen = fromAddrLen;
+            m_prevFromPort = static_cast<unsigned short>(
+                strtoul(fromPortStr, NULL, 10));
+        }
+        else
+        {
+            m_prevFromIpAddr[0] = '\0';
+            m_prevFromAddrLen = 0;
+            m_prevFromPort = 0;
+        }
+    }
+
+    *pFromPort = m_prevFromPort;
+    return m_prevFromIpAddr;
+}
@@ -0,0 +1,225 @@
+/**
+ * @file
+ * Declares the UdpSocketObj class.
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <vector>
+#include "inc/comlib/comlib.h"
+#include "netobj.h"
+
+/**
+ * Represents a UDP socket bound to a local IP address and port, optionally
+ * connected to a remote host address and port, that sends and receives
+ * datagrams.
+ */
+class UdpSocketObj : public NetObj
+{
+public:
+    // Inherited from NetObj
+    virtual WSAEVENT netEvent() const;
+    virtual void onNetEvent();
+    virtual ULONGLONG bytesRecv() const;
+
+    /**
+     * The maximum length of a datagram that can be sent and received, which
+     * is the largest payload of a UDP datagram over IPv4.
+     */
+    static const int DATA_MAX_LEN = 65507;
+
+    /**
+     * Creates a UDP socket object that is bound to the given local IP address
+     * and port.
+     *
+     * @param localAddr the IP address to bind to.
+     * @param localPort the port to bind to, or 0 for any free port.
+     * @param remoteAddr the host address to connect to, or NULL if the socket
+     * object should not be connected.
+     * @param remotePort the host port to connect to. Ignored if remoteAddr is
+     * NULL.
+     * @param datagramRecvFn this will be called when the UDP socket object has
+     * received a datagram.
+     * @param arg this will be passed back as is in the UDP socket object's
+     * callback function.
+     * @param pUdpSktObj if the method was successful this will be set to point
+     * to the UDP socket object that was created.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int create(const char* localAddr, unsigned short localPort,
+        const char* remoteAddr, unsigned short remotePort,
+        CLPDatagramRecvFn datagramRecvFn, void* arg,
+        UdpSocketObj** pUdpSktObj);
+
+    virtual ~UdpSocketObj();
+
+    /**
+     * Sends a datagram to the connected remote host.
+     *
+     * @param buf the datagram to send.
+     * @param len the length of the datagram.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int sendDatagram(const char* buf, int len);
+
+    /**
+     * Sends a datagram to the given IP address and port.
+     *
+     * @param toAddr the IP address to send to.
+     * @param toPort the port to send to.
+     * @param buf the datagram to send.
+     * @param len the length of the datagram.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int sendDatagramTo(const char* toAddr, unsigned short toPort,
+        const char* buf, int len);
+
+    /**
+     * Sends a batch of datagrams to the connected remote host, stopping at the
+     * first datagram that cannot be sent.
+     *
+     * @param datagrams the datagrams to send.
+     * @param count the number of datagrams to send.
+     * @param pSentCount this will be set to the number of datagrams sent.
+     * @return CL_ERR_OK if all of the datagrams were sent, any other value
+     * otherwise.
+     */
+    int sendDatagrams(const CLDatagram* datagrams, int count,
+        int* pSentCount);
+
+    /**
+     * Closes this UDP socket object, so afterwards datagrams can no longer be
+     * sent and received.
+     */
+    void close();
+
+private:
+    /**
+     * Resolves the given address and port into a sockaddr structure suitable
+     * for passing to the winsock functions bind(), connect() and sendto().
+     *
+     * @param addr the address to resolve.
+     * @param port the port to resolve.
+     * @param flags the getaddrinfo() flags to resolve with.
+     * @param family the address family to resolve to, or AF_UNSPEC for any.
+     * @param pAddrInfo if the method was successful this will be set to point
+     * to an address information structure containing the needed information.
+     * The caller will need to use the winsock function freeaddrinfo() to
+     * delete the address information once finished with it.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    static int resolveAddr(const char* addr, unsigned short port, int flags,
+        int family, ADDRINFOA** pAddrInfo);
+
+    /**
+     * The first stage of construction.
+     *
+     * @param datagramRecvFn this will be called when the UDP socket object has
+     * received a datagram.
+     * @param arg this will be passed back as is in the UDP socket object's
+     * callback function.
+     */
+    UdpSocketObj(CLPDatagramRecvFn datagramRecvFn, void* arg);
+
+    /**
+     * The second stage of construction.
+     *
+     * @param localAddr the IP address to bind to.
+     * @param localPort the port to bind to.
+     * @param remoteAddr the host address to connect to, or NULL.
+     * @param remotePort the host port to connect to.
+     * @return CL_ERR_OK if the method was successful, any other value
+     * otherwise.
+     */
+    int construct(const char* localAddr, unsigned short localPort,
+        const char* remoteAddr, unsigned short remotePort);
+
+    /**
+     * Handles the FD_READ network event by receiving datagrams until there are
+     * none left or DATAGRAMS_PER_EVENT have been received.
+     */
+    void onFdRead();
+
+    /**
+     * Converts the address the last datagram was received from into an IP
+     * address string and port, reusing the previous conversion if the address
+     * has not changed.
+     *
+     * @param fromAddrLen the length of the address in m_fromAddr.
+     * @param pFromPort this will be set to the port the datagram came from.
+     * @return The IP address the datagram came from.
+     */
+    const char* fromAddrStr(int fromAddrLen, unsigned short* pFromPort);
+
+    /** The maximum number of datagrams received for each network event. */
+    static const int DATAGRAMS_PER_EVENT = 64;
+
+    /** Synchronizes access to this object. */
+    boost::mutex m_mutex;
+
+    /** This will be called when the UDP socket object received a datagram. */
+    CLPDatagramRecvFn m_datagramRecvFn;
+
+    /**
+     * This will be passed back as is in the UDP socket object's callback
+     * function.
+     */
+    void* m_arg;
+
+    /** The network event for this object. */
+    WSAEVENT m_netEvent;
+
+    /** The socket for this object. */
+    SOCKET m_socket;
+
+    /** The address family of the socket. */
+    int m_family;
+
+    /** A buffer for datagrams received. */
+    std::vector<char> m_recvBuf;
+
+    /**
+     * The number of bytes received so far. Only the network thread receives,
+     * so this needs no lock.
+     */
+    ULONGLONG m_bytesRecv;
+
+    /** The address the last datagram was received from. */
+    SOCKADDR_STORAGE m_fromAddr;
+
+    /** The address the datagram before the last one was received from. */
+    SOCKADDR_STORAGE m_prevFromAddr;
+
+    /** The length of the address in m_prevFromAddr, 0 if there is none. */
+    int m_prevFromAddrLen;
+
+    /** The IP address string for m_prevFromAddr. */
+    char m_prevFromIpAddr[NI_MAXHOST];
+
+    /** The port for m_prevFromAddr. */
+    unsigned short m_prevFromPort;
+
+    /** The IP address last sent to by sendDatagramTo(). */
+    std::string m_lastToAddr;
+
+    /** The port last sent to by sendDatagramTo(). */
+    unsigned short m_lastToPort;
+
+    /** The resolved address for m_lastToAddr and m_lastToPort. */
+    SOCKADDR_STORAGE m_lastTo;
+
+    /** The length of the address in m_lastTo. */
+    int m_lastToLen;
+};
+
+/** A shared pointer to a UDP socket object. */
+typedef boost::intrusive_ptr<UdpSocketObj> UdpSocketObjSPtr;
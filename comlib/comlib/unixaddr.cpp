@@ -0,0 +1,138 @@
+/**
+ * @file
+ * Defines functions for working with Unix domain socket addresses.
+ */
+
+#include "unixaddr.h"
+#include <cassert>
+#include <cstring>
+#include "inc/comlib/comlib.h"
+
+// The prefix that identifies a Unix domain socket address
+static const char UNIX_ADDR_PREFIX[] = "unix:";
+// The length of the prefix, not including the null
+static const size_t UNIX_ADDR_PREFIX_LEN = sizeof(UNIX_ADDR_PREFIX) - 1;
+
+// The address information and socket address for a Unix domain socket
+// allocated as one block. The address information must be the first member so
+// that freeAddrInfo() can delete the block given a pointer to it
+struct UnixAddrInfo
+{
+    ADDRINFOA addrInfo;
+    SOCKADDR_UN addr;
+};
+
+bool isUnixAddr(const char* addr)
+{
+    return (addr != 0 &&
+        _strnicmp(addr, UNIX_ADDR_PREFIX, UNIX_ADDR_PREFIX_LEN) == 0);
+}
+
+const char* unixAddrPath(const char* addr)
+{
+    assert(isUnixAddr(addr));
+    return addr + UNIX_ADDR_PREFIX_LEN;
+}
+
+int resolveUnixAddr(const char* addr, ADDRINFOA** pAddrInfo)
+{
+    assert(pAddrInfo != 0);
+
+    const char* path = unixAddrPath(addr);
+    size_t pathLen = strlen(path);
+    if (pathLen == 0 || pathLen >= UNIX_PATH_MAX)
+    {
+        return CL_ERR_ILLEGAL_ARG;
+    }
+
+    UnixAddrInfo* unixAddrInfo = new UnixAddrInfo;
+    memset(unixAddrInfo, 0, sizeof(*unixAddrInfo));
+
+    unixAddrInfo->addr.sun_family = AF_UNIX;
+    memcpy(unixAddrInfo->addr.sun_path, path, pathLen + 1);
+
+    unixAddrInfo->addrInfo.ai_family = AF_UNIX;
+    unixAddrInfo->addrInfo.ai_socktype = SOCK_STREAM;
+    unixAddrInfo->addrInfo.ai_protocol = 0;
+    unixAddrInfo->addrInfo.ai_addrlen = sizeof(unixAddrInfo->addr);
+    unixAddrInfo->addrInfo.ai_addr =
+        reinterpret_cast<SOCKADDR*>(&unixAddrInfo->addr);
+    unixAddrInfo->addrInfo.ai_next = NULL;
+
+    *pAddrInfo = &unixAddrInfo->addrInfo;
+    return CL_ERR_OK;
+}
+
+int removeStaleUnixSocket(const SOCKADDR_UN& addr)
+{
+    // Open the file itself rather than anything it points to
+    HANDLE file = CreateFileA(addr.sun_path, FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        DWORD lastErr = GetLastError();
+        if (lastErr == ERROR_FILE_NOT_FOUND || lastErr == ERROR_PATH_NOT_FOUND)
+        {
+            // Nothing is in the way, binding reports any problem with the
+            // path itself
+            return CL_ERR_OK;
+        }
+        return WSAEADDRINUSE;
+    }
+
+    FILE_ATTRIBUTE_TAG_INFO tagInfo;
+    BOOL gotTagInfo = GetFileInformationByHandleEx(file, FileAttributeTagInfo,
+        &tagInfo, sizeof(tagInfo));
+    CloseHandle(file);
+    if (!gotTagInfo ||
+        (tagInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0 ||
+        tagInfo.ReparseTag != IO_REPARSE_TAG_AF_UNIX)
+    {
+        // Not a socket file, so it is not ours to delete
+        return WSAEADDRINUSE;
+    }
+
+    // A server still listening on the file accepts the connection. Only a
+    // refusal shows the file was left behind
+    SOCKET probeSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probeSocket == INVALID_SOCKET)
+    {
+        return WSAGetLastError();
+    }
+
+    int err = WSAEADDRINUSE;
+    if (connect(probeSocket, reinterpret_cast<const SOCKADDR*>(&addr),
+        sizeof(addr)) == SOCKET_ERROR && WSAGetLastError() == WSAECONNREFUSED)
+    {
+        err = CL_ERR_OK;
+    }
+    closesocket(probeSocket);
+
+    if (err == CL_ERR_OK && !DeleteFileA(addr.sun_path))
+    {
+        err = WSAEADDRINUSE;
+    }
+
+    return err;
+}
+
+void freeAddrInfo(ADDRINFOA* addrInfo)
+{
+    if (addrInfo == NULL)
+    {
+        return;
+    }
+
+    if (addrInfo->ai_family == AF_UNIX)
+    {
+        // Allocated by resolveUnixAddr(), getaddrinfo() never returns AF_UNIX
+        // addresses
+        delete reinterpret_cast<UnixAddrInfo*>(addrInfo);
+    }
+    else
+    {
+        freeaddrinfo(addrInfo);
+    }
+}
@@ -0,0 +1,89 @@
+/**
+ * @file
+ * Declares functions for working with Unix domain socket addresses.
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#ifndef UNIX_PATH_MAX
+
+/** The maximum length of a Unix domain socket path, including the null. */
+#define UNIX_PATH_MAX 108
+
+/**
+ * A Unix domain socket address. Newer Windows SDKs declare this in afunix.h,
+ * it is declared here so that the library can still be built with older SDKs.
+ */
+typedef struct sockaddr_un
+{
+    /** The address family, always AF_UNIX. */
+    ADDRESS_FAMILY sun_family;
+
+    /** The null terminated path of the socket file. */
+    char sun_path[UNIX_PATH_MAX];
+} SOCKADDR_UN, *PSOCKADDR_UN;
+
+#endif
+
+#ifndef IO_REPARSE_TAG_AF_UNIX
+/**
+ * The reparse tag of a Unix domain socket file. Newer Windows SDKs declare
+ * this in winnt.h.
+ */
+#define IO_REPARSE_TAG_AF_UNIX 0x80000023L
+#endif
+
+/**
+ * Does the given address specify a Unix domain socket, i.e. does it have the
+ * form "unix:path"?
+ *
+ * @param addr the address to check.
+ * @return Whether or not the given address specifies a Unix domain socket.
+ */
+bool isUnixAddr(const char* addr);
+
+/**
+ * Returns the path of the socket file in the given Unix domain socket address.
+ *
+ * @param addr a Unix domain socket address, see isUnixAddr().
+ * @return The path following the "unix:" prefix.
+ */
+const char* unixAddrPath(const char* addr);
+
+/**
+ * Resolves the given Unix domain socket address into an address information
+ * structure that can be used in exactly the same way as one returned by the
+ * winsock function getaddrinfo().
+ *
+ * @param addr the Unix domain socket address to resolve.
+ * @param pAddrInfo if the function was successful this will be set to point to
+ * an address information structure containing the needed information. The
+ * caller will need to use freeAddrInfo() to delete the address information
+ * once finished with it.
+ * @return CL_ERR_OK if the function was successful, any other value otherwise.
+ */
+int resolveUnixAddr(const char* addr, ADDRINFOA** pAddrInfo);
+
+/**
+ * Deletes the socket file at the given address if it was left behind by a
+ * server that is no longer listening, so that the address can be bound to
+ * again. Nothing is deleted unless the file is a Unix domain socket file and
+ * connecting to it is refused, so a live server keeps its address and any
+ * other kind of file at the path is left alone.
+ *
+ * @param addr the Unix domain socket address about to be bound to.
+ * @return CL_ERR_OK if nothing is left at the path, WSAEADDRINUSE if the
+ * path is taken, any other value if the function failed.
+ */
+int removeStaleUnixSocket(const SOCKADDR_UN& addr);
+
+/**
+ * Deletes address information returned by either the winsock function
+ * getaddrinfo() or resolveUnixAddr(). It is okay to pass NULL.
+ *
+ * @param addrInfo the address information to delete.
+ */
+void freeAddrInfo(ADDRINFOA* addrInfo);
@@ -38,6 +38,23 @@ void dataRecv(CLSocket skt, const char* buf, int len, void* arg)
     }
 }
 
+void requestRecv(CLSocket skt, CLRequestId reqId, const char* buf, int len,
+                 void* arg)
+{
+    s_metrics.updateRecvThroughput(len);
+
+    // Respond with the request data
+    int err = CLRespond(skt, reqId, buf, len);
+    if (err == CL_ERR_OK)
+    {
+        s_metrics.updateSendThroughput(len);
+    }
+    else
+    {
+        s_metrics.incErrorCount(Metrics::RESPOND, err);
+    }
+}
+
 void socketClosed(CLSocket skt, int err, void* arg)
 {
     // This tells us that the socket was closed on the client side. Since there
@@ -77,21 +94,65 @@ void displayUsage()
 {
     std::cout << "Sends data received from a client back to the client.\r\n\r\n";
 
-    std::cout << "ECHOSERVER addr port\r\n\r\n";
+    std::cout << "ECHOSERVER addr port [/Z[:min]] [/L:bytes[:frames]] [/M:max] [/CAP:prefix]\r\n\r\n";
 
     std::cout << "addr  The IP address the server should listen on.\r\n";
     std::cout << "port  The port the server should listen on.\r\n";
+    std::cout << "/Z    Compress data of min bytes or more, 128 if not given, sent\r\n";
+    std::cout << "      to clients that compress too.\r\n";
+    std::cout << "/L    Limit each client to sending bytes, and optionally frames, per\r\n";
+    std::cout << "      second on average.\r\n";
+    std::cout << "/M    Accept at most max clients at once, leaving any more waiting\r\n";
+    std::cout << "      until others disconnect.\r\n";
+    std::cout << "/CAP  Capture the data clients send to files whose names start with\r\n";
+    std::cout << "      prefix, for replaying with capreplay.exe.\r\n";
     std::cout << "\r\n";
 }
 
 int main(int argc, char* argv[])
 {
-    if (argc != 3)
+    if (argc < 3 || argc > 7)
     {
         displayUsage();
         return 1;
     }
 
+    int compressMinLen = 0;
+    CLRateLimit rateLimit = {};
+    int maxCons = 0;
+    const char* capturePrefix = NULL;
+    for (int argIdx = 3; argIdx < argc; ++argIdx)
+    {
+        const char* arg = argv[argIdx];
+        if (_strnicmp(arg, "/Z", 2) == 0)
+        {
+            compressMinLen = (arg[2] == ':') ?
+                static_cast<int>(strtoul(&arg[3], NULL, 10)) : 128;
+        }
+        else if (_strnicmp(arg, "/L:", 3) == 0)
+        {
+            char* end = NULL;
+            rateLimit.recvBytesPerSec = strtoul(&arg[3], &end, 10);
+            if (*end == ':')
+            {
+                rateLimit.recvFramesPerSec = strtoul(end + 1, NULL, 10);
+            }
+        }
+        else if (_strnicmp(arg, "/M:", 3) == 0)
+        {
+            maxCons = static_cast<int>(strtoul(&arg[3], NULL, 10));
+        }
+        else if (_strnicmp(arg, "/CAP:", 5) == 0)
+        {
+            capturePrefix = &arg[5];
+        }
+        else
+        {
+            displayUsage();
+            return 1;
+        }
+    }
+
     unsigned short port =
         static_cast<unsigned short>(strtoul(argv[2], NULL, 10));
 
@@ -115,12 +176,37 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if (capturePrefix != NULL)
+    {
+        // Capture in segments of 64 MB
+        err = CLStartCapture(capturePrefix, 64 * 1024 * 1024);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLStartCapture() failed, err=" << err <<
+                "\r\n" << std::flush;
+        }
+    }
+
     // Create the listening socket
     CLSrvSocket srvSkt = 0;
     err = CLCreateSrvSocket(argv[1], port, conPending, srvSocketClosed, 200,
         NULL, &srvSkt);
     if (err == CL_ERR_OK)
     {
+        // Respond to requests from clients as well as echoing data
+        CLSetSrvRequestRecvFn(srvSkt, requestRecv);
+
+        if (compressMinLen > 0)
+        {
+            CLSetSrvCompression(srvSkt, compressMinLen);
+        }
+
+        // Stop any one client taking over a network thread
+        CLSetSrvRateLimit(srvSkt, &rateLimit);
+
+        // Leave clients beyond the cap queued in the backlog
+        CLSetSrvMaxCons(srvSkt, maxCons);
+
         static const DWORD DISPLAY_INTERVAL = 5 * 60 * 1000; // 5 mins
         while (WaitForSingleObject(s_shutdownEvent, DISPLAY_INTERVAL) !=
             WAIT_OBJECT_0)
@@ -136,6 +222,7 @@ int main(int argc, char* argv[])
 
     // Cleanup the communication library
     CLCleanup();
+    CLStopCapture();
 
     s_metrics.displayMetrics();
     return 0;
@@ -5,7 +5,8 @@
 const char* const Metrics::FUNC_STRINGS[] =
 {
     "CLAcceptCon",
-    "CLSendData"
+    "CLSendData",
+    "CLRespond"
 };
 
 Metrics::Metrics() : m_acceptedCons(0), m_totalBytesSent(0),
@@ -10,6 +10,7 @@ public:
     {
         ACCEPT_CON,
         SEND_DATA,
+        RESPOND,
         LAST_FUNC
     };
 
@@ -0,0 +1,127 @@
+// Echo server written with the coroutine front-end
+
+#include <windows.h>
+#include <iostream>
+#include <utility>
+#include <comlib/comlib.h>
+#include <comlib/comlibcoro.h>
+
+static HANDLE s_shutdownEvent = NULL;
+
+BOOL WINAPI consoleCtrlHandler(DWORD ctrlType)
+{
+    switch (ctrlType)
+    {
+    case CTRL_C_EVENT:
+    case CTRL_CLOSE_EVENT:
+        SetEvent(s_shutdownEvent);
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+comlib::Task serveClient(comlib::Socket skt)
+{
+    // Echo each frame back to the client until it closes the connection. The
+    // socket is deleted when this coroutine finishes
+    for (;;)
+    {
+        comlib::Frame frame = co_await skt.recv();
+        if (frame.err != CL_ERR_OK)
+        {
+            break;
+        }
+
+        int err = co_await skt.send(frame.buf, frame.len);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLSendData() failed, err=" << err << "\r\n" <<
+                std::flush;
+            break;
+        }
+    }
+}
+
+comlib::Task acceptClients(comlib::Listener& listener)
+{
+    for (;;)
+    {
+        comlib::Socket skt;
+        int err = co_await listener.accept(skt);
+        if (err != CL_ERR_OK)
+        {
+            // Shutdown since listening socket closed
+            std::cout << "\r\nServer socket closed, err=" << err << "\r\n" <<
+                std::flush;
+            SetEvent(s_shutdownEvent);
+            break;
+        }
+
+        serveClient(std::move(skt));
+    }
+}
+
+void displayUsage()
+{
+    std::cout << "Sends data received from a client back to the client, using coroutines.\r\n\r\n";
+
+    std::cout << "ECHOSERVERCORO addr port\r\n\r\n";
+
+    std::cout << "addr  The IP address the server should listen on.\r\n";
+    std::cout << "port  The port the server should listen on.\r\n";
+    std::cout << "\r\n";
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        displayUsage();
+        return 1;
+    }
+
+    unsigned short port =
+        static_cast<unsigned short>(strtoul(argv[2], NULL, 10));
+
+    s_shutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (s_shutdownEvent == NULL)
+    {
+        return 1;
+    }
+
+    if (!SetConsoleCtrlHandler(&consoleCtrlHandler, TRUE))
+    {
+        return 1;
+    }
+
+    // Startup the communication library
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return 1;
+    }
+
+    {
+        // Create the listening socket then accept clients until shutdown
+        comlib::Listener listener;
+        err = listener.listen(argv[1], port, 200);
+        if (err == CL_ERR_OK)
+        {
+            acceptClients(listener);
+            WaitForSingleObject(s_shutdownEvent, INFINITE);
+        }
+        else
+        {
+            std::cout << "\r\nCLCreateSrvSocket() failed, err=" << err <<
+                "\r\n" << std::flush;
+        }
+    }
+
+    // Cleanup the communication library
+    CLCleanup();
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include "link.h"
+#include <algorithm>
+
+Link::Link(const LinkConfig& config, unsigned int seed) : m_config(config),
+m_randomState(seed != 0 ? seed : 1), m_linkFreeMicros(0), m_lastDueMicros(0)
+{
+}
+
+double Link::schedule(double nowMicros, int len)
+{
+    if (m_config.resetFrames > 0 && random() * m_config.resetFrames < 1)
+    {
+        return -1;
+    }
+
+    // The frame goes onto the link once the frames before it are through
+    double startMicros = (std::max)(nowMicros, m_linkFreeMicros);
+    if (m_config.bytesPerSec > 0)
+    {
+        m_linkFreeMicros = startMicros + len * 1e6 / m_config.bytesPerSec;
+    }
+    else
+    {
+        m_linkFreeMicros = startMicros;
+    }
+
+    double dueMicros = m_linkFreeMicros +
+        (m_config.latency + random() * m_config.jitter) * 1000;
+    if (random() * 100 < m_config.lossPercent)
+    {
+        dueMicros += m_config.rto * 1000;
+    }
+
+    // Never overtake the frame before
+    dueMicros = (std::max)(dueMicros, m_lastDueMicros);
+    m_lastDueMicros = dueMicros;
+    return dueMicros;
+}
+
+double Link::random()
+{
+    // xorshift32, so a run can be repeated by giving the same seed
+    m_randomState ^= m_randomState << 13;
+    m_randomState ^= m_randomState >> 17;
+    m_randomState ^= m_randomState << 5;
+    return m_randomState / 4294967296.0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <windows.h>
+
+// How one direction of a proxied connection is impaired. Times are in ms
+struct LinkConfig
+{
+    double latency;      // Added to every frame
+    double jitter;       // Up to this much more is added at random
+    double bytesPerSec;  // Bandwidth cap, 0 for none
+    double lossPercent;  // Chance of a frame having to be retransmitted
+    double rto;          // How much later a retransmitted frame arrives
+    double resetFrames;  // Reset after this many frames on average, 0 never
+};
+
+// Works out when each frame sent one way over a connection arrives at the
+// other end. Frames arrive in the order they were sent, as over TCP, so a
+// frame held up by latency or loss holds up those behind it too
+class Link
+{
+public:
+    Link(const LinkConfig& config, unsigned int seed);
+
+    // Returns the time in microseconds the frame should be delivered, given
+    // the time it was received, or a negative value if the connection should
+    // be reset instead
+    double schedule(double nowMicros, int len);
+
+private:
+    // Returns a random number from 0 up to but not including 1
+    double random();
+
+    LinkConfig m_config;
+    unsigned int m_randomState;
+    double m_linkFreeMicros;
+    double m_lastDueMicros;
+};
@@ -0,0 +1,593 @@
+// Network impairment proxy
+
+#include <process.h>
+#include <windows.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <list>
+#include <map>
+#include <vector>
+#include <comlib/comlib.h>
+#include "link.h"
+
+// How long in ms a closed connection is kept before it is freed, so that any
+// callbacks still running for its sockets have finished with it
+static const DWORD CLOSED_PAIR_LINGER = 10000;
+
+// How long in microseconds a frame waits when the socket it is going to is not
+// there yet
+static const double SOCKET_WAIT_MICROS = 1000;
+
+// The most bytes queued to send on a socket whose other end is not reading
+// before the connection is reset. Frames are delivered by one thread, so it
+// must never block on one connection and hold up the others
+static const unsigned long MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+
+struct Pair;
+
+// One end of a connection through the proxy, passed to the socket callbacks
+struct Side
+{
+    Pair* pair;
+    bool up;  // Is data received at this end sent on to the server?
+};
+
+// A client connection and the connection made to the server for it
+struct Pair
+{
+    Pair(const LinkConfig& upConfig, const LinkConfig& downConfig,
+        unsigned int seed) : clientSkt(0), serverSkt(0), up(upConfig, seed),
+        down(downConfig, seed + 1), framesQueued(0), closed(false),
+        closeTime(0)
+    {
+        clientSide.pair = this;
+        clientSide.up = true;
+        serverSide.pair = this;
+        serverSide.up = false;
+    }
+
+    Side clientSide;
+    Side serverSide;
+    CLSocket clientSkt;
+    CLSocket serverSkt;
+    Link up;    // Client to server
+    Link down;  // Server to client
+    int framesQueued;
+    bool closed;
+    ULONGLONG closeTime;
+};
+
+// A frame waiting to be delivered
+struct Frame
+{
+    Pair* pair;
+    bool up;
+    std::vector<char> data;
+};
+
+static HANDLE s_shutdownEvent = NULL;
+static const char* s_hostAddr = NULL;
+static unsigned short s_hostPort = 0;
+static LinkConfig s_upConfig = {};
+static LinkConfig s_downConfig = {};
+static LARGE_INTEGER s_freq;
+static LARGE_INTEGER s_start;
+
+// Guards everything below
+static CRITICAL_SECTION s_critSect;
+
+// Frames waiting to be delivered by when they are due, and an event set when
+// a frame is added at the front
+static std::multimap<double, Frame> s_frames;
+static HANDLE s_framesEvent = NULL;
+
+static std::list<Pair*> s_closedPairs;
+static unsigned int s_nextSeed = 1;
+static unsigned long s_cons = 0;
+static unsigned long s_resets = 0;
+static unsigned long s_slowConsumers = 0;
+static unsigned __int64 s_framesUp = 0;
+static unsigned __int64 s_bytesUp = 0;
+static unsigned __int64 s_framesDown = 0;
+static unsigned __int64 s_bytesDown = 0;
+
+BOOL WINAPI consoleCtrlHandler(DWORD ctrlType)
+{
+    switch (ctrlType)
+    {
+    case CTRL_C_EVENT:
+    case CTRL_CLOSE_EVENT:
+        SetEvent(s_shutdownEvent);
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+double nowMicros()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<double>(now.QuadPart - s_start.QuadPart) * 1e6 /
+        static_cast<double>(s_freq.QuadPart);
+}
+
+// Marks a connection closed, returning false if it already was. The critical
+// section must be held
+bool closePair(Pair* pair)
+{
+    if (pair->closed)
+    {
+        return false;
+    }
+    pair->closed = true;
+    pair->closeTime = GetTickCount64();
+    s_closedPairs.push_back(pair);
+    return true;
+}
+
+// Frees closed connections once they have lingered. The critical section
+// must be held
+void freeClosedPairs()
+{
+    ULONGLONG now = GetTickCount64();
+    std::list<Pair*>::iterator it = s_closedPairs.begin();
+    while (it != s_closedPairs.end())
+    {
+        Pair* pair = *it;
+        if (pair->framesQueued == 0 &&
+            now - pair->closeTime >= CLOSED_PAIR_LINGER)
+        {
+            delete pair;
+            it = s_closedPairs.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void deleteSockets(CLSocket clientSkt, CLSocket serverSkt)
+{
+    if (clientSkt != 0)
+    {
+        CLDeleteSocket(clientSkt);
+    }
+    if (serverSkt != 0)
+    {
+        CLDeleteSocket(serverSkt);
+    }
+}
+
+void dataRecv(CLSocket skt, const char* buf, int len, void* arg)
+{
+    Side* side = static_cast<Side*>(arg);
+    Pair* pair = side->pair;
+    double now = nowMicros();
+
+    EnterCriticalSection(&s_critSect);
+
+    if (pair->closed)
+    {
+        LeaveCriticalSection(&s_critSect);
+        return;
+    }
+
+    double due = side->up ? pair->up.schedule(now, len) :
+        pair->down.schedule(now, len);
+    if (due < 0)
+    {
+        // Reset the connection, as a broken network path would
+        ++s_resets;
+        closePair(pair);
+        CLSocket clientSkt = pair->clientSkt;
+        CLSocket serverSkt = pair->serverSkt;
+        LeaveCriticalSection(&s_critSect);
+
+        deleteSockets(clientSkt, serverSkt);
+        return;
+    }
+
+    std::multimap<double, Frame>::iterator it =
+        s_frames.insert(std::make_pair(due, Frame()));
+    it->second.pair = pair;
+    it->second.up = side->up;
+    it->second.data.assign(buf, buf + len);
+    ++pair->framesQueued;
+    if (it == s_frames.begin())
+    {
+        SetEvent(s_framesEvent);
+    }
+
+    LeaveCriticalSection(&s_critSect);
+}
+
+void socketClosed(CLSocket skt, int err, void* arg)
+{
+    // Closing either end closes the other
+    Pair* pair = static_cast<Side*>(arg)->pair;
+
+    EnterCriticalSection(&s_critSect);
+    if (err == CL_ERR_SLOW_CONSUMER)
+    {
+        ++s_slowConsumers;
+    }
+    bool closing = closePair(pair);
+    CLSocket clientSkt = pair->clientSkt;
+    CLSocket serverSkt = pair->serverSkt;
+    LeaveCriticalSection(&s_critSect);
+
+    if (closing)
+    {
+        deleteSockets(clientSkt, serverSkt);
+    }
+}
+
+// Records a socket of a connection, deleting it straight away if the
+// connection was closed before it was made. Sending to it never blocks: once
+// too much is queued for it the connection is reset
+void attachSocket(Pair* pair, bool client, CLSocket skt)
+{
+    CLSlowConsumerPolicy policy = {};
+    policy.action = CL_SLOW_CONSUMER_DISCONNECT;
+    policy.maxQueuedBytes = MAX_QUEUED_BYTES;
+    int err = CLSetSlowConsumerPolicy(skt, &policy, NULL);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLSetSlowConsumerPolicy() failed, err=" << err <<
+            "\r\n" << std::flush;
+    }
+
+    EnterCriticalSection(&s_critSect);
+    if (client)
+    {
+        pair->clientSkt = skt;
+    }
+    else
+    {
+        pair->serverSkt = skt;
+    }
+    bool closed = pair->closed;
+    LeaveCriticalSection(&s_critSect);
+
+    if (closed)
+    {
+        CLDeleteSocket(skt);
+    }
+}
+
+void conPending(CLSrvSocket srvSkt, void* srvArg)
+{
+    EnterCriticalSection(&s_critSect);
+    unsigned int seed = s_nextSeed;
+    s_nextSeed += 2;
+    LeaveCriticalSection(&s_critSect);
+
+    Pair* pair = new Pair(s_upConfig, s_downConfig, seed);
+
+    // Connect to the server first, so that there is somewhere to send what
+    // the client sends
+    CLSocket serverSkt = 0;
+    int err = CLCreateSocket(s_hostAddr, s_hostPort, dataRecv, socketClosed,
+        &pair->serverSide, &serverSkt);
+    if (err == CL_ERR_OK)
+    {
+        attachSocket(pair, false, serverSkt);
+    }
+    else
+    {
+        std::cout << "\r\nCLCreateSocket() failed, err=" << err << "\r\n" <<
+            std::flush;
+    }
+
+    // Accept the client even if the server could not be reached, then close
+    // it straight away so that it does not wait
+    char clientIpAddr[80];
+    int clientIpAddrLen = sizeof(clientIpAddr);
+    unsigned short clientPort = 0;
+    CLSocket clientSkt = 0;
+    int acceptErr = CLAcceptCon(srvSkt, dataRecv, socketClosed,
+        &pair->clientSide, &clientSkt, clientIpAddr, clientIpAddrLen,
+        &clientPort);
+    if (acceptErr == CL_ERR_OK)
+    {
+        attachSocket(pair, true, clientSkt);
+    }
+    else
+    {
+        std::cout << "\r\nCLAcceptCon() failed, err=" << acceptErr <<
+            "\r\n" << std::flush;
+    }
+
+    EnterCriticalSection(&s_critSect);
+    bool closing = false;
+    if (err == CL_ERR_OK && acceptErr == CL_ERR_OK)
+    {
+        ++s_cons;
+    }
+    else
+    {
+        closing = closePair(pair);
+    }
+    LeaveCriticalSection(&s_critSect);
+
+    if (closing)
+    {
+        deleteSockets(clientSkt, serverSkt);
+    }
+}
+
+void srvSocketClosed(CLSrvSocket srvSkt, int err, void* srvArg)
+{
+    std::cout << "\r\nServer socket closed, err=" << err << "\r\n" <<
+        std::flush;
+    SetEvent(s_shutdownEvent);
+}
+
+// Delivers each frame when it is due
+unsigned __stdcall deliverThreadProc(void* arglist)
+{
+    for (;;)
+    {
+        CLSocket skt = 0;
+        std::vector<char> data;
+        DWORD waitTime = INFINITE;
+
+        EnterCriticalSection(&s_critSect);
+
+        freeClosedPairs();
+        if (!s_closedPairs.empty())
+        {
+            waitTime = 1000;
+        }
+
+        if (!s_frames.empty())
+        {
+            double now = nowMicros();
+            std::multimap<double, Frame>::iterator it = s_frames.begin();
+            if (it->first <= now)
+            {
+                Frame& frame = it->second;
+                Pair* pair = frame.pair;
+                skt = frame.up ? pair->serverSkt : pair->clientSkt;
+                if (!pair->closed && skt == 0)
+                {
+                    // The socket is still being created, so try again shortly
+                    std::multimap<double, Frame>::iterator retryIt =
+                        s_frames.insert(std::make_pair(
+                            now + SOCKET_WAIT_MICROS, Frame()));
+                    retryIt->second.pair = pair;
+                    retryIt->second.up = frame.up;
+                    retryIt->second.data.swap(frame.data);
+                }
+                else
+                {
+                    --pair->framesQueued;
+                    if (pair->closed)
+                    {
+                        skt = 0;
+                    }
+                    else if (frame.up)
+                    {
+                        ++s_framesUp;
+                        s_bytesUp += frame.data.size();
+                    }
+                    else
+                    {
+                        ++s_framesDown;
+                        s_bytesDown += frame.data.size();
+                    }
+                    data.swap(frame.data);
+                }
+                s_frames.erase(it);
+                waitTime = 0;
+            }
+            else
+            {
+                waitTime = (std::min)(waitTime, static_cast<DWORD>(
+                    std::ceil((it->first - now) / 1000)));
+            }
+        }
+
+        LeaveCriticalSection(&s_critSect);
+
+        if (skt != 0 && !data.empty())
+        {
+            int err = CLSendData(skt, &data[0], static_cast<int>(data.size()));
+            // A socket refusing data for a slow consumer is reset, and its
+            // closed callback closes the connection
+            if (err != CL_ERR_OK && err != CL_ERR_SOCKET_NOT_FOUND &&
+                err != CL_ERR_SLOW_CONSUMER)
+            {
+                std::cout << "\r\nCLSendData() failed, err=" << err <<
+                    "\r\n" << std::flush;
+            }
+        }
+
+        HANDLE events[2];
+        events[0] = s_shutdownEvent;
+        events[1] = s_framesEvent;
+        if (WaitForMultipleObjects(2, events, FALSE, waitTime) ==
+            WAIT_OBJECT_0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Parses a value given as up[:down], where the value for both directions is
+// the same if down is not given
+void parseUpDown(const char* str, double* pUp, double* pDown)
+{
+    char* end = NULL;
+    *pUp = strtod(str, &end);
+    *pDown = (*end == ':') ? strtod(end + 1, NULL) : *pUp;
+}
+
+void displayUsage()
+{
+    std::cout << "Passes connections on to a server, adding latency, jitter, bandwidth caps,\r\n";
+    std::cout << "loss and resets, to see how clients and servers behave over a poor network.\r\n\r\n";
+
+    std::cout << "NETPROXY addr port host_addr host_port [/LAT:ms] [/JIT:ms] [/BW:bytes]\r\n";
+    std::cout << "         [/LOSS:percent] [/RTO:ms] [/RESET:frames] [/SEED:n]\r\n\r\n";
+
+    std::cout << "addr       The IP address the proxy should listen on.\r\n";
+    std::cout << "port       The port the proxy should listen on.\r\n";
+    std::cout << "host_addr  The host address of the server to pass connections on to.\r\n";
+    std::cout << "host_port  The port of the server.\r\n";
+    std::cout << "/LAT       Delay each frame by ms.\r\n";
+    std::cout << "/JIT       Delay each frame by up to ms more at random, keeping frames in\r\n";
+    std::cout << "           order.\r\n";
+    std::cout << "/BW        Cap the bandwidth at bytes per second.\r\n";
+    std::cout << "/LOSS      Lose percent of frames, each of which then arrives an RTO late\r\n";
+    std::cout << "           as it would once TCP had retransmitted it.\r\n";
+    std::cout << "/RTO       The retransmission timeout for /LOSS, 200 ms if not given.\r\n";
+    std::cout << "/RESET     Reset the connection after frames frames on average.\r\n";
+    std::cout << "/SEED      Seed the random numbers with n, so a run can be repeated.\r\n\r\n";
+
+    std::cout << "Each of /LAT, /JIT, /BW, /LOSS and /RESET takes either one value for both\r\n";
+    std::cout << "directions or up:down, where up is for data from the client to the server\r\n";
+    std::cout << "and down for data from the server to the client, for example /LAT:40:0.\r\n";
+    std::cout << "\r\n";
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 5)
+    {
+        displayUsage();
+        return 1;
+    }
+
+    s_hostAddr = argv[3];
+    s_hostPort = static_cast<unsigned short>(strtoul(argv[4], NULL, 10));
+    s_upConfig.rto = 200;
+    s_downConfig.rto = 200;
+
+    for (int argIdx = 5; argIdx < argc; ++argIdx)
+    {
+        const char* arg = argv[argIdx];
+        if (_strnicmp(arg, "/LAT:", 5) == 0)
+        {
+            parseUpDown(&arg[5], &s_upConfig.latency, &s_downConfig.latency);
+        }
+        else if (_strnicmp(arg, "/JIT:", 5) == 0)
+        {
+            parseUpDown(&arg[5], &s_upConfig.jitter, &s_downConfig.jitter);
+        }
+        else if (_strnicmp(arg, "/BW:", 4) == 0)
+        {
+            parseUpDown(&arg[4], &s_upConfig.bytesPerSec,
+                &s_downConfig.bytesPerSec);
+        }
+        else if (_strnicmp(arg, "/LOSS:", 6) == 0)
+        {
+            parseUpDown(&arg[6], &s_upConfig.lossPercent,
+                &s_downConfig.lossPercent);
+        }
+        else if (_strnicmp(arg, "/RTO:", 5) == 0)
+        {
+            s_upConfig.rto = strtod(&arg[5], NULL);
+            s_downConfig.rto = s_upConfig.rto;
+        }
+        else if (_strnicmp(arg, "/RESET:", 7) == 0)
+        {
+            parseUpDown(&arg[7], &s_upConfig.resetFrames,
+                &s_downConfig.resetFrames);
+        }
+        else if (_strnicmp(arg, "/SEED:", 6) == 0)
+        {
+            s_nextSeed = strtoul(&arg[6], NULL, 10);
+        }
+        else
+        {
+            displayUsage();
+            return 1;
+        }
+    }
+
+    unsigned short port =
+        static_cast<unsigned short>(strtoul(argv[2], NULL, 10));
+
+    QueryPerformanceFrequency(&s_freq);
+    QueryPerformanceCounter(&s_start);
+    InitializeCriticalSection(&s_critSect);
+
+    s_shutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (s_shutdownEvent == NULL)
+    {
+        return 1;
+    }
+
+    s_framesEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        // Auto-reset, unsignaled
+    if (s_framesEvent == NULL)
+    {
+        return 1;
+    }
+
+    if (!SetConsoleCtrlHandler(&consoleCtrlHandler, TRUE))
+    {
+        return 1;
+    }
+
+    // Startup the communication library
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return 1;
+    }
+
+    // Wait for as little as a ms at a time for frames to be due, rather than
+    // for the 10-16 ms of the default timer resolution
+    timeBeginPeriod(1);
+
+    HANDLE deliverThread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0,
+        deliverThreadProc, NULL, 0, NULL));
+    if (deliverThread == NULL)
+    {
+        timeEndPeriod(1);
+        CLCleanup();
+        return 1;
+    }
+
+    // Create the listening socket
+    CLSrvSocket srvSkt = 0;
+    err = CLCreateSrvSocket(argv[1], port, conPending, srvSocketClosed, 200,
+        NULL, &srvSkt);
+    if (err == CL_ERR_OK)
+    {
+        WaitForSingleObject(s_shutdownEvent, INFINITE);
+    }
+    else
+    {
+        std::cout << "\r\nCLCreateSrvSocket() failed, err=" << err << "\r\n" <<
+            std::flush;
+        SetEvent(s_shutdownEvent);
+    }
+
+    WaitForSingleObject(deliverThread, INFINITE);
+    CloseHandle(deliverThread);
+
+    // Cleanup the communication library
+    CLCleanup();
+
+    timeEndPeriod(1);
+
+    std::cout << "\r\nConnections: " << s_cons << "\r\n";
+    std::cout << "Frames client to server: " << s_framesUp << " (" <<
+        s_bytesUp << " bytes)\r\n";
+    std::cout << "Frames server to client: " << s_framesDown << " (" <<
+        s_bytesDown << " bytes)\r\n";
+    std::cout << "Resets: " << s_resets << "\r\n";
+    std::cout << "Slow consumer resets: " << s_slowConsumers << "\r\n" <<
+        std::flush;
+    return 0;
+}
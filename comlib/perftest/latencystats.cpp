@@ -0,0 +1,71 @@
+#include "latencystats.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+LONGLONG LatencyStats::now()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+LatencyStats::LatencyStats()
+{
+}
+
+void LatencyStats::addSample(LONGLONG startTicks, LONGLONG endTicks)
+{
+    m_samples.push_back(ticksToMicros(endTicks - startTicks));
+}
+
+void LatencyStats::displayStats(const char* title) const
+{
+    std::cout << "\r\n" << title << " (" << m_samples.size() <<
+        " samples, us):\r\n";
+    if (m_samples.empty())
+    {
+        std::cout << std::flush;
+        return;
+    }
+
+    std::vector<double> sorted(m_samples);
+    std::sort(sorted.begin(), sorted.end());
+
+    double total = 0.0;
+    for (size_t idx = 0; idx < sorted.size(); ++idx)
+    {
+        total += sorted[idx];
+    }
+
+    static const double PERCENTILES[] = { 50.0, 90.0, 99.0, 99.9 };
+    static const size_t PERCENTILE_COUNT =
+        sizeof(PERCENTILES) / sizeof(PERCENTILES[0]);
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "  min    : " << sorted.front() << "\r\n";
+    for (size_t idx = 0; idx < PERCENTILE_COUNT; ++idx)
+    {
+        size_t rank = static_cast<size_t>(
+            (PERCENTILES[idx] / 100.0) * (sorted.size() - 1) + 0.5);
+        std::cout << "  p" << std::setw(6) << std::left << PERCENTILES[idx] <<
+            std::right << ": " << sorted[rank] << "\r\n";
+    }
+    std::cout << "  max    : " << sorted.back() << "\r\n";
+    std::cout << "  mean   : " << total / sorted.size() << "\r\n";
+    std::cout << "  rate   : " << sorted.size() / (total / 1000000.0) <<
+        " round trips/s\r\n";
+    std::cout << std::flush;
+}
+
+double LatencyStats::ticksToMicros(LONGLONG ticks)
+{
+    static LONGLONG s_frequency = 0;
+    if (s_frequency == 0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        s_frequency = frequency.QuadPart;
+    }
+    return (ticks * 1000000.0) / s_frequency;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+class LatencyStats
+{
+public:
+    static LONGLONG now();
+    static double ticksToMicros(LONGLONG ticks);
+
+    LatencyStats();
+    void addSample(LONGLONG startTicks, LONGLONG endTicks);
+    void displayStats(const char* title) const;
+
+private:
+    std::vector<double> m_samples;
+};
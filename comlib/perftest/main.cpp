@@ -0,0 +1,1958 @@
+// Performance test client
+
+#include <winsock2.h>
+#include <windows.h>
+#include <psapi.h>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <comlib/comlib.h>
+#include "latencystats.h"
+
+// How long in ms to wait for a reply before giving up
+static const DWORD REPLY_TIMEOUT = 5000;
+
+// The maximum number of bytes that can be waiting to be echoed when measuring
+// throughput. This is kept below the socket and ring buffer sizes so that an
+// echo server in this process, which may share a network thread with the
+// client, never blocks sending
+static const LONG THROUGHPUT_WINDOW = 32 * 1024;
+
+// The number of datagrams sent together when measuring UDP packet rates
+static const int UDP_BATCH_COUNT = 32;
+
+// How long in ms to wait without any datagram being echoed before treating
+// those still outstanding as lost
+static const DWORD UDP_STALL_INTERVAL = 100;
+
+static HANDLE s_replyEvent = NULL;
+static volatile bool s_socketClosed = false;
+
+// The maximum number of requests waiting for a response when measuring the
+// request rate, which is kept below the number the library can track
+static const LONG RPC_MAX_OUTSTANDING = 1000;
+
+// The number of replies received and expected when measuring throughput
+static volatile LONG s_repliesRecv = 0;
+static LONG s_repliesExpected = 0;
+
+// The number of requests that failed when measuring the request rate
+static volatile LONG s_requestsFailed = 0;
+
+// The number of threads sending bulk data when measuring control message
+// latency under load
+static const int BULK_THREAD_COUNT = 4;
+
+// The length of the control messages timed under bulk load
+static const int CONTROL_LEN = 16;
+
+// The first byte of a control message, which bulk data never starts with, so
+// that replies to control messages can be told apart from bulk data echoed
+static const char CONTROL_MARKER = '\x01';
+
+// The number of bulk data messages sent and echoed back, and set to stop the
+// bulk data threads
+static volatile LONG s_bulkSent = 0;
+static volatile LONG s_bulkRecv = 0;
+static volatile bool s_bulkStop = false;
+
+// What each bulk data thread sends
+struct BulkLoad
+{
+    CLSocket skt;
+    const char* buf;
+    int len;
+
+    // The maximum number of messages waiting to be echoed, or 0 for no limit
+    LONG maxOutstanding;
+};
+
+// The minimum length of data compressed by both ends of the connection, or 0
+// for none
+static int s_compressMinLen = 0;
+
+// The minimum length of data compressed when /Z is given without a length
+static const int DEFAULT_COMPRESS_MIN_LEN = 128;
+
+// The longest time in ms data sent by the client is held back in cork mode,
+// or 0 for cork mode off
+static DWORD s_corkMaxDelay = 0;
+
+// The longest time in ms data is held back when /C is given without a delay
+static const DWORD DEFAULT_CORK_MAX_DELAY = 1;
+
+// The number of bytes held back in cork mode that are sent at once. This is
+// kept well below THROUGHPUT_WINDOW so that the client never waits for replies
+// to data it is still holding back
+static const int CORK_MAX_BYTES = 8 * 1024;
+
+// The maximum number of connections the echo server in this process accepts
+// at once, or 0 for no cap
+static int s_maxCons = 0;
+
+// The number of connections the echo server in this process has accepted
+static volatile LONG s_consAccepted = 0;
+
+// The number of connections the echo server in this process has seen closed
+static volatile LONG s_consClosed = 0;
+
+// Are the network threads pinned to CPUs, each to the one with the fewest?
+static bool s_pinThreads = false;
+
+// How long in microseconds the network threads poll for network events before
+// waiting, or 0 to always wait
+static DWORD s_spinMicros = 0;
+
+// How long in microseconds the network threads poll when /B is given without a
+// time
+static const DWORD DEFAULT_SPIN_MICROS = 100;
+
+// Are busy sockets moved off network threads that are saturated?
+static bool s_rebalance = false;
+
+// The file the trace of the run is written to, or NULL if it is not traced
+static const char* s_tracePath = NULL;
+
+// The number of network threads the hotspot test spreads its connections
+// over. Each connection goes to the thread serving the fewest, so connections
+// this many apart start out on the same thread
+static const int HOTSPOT_THREAD_COUNT = 4;
+
+// How long in seconds the hotspot test sends bulk data for
+static const int HOTSPOT_SECS = 10;
+
+// The library context the echo server and client are created in, the default
+// context unless network threads are pinned or spin
+static CLContext s_ctx = 0;
+
+// The most network threads whose layout is displayed
+static const int NET_THREAD_STATS_MAX_COUNT = 64;
+
+// How long in ms the number of connections accepted must stay the same for
+// the echo server to be taken to have accepted all it will
+static const DWORD ACCEPT_SETTLE_INTERVAL = 500;
+
+// How long in ms to wait for a storm of connection attempts to complete before
+// giving up
+static const DWORD CONNECT_TIMEOUT = 120000;
+
+// The number of connection attempts that have completed, and of those the
+// number that failed
+static volatile LONG s_consCompleted = 0;
+static volatile LONG s_consFailed = 0;
+
+// The limits on the data the stuck test's server queues for a client that is
+// not reading
+static const unsigned long STUCK_MAX_QUEUED_BYTES = 1024 * 1024;
+static const unsigned long STUCK_MAX_QUEUE_AGE = 2000;
+
+// The socket the stuck test's server accepted, and how it was closed
+static CLSocket volatile s_stuckSkt = 0;
+static volatile bool s_stuckClosed = false;
+static volatile int s_stuckCloseErr = CL_ERR_OK;
+
+// Words that test data is made from, so that it compresses about as well as
+// typical text messages rather than as well as a run of one character
+static const char* const PAYLOAD_WORDS[] =
+{
+    "order", "price", "quantity", "symbol", "account", "status", "filled",
+    "cancel", "limit", "market", "buy", "sell", "id", "time", "venue", "0",
+    "1", "2", "3", "4", "5", "6", "7", "8", "9", "=", ";", " "
+};
+
+void echoDataRecv(CLSocket skt, const char* buf, int len, void* arg)
+{
+    // Echo the data back to the client
+    CLSendData(skt, buf, len);
+}
+
+void echoRequestRecv(CLSocket skt, CLRequestId reqId, const char* buf,
+                     int len, void* arg)
+{
+    // Respond with the request data
+    CLRespond(skt, reqId, buf, len);
+}
+
+void echoSocketClosed(CLSocket skt, int err, void* arg)
+{
+    CLDeleteSocket(skt);
+    InterlockedIncrement(&s_consClosed);
+}
+
+void echoConPending(CLSrvSocket srvSkt, void* srvArg)
+{
+    CLSocket clientSkt = 0;
+    int err = CLAcceptCon(srvSkt, echoDataRecv, echoSocketClosed, NULL,
+        &clientSkt, NULL, 0, NULL);
+    if (err == CL_ERR_OK)
+    {
+        InterlockedIncrement(&s_consAccepted);
+    }
+    else if (err != CL_ERR_TOO_MANY_CONS)
+    {
+        std::cout << "\r\nCLAcceptCon() failed, err=" << err << "\r\n" <<
+            std::flush;
+    }
+}
+
+void echoSrvSocketClosed(CLSrvSocket srvSkt, int err, void* srvArg)
+{
+    // Do nothing
+}
+
+void stuckDataRecv(CLSocket skt, const char* buf, int len, void* arg)
+{
+    // Do nothing
+}
+
+void stuckSocketClosed(CLSocket skt, int err, void* arg)
+{
+    s_stuckCloseErr = err;
+    s_stuckClosed = true;
+}
+
+void stuckConPending(CLSrvSocket srvSkt, void* srvArg)
+{
+    CLSocket clientSkt = 0;
+    int err = CLAcceptCon(srvSkt, stuckDataRecv, stuckSocketClosed, NULL,
+        &clientSkt, NULL, 0, NULL);
+    if (err == CL_ERR_OK)
+    {
+        s_stuckSkt = clientSkt;
+    }
+    else
+    {
+        std::cout << "\r\nCLAcceptCon() failed, err=" << err << "\r\n" <<
+            std::flush;
+    }
+}
+
+void replyRecv(CLSocket skt, const char* buf, int len, void* arg)
+{
+    SetEvent(s_replyEvent);
+}
+
+void throughputReplyRecv(CLSocket skt, const char* buf, int len, void* arg)
+{
+    if (InterlockedIncrement(&s_repliesRecv) == s_repliesExpected)
+    {
+        SetEvent(s_replyEvent);
+    }
+}
+
+void priorityReplyRecv(CLSocket skt, const char* buf, int len, void* arg)
+{
+    if (buf[0] == CONTROL_MARKER)
+    {
+        SetEvent(s_replyEvent);
+    }
+    else
+    {
+        InterlockedIncrement(&s_bulkRecv);
+    }
+}
+
+void udpEchoRecv(CLUdpSocket udpSkt, const char* buf, int len,
+                 const char* fromAddr, unsigned short fromPort, void* arg)
+{
+    // Echo the datagram back to the sender. If it cannot be sent straight
+    // away it is lost, which the client allows for
+    CLSendDatagramTo(udpSkt, fromAddr, fromPort, buf, len);
+}
+
+void udpReplyRecv(CLUdpSocket udpSkt, const char* buf, int len,
+                  const char* fromAddr, unsigned short fromPort, void* arg)
+{
+    InterlockedIncrement(&s_repliesRecv);
+}
+
+void rpcResponseRecv(CLSocket skt, int err, const char* buf, int len,
+                     void* reqArg)
+{
+    if (err != CL_ERR_OK)
+    {
+        InterlockedIncrement(&s_requestsFailed);
+    }
+
+    if (InterlockedIncrement(&s_repliesRecv) == s_repliesExpected)
+    {
+        SetEvent(s_replyEvent);
+    }
+}
+
+void conCompleted(CLSocket skt, int err, void* arg)
+{
+    if (err != CL_ERR_OK)
+    {
+        InterlockedIncrement(&s_consFailed);
+    }
+    InterlockedIncrement(&s_consCompleted);
+}
+
+void socketClosed(CLSocket skt, int err, void* arg)
+{
+    s_socketClosed = true;
+    SetEvent(s_replyEvent);
+}
+
+// Creates an echo server in this process if requested, then connects to the
+// given address
+int startup(const char* addr, unsigned short port, bool echoServer,
+            CLPDataRecvFn dataRecvFn, CLSrvSocket* pSrvSkt, CLSocket* pSkt)
+{
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return err;
+    }
+
+    if (s_pinThreads || s_spinMicros > 0)
+    {
+        CLContextConfig config = {};
+        config.pinThreads = s_pinThreads ? 1 : 0;
+        config.spinMicros = s_spinMicros;
+        err = CLCreateContext(&config, &s_ctx);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLCreateContext() failed, err=" << err <<
+                "\r\n" << std::flush;
+            CLCleanup();
+            return err;
+        }
+    }
+
+    if (echoServer)
+    {
+        err = CLCreateSrvSocketCtx(s_ctx, addr, port, echoConPending,
+            echoSrvSocketClosed, 200, NULL, pSrvSkt);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLCreateSrvSocketCtx() failed, err=" << err <<
+                "\r\n" << std::flush;
+            CLCleanup();
+            return err;
+        }
+
+        // Accepted sockets respond to requests as well as echoing data
+        CLSetSrvRequestRecvFn(*pSrvSkt, echoRequestRecv);
+
+        if (s_compressMinLen > 0)
+        {
+            CLSetSrvCompression(*pSrvSkt, s_compressMinLen);
+        }
+
+        if (s_maxCons > 0)
+        {
+            CLSetSrvMaxCons(*pSrvSkt, s_maxCons);
+        }
+    }
+
+    err = CLCreateSocketCtx(s_ctx, addr, port, dataRecvFn, socketClosed, NULL,
+        pSkt);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLCreateSocketCtx() failed, err=" << err << "\r\n" <<
+            std::flush;
+        CLCleanup();
+        return err;
+    }
+
+    if (s_compressMinLen > 0)
+    {
+        err = CLSetCompression(*pSkt, s_compressMinLen);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLSetCompression() failed, err=" << err <<
+                "\r\n" << std::flush;
+            CLCleanup();
+            return err;
+        }
+    }
+
+    if (s_corkMaxDelay > 0)
+    {
+        err = CLSetCork(*pSkt, s_corkMaxDelay, CORK_MAX_BYTES);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLSetCork() failed, err=" << err << "\r\n" <<
+                std::flush;
+            CLCleanup();
+        }
+    }
+    return err;
+}
+
+// Returns test data of the given length made from PAYLOAD_WORDS
+std::vector<char> makePayload(int dataLen)
+{
+    std::vector<char> data;
+    data.reserve(dataLen);
+    const int wordCount = sizeof(PAYLOAD_WORDS) / sizeof(PAYLOAD_WORDS[0]);
+    unsigned int seed = 12345;
+    while (static_cast<int>(data.size()) < dataLen)
+    {
+        seed = seed * 1103515245 + 12345;
+        const char* word = PAYLOAD_WORDS[(seed >> 16) % wordCount];
+        for (const char* c = word; *c != '\0' &&
+            static_cast<int>(data.size()) < dataLen; ++c)
+        {
+            data.push_back(*c);
+        }
+    }
+    return data;
+}
+
+// Returns the CPU time used by this process so far in seconds, counting both
+// user and kernel time
+double processCpuSecs()
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime,
+        &kernelTime, &userTime))
+    {
+        return 0.0;
+    }
+
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = kernelTime.dwLowDateTime;
+    kernel.HighPart = kernelTime.dwHighDateTime;
+    user.LowPart = userTime.dwLowDateTime;
+    user.HighPart = userTime.dwHighDateTime;
+
+    // FILETIME counts in units of 100 ns
+    return (kernel.QuadPart + user.QuadPart) / 10000000.0;
+}
+
+// Returns the memory committed to this process alone in bytes
+SIZE_T processPrivateBytes()
+{
+    PROCESS_MEMORY_COUNTERS_EX counters = {};
+    counters.cb = sizeof(counters);
+    if (!GetProcessMemoryInfo(GetCurrentProcess(),
+        reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters),
+        sizeof(counters)))
+    {
+        return 0;
+    }
+    return counters.PrivateUsage;
+}
+
+// Waits until the echo server in this process has stopped accepting
+// connections for a while
+void waitForAcceptsToSettle()
+{
+    LONG consAccepted = s_consAccepted;
+    for (;;)
+    {
+        Sleep(ACCEPT_SETTLE_INTERVAL);
+        if (s_consAccepted == consAccepted)
+        {
+            break;
+        }
+        consAccepted = s_consAccepted;
+    }
+}
+
+// Displays the CPU and NUMA node of each network thread in the context the
+// echo server and client were created in, and the sockets each serves
+void displayNetThreads()
+{
+    CLNetThreadStats stats[NET_THREAD_STATS_MAX_COUNT];
+    int count = 0;
+    if (CLGetNetThreadStats(s_ctx, stats, NET_THREAD_STATS_MAX_COUNT,
+        &count) != CL_ERR_OK)
+    {
+        return;
+    }
+
+    std::cout << "\r\nNetwork threads (CPU / NUMA node / sockets / busy % / "
+        "events/s):\r\n";
+    for (int idx = 0; idx < min(count, NET_THREAD_STATS_MAX_COUNT); ++idx)
+    {
+        std::cout << "  ";
+        if (stats[idx].cpu >= 0)
+        {
+            std::cout << stats[idx].cpu << " / " << stats[idx].numaNode;
+        }
+        else
+        {
+            std::cout << "any / any";
+        }
+        std::cout << " / " << stats[idx].socketCount << " / " <<
+            stats[idx].utilization << " / " << stats[idx].eventsPerSec <<
+            "\r\n";
+    }
+
+    // The totals are kept since each thread started, so they show where its
+    // time went over the whole test
+    std::cout << "\r\nNetwork thread totals (wakeups / events per wakeup / "
+        "callback % / add and remove % of busy time):\r\n";
+    std::cout << std::fixed << std::setprecision(1);
+    for (int idx = 0; idx < min(count, NET_THREAD_STATS_MAX_COUNT); ++idx)
+    {
+        const CLNetThreadStats& threadStats = stats[idx];
+        double busyMicros = static_cast<double>(
+            max(threadStats.busyMicros, 1ULL));
+        std::cout << "  " << threadStats.wakeups << " / " <<
+            static_cast<double>(threadStats.eventsHandled) /
+                max(threadStats.wakeups, 1ULL) << " / " <<
+            threadStats.callbackMicros * 100 / busyMicros << " / " <<
+            threadStats.changeMicros * 100 / busyMicros << "\r\n";
+    }
+    std::cout << std::flush;
+}
+
+// Sends data at the given priority then waits for it to be echoed back,
+// returning false if no reply was received
+bool roundTrip(CLSocket skt, const char* buf, int len, int pri)
+{
+    int err = CLSendDataPri(skt, buf, len, pri);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLSendDataPri() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return false;
+    }
+
+    if (s_corkMaxDelay > 0)
+    {
+        // Nothing more is sent until the reply arrives, so do not wait for
+        // the cork delay
+        err = CLFlush(skt);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLFlush() failed, err=" << err << "\r\n" <<
+                std::flush;
+            return false;
+        }
+    }
+
+    if (WaitForSingleObject(s_replyEvent, REPLY_TIMEOUT) != WAIT_OBJECT_0 ||
+        s_socketClosed)
+    {
+        std::cout << "\r\nNo reply received\r\n" << std::flush;
+        return false;
+    }
+
+    return true;
+}
+
+int runLatency(const char* addr, unsigned short port, DWORD count,
+               int dataLen, bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket skt = 0;
+    if (startup(addr, port, echoServer, replyRecv, &srvSkt, &skt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    std::vector<char> data = makePayload(dataLen);
+
+    // Warm up the connection before taking measurements
+    DWORD warmUpCount = min(count / 10, 1000);
+    bool ok = true;
+    for (DWORD idx = 0; ok && idx < warmUpCount; ++idx)
+    {
+        ok = roundTrip(skt, &data[0], dataLen, CL_PRI_NORMAL);
+    }
+
+    LatencyStats stats;
+    for (DWORD idx = 0; ok && idx < count; ++idx)
+    {
+        LONGLONG startTicks = LatencyStats::now();
+        ok = roundTrip(skt, &data[0], dataLen, CL_PRI_NORMAL);
+        if (ok)
+        {
+            stats.addSample(startTicks, LatencyStats::now());
+        }
+    }
+
+    std::cout << "\r\nAddress: " << addr << "\r\n";
+    if (s_spinMicros > 0)
+    {
+        std::cout << "Network threads spin for up to " << s_spinMicros <<
+            " us\r\n";
+    }
+    stats.displayStats("Round trip time");
+    displayNetThreads();
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runThroughput(const char* addr, unsigned short port, DWORD count,
+                  int dataLen, bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket skt = 0;
+    if (startup(addr, port, echoServer, throughputReplyRecv, &srvSkt, &skt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    std::vector<char> data = makePayload(dataLen);
+    s_repliesExpected = static_cast<LONG>(count);
+    LONG maxOutstanding = max(THROUGHPUT_WINDOW / (dataLen + 2), 1);
+
+    // Send without waiting for each reply, keeping within the window, then
+    // wait for the last reply
+    double startCpuSecs = processCpuSecs();
+    LONGLONG startTicks = LatencyStats::now();
+    bool ok = true;
+    for (DWORD idx = 0; ok && idx < count; ++idx)
+    {
+        while (static_cast<LONG>(idx) - s_repliesRecv >= maxOutstanding &&
+            !s_socketClosed)
+        {
+            SwitchToThread();
+        }
+
+        int err = CLSendData(skt, &data[0], dataLen);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLSendData() failed, err=" << err << "\r\n" <<
+                std::flush;
+            ok = false;
+        }
+    }
+
+    if (ok && (WaitForSingleObject(s_replyEvent, REPLY_TIMEOUT) !=
+        WAIT_OBJECT_0 || s_socketClosed))
+    {
+        std::cout << "\r\nOnly " << s_repliesRecv << " of " << count <<
+            " replies received\r\n" << std::flush;
+        ok = false;
+    }
+
+    if (ok)
+    {
+        double secs = LatencyStats::ticksToMicros(
+            LatencyStats::now() - startTicks) / 1000000.0;
+        double cpuSecs = processCpuSecs() - startCpuSecs;
+        double megabytes = (static_cast<double>(count) * dataLen) /
+            (1024 * 1024);
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        if (s_compressMinLen > 0)
+        {
+            std::cout << "Compressing data of " << s_compressMinLen <<
+                " bytes or more\r\n";
+        }
+        if (s_corkMaxDelay > 0)
+        {
+            std::cout << "Corking sends for up to " << s_corkMaxDelay <<
+                " ms or " << CORK_MAX_BYTES << " bytes\r\n";
+        }
+        std::cout << "\r\nThroughput (" << count << " x " << dataLen <<
+            " bytes echoed):\r\n";
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "  time   : " << secs << " s\r\n";
+        std::cout << "  rate   : " << count / secs << " messages/s\r\n";
+        std::cout << "  data   : " << megabytes / secs <<
+            " MB/s each way\r\n";
+        std::cout << "  cpu    : " << cpuSecs << " s (" <<
+            cpuSecs * 1000 / megabytes << " ms per MB)\r\n";
+        std::cout << std::flush;
+    }
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runUdp(const char* addr, unsigned short port, DWORD count, int dataLen,
+           bool echoServer)
+{
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return 1;
+    }
+
+    CLUdpSocket echoSkt = 0;
+    if (echoServer)
+    {
+        err = CLCreateUdpSocket(addr, port, NULL, 0, udpEchoRecv, NULL,
+            &echoSkt);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLCreateUdpSocket() failed, err=" << err <<
+                "\r\n" << std::flush;
+            CLCleanup();
+            return 1;
+        }
+    }
+
+    // Bind to any local address of the same family as the one sending to
+    const char* localAddr = strchr(addr, ':') != NULL ? "::" : "0.0.0.0";
+    CLUdpSocket skt = 0;
+    err = CLCreateUdpSocket(localAddr, 0, addr, port, udpReplyRecv, NULL,
+        &skt);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLCreateUdpSocket() failed, err=" << err << "\r\n" <<
+            std::flush;
+        CLCleanup();
+        return 1;
+    }
+
+    std::vector<char> data(dataLen, 'x');
+    CLDatagram batch[UDP_BATCH_COUNT];
+    for (int idx = 0; idx < UDP_BATCH_COUNT; ++idx)
+    {
+        batch[idx].buf = &data[0];
+        batch[idx].len = dataLen;
+    }
+    LONG maxOutstanding = max(THROUGHPUT_WINDOW / dataLen, 1);
+
+    // Send in batches without waiting for each reply, keeping within the
+    // window. Datagrams that have not been echoed when the replies stall are
+    // written off so that sending can carry on
+    LONGLONG startTicks = LatencyStats::now();
+    LONG sent = 0;
+    LONG writtenOff = 0;
+    DWORD lastProgressTime = GetTickCount();
+    LONG lastRepliesRecv = 0;
+    bool ok = true;
+    while (ok && sent < static_cast<LONG>(count))
+    {
+        LONG repliesRecv = s_repliesRecv;
+        if (repliesRecv != lastRepliesRecv)
+        {
+            lastRepliesRecv = repliesRecv;
+            lastProgressTime = GetTickCount();
+        }
+
+        LONG outstanding = sent - repliesRecv - writtenOff;
+        if (outstanding >= maxOutstanding)
+        {
+            if (GetTickCount() - lastProgressTime >= UDP_STALL_INTERVAL)
+            {
+                writtenOff += outstanding;
+                lastProgressTime = GetTickCount();
+            }
+            else
+            {
+                SwitchToThread();
+            }
+            continue;
+        }
+
+        int batchCount = static_cast<int>(min(min(
+            static_cast<LONG>(UDP_BATCH_COUNT), maxOutstanding - outstanding),
+            static_cast<LONG>(count) - sent));
+        int sentCount = 0;
+        err = CLSendDatagrams(skt, batch, batchCount, &sentCount);
+        sent += sentCount;
+        if (err == WSAEWOULDBLOCK)
+        {
+            SwitchToThread();
+        }
+        else if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLSendDatagrams() failed, err=" << err <<
+                "\r\n" << std::flush;
+            ok = false;
+        }
+    }
+
+    // Wait for the remaining replies until they stop arriving
+    LONG repliesRecv = s_repliesRecv;
+    while (ok && repliesRecv < static_cast<LONG>(count))
+    {
+        Sleep(UDP_STALL_INTERVAL);
+        if (s_repliesRecv == repliesRecv)
+        {
+            break;
+        }
+        repliesRecv = s_repliesRecv;
+    }
+    LONGLONG endTicks = LatencyStats::now();
+
+    if (ok)
+    {
+        double secs = LatencyStats::ticksToMicros(endTicks - startTicks) /
+            1000000.0;
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        std::cout << "\r\nUDP packet rate (" << count << " x " << dataLen <<
+            " bytes echoed):\r\n";
+        std::cout << "  time   : " << std::fixed << std::setprecision(1) <<
+            secs << " s\r\n";
+        std::cout << "  sent   : " << sent << "\r\n";
+        std::cout << "  echoed : " << repliesRecv << "\r\n";
+        std::cout << "  lost   : " << sent - repliesRecv << "\r\n";
+        std::cout << "  rate   : " << repliesRecv / secs <<
+            " packets/s echoed\r\n";
+        std::cout << std::flush;
+    }
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runRpc(const char* addr, unsigned short port, DWORD count, int dataLen,
+           bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket skt = 0;
+    if (startup(addr, port, echoServer, replyRecv, &srvSkt, &skt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    std::vector<char> data(dataLen, 'x');
+    s_repliesExpected = static_cast<LONG>(count);
+    LONG maxOutstanding = min(max(THROUGHPUT_WINDOW / (dataLen + 7), 1),
+        RPC_MAX_OUTSTANDING);
+
+    // Send requests without waiting for each response, keeping within the
+    // window, then wait for the last response
+    LONGLONG startTicks = LatencyStats::now();
+    bool ok = true;
+    for (DWORD idx = 0; ok && idx < count; ++idx)
+    {
+        while (static_cast<LONG>(idx) - s_repliesRecv >= maxOutstanding &&
+            !s_socketClosed)
+        {
+            SwitchToThread();
+        }
+
+        int err = CLRequest(skt, &data[0], dataLen, REPLY_TIMEOUT,
+            rpcResponseRecv, NULL);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLRequest() failed, err=" << err << "\r\n" <<
+                std::flush;
+            ok = false;
+        }
+    }
+
+    // Every request completes, if only by timing out
+    if (ok && WaitForSingleObject(s_replyEvent, 2 * REPLY_TIMEOUT) !=
+        WAIT_OBJECT_0)
+    {
+        std::cout << "\r\nOnly " << s_repliesRecv << " of " << count <<
+            " requests completed\r\n" << std::flush;
+        ok = false;
+    }
+
+    if (ok)
+    {
+        double secs = LatencyStats::ticksToMicros(
+            LatencyStats::now() - startTicks) / 1000000.0;
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        std::cout << "\r\nRequest rate (" << count << " x " << dataLen <<
+            " bytes, up to " << maxOutstanding << " outstanding):\r\n";
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "  time   : " << secs << " s\r\n";
+        std::cout << "  rate   : " << count / secs << " requests/s\r\n";
+        std::cout << "  failed : " << s_requestsFailed << "\r\n";
+        std::cout << std::flush;
+    }
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+// Sends bulk data until told to stop, keeping within the window if there is
+// one
+DWORD WINAPI bulkSendThreadProc(LPVOID param)
+{
+    const BulkLoad* load = static_cast<const BulkLoad*>(param);
+    while (!s_bulkStop && !s_socketClosed)
+    {
+        if (load->maxOutstanding > 0 &&
+            s_bulkSent - s_bulkRecv >= load->maxOutstanding)
+        {
+            SwitchToThread();
+            continue;
+        }
+
+        InterlockedIncrement(&s_bulkSent);
+        if (CLSendData(load->skt, load->buf, load->len) != CL_ERR_OK)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Times round trips of control messages sent at the given priority
+bool timeControl(CLSocket skt, DWORD count, int pri, LatencyStats& stats)
+{
+    char control[CONTROL_LEN] = { CONTROL_MARKER };
+    bool ok = true;
+    for (DWORD idx = 0; ok && idx < count; ++idx)
+    {
+        LONGLONG startTicks = LatencyStats::now();
+        ok = roundTrip(skt, control, CONTROL_LEN, pri);
+        if (ok)
+        {
+            stats.addSample(startTicks, LatencyStats::now());
+        }
+    }
+    return ok;
+}
+
+int runPriority(const char* addr, unsigned short port, DWORD count,
+                int dataLen, bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket skt = 0;
+    if (startup(addr, port, echoServer, priorityReplyRecv, &srvSkt, &skt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    // Time control messages with nothing else going on first
+    LatencyStats idleStats;
+    bool ok = timeControl(skt, count, CL_PRI_NORMAL, idleStats);
+
+    // An echo server in this process may share a network thread with the
+    // client, so it must never block sending, see THROUGHPUT_WINDOW
+    std::vector<char> data = makePayload(dataLen);
+    BulkLoad load;
+    load.skt = skt;
+    load.buf = &data[0];
+    load.len = dataLen;
+    load.maxOutstanding = echoServer ?
+        max(THROUGHPUT_WINDOW / (dataLen + 2), 1) : 0;
+
+    HANDLE threads[BULK_THREAD_COUNT];
+    int threadCount = 0;
+    for (; ok && threadCount < BULK_THREAD_COUNT; ++threadCount)
+    {
+        threads[threadCount] = CreateThread(NULL, 0, bulkSendThreadProc,
+            &load, 0, NULL);
+        if (threads[threadCount] == NULL)
+        {
+            std::cout << "\r\nCreateThread() failed, err=" <<
+                GetLastError() << "\r\n" << std::flush;
+            ok = false;
+        }
+    }
+
+    // Then time them behind the bulk data at normal and at high priority
+    LatencyStats normalStats;
+    LatencyStats highStats;
+    if (ok)
+    {
+        ok = timeControl(skt, count, CL_PRI_NORMAL, normalStats) &&
+            timeControl(skt, count, CL_PRI_HIGH, highStats);
+    }
+
+    CLSocketStats sktStats = {};
+    CLGetSocketStats(skt, &sktStats);
+
+    s_bulkStop = true;
+    for (int idx = 0; idx < threadCount; ++idx)
+    {
+        if (threads[idx] != NULL)
+        {
+            WaitForSingleObject(threads[idx], INFINITE);
+            CloseHandle(threads[idx]);
+        }
+    }
+
+    if (ok)
+    {
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        std::cout << "\r\n" << BULK_THREAD_COUNT << " threads sending " <<
+            dataLen << " byte messages, " << s_bulkRecv << " echoed\r\n";
+        idleStats.displayStats("Control round trip time, no bulk data");
+        normalStats.displayStats(
+            "Control round trip time, bulk data, normal priority");
+        highStats.displayStats(
+            "Control round trip time, bulk data, high priority");
+
+        std::cout << "\r\nSent by priority (frames / bytes):\r\n";
+        const char* const priNames[CL_PRI_COUNT] =
+            { "normal", "high", "urgent" };
+        for (int pri = 0; pri < CL_PRI_COUNT; ++pri)
+        {
+            std::cout << "  " << std::setw(7) << std::left << priNames[pri] <<
+                std::right << ": " << sktStats.framesSent[pri] << " / " <<
+                sktStats.bytesSent[pri] << "\r\n";
+        }
+        std::cout << std::flush;
+    }
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runFlood(const char* addr, unsigned short port, DWORD count,
+             int dataLen, bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket firstSkt = 0;
+    if (startup(addr, port, echoServer, replyRecv, &srvSkt, &firstSkt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    std::vector<char> data = makePayload(dataLen);
+    std::vector<CLSocket> skts;
+    skts.reserve(count);
+    skts.push_back(firstSkt);
+
+    // Open the rest of the connections as fast as possible, each sending
+    // some data for the echo server to buffer if it accepts them
+    SIZE_T startBytes = processPrivateBytes();
+    bool ok = (CLSendData(firstSkt, &data[0], dataLen) == CL_ERR_OK);
+    while (ok && skts.size() < count)
+    {
+        CLSocket skt = 0;
+        int err = CLCreateSocketCtx(s_ctx, addr, port, replyRecv,
+            socketClosed, NULL, &skt);
+        if (err == CL_ERR_OK)
+        {
+            skts.push_back(skt);
+            err = CLSendData(skt, &data[0], dataLen);
+        }
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nFailed after " << skts.size() <<
+                " connections, err=" << err << "\r\n" << std::flush;
+            ok = false;
+        }
+    }
+
+    if (echoServer)
+    {
+        waitForAcceptsToSettle();
+    }
+    SIZE_T floodBytes = processPrivateBytes();
+    LONG acceptedInFlood = s_consAccepted;
+
+    // Close the connections, so the echo server makes room for and accepts
+    // those still waiting in the backlog
+    for (size_t idx = 0; idx < skts.size(); ++idx)
+    {
+        CLDeleteSocket(skts[idx]);
+    }
+
+    if (echoServer)
+    {
+        waitForAcceptsToSettle();
+    }
+
+    std::cout << "\r\nAddress: " << addr << "\r\n";
+    std::cout << "\r\nConnections opened: " << skts.size() << "\r\n";
+    if (echoServer)
+    {
+        std::cout << "Echo server connection cap: ";
+        if (s_maxCons > 0)
+        {
+            std::cout << s_maxCons;
+        }
+        else
+        {
+            std::cout << "none";
+        }
+        std::cout << "\r\n";
+        std::cout << "Accepted while open: " << acceptedInFlood << "\r\n";
+        std::cout << "Accepted once closed: " << s_consAccepted << "\r\n";
+    }
+
+    // The memory grows by less than was allocated if the heap had room to
+    // spare, so only a large number of connections gives a useful figure
+    SIZE_T floodKBytes = (floodBytes > startBytes) ?
+        (floodBytes - startBytes) / 1024 : 0;
+    std::cout << "Private memory grown by: " << floodKBytes << " KB (" <<
+        (floodKBytes * 1024) / skts.size() << " bytes per connection)\r\n" <<
+        std::flush;
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runIdle(const char* addr, unsigned short port, DWORD count, int dataLen,
+            bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket firstSkt = 0;
+    if (startup(addr, port, echoServer, replyRecv, &srvSkt, &firstSkt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    std::vector<char> data = makePayload(dataLen);
+    std::vector<CLSocket> skts;
+    skts.reserve(count);
+    skts.push_back(firstSkt);
+
+    // Open the rest of the connections one at a time, each echoing data once
+    // before it is left idle, so memory only needed while data is in flight
+    // is counted only if it is kept afterwards
+    SIZE_T startBytes = processPrivateBytes();
+    bool ok = roundTrip(firstSkt, &data[0], dataLen, CL_PRI_NORMAL);
+    while (ok && skts.size() < count)
+    {
+        CLSocket skt = 0;
+        int err = CLCreateSocketCtx(s_ctx, addr, port, replyRecv,
+            socketClosed, NULL, &skt);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nFailed after " << skts.size() <<
+                " connections, err=" << err << "\r\n" << std::flush;
+            ok = false;
+            break;
+        }
+        skts.push_back(skt);
+        ok = roundTrip(skt, &data[0], dataLen, CL_PRI_NORMAL);
+    }
+
+    SIZE_T idleBytes = processPrivateBytes();
+
+    for (size_t idx = 0; idx < skts.size(); ++idx)
+    {
+        CLDeleteSocket(skts[idx]);
+    }
+
+    std::cout << "\r\nAddress: " << addr << "\r\n";
+    std::cout << "\r\nIdle connections: " << skts.size() << "\r\n";
+
+    // As for a flood, only a large number of connections gives a useful
+    // figure
+    SIZE_T idleKBytes = (idleBytes > startBytes) ?
+        (idleBytes - startBytes) / 1024 : 0;
+    std::cout << "Private memory grown by: " << idleKBytes << " KB (" <<
+        (idleKBytes * 1024) / skts.size() << " bytes per connection)\r\n" <<
+        std::flush;
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runChurn(const char* addr, unsigned short port, DWORD count,
+             int dataLen, bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket firstSkt = 0;
+    if (startup(addr, port, echoServer, replyRecv, &srvSkt, &firstSkt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    std::vector<char> data = makePayload(dataLen);
+
+    // Connect, echo data once and close again, over and over, so each cycle
+    // creates and deletes a socket object at both ends
+    SIZE_T startBytes = processPrivateBytes();
+    LONG startConsClosed = s_consClosed;
+    LONGLONG startTicks = LatencyStats::now();
+    bool ok = true;
+    DWORD cycles = 0;
+    for (; ok && cycles < count; ++cycles)
+    {
+        CLSocket skt = 0;
+        int err = CLCreateSocketCtx(s_ctx, addr, port, replyRecv,
+            socketClosed, NULL, &skt);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nFailed after " << cycles << " cycles, err=" <<
+                err << "\r\n" << std::flush;
+            ok = false;
+            break;
+        }
+        ok = roundTrip(skt, &data[0], dataLen, CL_PRI_NORMAL);
+        CLDeleteSocket(skt);
+    }
+
+    // The cycle is only complete once the echo server has closed its end
+    // too
+    DWORD startTickCount = GetTickCount();
+    while (ok && echoServer &&
+        s_consClosed - startConsClosed < static_cast<LONG>(cycles) &&
+        GetTickCount() - startTickCount < REPLY_TIMEOUT)
+    {
+        Sleep(1);
+    }
+
+    double secs = LatencyStats::ticksToMicros(
+        LatencyStats::now() - startTicks) / 1000000.0;
+    SIZE_T endBytes = processPrivateBytes();
+
+    if (ok)
+    {
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        std::cout << "\r\nChurn (" << cycles << " x connect, " << dataLen <<
+            " bytes echoed, close):\r\n";
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "  time   : " << secs << " s\r\n";
+        std::cout << "  rate   : " << cycles / secs << " cycles/s\r\n";
+        if (echoServer)
+        {
+            std::cout << "  closed : " << s_consClosed - startConsClosed <<
+                " by the echo server\r\n";
+        }
+
+        // Memory that grows with the number of cycles rather than staying
+        // flat is being leaked or not recycled
+        SIZE_T churnKBytes = (endBytes > startBytes) ?
+            (endBytes - startBytes) / 1024 : 0;
+        std::cout << "  memory : grown by " << churnKBytes << " KB\r\n";
+        std::cout << std::flush;
+    }
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+// Waits for the given number of connection attempts to complete, returning
+// how long in seconds since the given start they took, or a negative value if
+// they did not all complete in time
+double waitForConnects(LONG count, LONGLONG startTicks)
+{
+    DWORD startTickCount = GetTickCount();
+    while (s_consCompleted < count &&
+        GetTickCount() - startTickCount < CONNECT_TIMEOUT)
+    {
+        Sleep(1);
+    }
+    if (s_consCompleted < count)
+    {
+        return -1;
+    }
+    return LatencyStats::ticksToMicros(LatencyStats::now() - startTicks) /
+        1000000.0;
+}
+
+// Deletes the given sockets, then waits for the echo server in this process,
+// if there is one, to see them closed
+void deleteStorm(const std::vector<CLSocket>& skts, bool echoServer)
+{
+    LONG startConsClosed = s_consClosed;
+    for (size_t idx = 0; idx < skts.size(); ++idx)
+    {
+        if (skts[idx] != 0)
+        {
+            CLDeleteSocket(skts[idx]);
+        }
+    }
+
+    DWORD startTickCount = GetTickCount();
+    while (echoServer && s_consClosed - startConsClosed <
+        static_cast<LONG>(skts.size()) - s_consFailed &&
+        GetTickCount() - startTickCount < REPLY_TIMEOUT)
+    {
+        Sleep(1);
+    }
+}
+
+// Displays how long a storm of connection attempts took to complete
+void displayStorm(const char* title, DWORD count, double secs)
+{
+    std::cout << "\r\n" << title << " (" << count << " sockets):\r\n";
+    if (secs < 0)
+    {
+        std::cout << "  timed out with " << s_consCompleted <<
+            " attempts completed\r\n";
+    }
+    else
+    {
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "  time to all connected : " << secs << " s\r\n";
+        std::cout << std::setprecision(0);
+        std::cout << "  rate                  : " << count / secs <<
+            " connects/s\r\n";
+    }
+    std::cout << "  failed                : " << s_consFailed << "\r\n" <<
+        std::flush;
+}
+
+int runConnect(const char* addr, unsigned short port, DWORD count,
+               int maxInFlight, bool echoServer)
+{
+    CLSrvSocket srvSkt = 0;
+    CLSocket firstSkt = 0;
+    if (startup(addr, port, echoServer, replyRecv, &srvSkt, &firstSkt) !=
+        CL_ERR_OK)
+    {
+        return 1;
+    }
+
+    // Reconnect count sockets at once one call at a time, as a client
+    // without a batch would after a failover
+    std::vector<CLSocket> skts(count);
+    s_consCompleted = 0;
+    s_consFailed = 0;
+    LONGLONG startTicks = LatencyStats::now();
+    bool ok = true;
+    for (DWORD idx = 0; ok && idx < count; ++idx)
+    {
+        int err = CLCreateSocketAsyncCtx(s_ctx, addr, port, conCompleted,
+            replyRecv, socketClosed, NULL, &skts[idx]);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLCreateSocketAsyncCtx() failed after " <<
+                idx << " sockets, err=" << err << "\r\n" << std::flush;
+            ok = false;
+        }
+    }
+    double loopSecs = ok ? waitForConnects(static_cast<LONG>(count),
+        startTicks) : -1;
+    if (ok)
+    {
+        displayStorm("One call per socket", count, loopSecs);
+    }
+    deleteStorm(skts, echoServer);
+
+    // Then as one batch
+    std::vector<CLConnectTarget> targets(count);
+    for (DWORD idx = 0; idx < count; ++idx)
+    {
+        targets[idx].hostAddr = addr;
+        targets[idx].hostPort = port;
+        targets[idx].arg = NULL;
+    }
+    s_consCompleted = 0;
+    s_consFailed = 0;
+    startTicks = LatencyStats::now();
+    int err = ok ? CLCreateSocketsAsyncCtx(s_ctx, &targets[0],
+        static_cast<int>(count), maxInFlight, conCompleted, replyRecv,
+        socketClosed) : CL_ERR_OK;
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLCreateSocketsAsyncCtx() failed, err=" << err <<
+            "\r\n" << std::flush;
+        ok = false;
+    }
+    double batchSecs = ok ? waitForConnects(static_cast<LONG>(count),
+        startTicks) : -1;
+    if (ok)
+    {
+        displayStorm("One batch", count, batchSecs);
+        std::cout << "  most in flight        : " << maxInFlight << "\r\n" <<
+            std::flush;
+    }
+    for (DWORD idx = 0; idx < count; ++idx)
+    {
+        skts[idx] = targets[idx].skt;
+    }
+    deleteStorm(skts, echoServer);
+
+    CLCleanup();
+    return (ok && loopSecs >= 0 && batchSecs >= 0) ? 0 : 1;
+}
+
+// Creates an echo server listening in the given context, then connects to it
+// from the same context
+int connectEchoPair(CLContext ctx, const char* addr, unsigned short port,
+                    CLPDataRecvFn dataRecvFn, CLSocket* pSkt)
+{
+    CLSrvSocket srvSkt = 0;
+    int err = CLCreateSrvSocketCtx(ctx, addr, port, echoConPending,
+        echoSrvSocketClosed, 200, NULL, &srvSkt);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLCreateSrvSocketCtx() failed, err=" << err <<
+            "\r\n" << std::flush;
+        return err;
+    }
+
+    err = CLCreateSocketCtx(ctx, addr, port, dataRecvFn, socketClosed, NULL,
+        pSkt);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLCreateSocketCtx() failed, err=" << err <<
+            "\r\n" << std::flush;
+    }
+    return err;
+}
+
+int runIsolation(const char* addr, unsigned short port, DWORD count,
+                 int dataLen)
+{
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return 1;
+    }
+
+    // Bulk data goes through the default context. Control messages are timed
+    // both on a connection in the default context too and on one in a
+    // context of its own, each connection with an echo server in its context
+    CLContextConfig config = { 0, 0 };
+    CLContext latencyCtx = 0;
+    err = CLCreateContext(&config, &latencyCtx);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLCreateContext() failed, err=" << err <<
+            "\r\n" << std::flush;
+    }
+
+    CLSocket bulkSkt = 0;
+    CLSocket sharedSkt = 0;
+    CLSocket isolatedSkt = 0;
+    bool ok = (err == CL_ERR_OK) &&
+        connectEchoPair(0, addr, port, priorityReplyRecv, &bulkSkt) ==
+            CL_ERR_OK &&
+        connectEchoPair(0, addr, static_cast<unsigned short>(port + 1),
+            replyRecv, &sharedSkt) == CL_ERR_OK &&
+        connectEchoPair(latencyCtx, addr,
+            static_cast<unsigned short>(port + 2), replyRecv,
+            &isolatedSkt) == CL_ERR_OK;
+
+    // Time control messages with nothing else going on first
+    LatencyStats idleStats;
+    ok = ok && timeControl(isolatedSkt, count, CL_PRI_NORMAL, idleStats);
+
+    // The bulk echo server shares network threads with the client, so it
+    // must never block sending, see THROUGHPUT_WINDOW
+    std::vector<char> data = makePayload(dataLen);
+    BulkLoad load;
+    load.skt = bulkSkt;
+    load.buf = &data[0];
+    load.len = dataLen;
+    load.maxOutstanding = max(THROUGHPUT_WINDOW / (dataLen + 2), 1);
+
+    HANDLE threads[BULK_THREAD_COUNT];
+    int threadCount = 0;
+    for (; ok && threadCount < BULK_THREAD_COUNT; ++threadCount)
+    {
+        threads[threadCount] = CreateThread(NULL, 0, bulkSendThreadProc,
+            &load, 0, NULL);
+        if (threads[threadCount] == NULL)
+        {
+            std::cout << "\r\nCreateThread() failed, err=" <<
+                GetLastError() << "\r\n" << std::flush;
+            ok = false;
+        }
+    }
+
+    // Then time them alongside the bulk data, in the same context and in
+    // another
+    LatencyStats sharedStats;
+    LatencyStats isolatedStats;
+    if (ok)
+    {
+        ok = timeControl(sharedSkt, count, CL_PRI_NORMAL, sharedStats) &&
+            timeControl(isolatedSkt, count, CL_PRI_NORMAL, isolatedStats);
+    }
+
+    s_bulkStop = true;
+    for (int idx = 0; idx < threadCount; ++idx)
+    {
+        if (threads[idx] != NULL)
+        {
+            WaitForSingleObject(threads[idx], INFINITE);
+            CloseHandle(threads[idx]);
+        }
+    }
+
+    if (ok)
+    {
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        std::cout << "\r\n" << BULK_THREAD_COUNT << " threads sending " <<
+            dataLen << " byte messages, " << s_bulkRecv << " echoed\r\n";
+        idleStats.displayStats("Control round trip time, no bulk data");
+        sharedStats.displayStats(
+            "Control round trip time, bulk data in the same context");
+        isolatedStats.displayStats(
+            "Control round trip time, bulk data in another context");
+    }
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runHotspot(const char* addr, unsigned short port, DWORD count,
+               int dataLen, bool echoServer)
+{
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return 1;
+    }
+
+    CLContextConfig config = {};
+    config.threadCount = HOTSPOT_THREAD_COUNT;
+    config.pinThreads = s_pinThreads ? 1 : 0;
+    config.spinMicros = s_spinMicros;
+    config.rebalance = s_rebalance ? 1 : 0;
+    err = CLCreateContext(&config, &s_ctx);
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLCreateContext() failed, err=" << err <<
+            "\r\n" << std::flush;
+    }
+
+    // The echo server goes in the default context, so only the client
+    // sockets are laid out over the test context's threads
+    CLSrvSocket srvSkt = 0;
+    if (err == CL_ERR_OK && echoServer)
+    {
+        err = CLCreateSrvSocketCtx(0, addr, port, echoConPending,
+            echoSrvSocketClosed, 200, NULL, &srvSkt);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLCreateSrvSocketCtx() failed, err=" << err <<
+                "\r\n" << std::flush;
+        }
+    }
+
+    std::vector<CLSocket> skts;
+    bool ok = (err == CL_ERR_OK);
+    for (DWORD idx = 0; ok && idx < count; ++idx)
+    {
+        CLSocket skt = 0;
+        err = CLCreateSocketCtx(s_ctx, addr, port, priorityReplyRecv,
+            socketClosed, NULL, &skt);
+        if (err == CL_ERR_OK)
+        {
+            skts.push_back(skt);
+        }
+        else
+        {
+            std::cout << "\r\nCLCreateSocketCtx() failed, err=" << err <<
+                "\r\n" << std::flush;
+            ok = false;
+        }
+    }
+
+    // Send bulk data on every HOTSPOT_THREAD_COUNT-th connection, which all
+    // start out on the same network thread, leaving the rest idle
+    std::vector<char> data = makePayload(dataLen);
+    std::vector<BulkLoad> loads(
+        (skts.size() + HOTSPOT_THREAD_COUNT - 1) / HOTSPOT_THREAD_COUNT);
+    std::vector<HANDLE> threads;
+    for (size_t idx = 0; ok && idx < loads.size(); ++idx)
+    {
+        loads[idx].skt = skts[idx * HOTSPOT_THREAD_COUNT];
+        loads[idx].buf = &data[0];
+        loads[idx].len = dataLen;
+        loads[idx].maxOutstanding = max(THROUGHPUT_WINDOW / (dataLen + 2), 1);
+
+        HANDLE thread = CreateThread(NULL, 0, bulkSendThreadProc,
+            &loads[idx], 0, NULL);
+        if (thread != NULL)
+        {
+            threads.push_back(thread);
+        }
+        else
+        {
+            std::cout << "\r\nCreateThread() failed, err=" <<
+                GetLastError() << "\r\n" << std::flush;
+            ok = false;
+        }
+    }
+
+    if (ok)
+    {
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        std::cout << loads.size() << " of " << skts.size() <<
+            " connections sending " << dataLen << " byte messages, " <<
+            (s_rebalance ? "rebalancing" : "not rebalancing") << "\r\n";
+    }
+
+    // Show how much is echoed each second and how busy each network thread
+    // was over the second before
+    for (int sec = 0; ok && sec < HOTSPOT_SECS && !s_socketClosed; ++sec)
+    {
+        LONG startRecv = s_bulkRecv;
+        Sleep(1000);
+        std::cout << "\r\nSecond " << sec + 1 << ": " <<
+            s_bulkRecv - startRecv << " messages echoed\r\n";
+        displayNetThreads();
+    }
+
+    s_bulkStop = true;
+    for (size_t idx = 0; idx < threads.size(); ++idx)
+    {
+        WaitForSingleObject(threads[idx], INFINITE);
+        CloseHandle(threads[idx]);
+    }
+
+    CLCleanup();
+    return ok ? 0 : 1;
+}
+
+int runStuck(const char* addr, unsigned short port, DWORD count,
+             int dataLen)
+{
+    int err = CLStartup();
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nCLStartup() failed, err=" << err << "\r\n" <<
+            std::flush;
+        return 1;
+    }
+
+    // The server's sockets queue what their client does not read, dropping
+    // the oldest data to stay within the limits
+    CLSrvSocket srvSkt = 0;
+    CLSlowConsumerPolicy policy = { CL_SLOW_CONSUMER_DROP,
+        STUCK_MAX_QUEUED_BYTES, STUCK_MAX_QUEUE_AGE };
+    err = CLCreateSrvSocket(addr, port, stuckConPending, echoSrvSocketClosed,
+        200, NULL, &srvSkt);
+    if (err == CL_ERR_OK)
+    {
+        err = CLSetSrvSlowConsumerPolicy(srvSkt, &policy, NULL);
+    }
+
+    // The client reads about one frame then stops, as its receive limit is
+    // too low for the bucket to refill before the test ends
+    CLSocket clientSkt = 0;
+    if (err == CL_ERR_OK)
+    {
+        err = CLCreateSocket(addr, port, replyRecv, socketClosed, NULL,
+            &clientSkt);
+    }
+    if (err == CL_ERR_OK)
+    {
+        CLRateLimit limit = {};
+        limit.recvBytesPerSec = 1;
+        limit.recvBurstBytes = 1;
+        err = CLSetRateLimit(clientSkt, &limit);
+    }
+    if (err != CL_ERR_OK)
+    {
+        std::cout << "\r\nSetting up failed, err=" << err << "\r\n" <<
+            std::flush;
+        CLCleanup();
+        return 1;
+    }
+
+    ULONGLONG deadline = GetTickCount64() + REPLY_TIMEOUT;
+    while (s_stuckSkt == 0 && GetTickCount64() < deadline)
+    {
+        Sleep(10);
+    }
+    CLSocket stuckSkt = s_stuckSkt;
+    if (stuckSkt == 0)
+    {
+        std::cout << "\r\nThe connection was not accepted\r\n" << std::flush;
+        CLCleanup();
+        return 1;
+    }
+
+    // Send to the stuck client, timing each call. Without a policy one of
+    // these would block for good once the TCP buffers had filled
+    std::vector<char> data = makePayload(dataLen);
+    SIZE_T startBytes = processPrivateBytes();
+    LatencyStats sendStats;
+    DWORD refusedCount = 0;
+    bool ok = true;
+    for (DWORD idx = 0; ok && idx < count; ++idx)
+    {
+        LONGLONG startTicks = LatencyStats::now();
+        err = CLSendData(stuckSkt, &data[0], dataLen);
+        sendStats.addSample(startTicks, LatencyStats::now());
+        if (err == CL_ERR_SLOW_CONSUMER)
+        {
+            ++refusedCount;
+        }
+        else if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLSendData() failed, err=" << err << "\r\n" <<
+                std::flush;
+            ok = false;
+        }
+    }
+    SIZE_T sentBytes = processPrivateBytes();
+
+    // Give what is left queued time to become too old and be dropped too
+    Sleep(STUCK_MAX_QUEUE_AGE + 500);
+    CLSocketStats stats = {};
+    CLGetSocketStats(stuckSkt, &stats);
+
+    // Then have the server disconnect the client instead, which sending
+    // until a frame is refused, or the age limit, brings about
+    policy.action = CL_SLOW_CONSUMER_DISCONNECT;
+    CLSetSlowConsumerPolicy(stuckSkt, &policy, NULL);
+    LONGLONG disconnectTicks = LatencyStats::now();
+    err = CL_ERR_OK;
+    for (DWORD idx = 0; ok && err == CL_ERR_OK && idx < count; ++idx)
+    {
+        err = CLSendData(stuckSkt, &data[0], dataLen);
+    }
+    deadline = GetTickCount64() + STUCK_MAX_QUEUE_AGE + REPLY_TIMEOUT;
+    while (ok && !s_stuckClosed && GetTickCount64() < deadline)
+    {
+        Sleep(10);
+    }
+    double disconnectMs = LatencyStats::ticksToMicros(
+        LatencyStats::now() - disconnectTicks) / 1000.0;
+
+    if (ok)
+    {
+        std::cout << "\r\nAddress: " << addr << "\r\n";
+        std::cout << "Queue limits: " << STUCK_MAX_QUEUED_BYTES / 1024 <<
+            " KB, " << STUCK_MAX_QUEUE_AGE << " ms\r\n";
+        sendStats.displayStats("CLSendData() time to a client not reading");
+
+        SIZE_T sentKBytes = (sentBytes > startBytes) ?
+            (sentBytes - startBytes) / 1024 : 0;
+        std::cout << "\r\nDropping the oldest data:\r\n";
+        std::cout << "  frames refused        : " << refusedCount << "\r\n";
+        std::cout << "  frames dropped        : " << stats.framesDropped <<
+            "\r\n";
+        std::cout << "  bytes dropped         : " << stats.bytesDropped <<
+            "\r\n";
+        std::cout << "  bytes still queued    : " << stats.bytesQueued <<
+            "\r\n";
+        std::cout << "  times over a limit    : " << stats.slowConsumerHits <<
+            "\r\n";
+        std::cout << "  private memory grown  : " << sentKBytes << " KB\r\n";
+
+        std::cout << "\r\nDisconnecting:\r\n";
+        if (s_stuckClosed)
+        {
+            std::cout << std::fixed << std::setprecision(1);
+            std::cout << "  time to disconnect    : " << disconnectMs <<
+                " ms\r\n";
+            std::cout << "  close error           : " << s_stuckCloseErr <<
+                "\r\n" << std::flush;
+        }
+        else
+        {
+            std::cout << "  timed out\r\n" << std::flush;
+        }
+    }
+
+    CLCleanup();
+    return (ok && s_stuckClosed) ? 0 : 1;
+}
+
+void displayUsage()
+{
+    std::cout << "Measures the performance of the communication library.\r\n\r\n";
+
+    std::cout << "PERFTEST latency addr port count size [/S] [/Z[:min]] [/C[:delay]] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST throughput addr port count size [/S] [/Z[:min]] [/C[:delay]] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST rpc addr port count size [/S] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST priority addr port count size [/S] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST flood addr port count size [/S] [/M:max] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST idle addr port count size [/S] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST churn addr port count size [/S] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST connect addr port count max [/S] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST isolation addr port count size [/T:file]\r\n";
+    std::cout << "PERFTEST hotspot addr port count size [/S] [/R] [/P] [/B[:us]] [/T:file]\r\n";
+    std::cout << "PERFTEST stuck addr port count size [/T:file]\r\n";
+    std::cout << "PERFTEST udp addr port count size [/S] [/T:file]\r\n\r\n";
+
+    std::cout << "latency     Measures the round trip time of data echoed by a server.\r\n";
+    std::cout << "throughput  Measures the rate data can be echoed by a server when\r\n";
+    std::cout << "            sending without waiting for each reply.\r\n";
+    std::cout << "rpc         Measures the rate requests can be responded to by a server\r\n";
+    std::cout << "            with many requests waiting for a response at once.\r\n";
+    std::cout << "priority    Measures the round trip time of small control messages while\r\n";
+    std::cout << "            other threads send bulk data of the given size on the\r\n";
+    std::cout << "            same socket, at normal and at high priority.\r\n";
+    std::cout << "flood       Opens count connections at once, each sending size bytes,\r\n";
+    std::cout << "            and measures how many are accepted and the memory used.\r\n";
+    std::cout << "idle        Opens count connections one at a time, each echoing size\r\n";
+    std::cout << "            bytes once, and measures the memory used once they are idle.\r\n";
+    std::cout << "churn       Connects, echoes size bytes and closes count times, and\r\n";
+    std::cout << "            measures the rate of these cycles.\r\n";
+    std::cout << "connect     Connects count sockets asynchronously at once, first with a\r\n";
+    std::cout << "            call for each and then as one batch with up to max connection\r\n";
+    std::cout << "            attempts in flight, and measures the time until all are\r\n";
+    std::cout << "            connected each way.\r\n";
+    std::cout << "isolation   Measures the round trip time of small control messages while\r\n";
+    std::cout << "            other threads send bulk data of the given size on another\r\n";
+    std::cout << "            socket, in the same library context and in another. This\r\n";
+    std::cout << "            always runs its own echo servers, on ports port to port + 2\r\n";
+    std::cout << "            (addr must be an IP address or host name).\r\n";
+    std::cout << "hotspot     Opens count connections over four network threads and\r\n";
+    std::cout << "            sends bulk data of the given size on those that start out\r\n";
+    std::cout << "            on the same thread, showing how busy each thread is every\r\n";
+    std::cout << "            second for ten seconds.\r\n";
+    std::cout << "stuck       Sends count messages of the given size to a client that has\r\n";
+    std::cout << "            stopped reading, first with a slow consumer policy that drops\r\n";
+    std::cout << "            the oldest data and then with one that disconnects it. This\r\n";
+    std::cout << "            always runs its own server (addr must be an IP address or\r\n";
+    std::cout << "            host name).\r\n";
+    std::cout << "udp         Measures the rate UDP datagrams can be echoed by a server,\r\n";
+    std::cout << "            counting any that are lost (addr must be an IP address).\r\n";
+    std::cout << "addr        The host address to connect to, for example 127.0.0.1,\r\n";
+    std::cout << "            unix:C:\\Temp\\echo.sock, shm://echo or inproc://echo\r\n";
+    std::cout << "            (inproc addresses need /S).\r\n";
+    std::cout << "port        The port to connect to.\r\n";
+    std::cout << "count       The number of round trips, messages, requests or datagrams\r\n";
+    std::cout << "            to measure.\r\n";
+    std::cout << "size        The size of data to send.\r\n";
+    std::cout << "/S          Run an echo server in this process listening on addr and\r\n";
+    std::cout << "            port rather than using a separate echoserver process.\r\n";
+    std::cout << "/Z          Compress data of min bytes or more, 128 if not given,\r\n";
+    std::cout << "            at both ends of the connection (the echo server must\r\n";
+    std::cout << "            compress too, so use /S or echoserver /Z).\r\n";
+    std::cout << "/C          Cork data sent by the client for up to delay ms, 1 if not\r\n";
+    std::cout << "            given, so many messages are written at once (latency\r\n";
+    std::cout << "            flushes after each message instead).\r\n";
+    std::cout << "/M          Cap the connections the echo server in this process\r\n";
+    std::cout << "            accepts at once at max.\r\n";
+    std::cout << "/P          Pin each network thread to a CPU of its own where there are\r\n";
+    std::cout << "            enough (latency shows where the threads were pinned).\r\n";
+    std::cout << "/B          Have network threads poll for network events for up to us\r\n";
+    std::cout << "            microseconds, 100 if not given, before waiting to be woken.\r\n";
+    std::cout << "/R          Move busy sockets off network threads that are saturated.\r\n";
+    std::cout << "/T          Trace what the library does during the test and write it\r\n";
+    std::cout << "            to file in the Chrome trace event format.\r\n";
+    std::cout << "\r\n";
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 6 || (_stricmp(argv[1], "latency") != 0 &&
+        _stricmp(argv[1], "throughput") != 0 &&
+        _stricmp(argv[1], "rpc") != 0 &&
+        _stricmp(argv[1], "priority") != 0 &&
+        _stricmp(argv[1], "flood") != 0 &&
+        _stricmp(argv[1], "idle") != 0 &&
+        _stricmp(argv[1], "churn") != 0 &&
+        _stricmp(argv[1], "connect") != 0 &&
+        _stricmp(argv[1], "isolation") != 0 &&
+        _stricmp(argv[1], "hotspot") != 0 &&
+        _stricmp(argv[1], "stuck") != 0 &&
+        _stricmp(argv[1], "udp") != 0))
+    {
+        displayUsage();
+        return 1;
+    }
+
+    const char* addr = argv[2];
+    unsigned short port = static_cast<unsigned short>(
+        strtoul(argv[3], NULL, 10));
+    DWORD count = strtoul(argv[4], NULL, 10);
+    int dataLen = static_cast<int>(strtoul(argv[5], NULL, 10));
+    bool echoServer = false;
+
+    if (dataLen <= 0)
+    {
+        displayUsage();
+        return 1;
+    }
+
+    for (int i = 6; i < argc; ++i)
+    {
+        if (_stricmp(argv[i], "/S") == 0)
+        {
+            echoServer = true;
+        }
+        else if (_strnicmp(argv[i], "/Z", 2) == 0)
+        {
+            s_compressMinLen = (argv[i][2] == ':') ?
+                static_cast<int>(strtoul(&argv[i][3], NULL, 10)) :
+                DEFAULT_COMPRESS_MIN_LEN;
+        }
+        else if (_strnicmp(argv[i], "/C", 2) == 0)
+        {
+            s_corkMaxDelay = (argv[i][2] == ':') ?
+                strtoul(&argv[i][3], NULL, 10) : DEFAULT_CORK_MAX_DELAY;
+        }
+        else if (_strnicmp(argv[i], "/M:", 3) == 0)
+        {
+            s_maxCons = static_cast<int>(strtoul(&argv[i][3], NULL, 10));
+        }
+        else if (_stricmp(argv[i], "/P") == 0)
+        {
+            s_pinThreads = true;
+        }
+        else if (_stricmp(argv[i], "/R") == 0)
+        {
+            s_rebalance = true;
+        }
+        else if (_strnicmp(argv[i], "/B", 2) == 0)
+        {
+            s_spinMicros = (argv[i][2] == ':') ?
+                strtoul(&argv[i][3], NULL, 10) : DEFAULT_SPIN_MICROS;
+        }
+        else if (_strnicmp(argv[i], "/T:", 3) == 0)
+        {
+            s_tracePath = &argv[i][3];
+        }
+    }
+
+    if (s_tracePath != NULL)
+    {
+        CLSetTracing(1);
+    }
+
+    s_replyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        // Auto-reset, unsignaled
+    if (s_replyEvent == NULL)
+    {
+        return 1;
+    }
+
+    int result = 0;
+    if (_stricmp(argv[1], "throughput") == 0)
+    {
+        result = runThroughput(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "rpc") == 0)
+    {
+        result = runRpc(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "priority") == 0)
+    {
+        result = runPriority(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "flood") == 0)
+    {
+        result = runFlood(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "idle") == 0)
+    {
+        result = runIdle(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "churn") == 0)
+    {
+        result = runChurn(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "connect") == 0)
+    {
+        result = runConnect(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "isolation") == 0)
+    {
+        result = runIsolation(addr, port, count, dataLen);
+    }
+    else if (_stricmp(argv[1], "hotspot") == 0)
+    {
+        result = runHotspot(addr, port, count, dataLen, echoServer);
+    }
+    else if (_stricmp(argv[1], "stuck") == 0)
+    {
+        result = runStuck(addr, port, count, dataLen);
+    }
+    else if (_stricmp(argv[1], "udp") == 0)
+    {
+        result = runUdp(addr, port, count, dataLen, echoServer);
+    }
+    else
+    {
+        result = runLatency(addr, port, count, dataLen, echoServer);
+    }
+
+    if (s_tracePath != NULL)
+    {
+        int err = CLDumpTrace(s_tracePath);
+        if (err != CL_ERR_OK)
+        {
+            std::cout << "\r\nCLDumpTrace() failed, err=" << err << "\r\n";
+        }
+        else
+        {
+            std::cout << "Trace written to " << s_tracePath << "\r\n";
+        }
+    }
+    return result;
+}